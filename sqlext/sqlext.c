@@ -21,6 +21,7 @@
 # include <config.h>
 #endif
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 
@@ -95,6 +96,61 @@ sqlext_daap_unicode_xcollation(void *notused, int llen, const void *left, int rl
   return rpp;
 }
 
+/* Makes a key for the string that sorts like the DAAP collation when the keys
+ * are compared with memcmp() (as SQLite does with BLOBs), so sorting doesn't
+ * require normalizing and case folding for each comparison. The first byte
+ * puts strings starting with a letter first, the rest is the string case
+ * folded and NFD normalized, and UTF-8 sorts by code point like u8_casecmp().
+ */
+static void
+sqlext_daap_sortkey_xfunc(sqlite3_context *pv, int n, sqlite3_value **ppv)
+{
+  const uint8_t *str;
+  uint8_t *folded;
+  uint8_t *key;
+  size_t folded_len;
+  int len;
+  ucs4_t ch;
+  int ret;
+
+  if (n != 1)
+    {
+      sqlite3_result_error(pv, "daap_sortkey() requires 1 parameter", -1);
+      return;
+    }
+
+  str = sqlite3_value_text(ppv[0]);
+  if (!str)
+    {
+      sqlite3_result_null(pv);
+      return;
+    }
+
+  len = sqlite3_value_bytes(ppv[0]);
+
+  ret = u8_mbtoucr(&ch, str, len);
+
+  // If case folding fails (e.g. invalid UTF-8) we use the string as it is
+  folded = u8_casefold(str, len, NULL, UNINORM_NFD, NULL, &folded_len);
+  if (!folded)
+    folded_len = len;
+
+  key = sqlite3_malloc(folded_len + 1);
+  if (!key)
+    {
+      free(folded);
+      sqlite3_result_error_nomem(pv);
+      return;
+    }
+
+  key[0] = (ret >= 0 && uc_is_alpha(ch)) ? 0 : 1;
+  memcpy(key + 1, folded ? folded : str, folded_len);
+
+  free(folded);
+
+  sqlite3_result_blob(pv, key, folded_len + 1, sqlite3_free);
+}
+
 int
 sqlite3_extension_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
 {
@@ -110,6 +166,15 @@ sqlite3_extension_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines
       return -1;
     }
 
+  ret = sqlite3_create_function(db, "daap_sortkey", 1, SQLITE_UTF8, NULL, sqlext_daap_sortkey_xfunc, NULL, NULL);
+  if (ret != SQLITE_OK)
+    {
+      if (pzErrMsg)
+	*pzErrMsg = sqlite3_mprintf("Could not create daap_sortkey function: %s\n", sqlite3_errmsg(db));
+
+      return -1;
+    }
+
   ret = sqlite3_create_collation(db, "DAAP", SQLITE_UTF8, NULL, sqlext_daap_unicode_xcollation);
   if (ret != SQLITE_OK)
     {
@@ -30,7 +30,11 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <time.h>
 #include <pthread.h>
+#ifdef HAVE_PTHREAD_NP_H
+# include <pthread_np.h>
+#endif
 
 #include "db.h"
 #include "misc.h"
@@ -73,6 +77,13 @@
 #define ONLINE_SEARCH_COOLDOWN_TIME 3600
 #define ONLINE_SEARCH_FAILURES_MAX 3
 
+// See artwork_prebuild_add()
+#define PREBUILD_SIZES_MAX 8
+// Delay before an album is prebuilt, so that the scanner has committed its files
+#define PREBUILD_DELAY 10
+// Albums beyond this are left for on demand rendering
+#define PREBUILD_QUEUE_MAX 10000
+
 enum artwork_cache
 {
   NEVER = 0,       // No caching of any results
@@ -98,6 +109,9 @@ struct artwork_ctx {
   int max_h;
   // Input data to handler, did user configure to look for individual artwork
   int individual;
+  // Input data to handler, request is from the prebuild thread, which doesn't
+  // want what is already in the cache
+  bool prebuild;
 
   // Input data for item handlers
   struct db_media_file_info *dbmfi;
@@ -130,6 +144,9 @@ struct artwork_source {
 
   // When should results from the source be cached?
   enum artwork_cache cache;
+
+  // Source searches online, which the prebuild thread doesn't do
+  bool online;
 };
 
 /* Since online sources of artwork have similar characteristics there generic
@@ -177,6 +194,36 @@ struct online_source {
   enum parse_result (*response_jparse)(char **artwork_url, json_object *response, int max_w, int max_h);
 };
 
+/* Queue of albums that the prebuild thread should make the prebuilt sizes for.
+ * Each job is the path of a file in the album.
+ */
+struct prebuild_job {
+  char *path;
+  time_t queued;
+  bool retried;
+
+  struct prebuild_job *next;
+};
+
+struct prebuild_queue {
+  pthread_t tid;
+  bool running;
+
+  pthread_mutex_t lck;
+  pthread_cond_t cond;
+
+  struct prebuild_job *head;
+  struct prebuild_job *tail;
+  int count;
+  // Directory of the last queued path, so each album directory is queued once
+  char *last_dir;
+
+  // Also protected by lck
+  struct artwork_stats stats;
+
+  bool exit;
+};
+
 /* File extensions that we look for or accept
  */
 static const char *cover_extension[] =
@@ -188,6 +235,7 @@ static const char *cover_extension[] =
 
 /* Forward - group handlers */
 static int source_group_cache_get(struct artwork_ctx *ctx);
+static int source_group_prebuilt_get(struct artwork_ctx *ctx);
 static int source_group_dir_get(struct artwork_ctx *ctx);
 /* Forward - item handlers */
 static int source_item_cache_get(struct artwork_ctx *ctx);
@@ -212,6 +260,11 @@ static struct artwork_source artwork_group_source[] =
       .handler = source_group_cache_get,
       .cache = ON_FAILURE,
     },
+    {
+      .name = "prebuilt",
+      .handler = source_group_prebuilt_get,
+      .cache = ON_FAILURE,
+    },
     {
       .name = "directory",
       .handler = source_group_dir_get,
@@ -272,6 +325,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_SPOTIFY),
       .media_kinds = MEDIA_KIND_ALL,
       .cache = ON_SUCCESS | ON_FAILURE,
+      .online = true,
     },
     {
       .name = "playlist own",
@@ -286,6 +340,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_FILE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = ON_SUCCESS | ON_FAILURE,
+      .online = true,
     },
     {
       .name = "Spotify search web api (streams)",
@@ -293,6 +348,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_HTTP) | (1 << DATA_KIND_PIPE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = STASH,
+      .online = true,
     },
     {
       .name = "Discogs (files)",
@@ -300,6 +356,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_FILE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = ON_SUCCESS | ON_FAILURE,
+      .online = true,
     },
     {
       .name = "Discogs (streams)",
@@ -307,6 +364,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_HTTP) | (1 << DATA_KIND_PIPE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = STASH,
+      .online = true,
     },
     {
       // The Cover Art Archive seems rather slow, so low priority
@@ -315,6 +373,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_FILE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = ON_SUCCESS | ON_FAILURE,
+      .online = true,
     },
     {
       // The Cover Art Archive seems rather slow, so low priority
@@ -323,6 +382,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_HTTP) | (1 << DATA_KIND_PIPE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = STASH,
+      .online = true,
     },
     {
       .name = NULL,
@@ -391,10 +451,39 @@ static struct online_source musicbrainz_source =
     .search_history = { .mutex = PTHREAD_MUTEX_INITIALIZER },
   };
 
+// Square sizes that are prebuilt for each album, ascending
+static int prebuild_sizes[PREBUILD_SIZES_MAX];
+static int prebuild_nsizes;
+
+static struct prebuild_queue prebuild;
+
 
 
 /* -------------------------------- HELPERS -------------------------------- */
 
+/* Finds the smallest prebuilt size that covers the requested size
+ *
+ * @in  max_w     Requested width
+ * @in  max_h     Requested height
+ * @return        The prebuilt size, or 0 if none covers the request
+ */
+static int
+prebuild_size_find(int max_w, int max_h)
+{
+  int i;
+
+  if (max_w <= 0 || max_h <= 0)
+    return 0;
+
+  for (i = 0; i < prebuild_nsizes; i++)
+    {
+      if (prebuild_sizes[i] >= max_w && prebuild_sizes[i] >= max_h)
+	return prebuild_sizes[i];
+    }
+
+  return 0;
+}
+
 /* Reads an artwork file from the given http url straight into an evbuf
  *
  * @out evbuf     Image data
@@ -1337,6 +1426,9 @@ source_group_cache_get(struct artwork_ctx *ctx)
   int cached;
   int ret;
 
+  if (ctx->prebuild)
+    return ART_E_NONE;
+
   ret = cache_artwork_get(CACHE_ARTWORK_GROUP, ctx->persistentid, ctx->max_w, ctx->max_h, &cached, &format, ctx->evbuf);
   if (ret < 0)
     return ART_E_ERROR;
@@ -1350,6 +1442,42 @@ source_group_cache_get(struct artwork_ctx *ctx)
   return format;
 }
 
+/* Looks in the cache for the nearest prebuilt size, which is the smallest that
+ * is at least the requested size (the image is not rescaled further). If the
+ * requested size is a prebuilt size, source_group_cache_get() has looked.
+ */
+static int
+source_group_prebuilt_get(struct artwork_ctx *ctx)
+{
+  int size;
+  int format;
+  int cached;
+  int ret;
+
+  if (ctx->prebuild)
+    return ART_E_NONE;
+
+  size = prebuild_size_find(ctx->max_w, ctx->max_h);
+  if (size == 0 || (size == ctx->max_w && size == ctx->max_h))
+    return ART_E_NONE;
+
+  ret = cache_artwork_get(CACHE_ARTWORK_GROUP, ctx->persistentid, size, size, &cached, &format, ctx->evbuf);
+  if (ret < 0)
+    return ART_E_ERROR;
+
+  if (!cached)
+    return ART_E_NONE;
+
+  if (!format)
+    return ART_E_ABORT;
+
+  pthread_mutex_lock(&prebuild.lck);
+  prebuild.stats.prebuilt_hits++;
+  pthread_mutex_unlock(&prebuild.lck);
+
+  return format;
+}
+
 /* Looks for cover files in a directory, so if dir is /foo/bar and the user has
  * configured the cover file names "cover" and "artwork" it will look for
  * /foo/bar/cover.{png,jpg}, /foo/bar/artwork.{png,jpg} and also
@@ -1410,7 +1538,7 @@ source_item_cache_get(struct artwork_ctx *ctx)
   int cached;
   int ret;
 
-  if (!ctx->individual)
+  if (!ctx->individual || ctx->prebuild)
     return ART_E_NONE;
 
   ret = cache_artwork_get(CACHE_ARTWORK_INDIVIDUAL, ctx->id, ctx->max_w, ctx->max_h, &cached, &format, ctx->evbuf);
@@ -1799,6 +1927,9 @@ process_items(struct artwork_ctx *ctx, int item_mode)
 	  if ((artwork_item_source[i].media_kinds & ctx->media_kind) == 0)
 	    continue;
 
+	  if (ctx->prebuild && artwork_item_source[i].online)
+	    continue;
+
 	  // If just one handler says we should not cache a negative result then we obey that
 	  if ((artwork_item_source[i].cache & ON_FAILURE) == 0)
 	    ctx->cache = NEVER;
@@ -1889,6 +2020,213 @@ process_group(struct artwork_ctx *ctx)
 }
 
 
+/* -------------------------------- PREBUILD ------------------------------- */
+/*                             Thread: prebuild                              */
+
+static void
+stats_rendered_inc(void)
+{
+  pthread_mutex_lock(&prebuild.lck);
+  prebuild.stats.rendered++;
+  pthread_mutex_unlock(&prebuild.lck);
+}
+
+/* Makes the missing prebuilt sizes for the album of the file. The artwork is
+ * found once at the largest size, without looking online, and rescaled for the
+ * smaller sizes. If no artwork is found nothing is cached, so that an on demand
+ * request can still look online.
+ *
+ * @in  path      Path of a file in the album
+ * @return        0 if done, -1 if the file is not in the library (yet)
+ */
+static int
+prebuild_run(const char *path)
+{
+  struct media_file_info *mfi;
+  struct artwork_ctx ctx;
+  struct evbuffer *raw;
+  struct evbuffer *in;
+  struct evbuffer *out;
+  bool missing[PREBUILD_SIZES_MAX];
+  int64_t persistentid;
+  uint8_t *data;
+  size_t len;
+  int nmissing;
+  int cached;
+  int format;
+  int size;
+  int id;
+  int i;
+  int ret;
+
+  id = db_file_id_bypath(path);
+  if (id <= 0)
+    return -1;
+
+  mfi = db_file_fetch_byid(id);
+  if (!mfi)
+    return -1;
+
+  persistentid = mfi->songalbumid;
+  free_mfi(mfi, 0);
+
+  if (!persistentid)
+    return 0;
+
+  CHECK_NULL(L_ART, raw = evbuffer_new());
+  CHECK_NULL(L_ART, in = evbuffer_new());
+  CHECK_NULL(L_ART, out = evbuffer_new());
+
+  for (i = 0, nmissing = 0; i < prebuild_nsizes; i++)
+    {
+      ret = cache_artwork_get(CACHE_ARTWORK_GROUP, persistentid, prebuild_sizes[i], prebuild_sizes[i], &cached, &format, out);
+      evbuffer_drain(out, evbuffer_get_length(out));
+
+      missing[i] = (ret == 0 && !cached);
+      if (missing[i])
+	nmissing++;
+    }
+
+  if (nmissing == 0)
+    goto out;
+
+  memset(&ctx, 0, sizeof(struct artwork_ctx));
+
+  size = prebuild_sizes[prebuild_nsizes - 1];
+
+  ctx.qp.type = Q_GROUP_ITEMS;
+  ctx.qp.persistentid = persistentid;
+  ctx.persistentid = persistentid;
+  ctx.evbuf = raw;
+  ctx.max_w = size;
+  ctx.max_h = size;
+  ctx.cache = ON_FAILURE;
+  ctx.individual = cfg_getbool(cfg_getsec(cfg, "library"), "artwork_individual");
+  ctx.prebuild = true;
+
+  format = process_group(&ctx);
+  if (format <= 0 || !(ctx.cache & ON_SUCCESS))
+    {
+      DPRINTF(E_DBG, L_ART, "No artwork to prebuild for group %" PRIi64 "\n", persistentid);
+      goto out;
+    }
+
+  len = evbuffer_get_length(raw);
+  data = evbuffer_pullup(raw, -1);
+
+  for (i = prebuild_nsizes - 1; i >= 0; i--)
+    {
+      if (!missing[i])
+	continue;
+
+      // artwork_evbuf_rescale() moves the input to the output if no rescaling
+      // is required, so each size gets a copy
+      evbuffer_add(in, data, len);
+
+      ret = artwork_evbuf_rescale(out, in, prebuild_sizes[i], prebuild_sizes[i]);
+      evbuffer_drain(in, evbuffer_get_length(in));
+      if (ret < 0)
+	continue;
+
+      cache_artwork_add(CACHE_ARTWORK_GROUP, persistentid, prebuild_sizes[i], prebuild_sizes[i], format, ctx.path, out);
+      evbuffer_drain(out, evbuffer_get_length(out));
+
+      pthread_mutex_lock(&prebuild.lck);
+      prebuild.stats.prebuilt++;
+      pthread_mutex_unlock(&prebuild.lck);
+    }
+
+  DPRINTF(E_DBG, L_ART, "Prebuilt %d artwork sizes for group %" PRIi64 " from '%s'\n", nmissing, persistentid, ctx.path);
+
+ out:
+  evbuffer_free(out);
+  evbuffer_free(in);
+  evbuffer_free(raw);
+  return 0;
+}
+
+static void
+prebuild_job_append(struct prebuild_job *job)
+{
+  job->queued = time(NULL);
+  job->next = NULL;
+
+  if (prebuild.tail)
+    prebuild.tail->next = job;
+  else
+    prebuild.head = job;
+
+  prebuild.tail = job;
+  prebuild.count++;
+}
+
+static void
+prebuild_job_free(struct prebuild_job *job)
+{
+  free(job->path);
+  free(job);
+}
+
+static void *
+prebuild_thread(void *arg)
+{
+  struct prebuild_job *job;
+  struct timespec ts;
+  int ret;
+
+  ret = db_perthread_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Error: DB init failed (artwork prebuild thread)\n");
+      pthread_exit(NULL);
+    }
+
+  pthread_mutex_lock(&prebuild.lck);
+
+  while (!prebuild.exit)
+    {
+      job = prebuild.head;
+      if (!job)
+	{
+	  pthread_cond_wait(&prebuild.cond, &prebuild.lck);
+	  continue;
+	}
+
+      if (time(NULL) < job->queued + PREBUILD_DELAY)
+	{
+	  ts.tv_sec = job->queued + PREBUILD_DELAY;
+	  ts.tv_nsec = 0;
+	  pthread_cond_timedwait(&prebuild.cond, &prebuild.lck, &ts);
+	  continue;
+	}
+
+      prebuild.head = job->next;
+      if (!prebuild.head)
+	prebuild.tail = NULL;
+      prebuild.count--;
+
+      pthread_mutex_unlock(&prebuild.lck);
+      ret = prebuild_run(job->path);
+      pthread_mutex_lock(&prebuild.lck);
+
+      // The scanner may not have committed the file yet, so try once more
+      if (ret < 0 && !job->retried && !prebuild.exit)
+	{
+	  job->retried = true;
+	  prebuild_job_append(job);
+	}
+      else
+	prebuild_job_free(job);
+    }
+
+  pthread_mutex_unlock(&prebuild.lck);
+
+  db_perthread_deinit();
+
+  pthread_exit(NULL);
+}
+
+
 /* ------------------------------ ARTWORK API ------------------------------ */
 
 int
@@ -1926,7 +2264,10 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h)
   if (ret > 0)
     {
       if (ctx.cache & ON_SUCCESS)
-	cache_artwork_add(CACHE_ARTWORK_INDIVIDUAL, id, max_w, max_h, ret, ctx.path, evbuf);
+	{
+	  cache_artwork_add(CACHE_ARTWORK_INDIVIDUAL, id, max_w, max_h, ret, ctx.path, evbuf);
+	  stats_rendered_inc();
+	}
       if (ctx.cache & STASH)
 	cache_artwork_stash(evbuf, ctx.path, ret);
 
@@ -1940,7 +2281,10 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h)
   if (ret > 0)
     {
       if (ctx.cache & ON_SUCCESS)
-	cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, ret, ctx.path, evbuf);
+	{
+	  cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, ret, ctx.path, evbuf);
+	  stats_rendered_inc();
+	}
       if (ctx.cache & STASH)
 	cache_artwork_stash(evbuf, ctx.path, ret);
 
@@ -1985,7 +2329,10 @@ artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h)
   if (ret > 0)
     {
       if (ctx.cache & ON_SUCCESS)
-	cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, ret, ctx.path, evbuf);
+	{
+	  cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, ret, ctx.path, evbuf);
+	  stats_rendered_inc();
+	}
       if (ctx.cache & STASH)
 	cache_artwork_stash(evbuf, ctx.path, ret);
 
@@ -2035,3 +2382,152 @@ artwork_file_is_artwork(const char *filename)
 
   return 0;
 }
+
+/* Queues the album of a file for the prebuild thread. Files are scanned a
+ * directory at a time, so a new job is only made when the directory changes.
+ * Artwork files and non-files (e.g. Spotify) are skipped.
+ */
+void
+artwork_prebuild_add(const char *path)
+{
+  struct prebuild_job *job;
+  const char *ptr;
+  size_t len;
+
+  if (!prebuild.running || path[0] != '/')
+    return;
+
+  ptr = strrchr(path, '/');
+  if (artwork_file_is_artwork(ptr + 1))
+    return;
+
+  len = ptr - path;
+
+  pthread_mutex_lock(&prebuild.lck);
+
+  if (prebuild.last_dir && strncmp(prebuild.last_dir, path, len) == 0 && prebuild.last_dir[len] == '\0')
+    goto out;
+
+  if (prebuild.count >= PREBUILD_QUEUE_MAX)
+    {
+      DPRINTF(E_SPAM, L_ART, "Artwork prebuild queue is full, skipping '%s'\n", path);
+      goto out;
+    }
+
+  free(prebuild.last_dir);
+  CHECK_NULL(L_ART, prebuild.last_dir = strndup(path, len));
+
+  CHECK_NULL(L_ART, job = calloc(1, sizeof(struct prebuild_job)));
+  CHECK_NULL(L_ART, job->path = strdup(path));
+
+  prebuild_job_append(job);
+
+  pthread_cond_signal(&prebuild.cond);
+
+ out:
+  pthread_mutex_unlock(&prebuild.lck);
+}
+
+void
+artwork_stats_get(struct artwork_stats *stats)
+{
+  pthread_mutex_lock(&prebuild.lck);
+
+  memcpy(stats, &prebuild.stats, sizeof(struct artwork_stats));
+  stats->sizes = prebuild_nsizes;
+  stats->queued = prebuild.count;
+
+  pthread_mutex_unlock(&prebuild.lck);
+}
+
+int
+artwork_init(void)
+{
+  cfg_t *lib;
+  int size;
+  int n;
+  int i;
+  int j;
+  int ret;
+
+  memset(&prebuild, 0, sizeof(struct prebuild_queue));
+
+  CHECK_ERR(L_ART, pthread_mutex_init(&prebuild.lck, NULL));
+  CHECK_ERR(L_ART, pthread_cond_init(&prebuild.cond, NULL));
+
+  // Sorted and without duplicates
+  lib = cfg_getsec(cfg, "library");
+  n = cfg_size(lib, "artwork_prebuild_sizes");
+  for (i = 0, prebuild_nsizes = 0; i < n && prebuild_nsizes < PREBUILD_SIZES_MAX; i++)
+    {
+      size = cfg_getnint(lib, "artwork_prebuild_sizes", i);
+      if (size <= 0)
+	{
+	  DPRINTF(E_LOG, L_ART, "Ignoring invalid artwork prebuild size %d\n", size);
+	  continue;
+	}
+
+      for (j = 0; j < prebuild_nsizes && prebuild_sizes[j] != size; j++)
+	;
+      if (j < prebuild_nsizes)
+	continue;
+
+      for (j = prebuild_nsizes; j > 0 && prebuild_sizes[j - 1] > size; j--)
+	prebuild_sizes[j] = prebuild_sizes[j - 1];
+
+      prebuild_sizes[j] = size;
+      prebuild_nsizes++;
+    }
+
+  if (prebuild_nsizes == 0)
+    {
+      DPRINTF(E_INFO, L_ART, "Artwork prebuilding is disabled\n");
+      return 0;
+    }
+
+  ret = pthread_create(&prebuild.tid, NULL, prebuild_thread, NULL);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Could not spawn artwork prebuild thread: %s\n", strerror(ret));
+      prebuild_nsizes = 0;
+      return -1;
+    }
+
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+  pthread_setname_np(prebuild.tid, "artwork");
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+  pthread_set_name_np(prebuild.tid, "artwork");
+#endif
+
+  prebuild.running = true;
+
+  return 0;
+}
+
+void
+artwork_deinit(void)
+{
+  struct prebuild_job *job;
+
+  if (prebuild.running)
+    {
+      pthread_mutex_lock(&prebuild.lck);
+      prebuild.exit = true;
+      pthread_cond_signal(&prebuild.cond);
+      pthread_mutex_unlock(&prebuild.lck);
+
+      pthread_join(prebuild.tid, NULL);
+      prebuild.running = false;
+    }
+
+  while ((job = prebuild.head))
+    {
+      prebuild.head = job->next;
+      prebuild_job_free(job);
+    }
+
+  free(prebuild.last_dir);
+
+  pthread_cond_destroy(&prebuild.cond);
+  pthread_mutex_destroy(&prebuild.lck);
+}
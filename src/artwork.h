@@ -8,8 +8,23 @@
 #define ART_DEFAULT_HEIGHT 600
 #define ART_DEFAULT_WIDTH  600
 
+#include <stdint.h>
 #include <event2/buffer.h>
 
+struct artwork_stats
+{
+  // Number of prebuilt sizes, see artwork_prebuild_sizes in the config
+  int sizes;
+  // Albums waiting to be prebuilt
+  int queued;
+  // Images made by the prebuild thread
+  uint64_t prebuilt;
+  // Requests served from a larger prebuilt size
+  uint64_t prebuilt_hits;
+  // Images found and rescaled on demand for a request
+  uint64_t rendered;
+};
+
 /*
  * Get the artwork image for an individual item (track)
  *
@@ -43,4 +58,22 @@ artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h);
 int
 artwork_file_is_artwork(const char *filename);
 
+/*
+ * Queues the album of a scanned file, so that the prebuild thread makes the
+ * configured artwork sizes for it in the background (if they are not cached)
+ *
+ * @in  path     Path of the scanned file
+ */
+void
+artwork_prebuild_add(const char *path);
+
+void
+artwork_stats_get(struct artwork_stats *stats);
+
+int
+artwork_init(void);
+
+void
+artwork_deinit(void);
+
 #endif /* !__ARTWORK_H__ */
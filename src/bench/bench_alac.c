@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Microbenchmark of the ALAC encoders used for RAOP. Encodes RAOP sized packets
+ * (352 samples, 16 bit stereo) of synthetic audio and reports packets per
+ * second, how many times real time that is, and the compression ratio.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+
+#include "outputs/alac.h"
+
+#define BENCH_SAMPLES_PER_PACKET 352
+#define BENCH_PACKET_SIZE        (BENCH_SAMPLES_PER_PACKET * 4)
+#define BENCH_SAMPLE_RATE        44100
+// Number of different packets we cycle through, about 8 seconds of audio
+#define BENCH_NPACKETS           1000
+#define BENCH_ITERATIONS_DEFAULT 200000
+
+enum bench_signal
+{
+  BENCH_SIGNAL_MUSIC,
+  BENCH_SIGNAL_NOISE,
+  BENCH_SIGNAL_SILENCE,
+};
+
+static const char *bench_signal_names[] = { "music", "noise", "silence" };
+
+// "Music" is a few tones with a little noise, which compresses somewhat like
+// real music. Noise doesn't compress at all, which is the worst case.
+static void
+signal_make(uint8_t *raw, enum bench_signal signal)
+{
+  double v;
+  int16_t l;
+  int16_t r;
+  int i;
+
+  srand(1);
+
+  for (i = 0; i < BENCH_NPACKETS * BENCH_SAMPLES_PER_PACKET; i++)
+    {
+      switch (signal)
+	{
+	  case BENCH_SIGNAL_MUSIC:
+	    v = 6000.0 * sin(2.0 * M_PI * 220.0 * i / BENCH_SAMPLE_RATE) + 3000.0 * sin(2.0 * M_PI * 1760.0 * i / BENCH_SAMPLE_RATE);
+	    l = (int16_t)(v + (rand() % 256) - 128);
+	    r = (int16_t)(0.8 * v + (rand() % 256) - 128);
+	    break;
+	  case BENCH_SIGNAL_NOISE:
+	    l = (int16_t)(rand() & 0xffff);
+	    r = (int16_t)(rand() & 0xffff);
+	    break;
+	  default:
+	    l = 0;
+	    r = 0;
+	}
+
+      raw[4 * i]     = l & 0xff;
+      raw[4 * i + 1] = (l >> 8) & 0xff;
+      raw[4 * i + 2] = r & 0xff;
+      raw[4 * i + 3] = (r >> 8) & 0xff;
+    }
+}
+
+static double
+elapsed(struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+result_print(const char *name, const char *signal, int iterations, double secs, uint64_t bytes)
+{
+  double pps = iterations / secs;
+
+  printf("%-12s %-8s %10.0f packets/s %8.0fx real time  %5.1f%% of raw size\n",
+    name, signal, pps, pps * BENCH_SAMPLES_PER_PACKET / BENCH_SAMPLE_RATE,
+    100.0 * bytes / ((uint64_t)iterations * BENCH_PACKET_SIZE));
+}
+
+int
+main(int argc, char **argv)
+{
+  struct timespec start;
+  uint8_t dst[ALAC_HEADER_LEN + BENCH_PACKET_SIZE];
+  uint8_t *raw;
+  uint8_t *pkt;
+  uint64_t bytes;
+  int iterations = BENCH_ITERATIONS_DEFAULT;
+  int option;
+  int len;
+  int s;
+  int i;
+
+  while ((option = getopt(argc, argv, "n:h")) != -1)
+    {
+      switch (option)
+	{
+	  case 'n':
+	    iterations = atoi(optarg);
+	    break;
+	  default:
+	    printf("Usage: %s [-n <packets>]\n", argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+
+  if (iterations <= 0)
+    return EXIT_FAILURE;
+
+  raw = malloc(BENCH_NPACKETS * BENCH_PACKET_SIZE);
+  if (!raw)
+    return EXIT_FAILURE;
+
+  for (s = BENCH_SIGNAL_MUSIC; s <= BENCH_SIGNAL_SILENCE; s++)
+    {
+      signal_make(raw, s);
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (i = 0, bytes = 0; i < iterations; i++)
+	{
+	  pkt = raw + (i % BENCH_NPACKETS) * BENCH_PACKET_SIZE;
+	  alac_encode_verbatim(dst, pkt, BENCH_PACKET_SIZE);
+	  bytes += ALAC_HEADER_LEN + BENCH_PACKET_SIZE;
+	}
+      result_print("verbatim", bench_signal_names[s], iterations, elapsed(&start), bytes);
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (i = 0, bytes = 0; i < iterations; i++)
+	{
+	  pkt = raw + (i % BENCH_NPACKETS) * BENCH_PACKET_SIZE;
+	  len = alac_encode_compressed(dst, sizeof(dst), pkt, BENCH_SAMPLES_PER_PACKET, BENCH_SAMPLES_PER_PACKET);
+	  // Like raop.c, fall back to verbatim if compression doesn't pay
+	  if (len < 0)
+	    {
+	      alac_encode_verbatim(dst, pkt, BENCH_PACKET_SIZE);
+	      len = ALAC_HEADER_LEN + BENCH_PACKET_SIZE;
+	    }
+	  bytes += len;
+	}
+      result_print("compressed", bench_signal_names[s], iterations, elapsed(&start), bytes);
+    }
+
+  free(raw);
+
+  return EXIT_SUCCESS;
+}
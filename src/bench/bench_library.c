@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Benchmark of saving scan results to the library. Makes a synthetic library
+ * (artist/album/track) and saves it to a fresh database, first one file at a
+ * time like library_media_save(), then in batches like the filescanner's scan
+ * pool with db_file_save_batch(). Each is run twice, so both the first scan
+ * (inserts) and a rescan (updates) are measured.
+ *
+ * The database is opened like in the server, so the SQLite extension must be
+ * installed ("make install") for the benchmark to run.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <pwd.h>
+
+#include "logger.h"
+#include "conffile.h"
+#include "misc.h"
+#include "db.h"
+#include "cache.h"
+#include "library.h"
+#include "listener.h"
+
+#define BENCH_FILES_DEFAULT 100000
+#define BENCH_BATCH_DEFAULT 200
+// Same as the filescanner, which commits every 200 files
+#define BENCH_TRANSACTION   200
+#define BENCH_TRACKS        12
+#define BENCH_ALBUMS        5
+
+
+/* ----------------------------------- Stubs -------------------------------- */
+
+void
+cache_daap_suspend(void)
+{
+  return;
+}
+
+void
+cache_daap_resume(void)
+{
+  return;
+}
+
+void
+library_update_trigger(short update_events)
+{
+  return;
+}
+
+void
+listener_notify(enum listener_event_type type)
+{
+  return;
+}
+
+
+/* --------------------------------- Helpers -------------------------------- */
+
+static double
+elapsed(struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int
+config_write(const char *path, const char *db_path)
+{
+  struct passwd *pw;
+  FILE *f;
+
+  pw = getpwuid(getuid());
+  if (!pw)
+    return -1;
+
+  f = fopen(path, "w");
+  if (!f)
+    return -1;
+
+  fprintf(f, "general {\n\tuid = \"%s\"\n\tdb_path = \"%s\"\n}\n", pw->pw_name, db_path);
+  fprintf(f, "library {\n\tdirectories = { \"/tmp\" }\n}\n");
+
+  fclose(f);
+  return 0;
+}
+
+static struct media_file_info *
+files_make(int nfiles)
+{
+  struct media_file_info *mfi;
+  int artist;
+  int album;
+  int track;
+  int i;
+
+  CHECK_NULL(L_DB, mfi = calloc(nfiles, sizeof(struct media_file_info)));
+
+  for (i = 0; i < nfiles; i++)
+    {
+      track = i % BENCH_TRACKS + 1;
+      album = (i / BENCH_TRACKS) % BENCH_ALBUMS + 1;
+      artist = i / (BENCH_TRACKS * BENCH_ALBUMS) + 1;
+
+      mfi[i].path = safe_asprintf("/bench/Artist %d/Album %d/%02d Track.mp3", artist, album, track);
+      mfi[i].virtual_path = safe_asprintf("/file:%s", mfi[i].path);
+      mfi[i].fname = safe_asprintf("%02d Track.mp3", track);
+      mfi[i].title = safe_asprintf("Track %d", track);
+      mfi[i].artist = safe_asprintf("Artist %d", artist);
+      mfi[i].album_artist = safe_asprintf("Artist %d", artist);
+      mfi[i].album = safe_asprintf("Album %d", album);
+      mfi[i].genre = strdup("Rock");
+      mfi[i].type = strdup("mp3");
+      mfi[i].codectype = strdup("mpeg");
+      mfi[i].description = strdup("MPEG audio file");
+      mfi[i].track = track;
+      mfi[i].total_tracks = BENCH_TRACKS;
+      mfi[i].year = 1970 + artist % 50;
+      mfi[i].song_length = 180000 + 1000 * track;
+      mfi[i].file_size = 5000000;
+      mfi[i].bitrate = 256;
+      mfi[i].samplerate = 44100;
+      mfi[i].time_modified = 1500000000;
+      mfi[i].data_kind = DATA_KIND_FILE;
+      mfi[i].media_kind = MEDIA_KIND_MUSIC;
+      mfi[i].directory_id = DIR_FILE;
+    }
+
+  return mfi;
+}
+
+static void
+files_free(struct media_file_info *mfi, int nfiles)
+{
+  int i;
+
+  for (i = 0; i < nfiles; i++)
+    free_mfi(&mfi[i], 1);
+
+  free(mfi);
+}
+
+// Like library_media_save() called by process_regular_file()
+static int
+save_single(struct media_file_info *mfi, int nfiles)
+{
+  int i;
+  int ret;
+
+  db_transaction_begin();
+
+  for (i = 0; i < nfiles; i++)
+    {
+      mfi[i].id = db_file_id_bypath(mfi[i].path);
+      if (mfi[i].id == 0)
+	ret = db_file_add(&mfi[i]);
+      else
+	ret = db_file_update(&mfi[i]);
+      if (ret < 0)
+	break;
+
+      if ((i + 1) % BENCH_TRANSACTION == 0)
+	{
+	  db_transaction_end();
+	  db_transaction_begin();
+	}
+    }
+
+  db_transaction_end();
+
+  return i;
+}
+
+// Like scan_jobs_save() in the filescanner's scan pool
+static int
+save_batch(struct media_file_info *mfi, int nfiles, int batch)
+{
+  struct media_file_info **mfis;
+  int saved;
+  int n;
+  int i;
+  int j;
+
+  CHECK_NULL(L_DB, mfis = calloc(batch, sizeof(struct media_file_info *)));
+
+  db_transaction_begin();
+
+  for (i = 0, saved = 0; i < nfiles; i += n)
+    {
+      n = (nfiles - i < batch) ? nfiles - i : batch;
+
+      for (j = 0; j < n; j++)
+	{
+	  mfi[i + j].id = 0;
+	  mfis[j] = &mfi[i + j];
+	}
+
+      saved += db_file_save_batch(mfis, n);
+
+      if ((i + n) / BENCH_TRANSACTION != i / BENCH_TRANSACTION)
+	{
+	  db_transaction_end();
+	  db_transaction_begin();
+	}
+    }
+
+  db_transaction_end();
+
+  free(mfis);
+
+  return saved;
+}
+
+static void
+result_print(const char *name, const char *scan, int nfiles, int saved, double secs)
+{
+  uint32_t nitems;
+  uint32_t nstreams;
+
+  db_files_get_count(&nitems, &nstreams, NULL);
+
+  printf("%-8s %-8s %8.0f files/s %8.3f s  %d saved, %u in library\n",
+    name, scan, nfiles / secs, secs, saved, nitems);
+}
+
+static void
+usage(char *program)
+{
+  printf("Usage: %s [options]\n\n", program);
+  printf("Options:\n");
+  printf("  -n <files>         Number of files in the library (default %d)\n", BENCH_FILES_DEFAULT);
+  printf("  -b <batch>         Number of files per batch (default %d)\n", BENCH_BATCH_DEFAULT);
+  printf("  -v                 Log at debug level\n");
+  printf("\n");
+}
+
+
+int
+main(int argc, char **argv)
+{
+  struct media_file_info *mfi;
+  struct timespec start;
+  char tmpdir[] = "/tmp/forked-daapd-bench.XXXXXX";
+  char conf_path[PATH_MAX];
+  char db_path[PATH_MAX];
+  char path[PATH_MAX];
+  int nfiles = BENCH_FILES_DEFAULT;
+  int batch = BENCH_BATCH_DEFAULT;
+  int loglevel = E_LOG;
+  int option;
+  int saved;
+  int ret;
+
+  while ((option = getopt(argc, argv, "n:b:vh")) != -1)
+    {
+      switch (option)
+	{
+	  case 'n':
+	    nfiles = atoi(optarg);
+	    break;
+	  case 'b':
+	    batch = atoi(optarg);
+	    break;
+	  case 'v':
+	    loglevel = E_DBG;
+	    break;
+	  default:
+	    usage(argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+
+  if (nfiles <= 0 || batch <= 0)
+    {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  if (!mkdtemp(tmpdir))
+    {
+      fprintf(stderr, "Could not create temp dir: %s\n", strerror(errno));
+      return EXIT_FAILURE;
+    }
+
+  snprintf(conf_path, sizeof(conf_path), "%s/bench.conf", tmpdir);
+  snprintf(db_path, sizeof(db_path), "%s/songs3.db", tmpdir);
+
+  ret = EXIT_FAILURE;
+
+  logger_init(NULL, NULL, loglevel);
+
+  if (config_write(conf_path, db_path) < 0 || conffile_load(conf_path) < 0)
+    {
+      fprintf(stderr, "Could not make the benchmark config\n");
+      goto out_rmdir;
+    }
+
+  if (db_init() < 0)
+    {
+      fprintf(stderr, "Could not init the database\n");
+      goto out_unload;
+    }
+
+  if (db_perthread_init() < 0)
+    {
+      fprintf(stderr, "Could not open the database\n");
+      goto out_deinit;
+    }
+
+  mfi = files_make(nfiles);
+
+  printf("Library %d files (%d artists), batches of %d\n", nfiles, (nfiles - 1) / (BENCH_TRACKS * BENCH_ALBUMS) + 1, batch);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  saved = save_single(mfi, nfiles);
+  result_print("single", "scan", nfiles, saved, elapsed(&start));
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  saved = save_single(mfi, nfiles);
+  result_print("single", "rescan", nfiles, saved, elapsed(&start));
+
+  db_purge_all();
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  saved = save_batch(mfi, nfiles, batch);
+  result_print("batch", "scan", nfiles, saved, elapsed(&start));
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  saved = save_batch(mfi, nfiles, batch);
+  result_print("batch", "rescan", nfiles, saved, elapsed(&start));
+
+  files_free(mfi, nfiles);
+
+  ret = EXIT_SUCCESS;
+
+  db_perthread_deinit();
+ out_deinit:
+  db_deinit();
+ out_unload:
+  conffile_unload();
+ out_rmdir:
+  logger_deinit();
+  unlink(db_path);
+  snprintf(path, sizeof(path), "%s-wal", db_path);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s-shm", db_path);
+  unlink(path);
+  unlink(conf_path);
+  rmdir(tmpdir);
+
+  return ret;
+}
@@ -0,0 +1,480 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Benchmark of the player -> outputs data path. The benchmark plays the part of
+ * the player: like playback_cb() it calls outputs_write() with a tick's worth of
+ * audio, but from a synthetic source and as fast as possible instead of once
+ * per tick. The audio goes to the dummy and fifo outputs and to a number of
+ * extra quality subscriptions, which makes the resampling run like it would
+ * with e.g. Chromecast or ALSA devices connected.
+ *
+ * Reports per tick CPU time (all threads, so resampling is included), tick
+ * latency percentiles, bytes copied by outputs.c and heap allocations.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+#include <pwd.h>
+#include <stdatomic.h>
+
+#include <event2/event.h>
+#include <event2/thread.h>
+
+#include <libavformat/avformat.h>
+#include <libavfilter/avfilter.h>
+
+#include "logger.h"
+#include "conffile.h"
+#include "misc.h"
+#include "db.h"
+#include "http.h"
+#include "listener.h"
+#include "worker.h"
+#include "player.h"
+#include "outputs.h"
+
+// Same as the player's tick interval
+#define BENCH_TICK_MS          10
+#define BENCH_TICKS_DEFAULT    20000
+#define BENCH_DUMMIES_DEFAULT  4
+#define BENCH_DUMMIES_MAX      64
+#define BENCH_SUBSCRIPTIONS_DEFAULT 2
+
+// Extra qualities that we subscribe to, in order. The fifo subscribes to
+// 44100/16/2 itself.
+static struct media_quality bench_qualities[] =
+{
+  { 48000, 16, 2, 0 },
+  { 44100, 24, 2, 0 },
+  { 48000, 24, 2, 0 },
+  { 96000, 24, 2, 0 },
+};
+
+struct event_base *evbase_player;
+
+static struct output_device *bench_devices[BENCH_DUMMIES_MAX + 2];
+static int bench_ndevices;
+static int bench_nstarted;
+
+static atomic_uint_fast64_t bench_allocs;
+
+
+/* --------------------------- Allocation counting -------------------------- */
+
+// With glibc we can count allocations by all threads and libraries (ffmpeg,
+// libevent) by wrapping the allocator's entry points
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+void *
+malloc(size_t size)
+{
+  atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+  atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+  return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+  atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+  *memptr = __libc_memalign(alignment, size);
+  return *memptr ? 0 : ENOMEM;
+}
+# define BENCH_COUNTS_ALLOCS 1
+#else
+# define BENCH_COUNTS_ALLOCS 0
+#endif
+
+
+/* ------------------- Stubs for modules that are not linked ---------------- */
+
+struct output_definition output_raop = { .name = "AirPlay", .type = OUTPUT_TYPE_RAOP, .disabled = 1 };
+struct output_definition output_streaming = { .name = "mp3 streaming", .type = OUTPUT_TYPE_STREAMING, .disabled = 1 };
+#ifdef HAVE_ALSA
+struct output_definition output_alsa = { .name = "ALSA", .type = OUTPUT_TYPE_ALSA, .disabled = 1 };
+#endif
+#ifdef HAVE_LIBPULSE
+struct output_definition output_pulse = { .name = "Pulseaudio", .type = OUTPUT_TYPE_PULSE, .disabled = 1 };
+#endif
+#ifdef CHROMECAST
+struct output_definition output_cast = { .name = "Chromecast", .type = OUTPUT_TYPE_CAST, .disabled = 1 };
+#endif
+
+int
+player_device_add(void *device)
+{
+  struct output_device *added;
+
+  added = outputs_device_add(device, false, 0);
+  if (added && bench_ndevices < ARRAY_SIZE(bench_devices))
+    bench_devices[bench_ndevices++] = added;
+
+  return 0;
+}
+
+const char *
+player_pmap(void *p)
+{
+  return "bench_device_cb";
+}
+
+int
+db_speaker_save(struct output_device *device)
+{
+  return 0;
+}
+
+int
+db_speaker_get(struct output_device *device, uint64_t id)
+{
+  return -1;
+}
+
+void
+listener_notify(enum listener_event_type type)
+{
+  return;
+}
+
+void
+worker_execute(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay)
+{
+  cb(cb_arg);
+}
+
+struct http_icy_metadata *
+http_icy_metadata_get(AVFormatContext *fmtctx, int packet_only)
+{
+  return NULL;
+}
+
+
+/* --------------------------------- Helpers -------------------------------- */
+
+static void
+bench_device_cb(struct output_device *device, enum output_device_state status)
+{
+  if (status == OUTPUT_STATE_CONNECTED || status == OUTPUT_STATE_STREAMING)
+    bench_nstarted++;
+  else if (device)
+    DPRINTF(E_LOG, L_PLAYER, "Bench device '%s' changed to state %d\n", device->name, status);
+}
+
+static uint64_t
+timespec_to_ns(struct timespec *ts)
+{
+  return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static uint64_t
+clock_ns(clockid_t clk)
+{
+  struct timespec ts;
+
+  clock_gettime(clk, &ts);
+  return timespec_to_ns(&ts);
+}
+
+static int
+uint64_cmp(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static int
+config_write(const char *path, const char *fifo_path)
+{
+  struct passwd *pw;
+  FILE *f;
+
+  pw = getpwuid(getuid());
+  if (!pw)
+    return -1;
+
+  f = fopen(path, "w");
+  if (!f)
+    return -1;
+
+  fprintf(f, "general {\n\tuid = \"%s\"\n}\n", pw->pw_name);
+  fprintf(f, "library {\n\tdirectories = { \"/tmp\" }\n}\n");
+  fprintf(f, "audio {\n\ttype = \"dummy\"\n\tnickname = \"Bench dummy\"\n}\n");
+  fprintf(f, "fifo {\n\tnickname = \"Bench fifo\"\n\tpath = \"%s\"\n}\n", fifo_path);
+
+  fclose(f);
+  return 0;
+}
+
+// A sine in both channels, so the resamplers get something realistic to chew on
+static void
+source_read(int16_t *buf, int nsamples, int sample_rate, uint64_t *pos)
+{
+  double v;
+  int i;
+
+  for (i = 0; i < nsamples; i++, (*pos)++)
+    {
+      v = 16000.0 * sin(2.0 * M_PI * 440.0 * (double)*pos / sample_rate);
+      buf[2 * i] = (int16_t)v;
+      buf[2 * i + 1] = (int16_t)(v / 2);
+    }
+}
+
+static void
+usage(char *program)
+{
+  printf("Usage: %s [options]\n\n", program);
+  printf("Options:\n");
+  printf("  -t <ticks>         Number of ticks to run (default %d)\n", BENCH_TICKS_DEFAULT);
+  printf("  -d <devices>       Number of dummy devices (default %d, max %d)\n", BENCH_DUMMIES_DEFAULT, BENCH_DUMMIES_MAX);
+  printf("  -q <qualities>     Number of extra quality subscriptions (default %d, max %d)\n", BENCH_SUBSCRIPTIONS_DEFAULT, (int)ARRAY_SIZE(bench_qualities));
+  printf("  -r <sample rate>   Sample rate of the source (default 44100)\n");
+  printf("  -v                 Log at debug level\n");
+  printf("\n");
+}
+
+
+int
+main(int argc, char **argv)
+{
+  struct media_quality quality = { 44100, 16, 2, 0 };
+  struct outputs_stats stats;
+  struct output_device *device;
+  struct timespec pts;
+  char tmpdir[] = "/tmp/forked-daapd-bench.XXXXXX";
+  char conf_path[PATH_MAX];
+  char fifo_path[PATH_MAX];
+  uint64_t *latency;
+  uint64_t cpu_start;
+  uint64_t wall_start;
+  uint64_t cpu_total;
+  uint64_t wall_total;
+  uint64_t allocs_start;
+  uint64_t allocs_total;
+  uint64_t t;
+  uint64_t pos;
+  int16_t *buf;
+  size_t bufsize;
+  int nsamples;
+  int nticks = BENCH_TICKS_DEFAULT;
+  int ndummies = BENCH_DUMMIES_DEFAULT;
+  int nsubscriptions = BENCH_SUBSCRIPTIONS_DEFAULT;
+  int loglevel = E_LOG;
+  int option;
+  int ret;
+  int i;
+
+  while ((option = getopt(argc, argv, "t:d:q:r:vh")) != -1)
+    {
+      switch (option)
+	{
+	  case 't':
+	    nticks = atoi(optarg);
+	    break;
+	  case 'd':
+	    ndummies = atoi(optarg);
+	    break;
+	  case 'q':
+	    nsubscriptions = atoi(optarg);
+	    break;
+	  case 'r':
+	    quality.sample_rate = atoi(optarg);
+	    break;
+	  case 'v':
+	    loglevel = E_DBG;
+	    break;
+	  default:
+	    usage(argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+
+  if (nticks <= 0 || ndummies < 1 || ndummies > BENCH_DUMMIES_MAX || nsubscriptions < 0 ||
+      nsubscriptions > ARRAY_SIZE(bench_qualities) || quality.sample_rate <= 0)
+    {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  if (!mkdtemp(tmpdir))
+    {
+      fprintf(stderr, "Could not create temp dir: %s\n", strerror(errno));
+      return EXIT_FAILURE;
+    }
+
+  snprintf(conf_path, sizeof(conf_path), "%s/bench.conf", tmpdir);
+  snprintf(fifo_path, sizeof(fifo_path), "%s/fifo", tmpdir);
+
+  ret = EXIT_FAILURE;
+
+  logger_init(NULL, NULL, loglevel);
+
+  if (config_write(conf_path, fifo_path) < 0 || conffile_load(conf_path) < 0)
+    {
+      fprintf(stderr, "Could not make the benchmark config\n");
+      goto out_rmdir;
+    }
+
+#if (LIBAVFORMAT_VERSION_MAJOR < 58) || ((LIBAVFORMAT_VERSION_MAJOR == 58) && (LIBAVFORMAT_VERSION_MINOR < 12))
+  av_register_all();
+#endif
+#if (LIBAVFILTER_VERSION_MAJOR < 7) || ((LIBAVFILTER_VERSION_MAJOR == 7) && (LIBAVFILTER_VERSION_MINOR < 16))
+  avfilter_register_all();
+#endif
+  av_log_set_callback(logger_ffmpeg);
+
+  evthread_use_pthreads();
+  CHECK_NULL(L_PLAYER, evbase_player = event_base_new());
+
+  // Adds the dummy and fifo devices from the config via player_device_add()
+  if (outputs_init() < 0)
+    {
+      fprintf(stderr, "Could not init outputs\n");
+      goto out_unload;
+    }
+
+  for (i = 1; i < ndummies; i++)
+    {
+      CHECK_NULL(L_PLAYER, device = calloc(1, sizeof(struct output_device)));
+      device->id = 1000 + i;
+      device->name = safe_asprintf("Bench dummy %d", i);
+      device->type = OUTPUT_TYPE_DUMMY;
+      device->type_name = outputs_name(device->type);
+      player_device_add(device);
+    }
+
+  for (i = 0; i < bench_ndevices; i++)
+    outputs_device_start(bench_devices[i], bench_device_cb);
+
+  for (i = 0; i < nsubscriptions; i++)
+    outputs_quality_subscribe(&bench_qualities[i]);
+
+  event_base_loop(evbase_player, EVLOOP_NONBLOCK);
+
+  nsamples = quality.sample_rate * BENCH_TICK_MS / 1000;
+  bufsize = STOB(nsamples, quality.bits_per_sample, quality.channels);
+  CHECK_NULL(L_PLAYER, buf = malloc(bufsize));
+  CHECK_NULL(L_PLAYER, latency = calloc(nticks, sizeof(uint64_t)));
+
+  printf("Source %d/%d/%d, %d samples (%zu bytes) per tick\n", quality.sample_rate, quality.bits_per_sample, quality.channels, nsamples, bufsize);
+  printf("Devices %d started of %d (%d dummy, fifo), %d extra quality subscriptions\n", bench_nstarted, bench_ndevices, ndummies, nsubscriptions);
+
+  clock_gettime(CLOCK_MONOTONIC, &pts);
+  pos = 0;
+
+  allocs_start = atomic_load(&bench_allocs);
+  cpu_start = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+  wall_start = clock_ns(CLOCK_MONOTONIC);
+
+  for (i = 0; i < nticks; i++)
+    {
+      source_read(buf, nsamples, quality.sample_rate, &pos);
+
+      t = clock_ns(CLOCK_MONOTONIC);
+      outputs_write(buf, bufsize, nsamples, &quality, &pts);
+      latency[i] = clock_ns(CLOCK_MONOTONIC) - t;
+
+      // The player's clock, advanced by a tick instead of waiting for it
+      pts.tv_nsec += BENCH_TICK_MS * 1000000L;
+      if (pts.tv_nsec >= 1000000000L)
+	{
+	  pts.tv_sec++;
+	  pts.tv_nsec -= 1000000000L;
+	}
+
+      event_base_loop(evbase_player, EVLOOP_NONBLOCK);
+    }
+
+  cpu_total = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+  wall_total = clock_ns(CLOCK_MONOTONIC) - wall_start;
+  allocs_total = atomic_load(&bench_allocs) - allocs_start;
+
+  outputs_stats_get(&stats);
+  qsort(latency, nticks, sizeof(uint64_t), uint64_cmp);
+
+  printf("Ticks              %d (%.1f s of audio in %.3f s, %.0fx real time)\n",
+    nticks, nticks * BENCH_TICK_MS / 1000.0, wall_total / 1e9, (nticks * BENCH_TICK_MS * 1e6) / wall_total);
+  printf("CPU per tick       %.1f us\n", cpu_total / 1e3 / nticks);
+  printf("Tick latency       p50 %.1f us, p99 %.1f us, max %.1f us\n",
+    latency[nticks / 2] / 1e3, latency[(nticks * 99) / 100] / 1e3, latency[nticks - 1] / 1e3);
+  printf("Bytes in           %" PRIu64 " (%.0f per tick)\n", stats.bytes_in, (double)stats.bytes_in / nticks);
+  printf("Bytes copied       %" PRIu64 " (%.0f per tick)\n", stats.bytes_copied, (double)stats.bytes_copied / nticks);
+  printf("Bytes resampled    %" PRIu64 " (%.0f per tick)\n", stats.bytes_resampled, (double)stats.bytes_resampled / nticks);
+  printf("Late resampling    %" PRIu64 " ticks\n", stats.resample_late);
+  if (BENCH_COUNTS_ALLOCS)
+    printf("Allocations        %" PRIu64 " (%.1f per tick)\n", allocs_total, (double)allocs_total / nticks);
+  else
+    printf("Allocations        not counted on this platform\n");
+
+  outputs_stop(bench_device_cb);
+  event_base_loop(evbase_player, EVLOOP_NONBLOCK);
+
+  for (i = 0; i < nsubscriptions; i++)
+    outputs_quality_unsubscribe(&bench_qualities[i]);
+
+  free(latency);
+  free(buf);
+
+  outputs_deinit();
+
+  ret = EXIT_SUCCESS;
+
+ out_unload:
+  event_base_free(evbase_player);
+  conffile_unload();
+ out_rmdir:
+  logger_deinit();
+  unlink(fifo_path);
+  unlink(conf_path);
+  rmdir(tmpdir);
+
+  return ret;
+}
@@ -29,6 +29,8 @@
 #include <errno.h>
 #include <time.h>
 #include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <pthread.h>
 #ifdef HAVE_PTHREAD_NP_H
 # include <pthread_np.h>
@@ -43,11 +45,16 @@
 #include "httpd_daap.h"
 #include "db.h"
 #include "cache.h"
+#include "artwork.h"
 #include "listener.h"
 #include "commands.h"
+#include "misc.h"
 
 
-#define CACHE_VERSION 3
+#define CACHE_VERSION 4
+
+// Number of hash buckets for the in-memory DAAP reply cache
+#define CACHE_DAAP_HASH_SIZE 256
 
 
 struct cache_arg
@@ -56,6 +63,7 @@ struct cache_arg
   char *ua;    // user agent
   int is_remote;
   int msec;
+  short events; // LISTENER_* events
 
   const char *path;  // artwork path
   char *pathcopy;  // copy of artwork path (for async operations)
@@ -71,6 +79,50 @@ struct cache_arg
   struct evbuffer *evbuf;
 };
 
+// A cached DAAP reply. The gzipped data is shared with the evbuffers of the
+// replies that are being sent, so entries are refcounted. The cache itself
+// holds one reference while the entry is in the hash table and the LRU list.
+struct cache_daap_entry
+{
+  char *key;
+  // LISTENER_* events that invalidate the reply
+  short events;
+  int refcount;
+
+  uint8_t *data;
+  size_t len;
+
+  struct cache_daap_entry *hash_next;
+  struct cache_daap_entry *lru_prev;
+  struct cache_daap_entry *lru_next;
+};
+
+// A transcoded file in the on-disk cache, see xcode_filename()
+struct cache_xcode_entry
+{
+  int id;
+  uint32_t mtime;
+  int profile;
+  off_t size;
+  // Only used for ordering the entries when loading them
+  time_t used;
+
+  // Most recently used first
+  struct cache_xcode_entry *next;
+};
+
+// A transcoded file that is being written while it is streamed
+struct cache_xcode_file
+{
+  int id;
+  uint32_t mtime;
+  int profile;
+
+  char *tmp_path;
+  int fd;
+  off_t size;
+};
+
 /* --- Globals --- */
 // cache thread
 static pthread_t tid_cache;
@@ -101,6 +153,26 @@ static int g_suspended;
 // that will have their reply cached
 static int g_cfg_threshold;
 
+// In-memory DAAP reply cache. Lookups are made directly by the httpd threads,
+// while entries are only added by the cache thread. The lock protects all of
+// the below.
+static pthread_mutex_t g_daap_lck;
+static struct cache_daap_entry *g_daap_hash[CACHE_DAAP_HASH_SIZE];
+// Most recently used entry is the head
+static struct cache_daap_entry *g_daap_lru_head;
+static struct cache_daap_entry *g_daap_lru_tail;
+static size_t g_daap_size;
+static size_t g_daap_max_size;
+static struct cache_daap_stats g_daap_stats;
+
+// On-disk cache of transcoded files. Used directly by the httpd threads, the
+// lock protects the list and the size.
+static pthread_mutex_t g_xcode_lck;
+static char *g_xcode_dir;
+static struct cache_xcode_entry *g_xcode_entries;
+static off_t g_xcode_size;
+static off_t g_xcode_max_size;
+
 /* --------------------------------- HELPERS ------------------------------- */
 
 /* The purpose of this function is to remove transient tags from a request 
@@ -123,6 +195,356 @@ remove_tag(char *in, const char *tag)
     *(s - 1) = '\0';
 }
 
+/* Replies only depend on the user-agent through transcode_needed(), which just
+ * looks at the product name, so e.g. "iTunes/12.8 (Macintosh; OS X 10.13)" and
+ * "iTunes/12.9" can share replies. Returns the product name.
+ */
+static char *
+ua_class(const char *ua)
+{
+  if (!ua)
+    return strdup("");
+
+  return strndup(ua, strcspn(ua, "/ "));
+}
+
+/* Returns the key for the reply cache, the query is normalized by removing
+ * transient tags.
+ */
+static char *
+cache_daap_key(const char *query, const char *ua, int is_remote)
+{
+  char *normalized;
+  char *uaclass;
+  char *key;
+
+  normalized = strdup(query);
+  remove_tag(normalized, "session-id");
+  remove_tag(normalized, "revision-number");
+
+  uaclass = ua_class(ua);
+
+  key = safe_asprintf("%d:%s:%s", is_remote, uaclass, normalized);
+
+  free(uaclass);
+  free(normalized);
+
+  return key;
+}
+
+/* Returns the events that should invalidate the reply to the query, or 0 if
+ * we aren't able to pre-build and cache replies of that type. All the types
+ * list library content, so they depend on LISTENER_DATABASE. Ratings and
+ * playlist items are changed without that event, so replies that include
+ * them must also be invalidated by LISTENER_RATING/LISTENER_STORED_PLAYLIST.
+ */
+static short
+cache_daap_events(const char *query)
+{
+  if (strncmp(query, "/databases/1/containers/", strlen("/databases/1/containers/")) == 0)
+    return (LISTENER_DATABASE | LISTENER_STORED_PLAYLIST | LISTENER_RATING);
+  if (strncmp(query, "/databases/1/items?", strlen("/databases/1/items?")) == 0)
+    return (LISTENER_DATABASE | LISTENER_RATING);
+  if (strncmp(query, "/databases/1/groups?", strlen("/databases/1/groups?")) == 0)
+    return LISTENER_DATABASE;
+  if (strncmp(query, "/databases/1/browse/", strlen("/databases/1/browse/")) == 0)
+    return LISTENER_DATABASE;
+
+  return 0;
+}
+
+
+/* ------------------------- In-memory DAAP cache -------------------------- */
+/*             Functions with _locked must be called with g_daap_lck        */
+
+static void
+daap_entry_unref_locked(struct cache_daap_entry *entry)
+{
+  entry->refcount--;
+  if (entry->refcount > 0)
+    return;
+
+  free(entry->key);
+  free(entry->data);
+  free(entry);
+}
+
+/* Cleanup callback for evbuffer_add_reference(), may be called from any thread */
+static void
+daap_entry_unref_cb(const void *data, size_t datalen, void *extra)
+{
+  struct cache_daap_entry *entry = extra;
+
+  pthread_mutex_lock(&g_daap_lck);
+  daap_entry_unref_locked(entry);
+  pthread_mutex_unlock(&g_daap_lck);
+}
+
+static struct cache_daap_entry *
+daap_entry_find_locked(const char *key)
+{
+  struct cache_daap_entry *entry;
+  uint32_t hash;
+
+  hash = djb_hash(key, strlen(key)) % CACHE_DAAP_HASH_SIZE;
+
+  for (entry = g_daap_hash[hash]; entry; entry = entry->hash_next)
+    {
+      if (strcmp(entry->key, key) == 0)
+	return entry;
+    }
+
+  return NULL;
+}
+
+static void
+daap_entry_lru_unlink_locked(struct cache_daap_entry *entry)
+{
+  if (entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    g_daap_lru_head = entry->lru_next;
+
+  if (entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    g_daap_lru_tail = entry->lru_prev;
+
+  entry->lru_prev = NULL;
+  entry->lru_next = NULL;
+}
+
+static void
+daap_entry_lru_push_locked(struct cache_daap_entry *entry)
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = g_daap_lru_head;
+
+  if (g_daap_lru_head)
+    g_daap_lru_head->lru_prev = entry;
+  else
+    g_daap_lru_tail = entry;
+
+  g_daap_lru_head = entry;
+}
+
+/* Takes the entry out of the cache and drops the cache's reference. Replies
+ * that are being sent keep their own reference to the data.
+ */
+static void
+daap_entry_remove_locked(struct cache_daap_entry *entry)
+{
+  struct cache_daap_entry **pentry;
+  uint32_t hash;
+
+  hash = djb_hash(entry->key, strlen(entry->key)) % CACHE_DAAP_HASH_SIZE;
+
+  for (pentry = &g_daap_hash[hash]; *pentry; pentry = &(*pentry)->hash_next)
+    {
+      if (*pentry == entry)
+	{
+	  *pentry = entry->hash_next;
+	  break;
+	}
+    }
+
+  daap_entry_lru_unlink_locked(entry);
+
+  g_daap_size -= entry->len;
+  g_daap_stats.entries--;
+
+  daap_entry_unref_locked(entry);
+}
+
+static void
+daap_entry_insert_locked(struct cache_daap_entry *entry)
+{
+  uint32_t hash;
+
+  hash = djb_hash(entry->key, strlen(entry->key)) % CACHE_DAAP_HASH_SIZE;
+
+  entry->hash_next = g_daap_hash[hash];
+  g_daap_hash[hash] = entry;
+
+  daap_entry_lru_push_locked(entry);
+
+  g_daap_size += entry->len;
+  g_daap_stats.entries++;
+}
+
+static void
+daap_entries_clear(void)
+{
+  pthread_mutex_lock(&g_daap_lck);
+  while (g_daap_lru_head)
+    daap_entry_remove_locked(g_daap_lru_head);
+  pthread_mutex_unlock(&g_daap_lck);
+}
+
+
+/* ------------------------ On-disk transcode cache ------------------------ */
+
+// The file id and mtime are in the name, so a file that is changed gets a new
+// cache entry, and the old one will be evicted eventually
+static void
+xcode_filename(char *buf, size_t size, int id, uint32_t mtime, int profile)
+{
+  snprintf(buf, size, "%s/%d-%" PRIu32 "-%d.xcode", g_xcode_dir, id, mtime, profile);
+}
+
+static void
+xcode_entry_free_locked(struct cache_xcode_entry *entry, int del)
+{
+  char path[PATH_MAX];
+
+  if (del)
+    {
+      xcode_filename(path, sizeof(path), entry->id, entry->mtime, entry->profile);
+      unlink(path);
+    }
+
+  g_xcode_size -= entry->size;
+  free(entry);
+}
+
+// Removes entries from the tail (least recently used) until we are below the
+// max size. The head entry is never removed.
+static void
+xcode_evict_locked(void)
+{
+  struct cache_xcode_entry *entry;
+  struct cache_xcode_entry *prev;
+
+  while (g_xcode_size > g_xcode_max_size && g_xcode_entries && g_xcode_entries->next)
+    {
+      for (prev = g_xcode_entries, entry = prev->next; entry->next; prev = entry, entry = entry->next)
+	; // Find the tail
+
+      DPRINTF(E_DBG, L_CACHE, "Evicting transcoded file id %d from cache\n", entry->id);
+
+      prev->next = NULL;
+      xcode_entry_free_locked(entry, 1);
+    }
+}
+
+// Loads the entries from the cache dir, ordered by mtime, which we set when an
+// entry is used. Leftover temp files from writes that didn't complete are
+// removed.
+static void
+xcode_entries_load(void)
+{
+  struct cache_xcode_entry *entry;
+  struct cache_xcode_entry **link;
+  struct dirent *de;
+  struct stat sb;
+  char path[PATH_MAX];
+  int nentries;
+  int n;
+  DIR *dh;
+
+  dh = opendir(g_xcode_dir);
+  if (!dh)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not open transcode cache dir '%s': %s\n", g_xcode_dir, strerror(errno));
+      return;
+    }
+
+  nentries = 0;
+
+  while ((de = readdir(dh)))
+    {
+      snprintf(path, sizeof(path), "%s/%s", g_xcode_dir, de->d_name);
+
+      if (strstr(de->d_name, ".tmp."))
+	{
+	  unlink(path);
+	  continue;
+	}
+
+      if (stat(path, &sb) < 0 || !S_ISREG(sb.st_mode))
+	continue;
+
+      CHECK_NULL(L_CACHE, entry = calloc(1, sizeof(struct cache_xcode_entry)));
+      if (sscanf(de->d_name, "%d-%" SCNu32 "-%d.xcode%n", &entry->id, &entry->mtime, &entry->profile, &n) != 3 || de->d_name[n] != '\0')
+	{
+	  free(entry);
+	  continue;
+	}
+
+      entry->size = sb.st_size;
+      entry->used = sb.st_mtime;
+
+      for (link = &g_xcode_entries; *link && (*link)->used >= entry->used; link = &(*link)->next)
+	; // Find the first entry that was used before this one
+
+      entry->next = *link;
+      *link = entry;
+      g_xcode_size += entry->size;
+      nentries++;
+    }
+
+  closedir(dh);
+
+  // In case the max size was reduced since last time
+  xcode_evict_locked();
+
+  DPRINTF(E_INFO, L_CACHE, "Transcode cache has %d files (%" PRIi64 " MB)\n", nentries, (int64_t)g_xcode_size / (1024 * 1024));
+}
+
+static void
+xcode_entries_clear(void)
+{
+  struct cache_xcode_entry *entry;
+
+  for (entry = g_xcode_entries; g_xcode_entries; entry = g_xcode_entries)
+    {
+      g_xcode_entries = entry->next;
+      xcode_entry_free_locked(entry, 0);
+    }
+}
+
+static void
+xcode_init(void)
+{
+  int ret;
+
+  g_xcode_max_size = (off_t)cfg_getint(cfg_getsec(cfg, "general"), "cache_xcode_size") * 1024 * 1024;
+  g_xcode_dir = cfg_getstr(cfg_getsec(cfg, "general"), "cache_xcode_path");
+  if (g_xcode_max_size <= 0 || !g_xcode_dir || (strlen(g_xcode_dir) == 0))
+    {
+      DPRINTF(E_LOG, L_CACHE, "Transcode cache size or path not set, disabling transcode cache\n");
+      g_xcode_max_size = 0;
+      return;
+    }
+
+  ret = mkdir(g_xcode_dir, 0755);
+  if (ret < 0 && errno != EEXIST)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not create transcode cache dir '%s', disabling transcode cache: %s\n", g_xcode_dir, strerror(errno));
+      g_xcode_max_size = 0;
+      return;
+    }
+
+  CHECK_ERR(L_CACHE, pthread_mutex_init(&g_xcode_lck, NULL));
+
+  g_xcode_entries = NULL;
+  g_xcode_size = 0;
+
+  xcode_entries_load();
+}
+
+static void
+xcode_deinit(void)
+{
+  if (g_xcode_max_size == 0)
+    return;
+
+  xcode_entries_clear();
+  pthread_mutex_destroy(&g_xcode_lck);
+
+  g_xcode_max_size = 0;
+}
+
 
 /* --------------------------------- MAIN --------------------------------- */
 /*                              Thread: cache                              */
@@ -130,23 +552,16 @@ remove_tag(char *in, const char *tag)
 static int
 cache_create_tables(void)
 {
-#define T_REPLIES						\
-  "CREATE TABLE IF NOT EXISTS replies ("			\
-  "   id                 INTEGER PRIMARY KEY NOT NULL,"		\
-  "   query              VARCHAR(4096) NOT NULL,"		\
-  "   reply              BLOB"					\
-  ");"
 #define T_QUERIES						\
   "CREATE TABLE IF NOT EXISTS queries ("			\
   "   id                 INTEGER PRIMARY KEY NOT NULL,"		\
-  "   query              VARCHAR(4096) UNIQUE NOT NULL,"	\
+  "   key                VARCHAR(4096) UNIQUE NOT NULL,"	\
+  "   query              VARCHAR(4096) NOT NULL,"		\
   "   user_agent         VARCHAR(1024),"			\
   "   is_remote          INTEGER DEFAULT 0,"			\
   "   msec               INTEGER DEFAULT 0,"			\
   "   timestamp          INTEGER DEFAULT 0"			\
   ");"
-#define I_QUERY							\
-  "CREATE INDEX IF NOT EXISTS idx_query ON replies (query);"
 #define T_ARTWORK					\
   "CREATE TABLE IF NOT EXISTS artwork ("		\
   "   id                  INTEGER PRIMARY KEY NOT NULL,"\
@@ -176,17 +591,6 @@ cache_create_tables(void)
   int ret;
 
 
-  // Create reply cache table
-  ret = sqlite3_exec(g_db_hdl, T_REPLIES, NULL, NULL, &errmsg);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_FATAL, L_CACHE, "Error creating cache table 'replies': %s\n", errmsg);
-
-      sqlite3_free(errmsg);
-      sqlite3_close(g_db_hdl);
-      return -1;
-    }
-
   // Create query table (the queries for which we will generate and cache replies)
   ret = sqlite3_exec(g_db_hdl, T_QUERIES, NULL, NULL, &errmsg);
   if (ret != SQLITE_OK)
@@ -198,17 +602,6 @@ cache_create_tables(void)
       return -1;
     }
 
-  // Create index
-  ret = sqlite3_exec(g_db_hdl, I_QUERY, NULL, NULL, &errmsg);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_FATAL, L_CACHE, "Error creating index on replies(query): %s\n", errmsg);
-
-      sqlite3_free(errmsg);
-      sqlite3_close(g_db_hdl);
-      return -1;
-    }
-
   // Create artwork table
   ret = sqlite3_exec(g_db_hdl, T_ARTWORK, NULL, NULL, &errmsg);
   if (ret != SQLITE_OK)
@@ -266,9 +659,7 @@ cache_create_tables(void)
   DPRINTF(E_DBG, L_CACHE, "Cache tables created\n");
 
   return 0;
-#undef T_REPLIES
 #undef T_QUERIES
-#undef I_QUERY
 #undef T_ARTWORK
 #undef I_ARTWORK_ID
 #undef I_ARTWORK_PATH
@@ -579,58 +970,99 @@ cache_close(void)
   DPRINTF(E_DBG, L_CACHE, "Cache closed\n");
 }
 
-/* Adds the reply (stored in evbuf) to the cache */
+/* Removes the query from the list of queries for which we cache replies */
 static int
-cache_daap_reply_add(const char *query, struct evbuffer *evbuf)
+cache_daap_query_delete(const char *key)
 {
-#define Q_TMPL "INSERT INTO replies (query, reply) VALUES (?, ?);"
-  sqlite3_stmt *stmt;
-  unsigned char *data;
-  size_t datalen;
+#define Q_TMPL "DELETE FROM queries WHERE key = '%q';"
+  char *query;
+  char *errmsg;
   int ret;
 
-  datalen = evbuffer_get_length(evbuf);
-  data = evbuffer_pullup(evbuf, -1);
+  query = sqlite3_mprintf(Q_TMPL, key);
 
-  ret = sqlite3_prepare_v2(g_db_hdl, Q_TMPL, -1, &stmt, 0);
+  ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error preparing query for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
+      DPRINTF(E_LOG, L_CACHE, "Error deleting query from cache: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
       return -1;
     }
 
-  sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
-  sqlite3_bind_blob(stmt, 2, data, datalen, SQLITE_STATIC);
+  return 0;
+#undef Q_TMPL
+}
 
-  ret = sqlite3_step(stmt);
-  if (ret != SQLITE_DONE)
+/* Adds the reply (stored in evbuf, gzipped) to the in-memory cache. Least
+ * recently used replies are evicted to stay within the memory budget, and
+ * their queries are removed so they won't be rebuilt.
+ */
+static int
+cache_daap_reply_add(const char *key, short events, struct evbuffer *evbuf)
+{
+  struct cache_daap_entry *entry;
+  char *evicted;
+  size_t len;
+
+  len = evbuffer_get_length(evbuf);
+  if (len > g_daap_max_size)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error stepping query for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
-      sqlite3_finalize(stmt);
+      DPRINTF(E_WARN, L_CACHE, "DAAP reply too large for cache (%zu bytes): %s\n", len, key);
+      cache_daap_query_delete(key);
       return -1;
     }
 
-  ret = sqlite3_finalize(stmt);
-  if (ret != SQLITE_OK)
+  CHECK_NULL(L_CACHE, entry = calloc(1, sizeof(struct cache_daap_entry)));
+  CHECK_NULL(L_CACHE, entry->key = strdup(key));
+  CHECK_NULL(L_CACHE, entry->data = malloc(len));
+
+  evbuffer_remove(evbuf, entry->data, len);
+  entry->len = len;
+  entry->events = events;
+  entry->refcount = 1;
+
+  while (1)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error finalizing query for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
-      return -1;
+      evicted = NULL;
+
+      pthread_mutex_lock(&g_daap_lck);
+      if (g_daap_lru_tail && (g_daap_size + len > g_daap_max_size))
+	{
+	  evicted = strdup(g_daap_lru_tail->key);
+	  daap_entry_remove_locked(g_daap_lru_tail);
+	  g_daap_stats.evictions++;
+	}
+      pthread_mutex_unlock(&g_daap_lck);
+
+      if (!evicted)
+	break;
+
+      DPRINTF(E_DBG, L_CACHE, "Evicting DAAP reply from cache: %s\n", evicted);
+
+      cache_daap_query_delete(evicted);
+      free(evicted);
     }
 
-  //DPRINTF(E_DBG, L_CACHE, "Wrote cache reply, size %d\n", datalen);
+  pthread_mutex_lock(&g_daap_lck);
+  if (daap_entry_find_locked(key))
+    daap_entry_remove_locked(daap_entry_find_locked(key));
+  daap_entry_insert_locked(entry);
+  pthread_mutex_unlock(&g_daap_lck);
 
   return 0;
-#undef Q_TMPL
 }
 
 /* Adds the query to the list of queries for which we will build and cache a reply */
 static enum command_state
 cache_daap_query_add(void *arg, int *retval)
 {
-#define Q_TMPL "INSERT OR REPLACE INTO queries (user_agent, is_remote, query, msec, timestamp) VALUES ('%q', %d, '%q', %d, %" PRIi64 ");"
-#define Q_CLEANUP "DELETE FROM queries WHERE id NOT IN (SELECT id FROM queries ORDER BY timestamp DESC LIMIT 20);"
+#define Q_TMPL "INSERT OR REPLACE INTO queries (key, query, user_agent, is_remote, msec, timestamp) VALUES ('%q', '%q', '%q', %d, %d, %" PRIi64 ");"
   struct cache_arg *cmdarg;
   struct timeval delay = { 60, 0 };
+  char *key;
+  char *uaclass;
   char *query;
   char *errmsg;
   int ret;
@@ -644,16 +1076,19 @@ cache_daap_query_add(void *arg, int *retval)
     }
 
   // Currently we are only able to pre-build and cache these reply types
-  if ( (strncmp(cmdarg->query, "/databases/1/containers/", strlen("/databases/1/containers/")) != 0) &&
-       (strncmp(cmdarg->query, "/databases/1/groups?", strlen("/databases/1/groups?")) != 0) &&
-       (strncmp(cmdarg->query, "/databases/1/items?", strlen("/databases/1/items?")) != 0) &&
-       (strncmp(cmdarg->query, "/databases/1/browse/", strlen("/databases/1/browse/")) != 0) )
+  if (!cache_daap_events(cmdarg->query))
     goto error_add;
 
+  key = cache_daap_key(cmdarg->query, cmdarg->ua, cmdarg->is_remote);
+
   remove_tag(cmdarg->query, "session-id");
   remove_tag(cmdarg->query, "revision-number");
 
-  query = sqlite3_mprintf(Q_TMPL, cmdarg->ua, cmdarg->is_remote, cmdarg->query, cmdarg->msec, (int64_t)time(NULL));
+  uaclass = ua_class(cmdarg->ua);
+
+  query = sqlite3_mprintf(Q_TMPL, key, cmdarg->query, uaclass, cmdarg->is_remote, cmdarg->msec, (int64_t)time(NULL));
+  free(uaclass);
+  free(key);
   if (!query)
     {
       DPRINTF(E_LOG, L_CACHE, "Out of memory making query string.\n");
@@ -676,16 +1111,6 @@ cache_daap_query_add(void *arg, int *retval)
   free(cmdarg->ua);
   free(cmdarg->query);
 
-  // Limits the size of the cache to only contain replies for 20 most recent queries
-  ret = sqlite3_exec(g_db_hdl, Q_CLEANUP, NULL, NULL, &errmsg);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Error cleaning up query list before update: %s\n", errmsg);
-      sqlite3_free(errmsg);
-      *retval = -1;
-      return COMMAND_END;
-    }
-
   // Will set of cache regeneration after waiting a bit (so there is less risk
   // of disturbing the user)
   evtimer_add(cache_daap_updateev, &delay);
@@ -702,108 +1127,12 @@ cache_daap_query_add(void *arg, int *retval)
 
   *retval = -1;
   return COMMAND_END;
-#undef Q_CLEANUP
-#undef Q_TMPL
-}
-
-// Gets a reply from the cache.
-// cmdarg->evbuf will be filled with the reply (gzipped)
-static enum command_state
-cache_daap_query_get(void *arg, int *retval)
-{
-#define Q_TMPL "SELECT reply FROM replies WHERE query = ?;"
-  struct cache_arg *cmdarg;
-  sqlite3_stmt *stmt;
-  char *query;
-  int datalen;
-  int ret;
-
-  cmdarg = arg;
-  query = cmdarg->query;
-  remove_tag(query, "session-id");
-  remove_tag(query, "revision-number");
-
-  // Look in the DB
-  ret = sqlite3_prepare_v2(g_db_hdl, Q_TMPL, -1, &stmt, 0);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Error preparing query for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
-      free(query);
-      *retval = -1;
-      return COMMAND_END;
-    }
-
-  sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
-
-  ret = sqlite3_step(stmt);
-  if (ret != SQLITE_ROW)  
-    {
-      if (ret != SQLITE_DONE)
-	DPRINTF(E_LOG, L_CACHE, "Error stepping query for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
-      goto error_get;
-    }
-
-  datalen = sqlite3_column_bytes(stmt, 0);
-
-  if (!cmdarg->evbuf)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Error: DAAP reply evbuffer is NULL\n");
-      goto error_get;
-    }
-
-  ret = evbuffer_add(cmdarg->evbuf, sqlite3_column_blob(stmt, 0), datalen);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Out of memory for DAAP reply evbuffer\n");
-      goto error_get;
-    }
-
-  ret = sqlite3_finalize(stmt);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_CACHE, "Error finalizing query for getting cache: %s\n", sqlite3_errmsg(g_db_hdl));
-
-  DPRINTF(E_INFO, L_CACHE, "Cache hit: %s\n", query);
-
-  free(query);
-
-  *retval = 0;
-  return COMMAND_END;
-
- error_get:
-  sqlite3_finalize(stmt);
-  free(query);
-  *retval = -1;
-  return COMMAND_END;
 #undef Q_TMPL
 }
 
-/* Removes the query from the cache */
-static int
-cache_daap_query_delete(const int id)
-{
-#define Q_TMPL "DELETE FROM queries WHERE id = %d;"
-  char *query;
-  char *errmsg;
-  int ret;
-
-  query = sqlite3_mprintf(Q_TMPL, id);
-
-  ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
-  sqlite3_free(query);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Error deleting query from cache: %s\n", errmsg);
-
-      sqlite3_free(errmsg);
-      return -1;
-    }
-
-  return 0;
-#undef Q_TMPL
-}
-
-/* Here we actually update the cache by asking httpd_daap for responses
- * to the queries set for caching
+/* Here we actually update the cache by asking httpd_daap for responses to the
+ * queries set for caching. Replies that are still cached are kept, so only new
+ * queries and replies that were invalidated will be built.
  */
 static void
 cache_daap_update_cb(int fd, short what, void *arg)
@@ -811,8 +1140,10 @@ cache_daap_update_cb(int fd, short what, void *arg)
   sqlite3_stmt *stmt;
   struct evbuffer *evbuf;
   struct evbuffer *gzbuf;
-  char *errmsg;
+  const char *key;
   char *query;
+  int cached;
+  int nbuilt;
   int ret;
 
   if (g_suspended)
@@ -823,30 +1154,32 @@ cache_daap_update_cb(int fd, short what, void *arg)
 
   DPRINTF(E_LOG, L_CACHE, "Beginning DAAP cache update\n");
 
-  ret = sqlite3_exec(g_db_hdl, "DELETE FROM replies;", NULL, NULL, &errmsg);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Error clearing reply cache before update: %s\n", errmsg);
-      sqlite3_free(errmsg);
-      return;
-    }
-
-  ret = sqlite3_prepare_v2(g_db_hdl, "SELECT id, user_agent, is_remote, query FROM queries;", -1, &stmt, 0);
+  ret = sqlite3_prepare_v2(g_db_hdl, "SELECT key, query, user_agent, is_remote FROM queries;", -1, &stmt, 0);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_CACHE, "Error preparing for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
       return;
     }
 
+  nbuilt = 0;
   while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
     {
-      query = strdup((char *)sqlite3_column_text(stmt, 3));
+      key = (const char *)sqlite3_column_text(stmt, 0);
+
+      pthread_mutex_lock(&g_daap_lck);
+      cached = (daap_entry_find_locked(key) != NULL);
+      pthread_mutex_unlock(&g_daap_lck);
+
+      if (cached)
+	continue;
 
-      evbuf = daap_reply_build(query, (char *)sqlite3_column_text(stmt, 1), sqlite3_column_int(stmt, 2));
+      query = strdup((char *)sqlite3_column_text(stmt, 1));
+
+      evbuf = daap_reply_build(query, (char *)sqlite3_column_text(stmt, 2), sqlite3_column_int(stmt, 3));
       if (!evbuf)
 	{
 	  DPRINTF(E_LOG, L_CACHE, "Error building DAAP reply for query: %s\n", query);
-	  cache_daap_query_delete(sqlite3_column_int(stmt, 0));
+	  cache_daap_query_delete(key);
 	  free(query);
 
 	  continue;
@@ -856,7 +1189,7 @@ cache_daap_update_cb(int fd, short what, void *arg)
       if (!gzbuf)
 	{
 	  DPRINTF(E_LOG, L_CACHE, "Error gzipping DAAP reply for query: %s\n", query);
-	  cache_daap_query_delete(sqlite3_column_int(stmt, 0));
+	  cache_daap_query_delete(key);
 	  free(query);
 	  evbuffer_free(evbuf);
 
@@ -865,7 +1198,9 @@ cache_daap_update_cb(int fd, short what, void *arg)
 
       evbuffer_free(evbuf);
 
-      cache_daap_reply_add(query, gzbuf);
+      ret = cache_daap_reply_add(key, cache_daap_events(query), gzbuf);
+      if (ret == 0)
+	nbuilt++;
 
       free(query);
       evbuffer_free(gzbuf);
@@ -876,16 +1211,47 @@ cache_daap_update_cb(int fd, short what, void *arg)
 
   sqlite3_finalize(stmt);
 
-  DPRINTF(E_LOG, L_CACHE, "DAAP cache updated\n");
+  DPRINTF(E_LOG, L_CACHE, "DAAP cache updated, %d replies built\n", nbuilt);
 }
 
-/* Sets off an update by activating the event. The delay is because we are low
+/* Drops the replies that are invalidated by the events, and then sets off a
+ * rebuild of those by activating the event. The delay is because we are low
  * priority compared to other listeners of database updates.
  */
 static enum command_state
 cache_daap_update(void *arg, int *retval)
 {
+  struct cache_arg *cmdarg;
+  struct cache_daap_entry *entry;
+  struct cache_daap_entry *next;
   struct timeval delay = { 10, 0 };
+  int ninvalidated;
+
+  cmdarg = arg;
+
+  ninvalidated = 0;
+
+  pthread_mutex_lock(&g_daap_lck);
+  for (entry = g_daap_lru_head; entry; entry = next)
+    {
+      next = entry->lru_next;
+
+      if (!(entry->events & cmdarg->events))
+	continue;
+
+      daap_entry_remove_locked(entry);
+      ninvalidated++;
+    }
+  g_daap_stats.invalidations += ninvalidated;
+  pthread_mutex_unlock(&g_daap_lck);
+
+  DPRINTF(E_DBG, L_CACHE, "Library change invalidated %d cached DAAP replies\n", ninvalidated);
+
+  if (ninvalidated == 0)
+    {
+      *retval = 0;
+      return COMMAND_END;
+    }
 
   *retval = event_add(cache_daap_updateev, &delay);
   return COMMAND_END;
@@ -895,7 +1261,18 @@ cache_daap_update(void *arg, int *retval)
 static void
 cache_daap_listener_cb(short event_mask)
 {
-  commands_exec_async(cmdbase, cache_daap_update, NULL);
+  struct cache_arg *cmdarg;
+
+  cmdarg = calloc(1, sizeof(struct cache_arg));
+  if (!cmdarg)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not allocate cache_arg\n");
+      return;
+    }
+
+  cmdarg->events = event_mask;
+
+  commands_exec_async(cmdbase, cache_daap_update, cmdarg);
 }
 
 
@@ -1329,6 +1706,9 @@ cache(void *arg)
  * You can't add queries where the canonical reply is not HTTP_OK, because
  * daap_request will use that as default for cache replies.
  *
+ * The replies are kept in memory, within the configured budget. They are
+ * dropped when the library changes in a way that affects them (see
+ * cache_daap_events), and then rebuilt by the cache thread.
  */
 
 void
@@ -1343,18 +1723,58 @@ cache_daap_resume(void)
   g_suspended = 0;
 }
 
+/* Thread: httpd (any) */
 int
-cache_daap_get(struct evbuffer *evbuf, const char *query)
+cache_daap_get(struct evbuffer *evbuf, const char *query, const char *ua, int is_remote)
 {
-  struct cache_arg cmdarg;
+  struct cache_daap_entry *entry;
+  char *key;
+  int ret;
 
-  if (!g_initialized)
+  if (!g_initialized || g_daap_max_size == 0)
     return -1;
 
-  cmdarg.query = strdup(query);
-  cmdarg.evbuf = evbuf;
+  key = cache_daap_key(query, ua, is_remote);
+
+  pthread_mutex_lock(&g_daap_lck);
+
+  entry = daap_entry_find_locked(key);
+  if (!entry)
+    {
+      g_daap_stats.misses++;
+      pthread_mutex_unlock(&g_daap_lck);
+
+      free(key);
+      return -1;
+    }
+
+  // Most recently used goes to the head of the list
+  daap_entry_lru_unlink_locked(entry);
+  daap_entry_lru_push_locked(entry);
+
+  // The reply evbuffer will reference the cached data instead of copying it
+  entry->refcount++;
+  ret = evbuffer_add_reference(evbuf, entry->data, entry->len, daap_entry_unref_cb, entry);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not add cached DAAP reply to evbuffer\n");
+
+      daap_entry_unref_locked(entry);
+      pthread_mutex_unlock(&g_daap_lck);
+
+      free(key);
+      return -1;
+    }
+
+  g_daap_stats.hits++;
+  g_daap_stats.hit_bytes += entry->len;
+
+  pthread_mutex_unlock(&g_daap_lck);
 
-  return commands_exec_sync(cmdbase, cache_daap_query_get, NULL, &cmdarg);
+  DPRINTF(E_INFO, L_CACHE, "Cache hit: %s\n", key);
+
+  free(key);
+  return 0;
 }
 
 void
@@ -1362,7 +1782,7 @@ cache_daap_add(const char *query, const char *ua, int is_remote, int msec)
 {
   struct cache_arg *cmdarg;
 
-  if (!g_initialized)
+  if (!g_initialized || g_daap_max_size == 0)
     return;
 
   cmdarg = calloc(1, sizeof(struct cache_arg));
@@ -1386,6 +1806,21 @@ cache_daap_threshold(void)
   return g_cfg_threshold;
 }
 
+int
+cache_daap_stats_get(struct cache_daap_stats *stats)
+{
+  if (!g_initialized)
+    return -1;
+
+  pthread_mutex_lock(&g_daap_lck);
+  memcpy(stats, &g_daap_stats, sizeof(struct cache_daap_stats));
+  stats->bytes = g_daap_size;
+  stats->max_bytes = g_daap_max_size;
+  pthread_mutex_unlock(&g_daap_lck);
+
+  return 0;
+}
+
 
 /* --------------------------- Artwork cache API -------------------------- */
 
@@ -1421,6 +1856,10 @@ cache_artwork_ping(const char *path, time_t mtime, int del)
   cmdarg->del = del;
 
   commands_exec_async(cmdbase, cache_artwork_ping_impl, cmdarg);
+
+  // Commands are run in order, so the prebuild thread's lookups in the cache
+  // will see the result of the ping
+  artwork_prebuild_add(path);
 }
 
 /*
@@ -1584,6 +2023,267 @@ cache_artwork_read(struct evbuffer *evbuf, const char *path, int *format)
 }
 
 
+/* ------------------------- Transcode cache API -------------------------- */
+
+/*
+ * Opens the cached transcoding of a file
+ *
+ * @param id file id
+ * @param mtime time_modified of the file, so that a changed file is a miss
+ * @param profile transcode profile of the cached data
+ * @param size set by this function to the size of the cached data
+ * @return file descriptor to read from, or -1 if not in the cache
+ */
+int
+cache_xcode_open(int id, uint32_t mtime, int profile, off_t *size)
+{
+  struct cache_xcode_entry *entry;
+  struct cache_xcode_entry *prev;
+  char path[PATH_MAX];
+  int fd;
+
+  if (g_xcode_max_size == 0)
+    return -1;
+
+  fd = -1;
+
+  pthread_mutex_lock(&g_xcode_lck);
+
+  for (prev = NULL, entry = g_xcode_entries; entry; prev = entry, entry = entry->next)
+    {
+      if (entry->id == id && entry->mtime == mtime && entry->profile == profile)
+	break;
+    }
+
+  if (!entry)
+    goto out;
+
+  if (prev)
+    prev->next = entry->next;
+  else
+    g_xcode_entries = entry->next;
+
+  xcode_filename(path, sizeof(path), id, mtime, profile);
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not open cached transcoding '%s': %s\n", path, strerror(errno));
+      xcode_entry_free_locked(entry, 0);
+      goto out;
+    }
+
+  // The mtime of the cache file tells when it was last used, also after restart
+  futimens(fd, NULL);
+
+  entry->next = g_xcode_entries;
+  g_xcode_entries = entry;
+
+  *size = entry->size;
+
+ out:
+  pthread_mutex_unlock(&g_xcode_lck);
+
+  return fd;
+}
+
+/*
+ * Starts writing a transcoding of a file to the cache. The data is given with
+ * cache_xcode_file_write(), and is only added to the cache if the caller gets
+ * to call cache_xcode_file_commit(), e.g. not if the client hangs up first.
+ *
+ * @param id file id
+ * @param mtime time_modified of the file
+ * @param profile transcode profile of the data
+ * @return handle for the write, or NULL if the cache is disabled or on error
+ */
+struct cache_xcode_file *
+cache_xcode_file_new(int id, uint32_t mtime, int profile)
+{
+  struct cache_xcode_file *cf;
+  char path[PATH_MAX];
+
+  if (g_xcode_max_size == 0)
+    return NULL;
+
+  CHECK_NULL(L_CACHE, cf = calloc(1, sizeof(struct cache_xcode_file)));
+
+  xcode_filename(path, sizeof(path), id, mtime, profile);
+
+  cf->id = id;
+  cf->mtime = mtime;
+  cf->profile = profile;
+  cf->tmp_path = safe_asprintf("%s.tmp.XXXXXX", path);
+
+  cf->fd = mkstemp(cf->tmp_path);
+  if (cf->fd < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not create '%s' for transcode cache: %s\n", cf->tmp_path, strerror(errno));
+      free(cf->tmp_path);
+      free(cf);
+      return NULL;
+    }
+
+  return cf;
+}
+
+/*
+ * Appends the contents of evbuf, without draining it. If the write fails or
+ * the data gets too big for the cache, the write is aborted and the handle is
+ * freed.
+ *
+ * @return 0 if ok, -1 if the handle was freed
+ */
+int
+cache_xcode_file_write(struct cache_xcode_file *cf, struct evbuffer *evbuf)
+{
+  uint8_t *data;
+  size_t len;
+  ssize_t ret;
+
+  len = evbuffer_get_length(evbuf);
+  if (len == 0)
+    return 0;
+
+  if (cf->size + len > g_xcode_max_size)
+    {
+      DPRINTF(E_INFO, L_CACHE, "Transcoding of file id %d is too big for the transcode cache\n", cf->id);
+      goto error;
+    }
+
+  data = evbuffer_pullup(evbuf, -1);
+
+  while (len > 0)
+    {
+      ret = write(cf->fd, data, len);
+      if (ret < 0 && errno == EINTR)
+	continue;
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Error writing '%s' for transcode cache: %s\n", cf->tmp_path, strerror(errno));
+	  goto error;
+	}
+
+      data += ret;
+      len -= ret;
+      cf->size += ret;
+    }
+
+  return 0;
+
+ error:
+  cache_xcode_file_abort(cf);
+  return -1;
+}
+
+// The WAV header is made before transcoding with sizes estimated from the song
+// length, so in the cache file it is patched with the actual sizes
+static void
+xcode_file_wav_fixup(struct cache_xcode_file *cf)
+{
+  uint8_t header[44];
+  uint32_t riff_len;
+  uint32_t data_len;
+  ssize_t ret;
+  int i;
+
+  if (cf->size < (off_t)sizeof(header) || cf->size - 8 > UINT32_MAX)
+    return;
+
+  ret = pread(cf->fd, header, sizeof(header), 0);
+  if (ret != (ssize_t)sizeof(header) || memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0 || memcmp(header + 36, "data", 4) != 0)
+    return;
+
+  riff_len = cf->size - 8;
+  data_len = cf->size - sizeof(header);
+  for (i = 0; i < 4; i++)
+    {
+      header[4 + i] = (riff_len >> (8 * i)) & 0xff;
+      header[40 + i] = (data_len >> (8 * i)) & 0xff;
+    }
+
+  ret = pwrite(cf->fd, header, sizeof(header), 0);
+  if (ret != (ssize_t)sizeof(header))
+    DPRINTF(E_LOG, L_CACHE, "Could not update WAV header of '%s' for transcode cache\n", cf->tmp_path);
+}
+
+/*
+ * Adds the written data to the cache, replacing other transcodings of the same
+ * file, and frees the handle
+ */
+void
+cache_xcode_file_commit(struct cache_xcode_file *cf)
+{
+  struct cache_xcode_entry *entry;
+  struct cache_xcode_entry *old;
+  struct cache_xcode_entry **link;
+  char path[PATH_MAX];
+  int ret;
+
+  xcode_file_wav_fixup(cf);
+
+  close(cf->fd);
+
+  xcode_filename(path, sizeof(path), cf->id, cf->mtime, cf->profile);
+
+  ret = rename(cf->tmp_path, path);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not rename '%s' for transcode cache: %s\n", cf->tmp_path, strerror(errno));
+      unlink(cf->tmp_path);
+      goto out;
+    }
+
+  CHECK_NULL(L_CACHE, entry = calloc(1, sizeof(struct cache_xcode_entry)));
+  entry->id = cf->id;
+  entry->mtime = cf->mtime;
+  entry->profile = cf->profile;
+  entry->size = cf->size;
+
+  pthread_mutex_lock(&g_xcode_lck);
+
+  // Drop the previous entry, or entries made before the file was changed. The
+  // file of the first was replaced by the rename above, so only delete others.
+  for (link = &g_xcode_entries; *link; )
+    {
+      old = *link;
+      if (old->id == cf->id && old->profile == cf->profile)
+	{
+	  *link = old->next;
+	  xcode_entry_free_locked(old, (old->mtime != cf->mtime));
+	}
+      else
+	link = &old->next;
+    }
+
+  entry->next = g_xcode_entries;
+  g_xcode_entries = entry;
+  g_xcode_size += entry->size;
+
+  xcode_evict_locked();
+
+  pthread_mutex_unlock(&g_xcode_lck);
+
+  DPRINTF(E_DBG, L_CACHE, "Added transcoding of file id %d to cache (%" PRIi64 " bytes)\n", cf->id, (int64_t)cf->size);
+
+ out:
+  free(cf->tmp_path);
+  free(cf);
+}
+
+/*
+ * Discards the written data and frees the handle
+ */
+void
+cache_xcode_file_abort(struct cache_xcode_file *cf)
+{
+  close(cf->fd);
+  unlink(cf->tmp_path);
+  free(cf->tmp_path);
+  free(cf);
+}
+
+
 /* -------------------------- Cache general API --------------------------- */
 
 int
@@ -1593,6 +2293,10 @@ cache_init(void)
 
   g_initialized = 0;
 
+  // Doesn't depend on the cache thread or database, so it is usable even if
+  // those are disabled
+  xcode_init();
+
   g_db_path = cfg_getstr(cfg_getsec(cfg, "general"), "cache_path");
   if (!g_db_path || (strlen(g_db_path) == 0))
     {
@@ -1607,6 +2311,17 @@ cache_init(void)
       return 0;
     }
 
+  // A size of 0 only disables the DAAP reply cache, the artwork and xcode
+  // caches still need the cache thread
+  g_daap_max_size = (size_t)cfg_getint(cfg_getsec(cfg, "general"), "cache_daap_size") * 1024 * 1024;
+  if (g_daap_max_size == 0)
+    DPRINTF(E_LOG, L_CACHE, "DAAP cache size set to 0, disabling DAAP reply cache\n");
+
+  memset(&g_daap_stats, 0, sizeof(struct cache_daap_stats));
+  g_daap_size = 0;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_init(&g_daap_lck, NULL));
+
   evbase_cache = event_base_new();
   if (!evbase_cache)
     {
@@ -1623,11 +2338,15 @@ cache_init(void)
 
   cmdbase = commands_base_new(evbase_cache, NULL);
 
-  ret = listener_add(cache_daap_listener_cb, LISTENER_DATABASE);
-  if (ret < 0)
+  // Must cover all the events that cache_daap_events() can return
+  if (g_daap_max_size > 0)
     {
-      DPRINTF(E_LOG, L_CACHE, "Could not create listener event\n");
-      goto listener_fail;
+      ret = listener_add(cache_daap_listener_cb, LISTENER_DATABASE | LISTENER_STORED_PLAYLIST | LISTENER_RATING);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Could not create listener event\n");
+	  goto listener_fail;
+	}
     }
 
   DPRINTF(E_INFO, L_CACHE, "cache thread init\n");
@@ -1657,6 +2376,7 @@ cache_init(void)
   evbase_cache = NULL;
 
  evbase_fail:
+  pthread_mutex_destroy(&g_daap_lck);
   return -1;
 }
 
@@ -1665,6 +2385,8 @@ cache_deinit(void)
 {
   int ret;
 
+  xcode_deinit();
+
   if (!g_initialized)
     return;
 
@@ -1684,4 +2406,7 @@ cache_deinit(void)
   // Free event base
   event_free(cache_daap_updateev);
   event_base_free(evbase_cache);
+
+  daap_entries_clear();
+  pthread_mutex_destroy(&g_daap_lck);
 }
@@ -2,10 +2,25 @@
 #ifndef __CACHE_H__
 #define __CACHE_H__
 
+#include <stdint.h>
+#include <sys/types.h>
 #include <event2/buffer.h>
 
 /* ---------------------------- DAAP cache API  --------------------------- */
 
+struct cache_daap_stats
+{
+  uint64_t hits;
+  uint64_t misses;
+  // Bytes (gzipped) served from the cache
+  uint64_t hit_bytes;
+  uint64_t evictions;
+  uint64_t invalidations;
+  int entries;
+  size_t bytes;
+  size_t max_bytes;
+};
+
 void
 cache_daap_suspend(void);
 
@@ -13,7 +28,7 @@ void
 cache_daap_resume(void);
 
 int
-cache_daap_get(struct evbuffer *evbuf, const char *query);
+cache_daap_get(struct evbuffer *evbuf, const char *query, const char *ua, int is_remote);
 
 void
 cache_daap_add(const char *query, const char *ua, int is_remote, int msec);
@@ -21,6 +36,9 @@ cache_daap_add(const char *query, const char *ua, int is_remote, int msec);
 int
 cache_daap_threshold(void);
 
+int
+cache_daap_stats_get(struct cache_daap_stats *stats);
+
 
 /* ---------------------------- Artwork cache API  --------------------------- */
 
@@ -48,6 +66,25 @@ cache_artwork_stash(struct evbuffer *evbuf, const char *path, int format);
 int
 cache_artwork_read(struct evbuffer *evbuf, const char *path, int *format);
 
+/* --------------------------- Transcode cache API -------------------------- */
+
+struct cache_xcode_file;
+
+int
+cache_xcode_open(int id, uint32_t mtime, int profile, off_t *size);
+
+struct cache_xcode_file *
+cache_xcode_file_new(int id, uint32_t mtime, int profile);
+
+int
+cache_xcode_file_write(struct cache_xcode_file *cf, struct evbuffer *evbuf);
+
+void
+cache_xcode_file_commit(struct cache_xcode_file *cf);
+
+void
+cache_xcode_file_abort(struct cache_xcode_file *cf);
+
 /* ---------------------------- Cache API  --------------------------- */
 
 int
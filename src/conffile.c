@@ -50,10 +50,14 @@ static cfg_opt_t sec_general[] =
     CFG_INT_CB("loglevel", E_LOG, CFGF_NONE, &cb_loglevel),
     CFG_STR("admin_password", NULL, CFGF_NONE),
     CFG_INT("websocket_port", 3688, CFGF_NONE),
+    CFG_INT("httpd_threads", 1, CFGF_NONE),
     CFG_STR_LIST("trusted_networks", "{localhost,192.168,fd}", CFGF_NONE),
     CFG_BOOL("ipv6", cfg_true, CFGF_NONE),
     CFG_STR("cache_path", STATEDIR "/cache/" PACKAGE "/cache.db", CFGF_NONE),
     CFG_INT("cache_daap_threshold", 1000, CFGF_NONE),
+    CFG_INT("cache_daap_size", 64, CFGF_NONE),
+    CFG_STR("cache_xcode_path", STATEDIR "/cache/" PACKAGE "/xcode", CFGF_NONE),
+    CFG_INT("cache_xcode_size", 512, CFGF_NONE),
     CFG_BOOL("speaker_autoselect", cfg_true, CFGF_NONE),
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
     CFG_BOOL("high_resolution_clock", cfg_false, CFGF_NONE),
@@ -93,9 +97,11 @@ static cfg_opt_t sec_library[] =
     CFG_STR_LIST("artwork_basenames", "{artwork,cover,Folder}", CFGF_NONE),
     CFG_BOOL("artwork_individual", cfg_false, CFGF_NONE),
     CFG_STR_LIST("artwork_online_sources", NULL, CFGF_NONE),
+    CFG_INT_LIST("artwork_prebuild_sizes", "{150,300,600}", CFGF_NONE),
     CFG_STR_LIST("filetypes_ignore", "{.db,.ini,.db-journal,.pdf,.metadata}", CFGF_NONE),
     CFG_STR_LIST("filepath_ignore", NULL, CFGF_NONE),
     CFG_BOOL("filescan_disable", cfg_false, CFGF_NONE),
+    CFG_INT("filescan_threads", 0, CFGF_NONE),
     CFG_BOOL("m3u_overrides", cfg_false, CFGF_NONE),
     CFG_BOOL("itunes_overrides", cfg_false, CFGF_NONE),
     CFG_BOOL("itunes_smartpl", cfg_false, CFGF_NONE),
@@ -152,6 +158,7 @@ static cfg_opt_t sec_airplay[] =
     CFG_BOOL("exclude", cfg_false, CFGF_NONE),
     CFG_BOOL("permanent", cfg_false, CFGF_NONE),
     CFG_STR("password", NULL, CFGF_NONE),
+    CFG_BOOL("alac_compression", cfg_false, CFGF_NONE),
     CFG_END()
   };
 
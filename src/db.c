@@ -23,12 +23,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <string.h>
 #include <time.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <stdatomic.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -67,6 +69,9 @@
 #define DB_FLAG_NO_BIND  (1 << 0)
 // Flags that we will only update column value if we have non-zero value (to avoid zeroing e.g. rating)
 #define DB_FLAG_NO_ZERO  (1 << 1)
+// Flags that the column has a <column>_key column with its sort key, see daap_sortkey() in sqlext.c. We
+// sort by the key, since it is much faster to compare than the column with the DAAP collation.
+#define DB_FLAG_SORT_KEY (1 << 2)
 
 // The two last columns of playlist_info are calculated fields, so all playlist retrieval functions must use this query
 #define Q_PL_SELECT "SELECT f.*, COUNT(pi.id), SUM(pi.filepath NOT NULL AND pi.filepath LIKE 'http%%')" \
@@ -116,6 +121,42 @@ struct db_statements
   sqlite3_stmt *playlists_update;
 };
 
+// Prepared statements are kept per thread, like the connection, so that queries
+// which are run often are only parsed and planned once
+#define DB_STMT_CACHE_SIZE 32
+
+// Max number of paths looked up with one query by db_file_save_batch()
+#define DB_FILE_BATCH_LOOKUP 200
+
+// What a file saved by db_file_save_batch() had in the columns that
+// trg_groups_update looks at, before it was saved
+struct db_file_batch_old
+{
+  int64_t songalbumid;
+  int64_t songartistid;
+  uint32_t disabled;
+  uint32_t media_kind;
+  uint32_t song_length;
+  uint32_t time_added;
+  char *album_sort;
+  char *album_artist_sort;
+};
+
+struct db_stmt_cache_entry
+{
+  char *query;
+  uint32_t hash;
+  sqlite3_stmt *stmt;
+  uint64_t last_used;
+  bool in_use;
+};
+
+struct db_stmt_cache
+{
+  struct db_stmt_cache_entry entries[DB_STMT_CACHE_SIZE];
+  uint64_t clock;
+};
+
 struct col_type_map {
   char *name;
   size_t offset;
@@ -140,6 +181,7 @@ struct query_clause {
   char *having;
   char *order;
   char *index;
+  char *after;
 };
 
 struct browse_clause {
@@ -148,6 +190,16 @@ struct browse_clause {
   char *group;
 };
 
+struct keyset_clause {
+  enum query_type type;
+  enum sort_type sort;
+  char *key;
+  char *id;
+  bool sortkey;
+  ssize_t key_ofs;
+  ssize_t id_ofs;
+};
+
 /* This list must be kept in sync with
  * - the order of the columns in the files table
  * - the type and name of the fields in struct media_file_info
@@ -211,11 +263,11 @@ static const struct col_type_map mfi_cols_map[] =
     { "tv_season_num",      mfi_offsetof(tv_season_num),      DB_TYPE_INT },
     { "songartistid",       mfi_offsetof(songartistid),       DB_TYPE_INT64,  DB_FIXUP_SONGARTISTID },
     { "songalbumid",        mfi_offsetof(songalbumid),        DB_TYPE_INT64,  DB_FIXUP_SONGALBUMID },
-    { "title_sort",         mfi_offsetof(title_sort),         DB_TYPE_STRING, DB_FIXUP_TITLE_SORT },
-    { "artist_sort",        mfi_offsetof(artist_sort),        DB_TYPE_STRING, DB_FIXUP_ARTIST_SORT },
-    { "album_sort",         mfi_offsetof(album_sort),         DB_TYPE_STRING, DB_FIXUP_ALBUM_SORT },
-    { "album_artist_sort",  mfi_offsetof(album_artist_sort),  DB_TYPE_STRING, DB_FIXUP_ALBUM_ARTIST_SORT },
-    { "composer_sort",      mfi_offsetof(composer_sort),      DB_TYPE_STRING, DB_FIXUP_COMPOSER_SORT },
+    { "title_sort",         mfi_offsetof(title_sort),         DB_TYPE_STRING, DB_FIXUP_TITLE_SORT, DB_FLAG_SORT_KEY },
+    { "artist_sort",        mfi_offsetof(artist_sort),        DB_TYPE_STRING, DB_FIXUP_ARTIST_SORT, DB_FLAG_SORT_KEY },
+    { "album_sort",         mfi_offsetof(album_sort),         DB_TYPE_STRING, DB_FIXUP_ALBUM_SORT, DB_FLAG_SORT_KEY },
+    { "album_artist_sort",  mfi_offsetof(album_artist_sort),  DB_TYPE_STRING, DB_FIXUP_ALBUM_ARTIST_SORT, DB_FLAG_SORT_KEY },
+    { "composer_sort",      mfi_offsetof(composer_sort),      DB_TYPE_STRING, DB_FIXUP_COMPOSER_SORT, DB_FLAG_SORT_KEY },
     { "channels",           mfi_offsetof(channels),           DB_TYPE_INT },
   };
 
@@ -416,19 +468,33 @@ static const struct col_type_map wi_cols_map[] =
 static const char *sort_clause[] =
   {
     "",
-    "f.title_sort",
-    "f.album_sort, f.disc, f.track",
-    "f.album_artist_sort, f.album_sort, f.disc, f.track",
+    "f.title_sort_key",
+    "f.album_sort_key, f.disc, f.track",
+    "f.album_artist_sort_key, f.album_sort_key, f.disc, f.track",
     "f.type, f.parent_id, f.special_id, f.title",
     "f.year",
     "f.genre",
-    "f.composer_sort",
+    "f.composer_sort_key",
     "f.disc",
     "f.track",
     "f.virtual_path COLLATE NOCASE",
     "pos",
     "shuffle_pos",
-    "f.date_released DESC, f.title_sort DESC",
+    "f.date_released DESC, f.title_sort_key DESC",
+  };
+
+/* Keyset clauses, used for ORDER BY and WHERE when paging through a listing
+ * Col 3: sort key (NULL if the listing is only ordered by the tie-breaker),
+ * col 4: unique tie-breaker, col 5: if the sort key is a daap_sortkey() blob,
+ * col 6 and 7: the fields of a fetched row (dbmfi or dbgri) with the value the
+ * sort key is made from and with the tie-breaker
+ */
+static const struct keyset_clause keyset_clause[] =
+  {
+    { Q_ITEMS,         S_NONE,   NULL,               "f.id",           false, -1,                            dbmfi_offsetof(id) },
+    { Q_ITEMS,         S_NAME,   "f.title_sort_key", "f.id",           true,  dbmfi_offsetof(title_sort),    dbmfi_offsetof(id) },
+    { Q_GROUP_ALBUMS,  S_ALBUM,  "g.name_sort",      "g.persistentid", false, dbgri_offsetof(itemname_sort), dbgri_offsetof(persistentid) },
+    { Q_GROUP_ARTISTS, S_ARTIST, "g.name_sort",      "g.persistentid", false, dbgri_offsetof(itemname_sort), dbgri_offsetof(persistentid) },
   };
 
 /* Browse clauses, used for SELECT, WHERE, GROUP BY and for default ORDER BY
@@ -438,10 +504,10 @@ static const char *sort_clause[] =
 static const struct browse_clause browse_clause[] =
   {
     { "",                                      "",                 "" },
-    { "f.album_artist, f.album_artist_sort",   "f.album_artist",   "f.album_artist_sort, f.album_artist" },
-    { "f.album, f.album_sort",                 "f.album",          "f.album_sort, f.album" },
+    { "f.album_artist, f.album_artist_sort",   "f.album_artist",   "f.album_artist_sort_key, f.album_artist" },
+    { "f.album, f.album_sort",                 "f.album",          "f.album_sort_key, f.album" },
     { "f.genre, f.genre",                      "f.genre",          "f.genre" },
-    { "f.composer, f.composer_sort",           "f.composer",       "f.composer_sort, f.composer" },
+    { "f.composer, f.composer_sort",           "f.composer",       "f.composer_sort_key, f.composer" },
     { "f.year, f.year",                        "f.year",           "f.year" },
     { "f.disc, f.disc",                        "f.disc",           "f.disc" },
     { "f.track, f.track",                      "f.track",          "f.track" },
@@ -531,9 +597,17 @@ struct rng_ctx shuffle_rng;
 
 static char *db_path;
 static bool db_rating_updates;
+// Set if SQLite has FTS5, so that files_fts can be used for searches
+static bool db_fts_available;
 
 static __thread sqlite3 *hdl;
 static __thread struct db_statements db_statements;
+static __thread struct db_stmt_cache db_stmt_cache;
+
+// Statement cache counters for all threads
+static atomic_uint_fast64_t db_stmt_cache_hits;
+static atomic_uint_fast64_t db_stmt_cache_misses;
+static atomic_uint_fast64_t db_stmt_cache_evictions;
 
 
 /* Forward */
@@ -610,6 +684,228 @@ db_snprintf(char *s, int n, const char *fmt, ...)
   return 0;
 }
 
+
+/* Full-text search */
+
+// Fields of files that are in the full-text index (files_fts)
+static const char *db_fts_fields[] =
+  {
+    "f.title", "f.artist", "f.album", "f.album_artist", "f.composer", "f.genre", "f.path",
+  };
+
+// Makes an FTS5 query for files that in one of the fields have words starting
+// with each of the words in term, e.g. {title artist} : ("foo"* "bar"*).
+// Returns NULL if the full-text index can't be used for the search.
+static char *
+fts_match_make(const char **fields, const char *term)
+{
+  const char *start;
+  const char *p;
+  char *match;
+  char *m;
+  bool alnum;
+  size_t len;
+  int ntokens;
+  int i;
+  int j;
+
+  if (!db_fts_available)
+    return NULL;
+
+  // Worst case is one char words that are each quoted and made a prefix
+  len = 16 + 4 * strlen(term);
+  for (i = 0; fields[i]; i++)
+    {
+      for (j = 0; j < ARRAY_SIZE(db_fts_fields); j++)
+	{
+	  if (strcmp(fields[i], db_fts_fields[j]) == 0)
+	    break;
+	}
+
+      if (j == ARRAY_SIZE(db_fts_fields))
+	return NULL;
+
+      len += strlen(fields[i]) + 1;
+    }
+
+  CHECK_NULL(L_DB, match = malloc(len));
+
+  // Column names in the index are without the "f."
+  m = match;
+  *m++ = '{';
+  for (i = 0; fields[i]; i++)
+    m += sprintf(m, "%s%s", (i > 0) ? " " : "", fields[i] + 2);
+  m += sprintf(m, "} : (");
+
+  ntokens = 0;
+  p = term;
+  while (*p)
+    {
+      while (isspace((unsigned char)*p))
+	p++;
+
+      start = p;
+      alnum = false;
+      for (; *p && !isspace((unsigned char)*p); p++)
+	alnum |= (isalnum((unsigned char)*p) || ((unsigned char)*p >= 0x80));
+
+      // Words of only punctuation are not indexed, so we can't search for them
+      if (!alnum)
+	continue;
+
+      if (ntokens > 0)
+	*m++ = ' ';
+
+      *m++ = '"';
+      for (; start < p; start++)
+	{
+	  if (*start == '"')
+	    *m++ = '"';
+	  *m++ = *start;
+	}
+      *m++ = '"';
+      *m++ = '*';
+
+      ntokens++;
+    }
+
+  strcpy(m, ")");
+
+  if (ntokens == 0)
+    {
+      free(match);
+      return NULL;
+    }
+
+  return match;
+}
+
+char *
+db_search_filter(const char **fields, const char *term)
+{
+  char *filter;
+  char *match;
+  char *tmp;
+  int i;
+
+  match = fts_match_make(fields, term);
+  if (match)
+    {
+      filter = db_mprintf("(f.id IN (SELECT rowid FROM files_fts WHERE files_fts MATCH '%q'))", match);
+      free(match);
+      return filter;
+    }
+
+  filter = db_mprintf("(%s LIKE '%%%q%%'", fields[0], term);
+  for (i = 1; fields[i]; i++)
+    {
+      tmp = db_mprintf("%s OR %s LIKE '%%%q%%'", filter, fields[i], term);
+      free(filter);
+      filter = tmp;
+    }
+
+  tmp = db_mprintf("%s)", filter);
+  free(filter);
+
+  return tmp;
+}
+
+char *
+db_search_rank(const char **fields, const char *term)
+{
+  char *rank;
+  char *match;
+
+  match = fts_match_make(fields, term);
+  if (!match)
+    return NULL;
+
+  // FTS5's rank is bm25(), which is lower for better matches
+  rank = db_mprintf("(SELECT rank FROM files_fts WHERE files_fts MATCH '%q' AND rowid = f.id)", match);
+  free(match);
+
+  return rank;
+}
+
+char *
+db_query_after_make(struct query_params *qp)
+{
+  const char *sort;
+  char *token;
+  size_t len;
+  int n;
+  int i;
+
+  if (!qp->after)
+    return NULL;
+
+  // "<id>" or "<id>-<sort as hex>", so the token is safe to use in an URL
+  sort = qp->after_sort;
+  len = sort ? strlen(sort) : 0;
+
+  CHECK_NULL(L_DB, token = malloc(24 + 2 * len));
+
+  n = sprintf(token, "%" PRIi64, qp->after_id);
+  if (sort)
+    {
+      token[n++] = '-';
+      for (i = 0; i < len; i++)
+	n += sprintf(token + n, "%02x", (unsigned char)sort[i]);
+    }
+
+  token[n] = '\0';
+
+  return token;
+}
+
+int
+db_query_after_set(struct query_params *qp, const char *token)
+{
+  char *sort = NULL;
+  const char *hex;
+  char *end;
+  int64_t id;
+  size_t len;
+  int i;
+
+  errno = 0;
+  id = strtoll(token, &end, 10);
+  if (errno != 0 || end == token || (*end != '\0' && *end != '-'))
+    goto invalid;
+
+  if (*end == '-')
+    {
+      hex = end + 1;
+      len = strlen(hex);
+      if (len % 2 != 0)
+	goto invalid;
+
+      CHECK_NULL(L_DB, sort = calloc(1, len / 2 + 1));
+
+      for (i = 0; i < len / 2; i++)
+	{
+	  if (!isxdigit(hex[2 * i]) || !isxdigit(hex[2 * i + 1]) || sscanf(hex + 2 * i, "%2hhx", (unsigned char *)&sort[i]) != 1)
+	    goto invalid;
+	}
+
+      if (strlen(sort) != len / 2)
+	goto invalid;
+    }
+
+  free(qp->after_sort);
+
+  qp->after = true;
+  qp->after_sort = sort;
+  qp->after_id = id;
+
+  return 0;
+
+ invalid:
+  DPRINTF(E_LOG, L_DB, "Invalid after token '%s'\n", token);
+  free(sort);
+  return -1;
+}
+
 void
 free_pi(struct pairing_info *pi, int content_only)
 {
@@ -706,6 +1002,7 @@ free_query_params(struct query_params *qp, int content_only)
   free(qp->filter);
   free(qp->having);
   free(qp->order);
+  free(qp->after_sort);
 
   if (!content_only)
     free(qp);
@@ -1261,6 +1558,110 @@ db_blocking_prepare_v2(const char *query, int len, sqlite3_stmt **stmt, const ch
   return ret;
 }
 
+/* Returns a prepared statement for the query, from the thread's cache if it
+ * has one that isn't in use. The statement must be given back with
+ * db_stmt_release() instead of sqlite3_finalize(). Values should be bound
+ * instead of inlined in the query, otherwise the cache will mostly miss.
+ */
+static int
+db_stmt_prepare(const char *query, sqlite3_stmt **stmt)
+{
+  struct db_stmt_cache_entry *entry;
+  struct db_stmt_cache_entry *lru;
+  uint32_t hash;
+  int ret;
+  int i;
+
+  hash = djb_hash(query, strlen(query));
+  db_stmt_cache.clock++;
+
+  lru = NULL;
+  for (i = 0; i < DB_STMT_CACHE_SIZE; i++)
+    {
+      entry = &db_stmt_cache.entries[i];
+      if (entry->in_use)
+	continue;
+
+      if (entry->stmt && entry->hash == hash && strcmp(entry->query, query) == 0)
+	{
+	  entry->in_use = true;
+	  entry->last_used = db_stmt_cache.clock;
+	  atomic_fetch_add(&db_stmt_cache_hits, 1);
+
+	  *stmt = entry->stmt;
+	  return SQLITE_OK;
+	}
+
+      // Unused entries have last_used 0, so they are taken first
+      if (!lru || entry->last_used < lru->last_used)
+	lru = entry;
+    }
+
+  atomic_fetch_add(&db_stmt_cache_misses, 1);
+
+  ret = db_blocking_prepare_v2(query, -1, stmt, NULL);
+  if (ret != SQLITE_OK || !lru)
+    return ret; // If all entries are in use the statement just won't be cached
+
+  if (lru->stmt)
+    {
+      sqlite3_finalize(lru->stmt);
+      free(lru->query);
+      atomic_fetch_add(&db_stmt_cache_evictions, 1);
+    }
+
+  lru->query = strdup(query);
+  lru->stmt = lru->query ? *stmt : NULL;
+  lru->hash = hash;
+  lru->last_used = db_stmt_cache.clock;
+  lru->in_use = (lru->stmt != NULL);
+
+  return ret;
+}
+
+static void
+db_stmt_release(sqlite3_stmt *stmt)
+{
+  int i;
+
+  for (i = 0; i < DB_STMT_CACHE_SIZE; i++)
+    {
+      if (db_stmt_cache.entries[i].stmt != stmt)
+	continue;
+
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+      db_stmt_cache.entries[i].in_use = false;
+      return;
+    }
+
+  sqlite3_finalize(stmt);
+}
+
+void
+db_stmt_cache_stats_get(struct db_stmt_cache_stats *stats)
+{
+  stats->hits = atomic_load(&db_stmt_cache_hits);
+  stats->misses = atomic_load(&db_stmt_cache_misses);
+  stats->evictions = atomic_load(&db_stmt_cache_evictions);
+}
+
+static void
+db_stmt_cache_clear(void)
+{
+  int i;
+
+  for (i = 0; i < DB_STMT_CACHE_SIZE; i++)
+    {
+      if (db_stmt_cache.entries[i].stmt)
+	sqlite3_finalize(db_stmt_cache.entries[i].stmt);
+
+      free(db_stmt_cache.entries[i].query);
+    }
+
+  memset(&db_stmt_cache, 0, sizeof(struct db_stmt_cache));
+}
+
 static int
 db_statement_run(sqlite3_stmt *stmt)
 {
@@ -1471,8 +1872,9 @@ db_purge_all(void)
     {
       "DELETE FROM inotify;",
       "DELETE FROM playlistitems;",
-      "DELETE FROM files;",
+      // Groups first, so the delete trigger on files has nothing to update
       "DELETE FROM groups;",
+      "DELETE FROM files;",
     };
   char *errmsg;
   char *query;
@@ -1550,7 +1952,7 @@ db_get_one_int(const char *query)
 
   DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  ret = db_stmt_prepare(query, &stmt);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
@@ -1565,7 +1967,7 @@ db_get_one_int(const char *query)
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s (%s)\n", sqlite3_errmsg(hdl), query);
 
-      sqlite3_finalize(stmt);
+      db_stmt_release(stmt);
       return -1;
     }
 
@@ -1576,7 +1978,7 @@ db_get_one_int(const char *query)
     ; /* EMPTY */
 #endif
 
-  sqlite3_finalize(stmt);
+  db_stmt_release(stmt);
 
   return ret;
 }
@@ -1648,18 +2050,102 @@ db_free_query_clause(struct query_clause *qc)
   sqlite3_free(qc->having);
   sqlite3_free(qc->order);
   sqlite3_free(qc->index);
+  sqlite3_free(qc->after);
   free(qc);
 }
 
+static const struct keyset_clause *
+db_keyset_clause_get(struct query_params *qp)
+{
+  int i;
+
+  if (qp->order || qp->group)
+    return NULL;
+
+  for (i = 0; i < ARRAY_SIZE(keyset_clause); i++)
+    {
+      if (qp->type == keyset_clause[i].type && qp->sort == keyset_clause[i].sort)
+	return &keyset_clause[i];
+    }
+
+  return NULL;
+}
+
+bool
+db_query_keyset_usable(struct query_params *qp)
+{
+  return (db_keyset_clause_get(qp) != NULL);
+}
+
+// Keeps the position of a fetched row in after, so the next page of the
+// listing can continue from it. The values are taken from the same columns as
+// the keyset WHERE compares with.
+static void
+db_keyset_row_set(struct query_params *qp, void *row)
+{
+  const struct keyset_clause *ks;
+  const char *sort;
+  const char *id;
+
+  ks = db_keyset_clause_get(qp);
+  if (!ks)
+    return;
+
+  sort = ks->key ? *(char **)((char *)row + ks->key_ofs) : NULL;
+  id = *(char **)((char *)row + ks->id_ofs);
+
+  free(qp->after_sort);
+  qp->after_sort = safe_strdup(sort);
+  qp->after = (safe_atoi64(id, &qp->after_id) == 0);
+}
+
+// Rows sort by (key, id), so the next rows have key > after_sort, or the same
+// key and id > after_id. The first form lets SQLite seek in the key index.
+static char *
+db_build_query_after(struct query_params *qp, const struct keyset_clause *ks, const char *prefix)
+{
+  char *value;
+  char *after;
+
+  if (!ks->key)
+    return sqlite3_mprintf("%s %s > %" PRIi64, prefix, ks->id, qp->after_id);
+
+  if (!qp->after_sort)
+    return sqlite3_mprintf("%s ((%s IS NULL AND %s > %" PRIi64 ") OR %s IS NOT NULL)", prefix, ks->key, ks->id, qp->after_id, ks->key);
+
+  if (ks->sortkey)
+    value = sqlite3_mprintf("daap_sortkey('%q')", qp->after_sort);
+  else
+    value = sqlite3_mprintf("'%q'", qp->after_sort);
+
+  if (!value)
+    return NULL;
+
+  after = sqlite3_mprintf("%s %s >= %s AND (%s > %s OR %s > %" PRIi64 ")", prefix, ks->key, value, ks->key, value, ks->id, qp->after_id);
+
+  sqlite3_free(value);
+
+  return after;
+}
+
 static struct query_clause *
 db_build_query_clause(struct query_params *qp)
 {
+  const struct keyset_clause *ks;
   struct query_clause *qc;
+  char *where;
 
   qc = calloc(1, sizeof(struct query_clause));
   if (!qc)
     goto error;
 
+  ks = db_keyset_clause_get(qp);
+  if (qp->after && !ks)
+    {
+      DPRINTF(E_LOG, L_DB, "Query type %d with sort %d cannot be continued after a row\n", qp->type, qp->sort);
+      goto error;
+    }
+
   if (qp->type & Q_F_BROWSE)
     qc->group = sqlite3_mprintf("GROUP BY %s", browse_clause[qp->type & ~Q_F_BROWSE].group);
   else if (qp->group)
@@ -1676,12 +2162,25 @@ db_build_query_clause(struct query_params *qp)
   else
     qc->where = sqlite3_mprintf("");
 
+  if (qc->where && qp->media_kind)
+    {
+      where = qc->where;
+      qc->where = sqlite3_mprintf("%s %s f.media_kind = %d", where, (where[0] == '\0') ? "WHERE" : "AND", qp->media_kind);
+      sqlite3_free(where);
+    }
+
   if (qp->having && (qp->type & (Q_GROUP_ALBUMS | Q_GROUP_ARTISTS)))
     qc->having = sqlite3_mprintf("HAVING %s", qp->having);
   else
     qc->having = sqlite3_mprintf("");
 
-  if (qp->order)
+  // A unique tie-breaker makes pages consistent, also when paging with after.
+  // Only for listings paged by keyset, others keep their own order.
+  if (ks && (qp->keyset || qp->after) && !ks->key)
+    qc->order = sqlite3_mprintf("ORDER BY %s", ks->id);
+  else if (ks && (qp->keyset || qp->after))
+    qc->order = sqlite3_mprintf("ORDER BY %s, %s", ks->key, ks->id);
+  else if (qp->order)
     qc->order = sqlite3_mprintf("ORDER BY %s", qp->order);
   else if (qp->sort)
     qc->order = sqlite3_mprintf("ORDER BY %s", sort_clause[qp->sort]);
@@ -1712,7 +2211,12 @@ db_build_query_clause(struct query_params *qp)
 	break;
     }
 
-  if (!qc->where || !qc->index)
+  if (qc->where && qp->after)
+    qc->after = db_build_query_after(qp, ks, (qc->where[0] == '\0') ? "WHERE" : "AND");
+  else
+    qc->after = sqlite3_mprintf("");
+
+  if (!qc->where || !qc->index || !qc->after)
     goto error;
 
   return qc;
@@ -1756,7 +2260,7 @@ db_build_query_items(struct query_params *qp, struct query_clause *qc)
   char *query;
 
   count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s;", qc->where);
-  query = sqlite3_mprintf("SELECT f.* FROM files f %s %s %s %s;", qc->where, qc->group, qc->order, qc->index);
+  query = sqlite3_mprintf("SELECT f.* FROM files f %s %s %s %s %s;", qc->where, qc->after, qc->group, qc->order, qc->index);
 
   return db_build_query_check(qp, count, query);
 }
@@ -1896,14 +2400,85 @@ db_build_query_plitems(struct query_params *qp, struct query_clause *qc)
   return query;
 }
 
+// The groups table has aggregates of the enabled files in each group, which
+// we can use instead of a GROUP BY over files, if the query isn't filtered by
+// anything else than media kind
+static bool
+db_group_aggregates_usable(struct query_params *qp, enum group_type gt)
+{
+  if (qp->filter || qp->having || qp->order || qp->group || qp->with_disabled)
+    return false;
+
+  if (qp->sort != S_NONE && qp->sort != ((gt == G_ALBUMS) ? S_ALBUM : S_ARTIST))
+    return false;
+
+  return true;
+}
+
+// The media kind of a group is only usable if all its files have that kind. For
+// the groups with mixed media kinds (which should be few) the aggregates of the
+// files with the requested kind are counted by the subquery m.
+static char *
+db_build_query_group_aggregates(struct query_params *qp, struct query_clause *qc, enum group_type gt)
+{
+  const char *order;
+  const char *select;
+  const char *id;
+  char *from;
+  char *count;
+  char *query;
+
+  if (qp->sort == S_NONE)
+    order = "";
+  else if (qp->keyset || qp->after)
+    order = qc->order; // Sorted by name with the keyset tie-breaker
+  else
+    order = "ORDER BY g.name_sort";
+
+  id = (gt == G_ALBUMS) ? "songalbumid" : "songartistid";
+
+  if (qp->media_kind)
+    {
+      select = "IFNULL(m.track_count, g.track_count), IFNULL(m.album_count, g.album_count), g.album_artist, g.songartistid,"
+	       " IFNULL(m.song_length, g.song_length)";
+      from = sqlite3_mprintf("groups g LEFT JOIN"
+			   " (SELECT f.%s AS persistentid, COUNT(f.id) AS track_count, %s AS album_count, SUM(f.song_length) AS song_length"
+			   "  FROM groups gm JOIN files f ON f.%s = gm.persistentid"
+			   "  WHERE gm.type = %d AND gm.media_kind_count <> gm.track_count AND f.disabled = 0 AND f.media_kind = %d"
+			   "  GROUP BY f.%s) m ON m.persistentid = g.persistentid"
+			   " WHERE g.type = %d AND g.track_count > 0"
+			   " AND ((g.media_kind = %d AND g.media_kind_count = g.track_count) OR m.track_count > 0)",
+			   id, (gt == G_ALBUMS) ? "1" : "COUNT(DISTINCT f.songalbumid)", id, gt, qp->media_kind, id,
+			   gt, qp->media_kind);
+    }
+  else
+    {
+      select = "g.track_count, g.album_count, g.album_artist, g.songartistid, g.song_length";
+      from = sqlite3_mprintf("groups g WHERE g.type = %d AND g.track_count > 0", gt);
+    }
+
+  if (!from)
+    return NULL;
+
+  count = sqlite3_mprintf("SELECT COUNT(*) FROM %s;", from);
+  query = sqlite3_mprintf("SELECT g.id, g.persistentid, g.name, g.name_sort, %s FROM %s %s %s %s;", select, from, qc->after, order, qc->index);
+
+  sqlite3_free(from);
+
+  return db_build_query_check(qp, count, query);
+}
+
 static char *
 db_build_query_group_albums(struct query_params *qp, struct query_clause *qc)
 {
   char *count;
   char *query;
 
+  if (db_group_aggregates_usable(qp, G_ALBUMS))
+    return db_build_query_group_aggregates(qp, qc, G_ALBUMS);
+
   count = sqlite3_mprintf("SELECT COUNT(DISTINCT f.songalbumid) FROM files f %s;", qc->where);
-  query = sqlite3_mprintf("SELECT g.id, g.persistentid, f.album, f.album_sort, COUNT(f.id) as track_count, 1 as album_count, f.album_artist, f.songartistid, SUM(f.song_length) FROM files f JOIN groups g ON f.songalbumid = g.persistentid %s GROUP BY f.songalbumid %s %s %s;", qc->where, qc->having, qc->order, qc->index);
+  query = sqlite3_mprintf("SELECT g.id, g.persistentid, f.album, g.name_sort, COUNT(f.id) as track_count, 1 as album_count, f.album_artist, f.songartistid, SUM(f.song_length) FROM files f JOIN groups g ON f.songalbumid = g.persistentid %s %s GROUP BY f.songalbumid %s %s %s;", qc->where, qc->after, qc->having, qc->order, qc->index);
 
   return db_build_query_check(qp, count, query);
 }
@@ -1914,8 +2489,11 @@ db_build_query_group_artists(struct query_params *qp, struct query_clause *qc)
   char *count;
   char *query;
 
+  if (db_group_aggregates_usable(qp, G_ARTISTS))
+    return db_build_query_group_aggregates(qp, qc, G_ARTISTS);
+
   count = sqlite3_mprintf("SELECT COUNT(DISTINCT f.songartistid) FROM files f %s;", qc->where);
-  query = sqlite3_mprintf("SELECT g.id, g.persistentid, f.album_artist, f.album_artist_sort, COUNT(f.id) as track_count, COUNT(DISTINCT f.songalbumid) as album_count, f.album_artist, f.songartistid, SUM(f.song_length) FROM files f JOIN groups g ON f.songartistid = g.persistentid %s GROUP BY f.songartistid %s %s %s;", qc->where, qc->having, qc->order, qc->index);
+  query = sqlite3_mprintf("SELECT g.id, g.persistentid, f.album_artist, g.name_sort, COUNT(f.id) as track_count, COUNT(DISTINCT f.songalbumid) as album_count, f.album_artist, f.songartistid, SUM(f.song_length) FROM files f JOIN groups g ON f.songartistid = g.persistentid %s %s GROUP BY f.songartistid %s %s %s;", qc->where, qc->after, qc->having, qc->order, qc->index);
 
   return db_build_query_check(qp, count, query);
 }
@@ -2083,7 +2661,7 @@ db_query_start(struct query_params *qp)
 
   DPRINTF(E_DBG, L_DB, "Starting query '%s'\n", query);
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  ret = db_stmt_prepare(query, &stmt);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
@@ -2105,7 +2683,7 @@ db_query_end(struct query_params *qp)
   if (!qp->stmt)
     return;
 
-  sqlite3_finalize(qp->stmt);
+  db_stmt_release(qp->stmt);
   qp->stmt = NULL;
 }
 
@@ -2205,6 +2783,9 @@ db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi)
       *strcol = (char *)sqlite3_column_text(qp->stmt, i);
     }
 
+  if (qp->keyset)
+    db_keyset_row_set(qp, dbmfi);
+
   return 0;
 }
 
@@ -2325,6 +2906,9 @@ db_query_fetch_group(struct query_params *qp, struct db_group_info *dbgri)
       *strcol = (char *)sqlite3_column_text(qp->stmt, i);
     }
 
+  if (qp->keyset)
+    db_keyset_row_set(qp, dbgri);
+
   return 0;
 }
 
@@ -2677,6 +3261,101 @@ db_file_ping_bypath(const char *path, time_t mtime_max)
   return db_statement_run(db_statements.files_ping);
 }
 
+// Gets the paths of the enabled regular files in a directory (the files that
+// db_file_ping_bydirectory() pings), sorted like strcmp(). Returns the number
+// of paths, or -1 on error. The array and the paths must be freed by the caller.
+int
+db_file_paths_bydirectory(int dir_id, char ***paths)
+{
+#define Q_COUNT "SELECT COUNT(*) FROM files WHERE disabled = 0 AND directory_id = %d AND data_kind = %d;"
+#define Q_TMPL "SELECT path FROM files WHERE disabled = 0 AND directory_id = ? AND data_kind = ? ORDER BY path;"
+  sqlite3_stmt *stmt;
+  char *query;
+  const char *path;
+  int count;
+  int ret;
+  int i;
+
+  *paths = NULL;
+
+  query = sqlite3_mprintf(Q_COUNT, dir_id, DATA_KIND_FILE);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  count = db_get_one_int(query);
+  sqlite3_free(query);
+  if (count <= 0)
+    return count;
+
+  ret = db_stmt_prepare(Q_TMPL, &stmt);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  sqlite3_bind_int(stmt, 1, dir_id);
+  sqlite3_bind_int(stmt, 2, DATA_KIND_FILE);
+
+  CHECK_NULL(L_DB, *paths = calloc(count, sizeof(char *)));
+
+  for (i = 0; i < count && (ret = db_blocking_step(stmt)) == SQLITE_ROW; i++)
+    {
+      path = (const char *)sqlite3_column_text(stmt, 0);
+      CHECK_NULL(L_DB, (*paths)[i] = strdup(path ? path : ""));
+    }
+
+  if (ret != SQLITE_ROW && ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      db_stmt_release(stmt);
+      for (count = 0; count < i; count++)
+	free((*paths)[count]);
+      free(*paths);
+      *paths = NULL;
+      return -1;
+    }
+
+  db_stmt_release(stmt);
+
+  return i;
+
+#undef Q_COUNT
+#undef Q_TMPL
+}
+
+// Pings the enabled regular files in a directory, returns the number of files
+int
+db_file_ping_bydirectory(int dir_id)
+{
+#define Q_TMPL "UPDATE files SET db_timestamp = ? WHERE disabled = 0 AND directory_id = ? AND data_kind = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  ret = db_stmt_prepare(Q_TMPL, &stmt);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  sqlite3_bind_int64(stmt, 1, (int64_t)time(NULL));
+  sqlite3_bind_int(stmt, 2, dir_id);
+  sqlite3_bind_int(stmt, 3, DATA_KIND_FILE);
+
+  ret = db_statement_run(stmt);
+
+  db_stmt_release(stmt);
+
+  return ret;
+
+#undef Q_TMPL
+}
+
 void
 db_file_ping_bymatch(const char *path, int isdir)
 {
@@ -2891,11 +3570,11 @@ db_file_id_by_virtualpath_match(const char *path)
 #undef Q_TMPL
 }
 
+// Steps the statement from db_stmt_prepare() and releases it
 static struct media_file_info *
-db_file_fetch_byquery(char *query)
+db_file_fetch_bystmt(sqlite3_stmt *stmt)
 {
   struct media_file_info *mfi;
-  sqlite3_stmt *stmt;
   int ncols;
   char *cval;
   uint32_t *ival;
@@ -2905,24 +3584,12 @@ db_file_fetch_byquery(char *query)
   int i;
   int ret;
 
-  if (!query)
-    return NULL;
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
   mfi = calloc(1, sizeof(struct media_file_info));
   if (!mfi)
     {
       DPRINTF(E_LOG, L_DB, "Could not allocate struct media_file_info, out of memory\n");
-      return NULL;
-    }
-
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
 
-      free(mfi);
+      db_stmt_release(stmt);
       return NULL;
     }
 
@@ -2935,7 +3602,7 @@ db_file_fetch_byquery(char *query)
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_finalize(stmt);
+      db_stmt_release(stmt);
       free(mfi);
       return NULL;
     }
@@ -2947,7 +3614,7 @@ db_file_fetch_byquery(char *query)
     {
       DPRINTF(E_LOG, L_DB, "BUG: database has fewer columns (%d) than mfi column map (%u)\n", ncols, ARRAY_SIZE(mfi_cols_map));
 
-      sqlite3_finalize(stmt);
+      db_stmt_release(stmt);
       free(mfi);
       return NULL;
     }
@@ -2986,7 +3653,7 @@ db_file_fetch_byquery(char *query)
 	    DPRINTF(E_LOG, L_DB, "BUG: Unknown type %d in mfi column map\n", mfi_cols_map[i].type);
 
 	    free_mfi(mfi, 0);
-	    sqlite3_finalize(stmt);
+	    db_stmt_release(stmt);
 	    return NULL;
 	}
     }
@@ -2996,31 +3663,51 @@ db_file_fetch_byquery(char *query)
     ; /* EMPTY */
 #endif
 
-  sqlite3_finalize(stmt);
+  db_stmt_release(stmt);
 
   return mfi;
 }
 
-struct media_file_info *
-db_file_fetch_byid(int id)
+static struct media_file_info *
+db_file_fetch_byquery(char *query)
 {
-#define Q_TMPL "SELECT f.* FROM files f WHERE f.id = %d;"
-  struct media_file_info *mfi;
-  char *query;
+  sqlite3_stmt *stmt;
+  int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
   if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+    return NULL;
 
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_stmt_prepare(query, &stmt);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
       return NULL;
     }
 
-  mfi = db_file_fetch_byquery(query);
+  return db_file_fetch_bystmt(stmt);
+}
 
-  sqlite3_free(query);
+struct media_file_info *
+db_file_fetch_byid(int id)
+{
+#define Q_TMPL "SELECT f.* FROM files f WHERE f.id = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
 
-  return mfi;
+  DPRINTF(E_DBG, L_DB, "Running query '%s' with id %d\n", Q_TMPL, id);
+
+  ret = db_stmt_prepare(Q_TMPL, &stmt);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return NULL;
+    }
+
+  sqlite3_bind_int(stmt, 1, id);
+
+  return db_file_fetch_bystmt(stmt);
 
 #undef Q_TMPL
 }
@@ -3092,21 +3779,326 @@ db_file_update(struct media_file_info *mfi)
       return -1;
     }
 
-  mfi->db_timestamp = (uint64_t)time(NULL);
+  mfi->db_timestamp = (uint64_t)time(NULL);
+
+  fixup_tags_mfi(mfi);
+
+  ret = bind_mfi(db_statements.files_update, mfi);
+  if (ret < 0)
+    return -1;
+
+  ret = db_statement_run(db_statements.files_update);
+  if (ret < 0)
+    return -1;
+
+  library_update_trigger(LISTENER_DATABASE);
+
+  return 0;
+}
+
+// Looks up the ids and current group columns of the files with the paths of
+// mfis[0..n-1]. Files that are not in the library get id 0.
+static int
+db_file_batch_lookup(struct media_file_info **mfis, int n, struct db_file_batch_old *old)
+{
+#define Q_TMPL "SELECT f.id, f.path, f.songalbumid, f.songartistid, f.disabled, f.media_kind, f.song_length," \
+               " f.time_added, f.album_sort, f.album_artist_sort FROM files f WHERE f.path IN (%s);"
+  sqlite3_stmt *stmt;
+  char *params;
+  char *query;
+  const char *path;
+  int i;
+  int ret;
+
+  // "?,?,...,?"
+  params = malloc(2 * n);
+  if (!params)
+    return -1;
+
+  for (i = 0; i < n; i++)
+    {
+      params[2 * i] = '?';
+      params[2 * i + 1] = ',';
+    }
+  params[2 * n - 1] = '\0';
+
+  query = sqlite3_mprintf(Q_TMPL, params);
+  free(params);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  ret = db_stmt_prepare(query, &stmt);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      mfis[i]->id = 0;
+      sqlite3_bind_text(stmt, i + 1, mfis[i]->path, -1, SQLITE_STATIC);
+    }
+
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    {
+      path = (const char *)sqlite3_column_text(stmt, 1);
+      if (!path)
+	continue;
+
+      for (i = 0; i < n; i++)
+	{
+	  if (strcmp(mfis[i]->path, path) != 0)
+	    continue;
+
+	  mfis[i]->id = sqlite3_column_int(stmt, 0);
+	  old[i].songalbumid = sqlite3_column_int64(stmt, 2);
+	  old[i].songartistid = sqlite3_column_int64(stmt, 3);
+	  old[i].disabled = sqlite3_column_int64(stmt, 4);
+	  old[i].media_kind = sqlite3_column_int(stmt, 5);
+	  old[i].song_length = sqlite3_column_int(stmt, 6);
+	  old[i].time_added = sqlite3_column_int(stmt, 7);
+	  old[i].album_sort = safe_strdup((const char *)sqlite3_column_text(stmt, 8));
+	  old[i].album_artist_sort = safe_strdup((const char *)sqlite3_column_text(stmt, 9));
+	  break;
+	}
+    }
+
+  if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+  db_stmt_release(stmt);
+
+  return (ret == SQLITE_DONE) ? 0 : -1;
+
+#undef Q_TMPL
+}
+
+// Same check as the WHEN of trg_groups_update, so that files that are saved
+// again without changes don't make their groups be recounted
+static bool
+db_file_batch_groups_changed(struct db_file_batch_old *old, struct media_file_info *mfi)
+{
+  // time_added is DB_FLAG_NO_ZERO, so 0 doesn't overwrite it
+  return old->songalbumid != mfi->songalbumid || old->songartistid != mfi->songartistid ||
+	 old->disabled != mfi->disabled || old->media_kind != mfi->media_kind ||
+	 old->song_length != mfi->song_length || (mfi->time_added && old->time_added != mfi->time_added) ||
+	 !old->album_sort != !mfi->album_sort || (old->album_sort && strcmp(old->album_sort, mfi->album_sort) != 0) ||
+	 !old->album_artist_sort != !mfi->album_artist_sort ||
+	 (old->album_artist_sort && strcmp(old->album_artist_sort, mfi->album_artist_sort) != 0);
+}
+
+static void
+db_file_batch_old_free(struct db_file_batch_old *old, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      free(old[i].album_sort);
+      free(old[i].album_artist_sort);
+    }
+
+  free(old);
+}
+
+static int
+db_file_batch_group_add(int type, int64_t persistentid)
+{
+#define Q_TMPL "INSERT OR IGNORE INTO temp.groups_batch (type, persistentid) VALUES (?, ?);"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  if (persistentid == 0)
+    return 0;
+
+  ret = db_stmt_prepare(Q_TMPL, &stmt);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  sqlite3_bind_int(stmt, 1, type);
+  sqlite3_bind_int64(stmt, 2, persistentid);
+
+  ret = db_statement_run(stmt);
+
+  db_stmt_release(stmt);
+
+  return (ret < 0) ? -1 : 0;
+
+#undef Q_TMPL
+}
+
+// Set-based version of what trg_groups_insert and trg_groups_update do for
+// each file, only for the groups in temp.groups_batch. The aggregates are
+// counted like in the 21.05 upgrade. SQLite has no statistics for the temp
+// table, so without CROSS JOIN it may scan all the files instead of starting
+// from the few groups in the batch. The + on f.disabled keeps it from picking
+// an index on disabled over idx_sari for the artists.
+static int
+db_file_batch_groups_update(void)
+{
+#define Q_GROUPS_ADD_ALBUMS \
+  "INSERT OR IGNORE INTO groups (type, name, persistentid)" \
+  " SELECT 1, f.album, f.songalbumid FROM temp.groups_batch b CROSS JOIN files f ON b.type = 1 AND f.songalbumid = b.persistentid" \
+  " WHERE f.disabled = 0;"
+#define Q_GROUPS_ADD_ARTISTS \
+  "INSERT OR IGNORE INTO groups (type, name, persistentid)" \
+  " SELECT 2, f.album_artist, f.songartistid FROM temp.groups_batch b CROSS JOIN files f ON b.type = 2 AND f.songartistid = b.persistentid" \
+  " WHERE +f.disabled = 0;"
+#define Q_GROUPS_RESET \
+  "UPDATE groups SET track_count = 0, album_count = 0, song_length = 0, media_kind_count = 0" \
+  " WHERE id IN (SELECT g.id FROM groups g JOIN temp.groups_batch b ON g.type = b.type AND g.persistentid = b.persistentid);"
+#define Q_GROUPS_ALBUMS \
+  "INSERT OR REPLACE INTO groups (id, type, name, persistentid, name_sort, album_artist, songartistid," \
+  "   track_count, album_count, song_length, time_added, media_kind, media_kind_count)" \
+  " SELECT g.id, g.type, g.name, g.persistentid, f.album_sort, f.album_artist, f.songartistid," \
+  "   COUNT(f.id), 1, SUM(f.song_length), MAX(MAX(f.time_added), g.time_added), MIN(f.media_kind)," \
+  "   CASE WHEN MIN(f.media_kind) = MAX(f.media_kind) THEN COUNT(f.id) ELSE 0 END" \
+  " FROM temp.groups_batch b CROSS JOIN groups g ON g.type = 1 AND g.persistentid = b.persistentid" \
+  " CROSS JOIN files f ON f.songalbumid = g.persistentid" \
+  " WHERE b.type = 1 AND f.disabled = 0 GROUP BY f.songalbumid;"
+#define Q_GROUPS_ARTISTS \
+  "INSERT OR REPLACE INTO groups (id, type, name, persistentid, name_sort, album_artist, songartistid," \
+  "   track_count, album_count, song_length, time_added, media_kind, media_kind_count)" \
+  " SELECT g.id, g.type, g.name, g.persistentid, f.album_artist_sort, f.album_artist, f.songartistid," \
+  "   COUNT(f.id), COUNT(DISTINCT f.songalbumid), SUM(f.song_length), MAX(MAX(f.time_added), g.time_added), MIN(f.media_kind)," \
+  "   CASE WHEN MIN(f.media_kind) = MAX(f.media_kind) THEN COUNT(f.id) ELSE 0 END" \
+  " FROM temp.groups_batch b CROSS JOIN groups g ON g.type = 2 AND g.persistentid = b.persistentid" \
+  " CROSS JOIN files f ON f.songartistid = g.persistentid" \
+  " WHERE b.type = 2 AND +f.disabled = 0 GROUP BY f.songartistid;"
+#define Q_GROUPS_CLEAR \
+  "DELETE FROM temp.groups_batch;"
+  char *queries[] = { Q_GROUPS_ADD_ALBUMS, Q_GROUPS_ADD_ARTISTS, Q_GROUPS_RESET, Q_GROUPS_ALBUMS, Q_GROUPS_ARTISTS, Q_GROUPS_CLEAR };
+  int i;
+  int ret;
+
+  for (i = 0; i < ARRAY_SIZE(queries); i++)
+    {
+      ret = db_query_run(queries[i], 0, 0);
+      if (ret < 0)
+	return -1;
+    }
+
+  return 0;
+
+#undef Q_GROUPS_ADD_ALBUMS
+#undef Q_GROUPS_ADD_ARTISTS
+#undef Q_GROUPS_RESET
+#undef Q_GROUPS_ALBUMS
+#undef Q_GROUPS_ARTISTS
+#undef Q_GROUPS_CLEAR
+}
+
+/* Saves a batch of files, e.g. from a bulk scan, with fewer queries than when
+ * saving them one by one. The ids of the files already in the library are
+ * looked up with one query per DB_FILE_BATCH_LOOKUP files, so mfi->id is not
+ * used and the caller doesn't need to look it up. The groups triggers are
+ * switched off with the DB_ADMIN_GROUPS_DEFERRED flag, and the groups of the
+ * new and changed files are updated with a few set-based queries at the end
+ * instead. All of it is done in a savepoint, so other connections never see
+ * the flag. If the group update fails, the files are saved one by one instead.
+ */
+int
+db_file_save_batch(struct media_file_info **mfis, int n)
+{
+  struct db_file_batch_old *old;
+  int nlookup;
+  int nsaved;
+  int i;
+  int ret;
+
+  if (n <= 0)
+    return 0;
+
+  CHECK_NULL(L_DB, old = calloc(n, sizeof(struct db_file_batch_old)));
+
+  ret = db_query_run("SAVEPOINT file_batch;", 0, 0);
+  if (ret < 0)
+    goto error;
+
+  ret = db_query_run("CREATE TEMP TABLE IF NOT EXISTS groups_batch (type INTEGER NOT NULL, persistentid INTEGER NOT NULL,"
+		     " PRIMARY KEY (type, persistentid)) WITHOUT ROWID;", 0, 0);
+  if (ret < 0)
+    goto rollback;
+
+  ret = db_admin_set(DB_ADMIN_GROUPS_DEFERRED, "1");
+  if (ret < 0)
+    goto rollback;
+
+  for (i = 0; i < n; i += nlookup)
+    {
+      nlookup = MIN(n - i, DB_FILE_BATCH_LOOKUP);
+
+      ret = db_file_batch_lookup(mfis + i, nlookup, old + i);
+      if (ret < 0)
+	goto rollback;
+    }
+
+  for (i = 0, nsaved = 0; i < n; i++)
+    {
+      if (mfis[i]->id == 0)
+	ret = db_file_add(mfis[i]);
+      else
+	ret = db_file_update(mfis[i]);
+
+      if (ret < 0)
+	continue;
+
+      nsaved++;
+
+      // An added file has all zero old values, so it always counts as changed
+      if (!db_file_batch_groups_changed(&old[i], mfis[i]))
+	continue;
+
+      // fixup_tags_mfi() has set the ids of the new groups
+      if (db_file_batch_group_add(1, mfis[i]->songalbumid) < 0 || db_file_batch_group_add(2, mfis[i]->songartistid) < 0 ||
+	  db_file_batch_group_add(1, old[i].songalbumid) < 0 || db_file_batch_group_add(2, old[i].songartistid) < 0)
+	goto rollback;
+    }
+
+  ret = db_file_batch_groups_update();
+  if (ret < 0)
+    goto rollback;
+
+  ret = db_admin_delete(DB_ADMIN_GROUPS_DEFERRED);
+  if (ret < 0)
+    goto rollback;
+
+  db_query_run("RELEASE file_batch;", 0, 0);
+
+  db_file_batch_old_free(old, n);
+  return nsaved;
+
+ rollback:
+  db_query_run("ROLLBACK TO file_batch;", 0, 0);
+  db_query_run("RELEASE file_batch;", 0, 0);
+ error:
+  db_file_batch_old_free(old, n);
 
-  fixup_tags_mfi(mfi);
+  DPRINTF(E_WARN, L_DB, "Batch save of %d files failed, saving them one by one\n", n);
 
-  ret = bind_mfi(db_statements.files_update, mfi);
-  if (ret < 0)
-    return -1;
+  for (i = 0, nsaved = 0; i < n; i++)
+    {
+      // The id from the lookup was rolled back too
+      mfis[i]->id = db_file_id_bypath(mfis[i]->path);
 
-  ret = db_statement_run(db_statements.files_update);
-  if (ret < 0)
-    return -1;
+      if (mfis[i]->id == 0)
+	ret = db_file_add(mfis[i]);
+      else
+	ret = db_file_update(mfis[i]);
 
-  library_update_trigger(LISTENER_DATABASE);
+      if (ret == 0)
+	nsaved++;
+    }
 
-  return 0;
+  return nsaved;
 }
 
 void
@@ -3806,30 +4798,21 @@ db_groups_cleanup()
 static enum group_type
 db_group_type_bypersistentid(int64_t persistentid)
 {
-#define Q_TMPL "SELECT g.type FROM groups g WHERE g.persistentid = %" PRIi64 ";"
-  char *query;
+#define Q_TMPL "SELECT g.type FROM groups g WHERE g.persistentid = ?;"
   sqlite3_stmt *stmt;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, persistentid);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return 0;
-    }
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  DPRINTF(E_DBG, L_DB, "Running query '%s' with persistentid %" PRIi64 "\n", Q_TMPL, persistentid);
 
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
+  ret = db_stmt_prepare(Q_TMPL, &stmt);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-
-      sqlite3_free(query);
       return 0;
     }
 
+  sqlite3_bind_int64(stmt, 1, persistentid);
+
   ret = db_blocking_step(stmt);
   if (ret != SQLITE_ROW)
     {
@@ -3838,8 +4821,7 @@ db_group_type_bypersistentid(int64_t persistentid)
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
+      db_stmt_release(stmt);
       return 0;
     }
 
@@ -3850,8 +4832,7 @@ db_group_type_bypersistentid(int64_t persistentid)
     ; /* EMPTY */
 #endif
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
+  db_stmt_release(stmt);
 
   return ret;
 
@@ -4107,8 +5088,8 @@ db_directory_add(struct directory_info *di, int *id)
 static int
 db_directory_update(struct directory_info *di)
 {
-#define QADD_TMPL "UPDATE directories SET virtual_path = TRIM(%Q), db_timestamp = %d, disabled = %d, parent_id = %d, path = TRIM(%Q)" \
-                  " WHERE id = %d;"
+#define QADD_TMPL "UPDATE directories SET virtual_path = TRIM(%Q), db_timestamp = %d, disabled = %d, parent_id = %d, path = TRIM(%Q)," \
+                  " mtime = 0 WHERE id = %d;"
   char *query;
   char *errmsg;
   int ret;
@@ -4173,6 +5154,69 @@ db_directory_addorupdate(char *virtual_path, char *path, int disabled, int paren
   return id;
 }
 
+// Gets the directory mtime that was saved after the last complete scan of the
+// directory, and the time that scan started. The mtime is reset to 0 whenever
+// the directory is updated, so 0 means there is no usable mtime.
+int
+db_directory_mtime_get(const char *virtual_path, time_t *mtime, time_t *db_timestamp)
+{
+#define Q_TMPL "SELECT d.mtime, d.db_timestamp FROM directories d WHERE d.disabled = 0 AND d.virtual_path = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  ret = db_stmt_prepare(Q_TMPL, &stmt);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  sqlite3_bind_text(stmt, 1, virtual_path, -1, SQLITE_STATIC);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret != SQLITE_DONE)
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      db_stmt_release(stmt);
+      return -1;
+    }
+
+  *mtime = sqlite3_column_int64(stmt, 0);
+  *db_timestamp = sqlite3_column_int64(stmt, 1);
+
+  db_stmt_release(stmt);
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+void
+db_directory_mtime_set(int id, time_t mtime)
+{
+#define Q_TMPL "UPDATE directories SET mtime = ? WHERE id = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  ret = db_stmt_prepare(Q_TMPL, &stmt);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return;
+    }
+
+  sqlite3_bind_int64(stmt, 1, (int64_t)mtime);
+  sqlite3_bind_int(stmt, 2, id);
+
+  db_statement_run(stmt);
+
+  db_stmt_release(stmt);
+
+#undef Q_TMPL
+}
+
 void
 db_directory_ping_bymatch(char *virtual_path)
 {
@@ -4189,7 +5233,7 @@ void
 db_directory_disable_bymatch(char *path, enum strip_type strip, uint32_t cookie)
 {
 #define Q_TMPL "UPDATE directories SET virtual_path = substr(virtual_path, %d)," \
-               " disabled = %" PRIi64 " WHERE virtual_path = '/file:%q' OR virtual_path LIKE '/file:%q/%%';"
+               " disabled = %" PRIi64 ", mtime = 0 WHERE virtual_path = '/file:%q' OR virtual_path LIKE '/file:%q/%%';"
   char *query;
   int64_t disabled;
   int vpath_striplen;
@@ -4208,7 +5252,7 @@ int
 db_directory_enable_bycookie(uint32_t cookie, char *path)
 {
 #define Q_TMPL "UPDATE directories SET virtual_path = ('/file:%q' || virtual_path)," \
-               " disabled = 0 WHERE disabled = %" PRIi64 ";"
+               " disabled = 0, mtime = 0 WHERE disabled = %" PRIi64 ";"
   char *query;
   int ret;
 
@@ -4223,7 +5267,7 @@ db_directory_enable_bycookie(uint32_t cookie, char *path)
 int
 db_directory_enable_bypath(char *path)
 {
-#define Q_TMPL "UPDATE directories SET disabled = 0 WHERE virtual_path = %Q AND disabled <> 0;"
+#define Q_TMPL "UPDATE directories SET disabled = 0, mtime = 0 WHERE virtual_path = %Q AND disabled <> 0;"
   char *query;
   int ret;
 
@@ -4681,75 +5725,125 @@ queue_transaction_end(int retval, int queue_version)
 static int
 queue_reshuffle(uint32_t item_id, int queue_version);
 
-static int
-queue_add_file(struct db_media_file_info *dbmfi, int pos, int shuffle_pos, int queue_version)
-{
-#define Q_TMPL "INSERT INTO queue "							\
+// The queue is written with bound statements from the statement cache, so that
+// adding or renumbering thousands of items doesn't parse a query per item
+#define Q_QUEUE_INSERT "INSERT INTO queue "						\
 		    "(id, file_id, song_length, data_kind, media_kind, "		\
 		    "pos, shuffle_pos, path, virtual_path, title, "			\
-		    "artist, composer, album_artist, album, genre, songalbumid, songartistid,"	\
+		    "artist, composer, album_artist, album, genre, songalbumid, songartistid, "	\
 		    "time_modified, artist_sort, album_sort, album_artist_sort, year, "	\
 		    "type, bitrate, samplerate, channels, "				\
-		    "track, disc, queue_version)" 					\
+		    "track, disc, artwork_url, queue_version)" 				\
 		"VALUES"                                           			\
-		    "(NULL, %s, %s, %s, %s, "						\
-		    "%d, %d, %Q, %Q, %Q, "						\
-		    "%Q, %Q, %Q, %Q, %Q, %s, %s,"					\
-		    "%s, %Q, %Q, %Q, %s, "						\
-		    "%Q, %s, %s, %s, "				                        \
-		    "%s, %s, %d);"
+		    "(NULL, ?, ?, ?, ?, "						\
+		    "?, ?, ?, ?, ?, "							\
+		    "?, ?, ?, ?, ?, ?, ?, "						\
+		    "?, ?, ?, ?, ?, "							\
+		    "?, ?, ?, ?, "							\
+		    "?, ?, ?, ?);"
 
-  char *query;
+static int
+queue_add_file(struct db_media_file_info *dbmfi, int pos, int shuffle_pos, int queue_version)
+{
+  sqlite3_stmt *stmt;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL,
-			  dbmfi->id, dbmfi->song_length, dbmfi->data_kind, dbmfi->media_kind,
-			  pos, shuffle_pos, dbmfi->path, dbmfi->virtual_path, dbmfi->title,
-			  dbmfi->artist, dbmfi->composer, dbmfi->album_artist, dbmfi->album, dbmfi->genre, dbmfi->songalbumid, dbmfi->songartistid,
-			  dbmfi->time_modified, dbmfi->artist_sort, dbmfi->album_sort, dbmfi->album_artist_sort, dbmfi->year,
-			  dbmfi->type, dbmfi->bitrate, dbmfi->samplerate, dbmfi->channels,
-			  dbmfi->track, dbmfi->disc, queue_version);
-  ret = db_query_run(query, 1, 0);
-
-  return ret;
+  ret = db_stmt_prepare(Q_QUEUE_INSERT, &stmt);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
 
-#undef Q_TMPL
+  // Integer columns get the text values of dbmfi converted by their affinity
+  sqlite3_bind_text(stmt, 1, dbmfi->id, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, dbmfi->song_length, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 3, dbmfi->data_kind, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 4, dbmfi->media_kind, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 5, pos);
+  sqlite3_bind_int(stmt, 6, shuffle_pos);
+  sqlite3_bind_text(stmt, 7, dbmfi->path, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 8, dbmfi->virtual_path, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 9, dbmfi->title, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 10, dbmfi->artist, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 11, dbmfi->composer, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 12, dbmfi->album_artist, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 13, dbmfi->album, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 14, dbmfi->genre, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 15, dbmfi->songalbumid, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 16, dbmfi->songartistid, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 17, dbmfi->time_modified, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 18, dbmfi->artist_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 19, dbmfi->album_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 20, dbmfi->album_artist_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 21, dbmfi->year, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 22, dbmfi->type, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 23, dbmfi->bitrate, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 24, dbmfi->samplerate, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 25, dbmfi->channels, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 26, dbmfi->track, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 27, dbmfi->disc, -1, SQLITE_STATIC);
+  sqlite3_bind_null(stmt, 28);
+  sqlite3_bind_int(stmt, 29, queue_version);
+
+  ret = db_statement_run(stmt);
+
+  db_stmt_release(stmt);
+
+  return (ret < 0) ? -1 : 0;
 }
 
 static int
 queue_add_item(struct db_queue_item *item, int pos, int shuffle_pos, int queue_version)
 {
-#define Q_TMPL "INSERT INTO queue "							\
-		    "(id, file_id, song_length, data_kind, media_kind, "		\
-		    "pos, shuffle_pos, path, virtual_path, title, "			\
-		    "artist, composer, album_artist, album, genre, songalbumid, songartistid, "	\
-		    "time_modified, artist_sort, album_sort, album_artist_sort, year, "	\
-		    "type, bitrate, samplerate, channels, "				\
-		    "track, disc, artwork_url, queue_version)" 				\
-		"VALUES"                                           			\
-		    "(NULL, %d, %d, %d, %d, "						\
-		    "%d, %d, %Q, %Q, %Q, "						\
-		    "%Q, %Q, %Q, %Q, %Q, %" PRIi64 ", %" PRIi64 ","			\
-		    "%d, %Q, %Q, %Q, %d, "						\
-		    "%Q, %" PRIu32 ", %" PRIu32 ", %" PRIu32 ", "			\
-		    "%d, %d, %Q, %d);"
-
-  char *query;
+  sqlite3_stmt *stmt;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL,
-			  item->file_id, item->song_length, item->data_kind, item->media_kind,
-			  pos, shuffle_pos, item->path, item->virtual_path, item->title,
-			  item->artist, item->composer, item->album_artist, item->album, item->genre, item->songalbumid, item->songartistid,
-			  item->time_modified, item->artist_sort, item->album_sort, item->album_artist_sort, item->year,
-                          item->type, item->bitrate, item->samplerate, item->channels,
-			  item->track, item->disc, item->artwork_url, queue_version);
-  ret = db_query_run(query, 1, 0);
-
-  return ret;
+  ret = db_stmt_prepare(Q_QUEUE_INSERT, &stmt);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
 
-#undef Q_TMPL
-}
+  sqlite3_bind_int(stmt, 1, item->file_id);
+  sqlite3_bind_int(stmt, 2, item->song_length);
+  sqlite3_bind_int(stmt, 3, item->data_kind);
+  sqlite3_bind_int(stmt, 4, item->media_kind);
+  sqlite3_bind_int(stmt, 5, pos);
+  sqlite3_bind_int(stmt, 6, shuffle_pos);
+  sqlite3_bind_text(stmt, 7, item->path, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 8, item->virtual_path, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 9, item->title, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 10, item->artist, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 11, item->composer, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 12, item->album_artist, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 13, item->album, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 14, item->genre, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 15, item->songalbumid);
+  sqlite3_bind_int64(stmt, 16, item->songartistid);
+  sqlite3_bind_int(stmt, 17, item->time_modified);
+  sqlite3_bind_text(stmt, 18, item->artist_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 19, item->album_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 20, item->album_artist_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 21, item->year);
+  sqlite3_bind_text(stmt, 22, item->type, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 23, item->bitrate);
+  sqlite3_bind_int64(stmt, 24, item->samplerate);
+  sqlite3_bind_int64(stmt, 25, item->channels);
+  sqlite3_bind_int(stmt, 26, item->track);
+  sqlite3_bind_int(stmt, 27, item->disc);
+  sqlite3_bind_text(stmt, 28, item->artwork_url, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 29, queue_version);
+
+  ret = db_statement_run(stmt);
+
+  db_stmt_release(stmt);
+
+  return (ret < 0) ? -1 : 0;
+}
+
+#undef Q_QUEUE_INSERT
 
 int
 db_queue_update_item(struct db_queue_item *qi)
@@ -5091,7 +6185,7 @@ queue_enum_start(struct query_params *qp)
 
   DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", query);
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  ret = db_stmt_prepare(query, &stmt);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
@@ -5239,18 +6333,16 @@ queue_fetch_byitemid(uint32_t item_id, struct db_queue_item *queue_item, int wit
   int ret;
 
   memset(&qp, 0, sizeof(struct query_params));
-  qp.filter = sqlite3_mprintf("id = %d", item_id);
+  qp.filter = "id = ?";
 
   ret = queue_enum_start(&qp);
   if (ret < 0)
-    {
-      sqlite3_free(qp.filter);
-      return -1;
-    }
+    return -1;
+
+  sqlite3_bind_int(qp.stmt, 1, item_id);
 
   ret = queue_enum_fetch(&qp, queue_item, with_metadata);
   db_query_end(&qp);
-  sqlite3_free(qp.filter);
   return ret;
 }
 
@@ -5474,51 +6566,133 @@ db_queue_fetch_prev(uint32_t item_id, char shuffle)
   return db_queue_fetch_byposrelativetoitem(-1, item_id, shuffle);
 }
 
+/*
+ * Gets the ids of the queue items from the given position (in the normal queue)
+ * and onwards, ordered by pos or shuffle_pos.
+ *
+ * @out ids Array of item ids, must be freed by the caller
+ * @out nids Number of ids
+ * @return 0 on success, -1 on failure
+ */
 static int
-queue_fix_pos(enum sort_type sort, int queue_version)
+queue_ids_get(int **ids, int *nids, enum sort_type sort, int from_pos)
 {
-#define Q_TMPL "UPDATE queue SET %q = %d, queue_version = %d WHERE id = %d and %q <> %d;"
-
-  struct query_params qp;
-  struct db_queue_item queue_item;
+  sqlite3_stmt *stmt;
+  uint32_t count;
   char *query;
-  int pos;
   int ret;
+  int i;
 
-  memset(&qp, 0, sizeof(struct query_params));
-  qp.sort = sort;
+  *ids = NULL;
+  *nids = 0;
 
-  ret = queue_enum_start(&qp);
-  if (ret < 0)
+  ret = db_queue_get_count(&count);
+  if (ret < 0 || count == 0)
+    return ret;
+
+  query = sqlite3_mprintf("SELECT id FROM queue WHERE pos >= ? ORDER BY %s;", sort_clause[sort]);
+  if (!query)
     {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
       return -1;
     }
 
-  pos = 0;
-  while ((ret = queue_enum_fetch(&qp, &queue_item, 0)) == 0 && (queue_item.id > 0))
+  ret = db_stmt_prepare(query, &stmt);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
     {
-      if (queue_item.pos != pos)
-        {
-	  if (sort == S_SHUFFLE_POS)
-	    query = sqlite3_mprintf(Q_TMPL, "shuffle_pos", pos, queue_version, queue_item.id, "shuffle_pos", pos);
-	  else
-	    query = sqlite3_mprintf(Q_TMPL, "pos", pos, queue_version, queue_item.id, "pos", pos);
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
 
-	  ret = db_query_run(query, 1, 0);
-	  if (ret < 0)
-	    {
-	      DPRINTF(E_LOG, L_DB, "Failed to update item with item-id: %d\n", queue_item.id);
-	      break;
-	    }
-	}
+  sqlite3_bind_int(stmt, 1, from_pos);
 
-      pos++;
+  CHECK_NULL(L_DB, *ids = malloc(count * sizeof(int)));
+
+  for (i = 0; i < count && (ret = db_blocking_step(stmt)) == SQLITE_ROW; i++)
+    (*ids)[i] = sqlite3_column_int(stmt, 0);
+
+  if (ret != SQLITE_ROW && ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      db_stmt_release(stmt);
+      free(*ids);
+      *ids = NULL;
+      return -1;
     }
 
-  db_query_end(&qp);
-  return ret;
+  db_stmt_release(stmt);
 
-#undef Q_TMPL
+  *nids = i;
+
+  return 0;
+}
+
+/*
+ * Sets pos (or shuffle_pos) of the items in the given array of ids to their
+ * index in the array plus start_pos. Items that already have the right position
+ * are not changed.
+ *
+ * The queue table is the only copy of the queue, there is no in-memory queue
+ * that is written behind. All the readers (JSON API, MPD, DAAP/DACP) query the
+ * table with their own filters on their own connections, so they would all see
+ * stale positions until a write-behind was done. This is one prepared
+ * statement stepped per item, and skips the items that don't move.
+ */
+static int
+queue_pos_write(enum sort_type sort, int *ids, int nids, int start_pos, int queue_version)
+{
+#define Q_POS "UPDATE queue SET pos = ?1, queue_version = ?2 WHERE id = ?3 AND pos <> ?1;"
+#define Q_SHUFFLE_POS "UPDATE queue SET shuffle_pos = ?1, queue_version = ?2 WHERE id = ?3 AND shuffle_pos <> ?1;"
+  sqlite3_stmt *stmt;
+  int ret;
+  int i;
+
+  ret = db_stmt_prepare((sort == S_SHUFFLE_POS) ? Q_SHUFFLE_POS : Q_POS, &stmt);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  for (i = 0; i < nids; i++)
+    {
+      sqlite3_bind_int(stmt, 1, start_pos + i);
+      sqlite3_bind_int(stmt, 2, queue_version);
+      sqlite3_bind_int(stmt, 3, ids[i]);
+
+      ret = db_statement_run(stmt);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DB, "Failed to update item with item-id: %d\n", ids[i]);
+	  break;
+	}
+    }
+
+  db_stmt_release(stmt);
+
+  return (ret < 0) ? -1 : 0;
+
+#undef Q_POS
+#undef Q_SHUFFLE_POS
+}
+
+static int
+queue_fix_pos(enum sort_type sort, int queue_version)
+{
+  int *ids;
+  int nids;
+  int ret;
+
+  ret = queue_ids_get(&ids, &nids, sort, 0);
+  if (ret < 0)
+    return -1;
+
+  ret = queue_pos_write(sort, ids, nids, 0, queue_version);
+
+  free(ids);
+  return ret;
 }
 
 /*
@@ -5939,12 +7113,8 @@ queue_reshuffle(uint32_t item_id, int queue_version)
 {
   char *query;
   int pos;
-  uint32_t count;
-  struct db_queue_item queue_item;
-  int *shuffle_pos;
+  int *ids;
   int len;
-  int i;
-  struct query_params qp;
   int ret;
 
   DPRINTF(E_DBG, L_DB, "Reshuffle queue after item with item-id: %d\n", item_id);
@@ -5965,53 +7135,19 @@ queue_reshuffle(uint32_t item_id, int queue_version)
       pos++; // Do not reshuffle the base item
     }
 
-  ret = db_queue_get_count(&count);
+  // Shuffle the ids of the items from pos, and give them shuffle positions in that order
+  ret = queue_ids_get(&ids, &len, S_POS, pos);
   if (ret < 0)
     return -1;
 
-  len = count - pos;
-
-  DPRINTF(E_DBG, L_DB, "Reshuffle %d items off %" PRIu32 " total items, starting from pos %d\n", len, count, pos);
-
-  shuffle_pos = malloc(len * sizeof(int));
-  for (i = 0; i < len; i++)
-    {
-      shuffle_pos[i] = i + pos;
-    }
-
-  shuffle_int(&shuffle_rng, shuffle_pos, len);
-
-  memset(&qp, 0, sizeof(struct query_params));
-  qp.filter = sqlite3_mprintf("pos >= %d", pos);
-
-  ret = queue_enum_start(&qp);
-  if (ret < 0)
-    {
-      sqlite3_free(qp.filter);
-      return -1;
-    }
-
-  i = 0;
-  while ((ret = queue_enum_fetch(&qp, &queue_item, 0)) == 0 && (queue_item.id > 0) && (i < len))
-    {
-      query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = %d where id = %d;", shuffle_pos[i], queue_item.id);
-      ret = db_query_run(query, 1, 0);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_DB, "Failed to delete item with item-id: %d\n", queue_item.id);
-	  break;
-	}
-
-      i++;
-    }
+  DPRINTF(E_DBG, L_DB, "Reshuffle %d items, starting from pos %d\n", len, pos);
 
-  db_query_end(&qp);
-  sqlite3_free(qp.filter);
+  shuffle_int(&shuffle_rng, ids, len);
 
-  if (ret < 0)
-    return -1;
+  ret = queue_pos_write(S_SHUFFLE_POS, ids, len, pos, queue_version);
 
-  return 0;
+  free(ids);
+  return ret;
 }
 
 /*
@@ -6838,16 +7974,28 @@ db_statements_prepare_insert(const struct col_type_map *map, size_t map_size, co
   sqlite3_stmt *stmt;
   int ret;
   int i;
+  int n;
 
   memset(keystr, 0, sizeof(keystr));
   memset(valstr, 0, sizeof(valstr));
-  for (i = 0; i < map_size; i++)
+  for (i = 0, n = 1; i < map_size; i++)
     {
       if (map[i].flag & DB_FLAG_NO_BIND)
 	continue;
 
-      CHECK_ERR(L_DB, safe_snprintf_cat(keystr, sizeof(keystr), "%s, ", map[i].name));
-      CHECK_ERR(L_DB, safe_snprintf_cat(valstr, sizeof(valstr), "?, "));
+      // The key is made from the same parameter, so we refer to it by number
+      if (map[i].flag & DB_FLAG_SORT_KEY)
+	{
+	  CHECK_ERR(L_DB, safe_snprintf_cat(keystr, sizeof(keystr), "%s, %s_key, ", map[i].name, map[i].name));
+	  CHECK_ERR(L_DB, safe_snprintf_cat(valstr, sizeof(valstr), "?%d, daap_sortkey(?%d), ", n, n));
+	}
+      else
+	{
+	  CHECK_ERR(L_DB, safe_snprintf_cat(keystr, sizeof(keystr), "%s, ", map[i].name));
+	  CHECK_ERR(L_DB, safe_snprintf_cat(valstr, sizeof(valstr), "?%d, ", n));
+	}
+
+      n++;
     }
 
   // Terminate at the ending ", "
@@ -6877,23 +8025,28 @@ db_statements_prepare_update(const struct col_type_map *map, size_t map_size, co
   sqlite3_stmt *stmt;
   int ret;
   int i;
+  int n;
 
   memset(keystr, 0, sizeof(keystr));
-  for (i = 0; i < map_size; i++)
+  for (i = 0, n = 1; i < map_size; i++)
     {
       if (map[i].flag & DB_FLAG_NO_BIND)
 	continue;
 
       if (map[i].flag & DB_FLAG_NO_ZERO)
-	CHECK_ERR(L_DB, safe_snprintf_cat(keystr, sizeof(keystr), "%s = daap_no_zero(?, %s), ", map[i].name, map[i].name));
+	CHECK_ERR(L_DB, safe_snprintf_cat(keystr, sizeof(keystr), "%s = daap_no_zero(?%d, %s), ", map[i].name, n, map[i].name));
+      else if (map[i].flag & DB_FLAG_SORT_KEY)
+	CHECK_ERR(L_DB, safe_snprintf_cat(keystr, sizeof(keystr), "%s = ?%d, %s_key = daap_sortkey(?%d), ", map[i].name, n, map[i].name, n));
       else
-	CHECK_ERR(L_DB, safe_snprintf_cat(keystr, sizeof(keystr), "%s = ?, ", map[i].name));
+	CHECK_ERR(L_DB, safe_snprintf_cat(keystr, sizeof(keystr), "%s = ?%d, ", map[i].name, n));
+
+      n++;
     }
 
   // Terminate at the ending ", "
   *(strrchr(keystr, ',')) = '\0';
 
-  CHECK_NULL(L_DB, query = db_mprintf("UPDATE %s SET %s WHERE %s = ?;", table, keystr, map[0].name));
+  CHECK_NULL(L_DB, query = db_mprintf("UPDATE %s SET %s WHERE %s = ?%d;", table, keystr, map[0].name, n));
 
   ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
   if (ret != SQLITE_OK)
@@ -6977,6 +8130,8 @@ db_perthread_deinit(void)
   if (!hdl)
     return;
 
+  db_stmt_cache_clear();
+
   /* Tear down anything that's in flight */
   while ((stmt = sqlite3_next_stmt(hdl, 0)))
     sqlite3_finalize(stmt);
@@ -7194,6 +8349,8 @@ db_init(void)
 
   db_set_cfg_names();
 
+  db_fts_available = (db_init_fts(hdl) == 0);
+
   CHECK_ERR(L_DB, db_files_get_count(&files, NULL, NULL));
   CHECK_ERR(L_DB, db_pl_get_count(&pls));
 
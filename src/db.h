@@ -72,6 +72,8 @@ enum query_type {
 #define DB_ADMIN_START_TIME "start_time"
 #define DB_ADMIN_LASTFM_SESSION_KEY "lastfm_sk"
 #define DB_ADMIN_SPOTIFY_REFRESH_TOKEN "spotify_refresh_token"
+// Only set inside db_file_save_batch(), turns off the groups triggers
+#define DB_ADMIN_GROUPS_DEFERRED "groups_deferred"
 
 /* Max value for media_file_info->rating (valid range is from 0 to 100) */
 #define DB_FILES_RATING_MAX 100
@@ -89,11 +91,23 @@ struct query_params {
   int offset;
   int limit;
 
+  /* Keyset pagination: continue after the row with this sort value and id,
+   * set with db_query_after_set() */
+  bool after;
+  char *after_sort;
+  int64_t after_id;
+  /* Set by callers that page by keyset. The listing is then ordered by (sort
+   * key, id), and the fetch functions keep the last row in after, so that
+   * db_query_after_make() can make the token for the next page */
+  bool keyset;
+
   char *having;
   char *order;
   char *group;
 
   char *filter;
+  /* Only items of this media kind (enum media_kind), 0 for all */
+  int media_kind;
 
   int with_disabled;
 
@@ -106,6 +120,12 @@ struct query_params {
   char buf2[32];
 };
 
+struct db_stmt_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
+
 struct pairing_info {
   char *remote_id;
   char *name;
@@ -513,6 +533,57 @@ db_mprintf(const char *fmt, ...);
 int
 db_snprintf(char *s, int n, const char *fmt, ...);
 
+/* Makes a query filter for files where the given fields contain the words in
+ * term. Uses the full-text index when possible (words are then matched by
+ * prefix, ignoring case and diacritics), otherwise LIKE '%term%'.
+ *
+ * @in  fields   NULL terminated list of fields, e.g. "f.title"
+ * @in  term     Search term
+ * @return       Filter, must be freed by caller
+ */
+char *
+db_search_filter(const char **fields, const char *term);
+
+/* Makes an expression for ORDER BY that sorts files matching the search for
+ * term in fields by relevance. For use with the filter from
+ * db_search_filter(), and only possible when it uses the full-text index.
+ *
+ * @return       Expression (lower is better), NULL if full-text search is not
+ *               possible. Must be freed by caller.
+ */
+char *
+db_search_rank(const char **fields, const char *term);
+
+/* Makes an opaque token for continuing a listing after the last row fetched
+ * from a query with keyset set, which is cheaper than an offset for deep pages.
+ * Supported for tracks sorted by title or not sorted, and for albums and
+ * artists sorted by name.
+ *
+ * @in  qp       Query with keyset set
+ * @return       Token, NULL if no row was fetched. Must be freed by caller
+ */
+char *
+db_query_after_make(struct query_params *qp);
+
+/* Whether the query can be ordered and continued by keyset, see keyset above
+ *
+ * @return       true if db_query_after_make() can be used with the query
+ */
+bool
+db_query_keyset_usable(struct query_params *qp);
+
+/* Sets the query to continue after the row in a token from
+ * db_query_after_make(). Offset is then relative to that row.
+ *
+ * @return       0 on success, -1 if the token is invalid
+ */
+int
+db_query_after_set(struct query_params *qp, const char *token);
+
+/* Counters of the prepared statement cache, summed over all threads */
+void
+db_stmt_cache_stats_get(struct db_stmt_cache_stats *stats);
+
 void
 free_pi(struct pairing_info *pi, int content_only);
 
@@ -601,6 +672,12 @@ db_file_ping(int id);
 int
 db_file_ping_bypath(const char *path, time_t mtime_max);
 
+int
+db_file_paths_bydirectory(int dir_id, char ***paths);
+
+int
+db_file_ping_bydirectory(int dir_id);
+
 void
 db_file_ping_bymatch(const char *path, int isdir);
 
@@ -631,6 +708,9 @@ db_file_add(struct media_file_info *mfi);
 int
 db_file_update(struct media_file_info *mfi);
 
+int
+db_file_save_batch(struct media_file_info **mfis, int n);
+
 void
 db_file_seek_update(int id, uint32_t seek);
 
@@ -743,6 +823,12 @@ db_directory_enum_end(struct directory_enum *de);
 int
 db_directory_addorupdate(char *virtual_path, char *path, int disabled, int parent_id);
 
+int
+db_directory_mtime_get(const char *virtual_path, time_t *mtime, time_t *db_timestamp);
+
+void
+db_directory_mtime_set(int id, time_t mtime);
+
 void
 db_directory_ping_bymatch(char *virtual_path);
 
@@ -21,6 +21,7 @@
 
 #include <sqlite3.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #include "db_init.h"
 #include "logger.h"
@@ -96,7 +97,12 @@
   "   album_sort         VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
   "   album_artist_sort  VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
   "   composer_sort      VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
-  "   channels           INTEGER DEFAULT 0"		\
+  "   channels           INTEGER DEFAULT 0,"		\
+  "   title_sort_key     BLOB DEFAULT NULL,"		\
+  "   artist_sort_key    BLOB DEFAULT NULL,"		\
+  "   album_sort_key     BLOB DEFAULT NULL,"		\
+  "   album_artist_sort_key BLOB DEFAULT NULL,"	\
+  "   composer_sort_key  BLOB DEFAULT NULL"		\
   ");"
 
 #define T_PL					\
@@ -132,6 +138,15 @@
   "   type           INTEGER NOT NULL,"					\
   "   name           VARCHAR(1024) NOT NULL COLLATE DAAP,"		\
   "   persistentid   INTEGER NOT NULL,"					\
+  "   name_sort      VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"		\
+  "   album_artist   VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"		\
+  "   songartistid   INTEGER DEFAULT 0,"				\
+  "   track_count    INTEGER DEFAULT 0,"				\
+  "   album_count    INTEGER DEFAULT 0,"				\
+  "   song_length    INTEGER DEFAULT 0,"				\
+  "   time_added     INTEGER DEFAULT 0,"				\
+  "   media_kind     INTEGER DEFAULT 0,"				\
+  "   media_kind_count INTEGER DEFAULT 0,"				\
   "CONSTRAINT groups_type_unique_persistentid UNIQUE (type, persistentid)" \
   ");"
 
@@ -165,7 +180,8 @@
   "   db_timestamp        INTEGER DEFAULT 0,"			\
   "   disabled            INTEGER DEFAULT 0,"			\
   "   parent_id           INTEGER DEFAULT 0,"			\
-  "   path                VARCHAR(4096) DEFAULT NULL"		\
+  "   path                VARCHAR(4096) DEFAULT NULL,"		\
+  "   mtime               INTEGER DEFAULT 0"			\
   ");"
 
 #define T_QUEUE								\
@@ -301,7 +317,7 @@ static const struct db_init_query db_init_table_queries[] =
 
 /* Used by Q_GROUP_ALBUMS */
 #define I_SONGALBUMID				\
-  "CREATE INDEX IF NOT EXISTS idx_sali ON files(songalbumid, disabled, media_kind, album_sort, disc, track);"
+  "CREATE INDEX IF NOT EXISTS idx_sali ON files(songalbumid, disabled, media_kind, album_sort_key, disc, track);"
 
 /* Used by Q_GROUP_ARTISTS */
 #define I_STATEMKINDSARI				\
@@ -312,15 +328,15 @@ static const struct db_init_query db_init_table_queries[] =
 
 /* Used by Q_BROWSE_ALBUM */
 #define I_ALBUM					\
-  "CREATE INDEX IF NOT EXISTS idx_album ON files(disabled, album_sort, album, media_kind);"
+  "CREATE INDEX IF NOT EXISTS idx_album ON files(disabled, album_sort_key, album, media_kind);"
 
 /* Used by Q_BROWSE_ARTIST */
 #define I_ALBUMARTIST				\
-  "CREATE INDEX IF NOT EXISTS idx_albumartist ON files(disabled, album_artist_sort, album_artist, media_kind);"
+  "CREATE INDEX IF NOT EXISTS idx_albumartist ON files(disabled, album_artist_sort_key, album_artist, media_kind);"
 
 /* Used by Q_BROWSE_COMPOSERS */
 #define I_COMPOSER				\
-  "CREATE INDEX IF NOT EXISTS idx_composer ON files(disabled, composer_sort, composer, media_kind);"
+  "CREATE INDEX IF NOT EXISTS idx_composer ON files(disabled, composer_sort_key, composer, media_kind);"
 
 /* Used by Q_BROWSE_GENRES */
 #define I_GENRE					\
@@ -328,7 +344,7 @@ static const struct db_init_query db_init_table_queries[] =
 
 /* Used by Q_PLITEMS for smart playlists */
 #define I_TITLE					\
-  "CREATE INDEX IF NOT EXISTS idx_title ON files(disabled, title_sort, media_kind);"
+  "CREATE INDEX IF NOT EXISTS idx_title ON files(disabled, title_sort_key, media_kind);"
 
 #define I_FILELIST					\
   "CREATE INDEX IF NOT EXISTS idx_filelist ON files(disabled, virtual_path, time_modified);"
@@ -357,6 +373,17 @@ static const struct db_init_query db_init_table_queries[] =
 #define I_GRP_PERSIST				\
   "CREATE INDEX IF NOT EXISTS idx_grp_persist ON groups(persistentid);"
 
+/* Used by Q_GROUP_ALBUMS and Q_GROUP_ARTISTS */
+#define I_GRP_TYPE_SORT				\
+  "CREATE INDEX IF NOT EXISTS idx_grp_type_sort ON groups(type, name_sort, track_count);"
+
+#define I_GRP_MKIND_SORT				\
+  "CREATE INDEX IF NOT EXISTS idx_grp_mkind_sort ON groups(type, media_kind, name_sort, track_count);"
+
+/* Groups whose tracks are not all of the same media kind */
+#define I_GRP_MIXED				\
+  "CREATE INDEX IF NOT EXISTS idx_grp_mixed ON groups(type) WHERE media_kind_count <> track_count;"
+
 #define I_PAIRING				\
   "CREATE INDEX IF NOT EXISTS idx_pairingguid ON pairings(guid);"
 
@@ -398,6 +425,9 @@ static const struct db_init_query db_init_index_queries[] =
     { I_PLITEMID,  "create playlist id index" },
 
     { I_GRP_PERSIST, "create groups persistentid index" },
+    { I_GRP_TYPE_SORT, "create groups type/sort index" },
+    { I_GRP_MKIND_SORT, "create groups type/mkind/sort index" },
+    { I_GRP_MIXED, "create groups mixed media kind index" },
 
     { I_PAIRING,   "create pairing guid index" },
 
@@ -411,24 +441,150 @@ static const struct db_init_query db_init_index_queries[] =
 
 /* Triggers must be prefixed with trg_ for db_drop_triggers() to id them */
 
+/* The groups table keeps aggregates (track count, length etc.) of the enabled
+ * files in each album and artist, so that browsing doesn't need to GROUP BY
+ * over the files table. The triggers below remove a file from its groups with
+ * GRP_REMOVE and add it with GRP_ADD. Note that the expressions on the right
+ * hand side of SET see the row as it was before the update.
+ *
+ * media_kind is the media kind of the first file added to the group, and
+ * media_kind_count is how many files have that kind. If there are files with
+ * other kinds, then media_kind_count <> track_count. time_added is when the
+ * newest file was added, it is not reduced when files are removed.
+ */
+#define GRP_ADD(n, type, id, name_sort, album_count)					\
+  "   UPDATE groups SET"								\
+  "     media_kind = CASE WHEN track_count = 0 THEN " n ".media_kind ELSE media_kind END,"	\
+  "     media_kind_count = CASE WHEN track_count = 0 THEN 1"				\
+  "       WHEN media_kind = " n ".media_kind THEN media_kind_count + 1 ELSE media_kind_count END,"	\
+  "     track_count = track_count + 1,"							\
+  "     album_count = " album_count ","							\
+  "     song_length = song_length + " n ".song_length,"				\
+  "     time_added = MAX(time_added, " n ".time_added),"				\
+  "     name_sort = " n "." name_sort ","						\
+  "     album_artist = " n ".album_artist,"						\
+  "     songartistid = " n ".songartistid"						\
+  "     WHERE type = " type " AND persistentid = " n "." id " AND " n ".disabled = 0;"
+
+#define GRP_REMOVE(o, type, id, album_count)						\
+  "   UPDATE groups SET"								\
+  "     media_kind_count = media_kind_count - (media_kind = " o ".media_kind),"	\
+  "     track_count = track_count - 1,"							\
+  "     album_count = " album_count ","							\
+  "     song_length = song_length - " o ".song_length"				\
+  "     WHERE type = " type " AND persistentid = " o "." id " AND " o ".disabled = 0;"
+
+// Albums must be updated before artists, since the artist's album count
+// depends on the album's track count
+#define GRP_ADD_FILE(n)									\
+  GRP_ADD(n, "1", "songalbumid", "album_sort", "1")					\
+  GRP_ADD(n, "2", "songartistid", "album_artist_sort",					\
+    "album_count + (SELECT COUNT(*) FROM groups WHERE type = 1 AND persistentid = " n ".songalbumid AND track_count = 1)")
+
+#define GRP_REMOVE_FILE(o)								\
+  GRP_REMOVE(o, "1", "songalbumid", "1")						\
+  GRP_REMOVE(o, "2", "songartistid",							\
+    "album_count - (SELECT COUNT(*) FROM groups WHERE type = 1 AND persistentid = " o ".songalbumid AND track_count = 0)")
+
+// The triggers are off while db_file_save_batch() has set the admin flag
+// DB_ADMIN_GROUPS_DEFERRED, it updates the groups itself
+#define GRP_NOT_DEFERRED										\
+  "NOT EXISTS (SELECT 1 FROM admin WHERE key = 'groups_deferred')"
+
 #define TRG_GROUPS_INSERT										\
   "CREATE TRIGGER trg_groups_insert AFTER INSERT ON files FOR EACH ROW"					\
+  "   WHEN " GRP_NOT_DEFERRED										\
   " BEGIN"												\
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (1, NEW.album, NEW.songalbumid);"	\
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (2, NEW.album_artist, NEW.songartistid);"	\
+  GRP_ADD_FILE("NEW")											\
   " END;"
 
 #define TRG_GROUPS_UPDATE										\
-  "CREATE TRIGGER trg_groups_update AFTER UPDATE OF songartistid, songalbumid ON files FOR EACH ROW"	\
+  "CREATE TRIGGER trg_groups_update AFTER UPDATE OF songartistid, songalbumid, disabled, media_kind,"	\
+  "   song_length, time_added, album_sort, album_artist_sort ON files FOR EACH ROW"			\
+  "   WHEN (OLD.songartistid <> NEW.songartistid OR OLD.songalbumid <> NEW.songalbumid"		\
+  "     OR OLD.disabled <> NEW.disabled OR OLD.media_kind IS NOT NEW.media_kind"				\
+  "     OR OLD.song_length IS NOT NEW.song_length OR OLD.time_added IS NOT NEW.time_added"		\
+  "     OR OLD.album_sort IS NOT NEW.album_sort OR OLD.album_artist_sort IS NOT NEW.album_artist_sort)"	\
+  "     AND " GRP_NOT_DEFERRED										\
   " BEGIN"												\
+  GRP_REMOVE_FILE("OLD")										\
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (1, NEW.album, NEW.songalbumid);"	\
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (2, NEW.album_artist, NEW.songartistid);"	\
+  GRP_ADD_FILE("NEW")											\
+  " END;"
+
+#define TRG_GROUPS_DELETE										\
+  "CREATE TRIGGER trg_groups_delete AFTER DELETE ON files FOR EACH ROW"					\
+  " BEGIN"												\
+  GRP_REMOVE_FILE("OLD")										\
   " END;"
 
 static const struct db_init_query db_init_trigger_queries[] =
   {
     { TRG_GROUPS_INSERT,           "create trigger trg_groups_insert" },
     { TRG_GROUPS_UPDATE,           "create trigger trg_groups_update" },
+    { TRG_GROUPS_DELETE,           "create trigger trg_groups_delete" },
+  };
+
+
+/* Full-text search index of files, used for searches from the JSON API and
+ * MPD. This is an external content table, so the text is only stored in the
+ * files table, and the triggers below keep the index in sync with it. Since
+ * SQLite may be built without FTS5 the table and the triggers are not part of
+ * the schema, see db_init_fts().
+ */
+#define T_FILES_FTS									\
+  "CREATE VIRTUAL TABLE IF NOT EXISTS files_fts USING fts5("				\
+  "   title, artist, album, album_artist, composer, genre, path,"			\
+  "   content = 'files', content_rowid = 'id',"						\
+  "   tokenize = 'unicode61 remove_diacritics 1', prefix = '2 3'"			\
+  ");"
+
+#define FTS_COLS									\
+  "title, artist, album, album_artist, composer, genre, path"
+
+#define FTS_VALUES(x)									\
+  x ".title, " x ".artist, " x ".album, " x ".album_artist, " x ".composer, " x ".genre, " x ".path"
+
+#define TRG_FTS_INSERT									\
+  "CREATE TRIGGER IF NOT EXISTS trg_fts_insert AFTER INSERT ON files FOR EACH ROW"	\
+  " BEGIN"										\
+  "   INSERT INTO files_fts (rowid, " FTS_COLS ") VALUES (NEW.id, " FTS_VALUES("NEW") ");"	\
+  " END;"
+
+#define TRG_FTS_DELETE									\
+  "CREATE TRIGGER IF NOT EXISTS trg_fts_delete AFTER DELETE ON files FOR EACH ROW"	\
+  " BEGIN"										\
+  "   INSERT INTO files_fts (files_fts, rowid, " FTS_COLS ") VALUES ('delete', OLD.id, " FTS_VALUES("OLD") ");"	\
+  " END;"
+
+#define TRG_FTS_UPDATE									\
+  "CREATE TRIGGER IF NOT EXISTS trg_fts_update AFTER UPDATE OF " FTS_COLS " ON files FOR EACH ROW"	\
+  "   WHEN OLD.title IS NOT NEW.title OR OLD.artist IS NOT NEW.artist OR OLD.album IS NOT NEW.album"	\
+  "     OR OLD.album_artist IS NOT NEW.album_artist OR OLD.composer IS NOT NEW.composer"		\
+  "     OR OLD.genre IS NOT NEW.genre OR OLD.path IS NOT NEW.path"				\
+  " BEGIN"										\
+  "   INSERT INTO files_fts (files_fts, rowid, " FTS_COLS ") VALUES ('delete', OLD.id, " FTS_VALUES("OLD") ");"	\
+  "   INSERT INTO files_fts (rowid, " FTS_COLS ") VALUES (NEW.id, " FTS_VALUES("NEW") ");"	\
+  " END;"
+
+#define Q_FTS_REBUILD									\
+  "INSERT INTO files_fts (files_fts) VALUES ('rebuild');"
+
+// Without the index the triggers would make every change of files fail
+#define Q_FTS_DROP_TRIGGERS								\
+  "DROP TRIGGER IF EXISTS trg_fts_insert;"						\
+  "DROP TRIGGER IF EXISTS trg_fts_delete;"						\
+  "DROP TRIGGER IF EXISTS trg_fts_update;"
+
+static const struct db_init_query db_init_fts_queries[] =
+  {
+    { T_FILES_FTS,                 "create table files_fts" },
+    { TRG_FTS_INSERT,              "create trigger trg_fts_insert" },
+    { TRG_FTS_DELETE,              "create trigger trg_fts_delete" },
+    { TRG_FTS_UPDATE,              "create trigger trg_fts_update" },
   };
 
 
@@ -480,6 +636,66 @@ db_init_triggers(sqlite3 *hdl)
   return 0;
 }
 
+int
+db_init_fts(sqlite3 *hdl)
+{
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  bool rebuild;
+  int i;
+  int ret;
+
+  // The triggers are dropped by schema upgrades, and the files table may
+  // have been changed without them, so then we rebuild the index
+  ret = sqlite3_prepare_v2(hdl, "SELECT COUNT(*) FROM sqlite_master WHERE type = 'trigger' AND name = 'trg_fts_insert';", -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  rebuild = (sqlite3_step(stmt) != SQLITE_ROW || sqlite3_column_int(stmt, 0) == 0);
+  sqlite3_finalize(stmt);
+
+  for (i = 0; i < (sizeof(db_init_fts_queries) / sizeof(db_init_fts_queries[0])); i++)
+    {
+      DPRINTF(E_DBG, L_DB, "DB init fts query: %s\n", db_init_fts_queries[i].desc);
+
+      ret = sqlite3_exec(hdl, db_init_fts_queries[i].query, NULL, NULL, &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Full-text search not available (SQLite without FTS5?): %s\n", errmsg);
+	  sqlite3_free(errmsg);
+	  goto error;
+	}
+    }
+
+  if (!rebuild)
+    return 0;
+
+  DPRINTF(E_LOG, L_DB, "Building full-text search index, this may take some time...\n");
+
+  ret = sqlite3_exec(hdl, Q_FTS_REBUILD, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not build full-text search index: %s\n", errmsg);
+      sqlite3_free(errmsg);
+      goto error;
+    }
+
+  return 0;
+
+ error:
+  ret = sqlite3_exec(hdl, Q_FTS_DROP_TRIGGERS, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not drop full-text search triggers: %s\n", errmsg);
+      sqlite3_free(errmsg);
+    }
+
+  return -1;
+}
+
 int
 db_init_tables(sqlite3 *hdl)
 {
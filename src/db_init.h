@@ -26,7 +26,7 @@
  * is a major upgrade. In other words minor version upgrades permit downgrading
  * forked-daapd after the database was upgraded. */
 #define SCHEMA_VERSION_MAJOR 21
-#define SCHEMA_VERSION_MINOR 04
+#define SCHEMA_VERSION_MINOR 0x08
 
 int
 db_init_indices(sqlite3 *hdl);
@@ -34,6 +34,9 @@ db_init_indices(sqlite3 *hdl);
 int
 db_init_triggers(sqlite3 *hdl);
 
+int
+db_init_fts(sqlite3 *hdl);
+
 int
 db_init_tables(sqlite3 *hdl);
 
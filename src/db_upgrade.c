@@ -1060,6 +1060,112 @@ static const struct db_upgrade_query db_upgrade_v2104_queries[] =
     { U_v2104_SCVER_MINOR,    "set schema_version_minor to 04" },
   };
 
+#define U_v2105_ALTER_GROUPS_ADD_NAME_SORT \
+  "ALTER TABLE groups ADD COLUMN name_sort VARCHAR(1024) DEFAULT NULL COLLATE DAAP;"
+#define U_v2105_ALTER_GROUPS_ADD_ALBUM_ARTIST \
+  "ALTER TABLE groups ADD COLUMN album_artist VARCHAR(1024) DEFAULT NULL COLLATE DAAP;"
+#define U_v2105_ALTER_GROUPS_ADD_SONGARTISTID \
+  "ALTER TABLE groups ADD COLUMN songartistid INTEGER DEFAULT 0;"
+#define U_v2105_ALTER_GROUPS_ADD_TRACK_COUNT \
+  "ALTER TABLE groups ADD COLUMN track_count INTEGER DEFAULT 0;"
+#define U_v2105_ALTER_GROUPS_ADD_ALBUM_COUNT \
+  "ALTER TABLE groups ADD COLUMN album_count INTEGER DEFAULT 0;"
+#define U_v2105_ALTER_GROUPS_ADD_SONG_LENGTH \
+  "ALTER TABLE groups ADD COLUMN song_length INTEGER DEFAULT 0;"
+#define U_v2105_ALTER_GROUPS_ADD_TIME_ADDED \
+  "ALTER TABLE groups ADD COLUMN time_added INTEGER DEFAULT 0;"
+#define U_v2105_ALTER_GROUPS_ADD_MEDIA_KIND \
+  "ALTER TABLE groups ADD COLUMN media_kind INTEGER DEFAULT 0;"
+#define U_v2105_ALTER_GROUPS_ADD_MEDIA_KIND_COUNT \
+  "ALTER TABLE groups ADD COLUMN media_kind_count INTEGER DEFAULT 0;"
+// From now on the aggregates are maintained by triggers. Groups with mixed
+// media kinds get a media_kind_count of 0, which marks them as mixed.
+#define U_v2105_GROUPS_ALBUMS_AGGREGATE \
+  "INSERT OR REPLACE INTO groups (id, type, name, persistentid, name_sort, album_artist, songartistid," \
+  "   track_count, album_count, song_length, time_added, media_kind, media_kind_count)" \
+  " SELECT g.id, g.type, g.name, g.persistentid, f.album_sort, f.album_artist, f.songartistid," \
+  "   COUNT(f.id), 1, SUM(f.song_length), MAX(f.time_added), MIN(f.media_kind)," \
+  "   CASE WHEN MIN(f.media_kind) = MAX(f.media_kind) THEN COUNT(f.id) ELSE 0 END" \
+  " FROM files f JOIN groups g ON f.songalbumid = g.persistentid AND g.type = 1" \
+  " WHERE f.disabled = 0 GROUP BY f.songalbumid;"
+#define U_v2105_GROUPS_ARTISTS_AGGREGATE \
+  "INSERT OR REPLACE INTO groups (id, type, name, persistentid, name_sort, album_artist, songartistid," \
+  "   track_count, album_count, song_length, time_added, media_kind, media_kind_count)" \
+  " SELECT g.id, g.type, g.name, g.persistentid, f.album_artist_sort, f.album_artist, f.songartistid," \
+  "   COUNT(f.id), COUNT(DISTINCT f.songalbumid), SUM(f.song_length), MAX(f.time_added), MIN(f.media_kind)," \
+  "   CASE WHEN MIN(f.media_kind) = MAX(f.media_kind) THEN COUNT(f.id) ELSE 0 END" \
+  " FROM files f JOIN groups g ON f.songartistid = g.persistentid AND g.type = 2" \
+  " WHERE f.disabled = 0 GROUP BY f.songartistid;"
+#define U_v2105_SCVER_MINOR                    \
+  "UPDATE admin SET value = '05' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2105_queries[] =
+  {
+    { U_v2105_ALTER_GROUPS_ADD_NAME_SORT,        "alter table groups add column name_sort" },
+    { U_v2105_ALTER_GROUPS_ADD_ALBUM_ARTIST,     "alter table groups add column album_artist" },
+    { U_v2105_ALTER_GROUPS_ADD_SONGARTISTID,     "alter table groups add column songartistid" },
+    { U_v2105_ALTER_GROUPS_ADD_TRACK_COUNT,      "alter table groups add column track_count" },
+    { U_v2105_ALTER_GROUPS_ADD_ALBUM_COUNT,      "alter table groups add column album_count" },
+    { U_v2105_ALTER_GROUPS_ADD_SONG_LENGTH,      "alter table groups add column song_length" },
+    { U_v2105_ALTER_GROUPS_ADD_TIME_ADDED,       "alter table groups add column time_added" },
+    { U_v2105_ALTER_GROUPS_ADD_MEDIA_KIND,       "alter table groups add column media_kind" },
+    { U_v2105_ALTER_GROUPS_ADD_MEDIA_KIND_COUNT, "alter table groups add column media_kind_count" },
+    { U_v2105_GROUPS_ALBUMS_AGGREGATE,           "aggregate files in album groups" },
+    { U_v2105_GROUPS_ARTISTS_AGGREGATE,          "aggregate files in artist groups" },
+
+    { U_v2105_SCVER_MINOR,    "set schema_version_minor to 05" },
+  };
+
+#define U_v2106_ALTER_FILES_ADD_TITLE_SORT_KEY \
+  "ALTER TABLE files ADD COLUMN title_sort_key BLOB DEFAULT NULL;"
+#define U_v2106_ALTER_FILES_ADD_ARTIST_SORT_KEY \
+  "ALTER TABLE files ADD COLUMN artist_sort_key BLOB DEFAULT NULL;"
+#define U_v2106_ALTER_FILES_ADD_ALBUM_SORT_KEY \
+  "ALTER TABLE files ADD COLUMN album_sort_key BLOB DEFAULT NULL;"
+#define U_v2106_ALTER_FILES_ADD_ALBUM_ARTIST_SORT_KEY \
+  "ALTER TABLE files ADD COLUMN album_artist_sort_key BLOB DEFAULT NULL;"
+#define U_v2106_ALTER_FILES_ADD_COMPOSER_SORT_KEY \
+  "ALTER TABLE files ADD COLUMN composer_sort_key BLOB DEFAULT NULL;"
+#define U_v2106_FILES_SORT_KEYS \
+  "UPDATE files SET title_sort_key = daap_sortkey(title_sort), artist_sort_key = daap_sortkey(artist_sort)," \
+  "  album_sort_key = daap_sortkey(album_sort), album_artist_sort_key = daap_sortkey(album_artist_sort)," \
+  "  composer_sort_key = daap_sortkey(composer_sort);"
+#define U_v2106_SCVER_MINOR                    \
+  "UPDATE admin SET value = '06' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2106_queries[] =
+  {
+    { U_v2106_ALTER_FILES_ADD_TITLE_SORT_KEY,        "alter table files add column title_sort_key" },
+    { U_v2106_ALTER_FILES_ADD_ARTIST_SORT_KEY,       "alter table files add column artist_sort_key" },
+    { U_v2106_ALTER_FILES_ADD_ALBUM_SORT_KEY,        "alter table files add column album_sort_key" },
+    { U_v2106_ALTER_FILES_ADD_ALBUM_ARTIST_SORT_KEY, "alter table files add column album_artist_sort_key" },
+    { U_v2106_ALTER_FILES_ADD_COMPOSER_SORT_KEY,     "alter table files add column composer_sort_key" },
+    { U_v2106_FILES_SORT_KEYS,                       "set sort keys of files" },
+
+    { U_v2106_SCVER_MINOR,    "set schema_version_minor to 06" },
+  };
+
+#define U_v2107_ALTER_DIRECTORIES_ADD_MTIME \
+  "ALTER TABLE directories ADD COLUMN mtime INTEGER DEFAULT 0;"
+#define U_v2107_SCVER_MINOR                    \
+  "UPDATE admin SET value = '07' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2107_queries[] =
+  {
+    { U_v2107_ALTER_DIRECTORIES_ADD_MTIME, "alter table directories add column mtime" },
+
+    { U_v2107_SCVER_MINOR,    "set schema_version_minor to 07" },
+  };
+
+// The groups triggers are recreated after the upgrade
+#define U_v2108_SCVER_MINOR                    \
+  "UPDATE admin SET value = '08' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2108_queries[] =
+  {
+    { U_v2108_SCVER_MINOR,    "set schema_version_minor to 08" },
+  };
+
 
 int
 db_upgrade(sqlite3 *hdl, int db_ver)
@@ -1233,6 +1339,34 @@ db_upgrade(sqlite3 *hdl, int db_ver)
 
     case 2103:
       ret = db_generic_upgrade(hdl, db_upgrade_v2104_queries, ARRAY_SIZE(db_upgrade_v2104_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2104:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2105_queries, ARRAY_SIZE(db_upgrade_v2105_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2105:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2106_queries, ARRAY_SIZE(db_upgrade_v2106_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2106:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2107_queries, ARRAY_SIZE(db_upgrade_v2107_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2107:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2108_queries, ARRAY_SIZE(db_upgrade_v2108_queries));
       if (ret < 0)
 	return -1;
       break;
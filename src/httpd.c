@@ -65,6 +65,7 @@
 #include "httpd_oauth.h"
 #include "httpd_artworkapi.h"
 #include "transcode.h"
+#include "cache.h"
 #ifdef LASTFM
 # include "lastfm.h"
 #endif
@@ -74,6 +75,9 @@
 
 
 #define STREAM_CHUNK_SIZE (64 * 1024)
+// Untranscoded files are sent from file segments, so the data isn't copied and
+// we can take bigger chunks
+#define STREAM_FILE_CHUNK_SIZE (1024 * 1024)
 #define ERR_PAGE "<html>\n<head>\n" \
   "<title>%d %s</title>\n" \
   "</head>\n<body>\n" \
@@ -84,6 +88,8 @@
 #define HTTPD_STREAM_BPS         16
 #define HTTPD_STREAM_CHANNELS    2
 
+#define HTTPD_THREADS_MAX 32
+
 
 struct content_type_map {
   char *ext;
@@ -104,6 +110,15 @@ struct stream_ctx {
   off_t end_offset;
   int marked;
   struct transcode_ctx *xcode;
+  // Copy of the transcoded output that goes into the transcode cache
+  struct cache_xcode_file *cache_file;
+};
+
+struct httpd_reply_stream {
+  struct evhttp_request *req;
+  // Deflated output, only used if gzipping
+  struct evbuffer *gzbuf;
+  z_stream *strm;
 };
 
 static const struct content_type_map ext2ctype[] =
@@ -119,6 +134,17 @@ static const struct content_type_map ext2ctype[] =
     { NULL, NULL }
   };
 
+/* Additional request threads. Each has its own event base, evhttp and DB
+ * connection, and accepts connections from the listening sockets of the main
+ * httpd thread, so that a slow request doesn't hold up every other client.
+ */
+struct httpd_thread
+{
+  pthread_t tid;
+  struct event_base *evbase;
+  struct evhttp *evhttp;
+};
+
 static const char *http_reply_401 = "<html><head><title>401 Unauthorized</title></head><body>Authorization required</body></html>";
 
 static const char *webroot_directory;
@@ -134,6 +160,9 @@ static struct event *exitev;
 static struct evhttp *evhttpd;
 static pthread_t tid_httpd;
 
+static struct httpd_thread *httpd_threads;
+static int httpd_threads_count;
+
 static const char *allow_origin;
 static int httpd_port;
 
@@ -552,6 +581,10 @@ stream_end(struct stream_ctx *st, int failed)
       close(st->fd);
     }
 
+  // Only complete transcodings are added to the cache
+  if (st->cache_file)
+    cache_xcode_file_abort(st->cache_file);
+
 #ifdef HAVE_LIBEVENT2_OLD
   if (g_st == st)
     g_st = NULL;
@@ -621,12 +654,23 @@ stream_chunk_xcode_cb(int fd, short event, void *arg)
       else
 	DPRINTF(E_LOG, L_HTTPD, "Transcoding error, file id %d\n", st->id);
 
+      if (xcoded == 0 && st->cache_file)
+	{
+	  cache_xcode_file_commit(st->cache_file);
+	  st->cache_file = NULL;
+	}
+
       stream_end(st, 0);
       return;
     }
 
   DPRINTF(E_DBG, L_HTTPD, "Got %d bytes from transcode; streaming file id %d\n", xcoded, st->id);
 
+  // The transcoding always starts from the beginning of the file, also with a
+  // range request, so everything we get goes to the cache
+  if (st->cache_file && cache_xcode_file_write(st->cache_file, st->evbuf) < 0)
+    st->cache_file = NULL;
+
   /* Consume transcoded data until we meet start_offset */
   if (st->start_offset > st->offset)
     {
@@ -684,6 +728,11 @@ static void
 stream_chunk_raw_cb(int fd, short event, void *arg)
 {
   struct stream_ctx *st;
+#ifndef HAVE_LIBEVENT2_OLD
+  struct evbuffer_file_segment *seg;
+  off_t end;
+  int segfd;
+#endif
   size_t chunk_size;
   int ret;
 
@@ -695,10 +744,51 @@ stream_chunk_raw_cb(int fd, short event, void *arg)
       return;
     }
 
+#ifndef HAVE_LIBEVENT2_OLD
+  /* st->evbuf is flagged as draining to the socket, so libevent will move the
+   * segment to the connection's output and give it to sendfile(). If it can't
+   * use sendfile() it maps or reads the segment, which is why there is one
+   * segment per chunk and not one for the whole file. The segment has its own
+   * fd, since it may still be in the output when st->fd is closed.
+   */
+  end = st->end_offset ? st->end_offset + 1 : st->size;
+  if (st->offset >= end)
+    {
+      DPRINTF(E_INFO, L_HTTPD, "Done streaming file id %d\n", st->id);
+
+      stream_end(st, 0);
+      return;
+    }
+
+  chunk_size = (end - st->offset < STREAM_FILE_CHUNK_SIZE) ? end - st->offset : STREAM_FILE_CHUNK_SIZE;
+
+  seg = NULL;
+  segfd = fcntl(st->fd, F_DUPFD_CLOEXEC, 0);
+  if (segfd >= 0)
+    {
+      seg = evbuffer_file_segment_new(segfd, st->offset, chunk_size, EVBUF_FS_CLOSE_ON_FREE);
+      if (!seg)
+	close(segfd);
+    }
+
+  // The evbuf keeps a reference to the segment
+  ret = seg ? evbuffer_add_file_segment(st->evbuf, seg, 0, chunk_size) : -1;
+  if (seg)
+    evbuffer_file_segment_free(seg);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Streaming error, file id %d\n", st->id);
+
+      stream_end(st, 0);
+      return;
+    }
+
+  ret = chunk_size;
+#else
   if (st->end_offset && ((st->offset + STREAM_CHUNK_SIZE) > (st->end_offset + 1)))
     chunk_size = st->end_offset + 1 - st->offset;
   else
-    chunk_size = STREAM_CHUNK_SIZE;  
+    chunk_size = STREAM_CHUNK_SIZE;
 
   ret = read(st->fd, st->buf, chunk_size);
   if (ret <= 0)
@@ -712,9 +802,10 @@ stream_chunk_raw_cb(int fd, short event, void *arg)
       return;
     }
 
-  DPRINTF(E_DBG, L_HTTPD, "Read %d bytes; streaming file id %d\n", ret, st->id);
-
   evbuffer_add(st->evbuf, st->buf, ret);
+#endif
+
+  DPRINTF(E_DBG, L_HTTPD, "Read %d bytes; streaming file id %d\n", ret, st->id);
 
 #ifdef HAVE_LIBEVENT2_OLD
   evhttp_send_reply_chunk(st->req, st->evbuf);
@@ -774,6 +865,30 @@ httpd(void *arg)
   pthread_exit(NULL);
 }
 
+static void *
+httpd_thread(void *arg)
+{
+  struct httpd_thread *thread = arg;
+  int ret;
+
+  ret = db_perthread_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Error: DB init failed (request thread)\n");
+
+      pthread_exit(NULL);
+    }
+
+  event_base_dispatch(thread->evbase);
+
+  if (!httpd_exit)
+    DPRINTF(E_FATAL, L_HTTPD, "HTTPd request thread event loop terminated ahead of time!\n");
+
+  db_perthread_deinit();
+
+  pthread_exit(NULL);
+}
+
 static void
 exit_cb(int fd, short event, void *arg)
 {
@@ -1030,6 +1145,18 @@ httpd_request_parse(struct evhttp_request *req, struct httpd_uri_parsed *uri_par
   return NULL;
 }
 
+struct event_base *
+httpd_request_evbase(struct evhttp_request *req)
+{
+  struct evhttp_connection *evcon;
+
+  evcon = evhttp_request_get_connection(req);
+  if (!evcon)
+    return evbase_httpd;
+
+  return evhttp_connection_get_base(evcon);
+}
+
 /* Thread: httpd */
 void
 httpd_stream_file(struct evhttp_request *req, int id)
@@ -1050,8 +1177,11 @@ httpd_stream_file(struct evhttp_request *req, int id)
   char buf[64];
   int64_t offset;
   int64_t end_offset;
+#ifdef HAVE_LIBEVENT2_OLD
   off_t pos;
+#endif
   int transcode;
+  int xcode_cached;
   int ret;
 
   offset = 0;
@@ -1128,6 +1258,20 @@ httpd_stream_file(struct evhttp_request *req, int id)
 
   output_headers = evhttp_request_get_output_headers(req);
 
+  // If we have transcoded the file before, the result is served like a raw
+  // file, so the client also gets a Content-Length and cheap range requests
+  xcode_cached = 0;
+  if (transcode)
+    {
+      st->fd = cache_xcode_open(mfi->id, mfi->time_modified, XCODE_PCM16_HEADER, &st->size);
+      if (st->fd >= 0)
+	{
+	  DPRINTF(E_INFO, L_HTTPD, "Transcoding of %s is cached\n", mfi->path);
+	  xcode_cached = 1;
+	  transcode = 0;
+	}
+    }
+
   if (transcode)
     {
       DPRINTF(E_INFO, L_HTTPD, "Preparing to transcode %s\n", mfi->path);
@@ -1144,6 +1288,8 @@ httpd_stream_file(struct evhttp_request *req, int id)
 	  goto out_free_st;
 	}
 
+      st->cache_file = cache_xcode_file_new(mfi->id, mfi->time_modified, XCODE_PCM16_HEADER);
+
       if (!evhttp_find_header(output_headers, "Content-Type"))
 	evhttp_add_header(output_headers, "Content-Type", "audio/wav");
     }
@@ -1152,38 +1298,68 @@ httpd_stream_file(struct evhttp_request *req, int id)
       /* Stream the raw file */
       DPRINTF(E_INFO, L_HTTPD, "Preparing to stream %s\n", mfi->path);
 
-      st->buf = (uint8_t *)malloc(STREAM_CHUNK_SIZE);
-      if (!st->buf)
+      stream_cb = stream_chunk_raw_cb;
+
+      if (!xcode_cached)
 	{
-	  DPRINTF(E_LOG, L_HTTPD, "Out of memory for raw streaming buffer\n");
+	  st->fd = open(mfi->path, O_RDONLY);
+	  if (st->fd < 0)
+	    {
+	      DPRINTF(E_LOG, L_HTTPD, "Could not open %s: %s\n", mfi->path, strerror(errno));
 
-	  evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
+	      evhttp_send_error(req, HTTP_NOTFOUND, "Not Found");
 
-	  goto out_free_st;
+	      goto out_cleanup;
+	    }
+
+	  ret = stat(mfi->path, &sb);
+	  if (ret < 0)
+	    {
+	      DPRINTF(E_LOG, L_HTTPD, "Could not stat() %s: %s\n", mfi->path, strerror(errno));
+
+	      evhttp_send_error(req, HTTP_NOTFOUND, "Not Found");
+
+	      goto out_cleanup;
+	    }
+	  st->size = sb.st_size;
 	}
 
-      stream_cb = stream_chunk_raw_cb;
+      /* A suffix range (bytes=-500) means the last bytes of the file */
+      if (offset < 0)
+	{
+	  offset = (st->size + offset > 0) ? st->size + offset : 0;
+	  end_offset = 0;
+	}
 
-      st->fd = open(mfi->path, O_RDONLY);
-      if (st->fd < 0)
+      if (offset > 0 && offset >= st->size)
 	{
-	  DPRINTF(E_LOG, L_HTTPD, "Could not open %s: %s\n", mfi->path, strerror(errno));
+	  DPRINTF(E_LOG, L_HTTPD, "Range start %" PRIi64 " is beyond the end of %s\n", offset, mfi->path);
+
+	  ret = snprintf(buf, sizeof(buf), "bytes */%" PRIi64, (int64_t)st->size);
+	  if ((ret > 0) && (ret < sizeof(buf)))
+	    evhttp_add_header(output_headers, "Content-Range", buf);
 
-	  evhttp_send_error(req, HTTP_NOTFOUND, "Not Found");
+	  evhttp_send_error(req, 416, "Requested Range Not Satisfiable");
 
 	  goto out_cleanup;
 	}
 
-      ret = stat(mfi->path, &sb);
-      if (ret < 0)
+      if (end_offset >= st->size)
+	end_offset = st->size - 1;
+
+      /* Unless libevent is too old the file is sent in file segments, so the
+       * data doesn't pass through our buffers, see stream_chunk_raw_cb()
+       */
+#ifdef HAVE_LIBEVENT2_OLD
+      st->buf = (uint8_t *)malloc(STREAM_CHUNK_SIZE);
+      if (!st->buf)
 	{
-	  DPRINTF(E_LOG, L_HTTPD, "Could not stat() %s: %s\n", mfi->path, strerror(errno));
+	  DPRINTF(E_LOG, L_HTTPD, "Out of memory for raw streaming buffer\n");
 
-	  evhttp_send_error(req, HTTP_NOTFOUND, "Not Found");
+	  evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
 
 	  goto out_cleanup;
 	}
-      st->size = sb.st_size;
 
       pos = lseek(st->fd, offset, SEEK_SET);
       if (pos == (off_t) -1)
@@ -1194,6 +1370,8 @@ httpd_stream_file(struct evhttp_request *req, int id)
 
 	  goto out_cleanup;
 	}
+#endif
+
       st->offset = offset;
       st->end_offset = end_offset;
 
@@ -1201,7 +1379,12 @@ httpd_stream_file(struct evhttp_request *req, int id)
        * and overrides whatever may have been set previously, like
        * application/x-dmap-tagged when we're speaking DAAP.
        */
-      if (mfi->has_video)
+      if (xcode_cached)
+	{
+	  if (!evhttp_find_header(output_headers, "Content-Type"))
+	    evhttp_add_header(output_headers, "Content-Type", "audio/wav");
+	}
+      else if (mfi->has_video)
 	{
 	  /* Front Row and others expect video/<type> */
 	  ret = snprintf(buf, sizeof(buf), "video/%s", mfi->type);
@@ -1238,6 +1421,13 @@ httpd_stream_file(struct evhttp_request *req, int id)
       goto out_cleanup;
     }
 
+#ifndef HAVE_LIBEVENT2_OLD
+  // Without the flag libevent would map or read file segments when they are
+  // added, instead of leaving them for sendfile()
+  if (stream_cb == stream_chunk_raw_cb)
+    evbuffer_set_flags(st->evbuf, EVBUFFER_FLAG_DRAINS_TO_FD);
+#endif
+
   ret = evbuffer_expand(st->evbuf, STREAM_CHUNK_SIZE);
   if (ret != 0)
     {
@@ -1249,7 +1439,7 @@ httpd_stream_file(struct evhttp_request *req, int id)
       goto out_cleanup;
     }
 
-  st->ev = event_new(evbase_httpd, -1, EV_TIMEOUT, stream_cb, st);
+  st->ev = event_new(httpd_request_evbase(req), -1, EV_TIMEOUT, stream_cb, st);
   evutil_timerclear(&tv);
   if (!st->ev || (event_add(st->ev, &tv) < 0))
     {
@@ -1288,12 +1478,12 @@ httpd_stream_file(struct evhttp_request *req, int id)
       if (offset > 0)
 	st->stream_size -= offset;
       if (end_offset > 0)
-	st->stream_size -= (st->size - end_offset);
+	st->stream_size -= (st->size - end_offset - 1);
 
       DPRINTF(E_DBG, L_HTTPD, "Stream request with range %" PRIi64 "-%" PRIi64 "\n", offset, end_offset);
 
       ret = snprintf(buf, sizeof(buf), "bytes %" PRIi64 "-%" PRIi64 "/%" PRIi64,
-		     offset, (end_offset) ? end_offset : (int64_t)st->size, (int64_t)st->size);
+		     offset, (end_offset) ? end_offset : (int64_t)st->size - 1, (int64_t)st->size);
       if ((ret < 0) || (ret >= sizeof(buf)))
 	DPRINTF(E_LOG, L_HTTPD, "Content-Range too large for buffer, dropping\n");
       else
@@ -1331,6 +1521,8 @@ httpd_stream_file(struct evhttp_request *req, int id)
  out_cleanup:
   if (st->evbuf)
     evbuffer_free(st->evbuf);
+  if (st->cache_file)
+    cache_xcode_file_abort(st->cache_file);
   if (st->xcode)
     transcode_cleanup(&st->xcode);
   if (st->buf)
@@ -1447,6 +1639,171 @@ httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struc
     }
 }
 
+/* Runs data from in through the gzip stream and adds the output to the out
+ * evbuffer. With Z_SYNC_FLUSH all the pending output is flushed, so out will
+ * never be empty when this returns successfully.
+ */
+static int
+reply_stream_deflate(z_stream *strm, struct evbuffer *out, struct evbuffer *in, int flush)
+{
+  struct evbuffer_iovec iovec[1];
+  int ret;
+
+  strm->next_in = in ? evbuffer_pullup(in, -1) : NULL;
+  strm->avail_in = in ? evbuffer_get_length(in) : 0;
+
+  do
+    {
+      ret = evbuffer_reserve_space(out, deflateBound(strm, strm->avail_in) + 64, iovec, 1);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not reserve memory for gzipped reply chunk\n");
+	  return -1;
+	}
+
+      strm->next_out = iovec[0].iov_base;
+      strm->avail_out = iovec[0].iov_len;
+
+      ret = deflate(strm, flush);
+      if ((ret != Z_OK) && (ret != Z_STREAM_END) && (ret != Z_BUF_ERROR))
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Deflating reply chunk failed: %s\n", zError(ret));
+	  return -1;
+	}
+
+      iovec[0].iov_len -= strm->avail_out;
+      evbuffer_commit_space(out, iovec, 1);
+    }
+  while (strm->avail_out == 0);
+
+  if (in)
+    evbuffer_drain(in, evbuffer_get_length(in));
+
+  return 0;
+}
+
+struct httpd_reply_stream *
+httpd_send_reply_start(struct evhttp_request *req, int code, const char *reason, enum httpd_send_flags flags)
+{
+  struct httpd_reply_stream *rs;
+  struct evkeyvalq *input_headers;
+  struct evkeyvalq *output_headers;
+  const char *param;
+  int do_gzip;
+  int ret;
+
+  if (!req)
+    return NULL;
+
+  input_headers = evhttp_request_get_input_headers(req);
+  output_headers = evhttp_request_get_output_headers(req);
+
+  do_gzip = ( (!(flags & HTTPD_SEND_NO_GZIP)) &&
+              (param = evhttp_find_header(input_headers, "Accept-Encoding")) &&
+              (strstr(param, "gzip") || strstr(param, "*"))
+            );
+
+  CHECK_NULL(L_HTTPD, rs = calloc(1, sizeof(struct httpd_reply_stream)));
+
+  rs->req = req;
+
+  if (do_gzip)
+    {
+      CHECK_NULL(L_HTTPD, rs->strm = calloc(1, sizeof(z_stream)));
+      CHECK_NULL(L_HTTPD, rs->gzbuf = evbuffer_new());
+
+      // Set up a gzip stream (the "+ 16" in 15 + 16), instead of a zlib stream (default)
+      ret = deflateInit2(rs->strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+      if (ret != Z_OK)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "zlib setup failed: %s\n", zError(ret));
+
+	  evbuffer_free(rs->gzbuf);
+	  free(rs->strm);
+	  free(rs);
+	  return NULL;
+	}
+
+      DPRINTF(E_DBG, L_HTTPD, "Gzipping chunked response\n");
+
+      evhttp_add_header(output_headers, "Content-Encoding", "gzip");
+    }
+
+  if (allow_origin)
+    evhttp_add_header(output_headers, "Access-Control-Allow-Origin", allow_origin);
+
+  evhttp_send_reply_start(req, code, reason);
+
+  return rs;
+}
+
+int
+httpd_send_reply_chunk(struct httpd_reply_stream *rs, struct evbuffer *evbuf, void (*cb)(struct evhttp_connection *, void *), void *arg)
+{
+  struct evbuffer *chunk;
+  int ret;
+
+  if (rs->strm)
+    {
+      ret = reply_stream_deflate(rs->strm, rs->gzbuf, evbuf, Z_SYNC_FLUSH);
+      if (ret < 0)
+	return -1;
+
+      chunk = rs->gzbuf;
+    }
+  else
+    chunk = evbuf;
+
+#ifdef HAVE_LIBEVENT2_OLD
+  // No write callback in libevent 2.0, and calling cb right away would just
+  // make the caller produce all its data without waiting for the client
+  if (cb)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Bug! Chunk callback is not supported with libevent < 2.1.4\n");
+      return -1;
+    }
+
+  evhttp_send_reply_chunk(rs->req, chunk);
+#else
+  evhttp_send_reply_chunk_with_cb(rs->req, chunk, cb, arg);
+#endif
+
+  return 0;
+}
+
+void
+httpd_send_reply_end(struct httpd_reply_stream *rs)
+{
+  int ret;
+
+  if (rs->strm)
+    {
+      ret = reply_stream_deflate(rs->strm, rs->gzbuf, NULL, Z_FINISH);
+      if (ret == 0)
+	evhttp_send_reply_chunk(rs->req, rs->gzbuf);
+    }
+
+  evhttp_send_reply_end(rs->req);
+
+  httpd_reply_stream_free(rs);
+}
+
+void
+httpd_reply_stream_free(struct httpd_reply_stream *rs)
+{
+  if (!rs)
+    return;
+
+  if (rs->strm)
+    {
+      deflateEnd(rs->strm);
+      free(rs->strm);
+      evbuffer_free(rs->gzbuf);
+    }
+
+  free(rs);
+}
+
 // This is a modified version of evhttp_send_error (credit libevent)
 void
 httpd_send_error(struct evhttp_request* req, int error, const char* reason)
@@ -1625,12 +1982,158 @@ httpd_basic_auth(struct evhttp_request *req, const char *user, const char *passw
   return -1;
 }
 
+/* Thread: httpd (request thread) */
+static void
+httpd_thread_exit_cb(int fd, short event, void *arg)
+{
+  struct httpd_thread *thread = arg;
+
+  event_base_loopbreak(thread->evbase);
+}
+
+/* Thread: main */
+static void
+httpd_thread_accept_cb(struct evhttp_bound_socket *bound, void *arg)
+{
+  struct httpd_thread *thread = arg;
+  evutil_socket_t fd;
+
+  // The thread's evhttp takes ownership of the socket and closes it when it is
+  // freed, so it gets its own copy of the main evhttp's listening socket
+  fd = fcntl(evhttp_bound_socket_get_fd(bound), F_DUPFD_CLOEXEC, 0);
+  if (fd < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not duplicate listening socket for request thread: %s\n", strerror(errno));
+      return;
+    }
+
+  if (!evhttp_accept_socket_with_handle(thread->evhttp, fd))
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not accept connections on socket %d in request thread\n", (int)fd);
+      close(fd);
+    }
+}
+
+static void
+httpd_thread_free(struct httpd_thread *thread)
+{
+  if (thread->evhttp)
+    evhttp_free(thread->evhttp);
+  if (thread->evbase)
+    event_base_free(thread->evbase);
+}
+
+static void
+httpd_threads_free(void)
+{
+  int i;
+
+  for (i = 0; i < httpd_threads_count; i++)
+    httpd_thread_free(&httpd_threads[i]);
+
+  free(httpd_threads);
+  httpd_threads = NULL;
+  httpd_threads_count = 0;
+}
+
+static void
+httpd_threads_stop(void)
+{
+  int ret;
+  int i;
+
+  for (i = 0; i < httpd_threads_count; i++)
+    {
+      // We use a one-shot event instead of event_base_loopbreak(), since the
+      // latter is lost if the thread has not entered its loop yet
+      ret = event_base_once(httpd_threads[i].evbase, -1, EV_TIMEOUT, httpd_thread_exit_cb, &httpd_threads[i], NULL);
+      if (ret < 0)
+	{
+	  DPRINTF(E_FATAL, L_HTTPD, "Could not send exit event to request thread %d\n", i + 1);
+	  continue;
+	}
+
+      ret = pthread_join(httpd_threads[i].tid, NULL);
+      if (ret != 0)
+	DPRINTF(E_FATAL, L_HTTPD, "Could not join request thread %d: %s\n", i + 1, strerror(ret));
+    }
+}
+
+/* Thread: main */
+static int
+httpd_threads_start(int count)
+{
+  struct httpd_thread *thread;
+  char name[16];
+  int ret;
+
+  if (count <= 0)
+    return 0;
+
+#ifdef HAVE_LIBEVENT2_OLD
+  DPRINTF(E_LOG, L_HTTPD, "Multiple httpd threads not supported with this version of libevent\n");
+  return 0;
+#endif
+
+  CHECK_NULL(L_HTTPD, httpd_threads = calloc(count, sizeof(struct httpd_thread)));
+
+  for (httpd_threads_count = 0; httpd_threads_count < count; httpd_threads_count++)
+    {
+      thread = &httpd_threads[httpd_threads_count];
+
+      thread->evbase = event_base_new();
+      if (!thread->evbase)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not create an event base for request thread\n");
+	  goto error;
+	}
+
+      thread->evhttp = evhttp_new(thread->evbase);
+      if (!thread->evhttp)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not create HTTP server for request thread\n");
+	  goto error;
+	}
+
+      if (allow_origin)
+	evhttp_set_allowed_methods(thread->evhttp, EVHTTP_REQ_GET | EVHTTP_REQ_POST | EVHTTP_REQ_PUT | EVHTTP_REQ_DELETE | EVHTTP_REQ_HEAD | EVHTTP_REQ_OPTIONS);
+
+      evhttp_foreach_bound_socket(evhttpd, httpd_thread_accept_cb, thread);
+      evhttp_set_gencb(thread->evhttp, httpd_gen_cb, NULL);
+
+      ret = pthread_create(&thread->tid, NULL, httpd_thread, thread);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not spawn HTTPd request thread: %s\n", strerror(ret));
+	  goto error;
+	}
+
+      snprintf(name, sizeof(name), "httpd%d", httpd_threads_count + 1);
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+      pthread_setname_np(thread->tid, name);
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+      pthread_set_name_np(thread->tid, name);
+#endif
+    }
+
+  DPRINTF(E_INFO, L_HTTPD, "Started %d additional httpd request threads\n", httpd_threads_count);
+
+  return 0;
+
+ error:
+  httpd_thread_free(thread);
+  httpd_threads_stop();
+  httpd_threads_free();
+  return -1;
+}
+
 /* Thread: main */
 int
 httpd_init(const char *webroot)
 {
   struct stat sb;
   int v6enabled;
+  int nthreads;
   int ret;
 
   httpd_exit = 0;
@@ -1800,6 +2303,22 @@ httpd_init(const char *webroot)
 
   evhttp_set_gencb(evhttpd, httpd_gen_cb, NULL);
 
+  // The main httpd thread counts as one of the configured threads
+  nthreads = cfg_getint(cfg_getsec(cfg, "general"), "httpd_threads");
+  if (nthreads < 1 || nthreads > HTTPD_THREADS_MAX)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Invalid httpd_threads (%d), must be between 1 and %d, using 1\n", nthreads, HTTPD_THREADS_MAX);
+      nthreads = 1;
+    }
+
+  ret = httpd_threads_start(nthreads - 1);
+  if (ret < 0)
+    {
+      DPRINTF(E_FATAL, L_HTTPD, "Could not start httpd request threads\n");
+
+      goto threads_fail;
+    }
+
   ret = pthread_create(&tid_httpd, NULL, httpd, NULL);
   if (ret != 0)
     {
@@ -1817,6 +2336,9 @@ httpd_init(const char *webroot)
   return 0;
 
  thread_fail:
+  httpd_threads_stop();
+  httpd_threads_free();
+ threads_fail:
  bind_fail:
   evhttp_free(evhttpd);
  evhttpd_fail:
@@ -1885,6 +2407,10 @@ httpd_deinit(void)
       return;
     }
 
+  // Modules may still hold requests belonging to the request threads, so we
+  // stop the threads first and free their evhttp after the modules' deinit
+  httpd_threads_stop();
+
   streaming_deinit();
 #ifdef HAVE_LIBWEBSOCKETS
   websocket_deinit();
@@ -1902,6 +2428,7 @@ httpd_deinit(void)
   close(exit_pipe[1]);
 #endif
   event_free(exitev);
+  httpd_threads_free();
   evhttp_free(evhttpd);
   event_base_free(evbase_httpd);
 }
@@ -14,6 +14,8 @@ enum httpd_send_flags
   HTTPD_SEND_NO_GZIP =   (1 << 0),
 };
 
+struct httpd_reply_stream;
+
 /*
  * Contains a parsed version of the URI httpd got. The URI may have been
  * complete:
@@ -98,6 +100,14 @@ httpd_uri_parse(const char *uri);
 struct httpd_request *
 httpd_request_parse(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed, const char *user_agent, struct httpd_uri_map *uri_map);
 
+/*
+ * Returns the event base of the httpd thread that serves the request. Events
+ * that reply to the request must be created on this base, since the request
+ * may belong to another thread than the main httpd thread.
+ */
+struct event_base *
+httpd_request_evbase(struct evhttp_request *req);
+
 void
 httpd_stream_file(struct evhttp_request *req, int id);
 
@@ -132,6 +142,43 @@ httpd_gzip_deflate(struct evbuffer *in);
 void
 httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struct evbuffer *evbuf, enum httpd_send_flags flags);
 
+/*
+ * Starts a chunked reply, which will be gzipped if the client accepts it and
+ * the caller doesn't set HTTPD_SEND_NO_GZIP. The body is sent with
+ * httpd_send_reply_chunk() and the reply is finished and freed with
+ * httpd_send_reply_end(). If the connection fails before that, the caller
+ * must free it with httpd_reply_stream_free().
+ *
+ * @in  req      The evhttp request struct
+ * @in  code     HTTP code, e.g. 200
+ * @in  reason   See httpd_send_reply()
+ * @in  flags    See flags above
+ * @return       Reply stream, or NULL on error (nothing has been sent then)
+ */
+struct httpd_reply_stream *
+httpd_send_reply_start(struct evhttp_request *req, int code, const char *reason, enum httpd_send_flags flags);
+
+/*
+ * Sends the content of evbuf as a chunk of the reply, which drains evbuf. The
+ * callback is invoked when the chunk has been written to the connection, so
+ * the caller can use it to produce the next chunk. Not supported with
+ * libevent < 2.1.4 (HAVE_LIBEVENT2_OLD), where cb must be NULL.
+ *
+ * @in  rs       The reply stream
+ * @in  evbuf    Data for the chunk, must not be empty
+ * @in  cb       Callback, see evhttp_send_reply_chunk_with_cb()
+ * @in  arg      Argument for the callback
+ * @return       0 on success, -1 on error
+ */
+int
+httpd_send_reply_chunk(struct httpd_reply_stream *rs, struct evbuffer *evbuf, void (*cb)(struct evhttp_connection *, void *), void *arg);
+
+void
+httpd_send_reply_end(struct httpd_reply_stream *rs);
+
+void
+httpd_reply_stream_free(struct httpd_reply_stream *rs);
+
 /*
  * This is a substitute for evhttp_send_error that should be used whenever an
  * error may be returned to a browser. It will set CORS headers as appropriate,
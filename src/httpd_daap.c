@@ -40,9 +40,11 @@
 
 #include <uninorm.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <event2/event.h>
 #include <event2/bufferevent.h>
+#include <zlib.h>
 
 #include "httpd_daap.h"
 #include "logger.h"
@@ -55,10 +57,6 @@
 #include "dmap_common.h"
 #include "cache.h"
 
-
-/* httpd event base, from httpd.c */
-extern struct event_base *evbase_httpd;
-
 /* Max number of sessions and session timeout
  * Many clients (including iTunes) don't seem to respect the timeout capability
  * that we announce, and just keep using the same session. Therefore we take a
@@ -76,9 +74,17 @@ extern struct event_base *evbase_httpd;
 /* Database number for the Radio item */
 #define DAAP_DB_RADIO 2
 
+/* Song lists that grow larger than this are not built in memory, instead they
+ * are streamed to the client in chunks of DAAP_SONGLIST_CHUNK_SIZE (before
+ * compression), see daap_songlist_stream_cb()
+ */
+#define DAAP_SONGLIST_STREAM_THRESHOLD (1024 * 1024)
+#define DAAP_SONGLIST_CHUNK_SIZE (64 * 1024)
+
 /* Errors that the reply handlers may return */
 enum daap_reply_result
 {
+  DAAP_REPLY_STREAMING       =  5,
   DAAP_REPLY_LOGOUT          =  4,
   DAAP_REPLY_NONE            =  3,
   DAAP_REPLY_NO_CONTENT      =  2,
@@ -116,22 +122,71 @@ struct sort_ctx {
   uint32_t misc_mshn;
 };
 
+/* A song list reply that is being streamed. The length of the list was found
+ * by a first run of the query, the chunks are then produced by running it
+ * again for each chunk, continuing after the last row sent (keyset, so the
+ * query must be ordered by keyset already in the first run). That way we
+ * don't keep a statement (and a read snapshot of the database) open while we
+ * wait for the client. A checksum of the songs from the first run tells us if
+ * the library changed in between.
+ */
+struct daap_songlist_stream {
+  struct evhttp_request *req;
+  struct httpd_reply_stream *rs;
+
+  /* Produces the next chunk when the previous one has been written */
+  struct event *ev;
+
+  struct query_params qp;
+  /* Index range of the original query, and how many rows we have sent */
+  int first;
+  int limit;
+  int rows;
+  /* Checksum of the songs from the first run, and of what we have sent */
+  uint32_t crc;
+  uint32_t sent_crc;
+
+  const struct dmap_field **meta;
+  int nmeta;
+  int sort_headers;
+
+  bool is_remote;
+  char *user_agent;
+  char *client_codecs;
+  char *last_codectype;
+  int transcode;
+
+  struct evbuffer *chunk;
+  struct evbuffer *song;
+  /* Sort headers (mshl), sent after the song list */
+  struct evbuffer *trailer;
+
+  /* Total length of the reply body that we announced, and what we have sent */
+  size_t len;
+  size_t sent;
+};
+
 
 /* Default meta tags if not provided in the query */
 static char *default_meta_plsongs = "dmap.itemkind,dmap.itemid,dmap.itemname,dmap.containeritemid,dmap.parentcontainerid";
 static char *default_meta_pl = "dmap.itemid,dmap.itemname,dmap.persistentid,com.apple.itunes.smart-playlist";
 static char *default_meta_group = "dmap.itemname,dmap.persistentid,daap.songalbumartist";
 
-/* DAAP session tracking */
+/* DAAP session tracking, the lock is needed since requests may be served by
+ * multiple httpd threads. Handlers get a copy of the session, not a pointer.
+ */
+static pthread_mutex_t daap_sessions_lck;
 static struct daap_session *daap_sessions;
 
 /* Update requests */
 static int current_rev;
+static pthread_mutex_t update_requests_lck;
 static struct daap_update_request *update_requests;
 static struct timeval daap_update_refresh_tv = { DAAP_UPDATE_REFRESH, 0 };
 
 
 /* -------------------------- SESSION HANDLING ------------------------------ */
+/* Unless otherwise noted the caller must hold daap_sessions_lck              */
 
 static void
 daap_session_free(struct daap_session *s)
@@ -213,22 +268,29 @@ daap_session_cleanup(void)
     }
 }
 
-static struct daap_session *
+/* Returns the id of the new session, or -1 if the requested id is taken. Takes
+ * the lock itself.
+ */
+static int
 daap_session_add(bool is_remote, int request_session_id)
 {
   struct daap_session *s;
-
-  daap_session_cleanup();
+  int id;
 
   CHECK_NULL(L_DAAP, s = calloc(1, sizeof(struct daap_session)));
 
+  pthread_mutex_lock(&daap_sessions_lck);
+
+  daap_session_cleanup();
+
   if (request_session_id)
     {
       if (daap_session_get(request_session_id))
 	{
+	  pthread_mutex_unlock(&daap_sessions_lck);
 	  DPRINTF(E_LOG, L_DAAP, "Session id requested in login (%d) is not available\n", request_session_id);
 	  free(s);
-	  return NULL;
+	  return -1;
 	}
 
       s->id = request_session_id;
@@ -247,7 +309,34 @@ daap_session_add(bool is_remote, int request_session_id)
 
   daap_sessions = s;
 
-  return s;
+  id = s->id;
+
+  pthread_mutex_unlock(&daap_sessions_lck);
+
+  return id;
+}
+
+/* Copies the session with the given id to *out and refreshes its timestamp.
+ * Takes the lock itself. Returns -1 if no such session.
+ */
+static int
+daap_session_copy(struct daap_session *out, int id)
+{
+  struct daap_session *s;
+
+  pthread_mutex_lock(&daap_sessions_lck);
+
+  s = daap_session_get(id);
+  if (s)
+    {
+      s->mtime = time(NULL);
+      *out = *s;
+      out->next = NULL;
+    }
+
+  pthread_mutex_unlock(&daap_sessions_lck);
+
+  return s ? 0 : -1;
 }
 
 
@@ -267,6 +356,8 @@ update_remove(struct daap_update_request *ur)
 {
   struct daap_update_request *p;
 
+  pthread_mutex_lock(&update_requests_lck);
+
   if (ur == update_requests)
     update_requests = ur->next;
   else
@@ -276,6 +367,7 @@ update_remove(struct daap_update_request *ur)
 
       if (!p)
 	{
+	  pthread_mutex_unlock(&update_requests_lck);
 	  DPRINTF(E_LOG, L_DAAP, "WARNING: struct daap_update_request not found in list; BUG!\n");
 	  return;
 	}
@@ -283,6 +375,8 @@ update_remove(struct daap_update_request *ur)
       p->next = ur->next;
     }
 
+  pthread_mutex_unlock(&update_requests_lck);
+
   update_free(ur);
 }
 
@@ -704,6 +798,7 @@ daap_reply_send(struct httpd_request *hreq, enum daap_reply_result result)
 	break;
       case DAAP_REPLY_NO_CONNECTION:
       case DAAP_REPLY_NONE:
+      case DAAP_REPLY_STREAMING:
 	// Send nothing
 	break;
     }
@@ -738,7 +833,6 @@ daap_request_authorize(struct httpd_request *hreq)
 	  return -1;
 	}
 
-      session->mtime = time(NULL);
       return 0;
     }
 
@@ -767,6 +861,341 @@ daap_request_authorize(struct httpd_request *hreq)
 }
 
 
+/* ------------------------- SONG LIST STREAMING ---------------------------- */
+
+static void
+songlist_transcode_update(int *transcode, char **last_codectype, struct db_media_file_info *dbmfi, bool is_remote, const char *user_agent, const char *client_codecs)
+{
+  if (!dbmfi->codectype)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", dbmfi->fname);
+
+      *transcode = 0;
+    }
+  else if (is_remote)
+    {
+      *transcode = 1;
+    }
+  else if (!*last_codectype || (strcmp(*last_codectype, dbmfi->codectype) != 0))
+    {
+      *transcode = transcode_needed(user_agent, client_codecs, dbmfi->codectype);
+
+      free(*last_codectype);
+      *last_codectype = strdup(dbmfi->codectype);
+    }
+}
+
+static void
+songlist_stream_free(struct daap_songlist_stream *st)
+{
+  db_query_end(&st->qp);
+  free_query_params(&st->qp, 1);
+
+  if (st->ev)
+    event_free(st->ev);
+  if (st->chunk)
+    evbuffer_free(st->chunk);
+  if (st->song)
+    evbuffer_free(st->song);
+  if (st->trailer)
+    evbuffer_free(st->trailer);
+
+  httpd_reply_stream_free(st->rs);
+
+  free(st->meta);
+  free(st->user_agent);
+  free(st->client_codecs);
+  free(st->last_codectype);
+  free(st);
+}
+
+static void
+songlist_stream_end(struct daap_songlist_stream *st)
+{
+  struct evhttp_connection *evcon;
+
+  evcon = evhttp_request_get_connection(st->req);
+  if (evcon)
+    evhttp_connection_set_closecb(evcon, NULL, NULL);
+
+  httpd_send_reply_end(st->rs);
+  st->rs = NULL;
+
+  songlist_stream_free(st);
+}
+
+/* Part of the reply has already been sent, so the only way to tell the client
+ * that something went wrong is to close the connection
+ */
+static void
+songlist_stream_abort(struct daap_songlist_stream *st)
+{
+  struct evhttp_connection *evcon;
+
+  evcon = evhttp_request_get_connection(st->req);
+  if (evcon)
+    {
+      evhttp_connection_set_closecb(evcon, NULL, NULL);
+      evhttp_connection_free(evcon);
+    }
+
+  songlist_stream_free(st);
+}
+
+static void
+songlist_stream_fail_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct daap_songlist_stream *st;
+
+  st = (struct daap_songlist_stream *)arg;
+
+  DPRINTF(E_WARN, L_DAAP, "Connection failed; stopping streaming of song list\n");
+
+  songlist_stream_free(st);
+}
+
+static void
+songlist_stream_resched_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct daap_songlist_stream *st;
+
+  st = (struct daap_songlist_stream *)arg;
+
+  event_active(st->ev, 0, 0);
+}
+
+// Song lists are only streamed if the query can be continued by keyset, and if
+// we get a callback when a chunk has been written (not with libevent 2.0)
+static bool
+songlist_streamable(struct httpd_request *hreq, struct query_params *qp)
+{
+#ifdef HAVE_LIBEVENT2_OLD
+  return false;
+#else
+  return (hreq->req && db_query_keyset_usable(qp));
+#endif
+}
+
+// Adds the song data in evbuf from offset to the checksum
+static uint32_t
+songlist_crc(uint32_t crc, struct evbuffer *evbuf, size_t offset)
+{
+  struct evbuffer_iovec iov[4];
+  struct evbuffer_ptr ptr;
+  size_t len;
+  size_t n;
+  int nvec;
+  int i;
+
+  len = evbuffer_get_length(evbuf) - offset;
+  while (len > 0)
+    {
+      evbuffer_ptr_set(evbuf, &ptr, offset, EVBUFFER_PTR_SET);
+      nvec = evbuffer_peek(evbuf, len, &ptr, iov, ARRAY_SIZE(iov));
+      for (i = 0; i < MIN(nvec, ARRAY_SIZE(iov)) && len > 0; i++)
+	{
+	  n = MIN(iov[i].iov_len, len);
+	  crc = crc32(crc, iov[i].iov_base, n);
+	  offset += n;
+	  len -= n;
+	}
+    }
+
+  return crc;
+}
+
+// Returns 1 if the query was started for the next page, 0 if there are no
+// more rows to get and -1 on error
+static int
+songlist_stream_page_start(struct daap_songlist_stream *st)
+{
+  int ret;
+
+  if (st->limit >= 0 && st->rows >= st->limit)
+    return 0;
+
+  // The first page starts at the offset of the requested index range, the
+  // next ones continue after the last row that the previous page fetched
+  st->qp.offset = st->qp.after ? 0 : st->first;
+  st->qp.limit = (st->limit < 0) ? -1 : st->limit - st->rows;
+  st->qp.idx_type = (st->qp.offset == 0 && st->qp.limit < 0) ? I_NONE : I_SUB;
+
+  ret = db_query_start(&st->qp);
+  if (ret < 0)
+    return -1;
+
+  return 1;
+}
+
+static void
+daap_songlist_stream_cb(int fd, short what, void *arg)
+{
+  struct daap_songlist_stream *st;
+  struct db_media_file_info dbmfi;
+  size_t offset;
+  int done;
+  int ret;
+
+  st = (struct daap_songlist_stream *)arg;
+
+  ret = songlist_stream_page_start(st);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not start query for song list stream\n");
+      goto abort;
+    }
+
+  done = (ret == 0);
+  while (!done && (evbuffer_get_length(st->chunk) < DAAP_SONGLIST_CHUNK_SIZE))
+    {
+      ret = db_query_fetch_file(&st->qp, &dbmfi);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Error fetching results for song list stream\n");
+	  goto abort;
+	}
+
+      if (!dbmfi.id)
+	{
+	  done = 1;
+	  break;
+	}
+
+      st->rows++;
+
+      songlist_transcode_update(&st->transcode, &st->last_codectype, &dbmfi, st->is_remote, st->user_agent, st->client_codecs);
+
+      offset = evbuffer_get_length(st->chunk);
+
+      ret = dmap_encode_file_metadata(st->chunk, st->song, &dbmfi, st->meta, st->nmeta, st->sort_headers, st->transcode);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Failed to encode song metadata\n");
+	  goto abort;
+	}
+
+      st->sent_crc = songlist_crc(st->sent_crc, st->chunk, offset);
+    }
+
+  // Let go of the statement while the client is reading the chunk
+  db_query_end(&st->qp);
+
+  if (done)
+    CHECK_ERR(L_DAAP, evbuffer_add_buffer(st->chunk, st->trailer));
+
+  // The container lengths were sent up front, so if the library changed since
+  // they were calculated we can't produce a valid reply
+  st->sent += evbuffer_get_length(st->chunk);
+  if ((st->sent > st->len) || (done && (st->sent != st->len)))
+    {
+      DPRINTF(E_LOG, L_DAAP, "Song list changed while streaming (length %zu, expected %zu), aborting reply\n", st->sent, st->len);
+      goto abort;
+    }
+  else if (done && (st->sent_crc != st->crc))
+    {
+      DPRINTF(E_LOG, L_DAAP, "Song list changed while streaming (checksum mismatch), aborting reply\n");
+      goto abort;
+    }
+
+  if (evbuffer_get_length(st->chunk) > 0)
+    {
+      ret = httpd_send_reply_chunk(st->rs, st->chunk, done ? NULL : songlist_stream_resched_cb, st);
+      if (ret < 0)
+	goto abort;
+    }
+
+  if (done)
+    {
+      DPRINTF(E_DBG, L_DAAP, "Done streaming song list, %zu bytes\n", st->sent);
+
+      songlist_stream_end(st);
+    }
+
+  return;
+
+ abort:
+  songlist_stream_abort(st);
+}
+
+/* Takes over the content of qp and meta, so the caller must not free those
+ * after calling this function. The header contains the containers that come
+ * before the song list and the trailer what comes after, len is the length of
+ * the song list itself and crc its checksum, see songlist_crc().
+ */
+static int
+daap_songlist_stream_start(struct httpd_request *hreq, struct query_params *qp, const struct dmap_field **meta, int nmeta, int sort_headers, const char *client_codecs, struct evbuffer *header, struct evbuffer *trailer, size_t len, uint32_t crc)
+{
+  struct daap_songlist_stream *st;
+  struct daap_session *s;
+
+  s = hreq->extra_data;
+
+  CHECK_NULL(L_DAAP, st = calloc(1, sizeof(struct daap_songlist_stream)));
+
+  memcpy(&st->qp, qp, sizeof(struct query_params));
+  memset(qp, 0, sizeof(struct query_params));
+
+  // The first run left its last row in after, but we start from the beginning
+  free(st->qp.after_sort);
+  st->qp.after_sort = NULL;
+  st->qp.after = false;
+
+  st->crc = crc;
+  st->sent_crc = crc32(0L, Z_NULL, 0);
+
+  if (st->qp.idx_type == I_SUB)
+    {
+      st->first = st->qp.offset;
+      st->limit = st->qp.limit;
+    }
+  else
+    {
+      st->first = 0;
+      st->limit = -1;
+    }
+
+  st->req = hreq->req;
+  st->meta = meta;
+  st->nmeta = nmeta;
+  st->sort_headers = sort_headers;
+  st->is_remote = s->is_remote;
+  st->user_agent = safe_strdup(hreq->user_agent);
+  st->client_codecs = safe_strdup(client_codecs);
+
+  CHECK_NULL(L_DAAP, st->chunk = evbuffer_new());
+  CHECK_NULL(L_DAAP, st->song = evbuffer_new());
+  CHECK_NULL(L_DAAP, st->trailer = evbuffer_new());
+  CHECK_ERR(L_DAAP, evbuffer_expand(st->chunk, DAAP_SONGLIST_CHUNK_SIZE + 4096));
+  CHECK_ERR(L_DAAP, evbuffer_expand(st->song, 512));
+
+  st->len = evbuffer_get_length(header) + len + evbuffer_get_length(trailer);
+
+  CHECK_ERR(L_DAAP, evbuffer_add_buffer(st->chunk, header));
+  CHECK_ERR(L_DAAP, evbuffer_add_buffer(st->trailer, trailer));
+
+  CHECK_NULL(L_DAAP, st->ev = event_new(httpd_request_evbase(st->req), -1, 0, daap_songlist_stream_cb, st));
+
+  st->rs = httpd_send_reply_start(st->req, HTTP_OK, "OK", 0);
+  if (!st->rs)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not start chunked reply for song list\n");
+      goto error;
+    }
+
+  evhttp_connection_set_closecb(evhttp_request_get_connection(st->req), songlist_stream_fail_cb, st);
+
+  DPRINTF(E_DBG, L_DAAP, "Streaming song list, %zu bytes\n", st->len);
+
+  event_active(st->ev, 0, 0);
+
+  return 0;
+
+ error:
+  songlist_stream_free(st);
+  return -1;
+}
+
+
 /* --------------------------- REPLY HANDLERS ------------------------------- */
 /* Note that some handlers can be called without a connection (needed for     */
 /* cache regeneration), while others cannot. Those that cannot should check   */
@@ -915,8 +1344,8 @@ static enum daap_reply_result
 daap_reply_login(struct httpd_request *hreq)
 {
   struct daap_session *adhoc = hreq->extra_data;
-  struct daap_session *session;
   struct pairing_info pi;
+  int session_id;
   const char *param;
   int request_session_id;
   int ret;
@@ -967,8 +1396,8 @@ daap_reply_login(struct httpd_request *hreq)
   else
     request_session_id = 0;
 
-  session = daap_session_add(adhoc->is_remote, request_session_id);
-  if (!session)
+  session_id = daap_session_add(adhoc->is_remote, request_session_id);
+  if (session_id < 0)
     {
       dmap_error_make(hreq->reply, "mlog", "Could not start session");
       return DAAP_REPLY_ERROR;
@@ -976,7 +1405,7 @@ daap_reply_login(struct httpd_request *hreq)
 
   dmap_add_container(hreq->reply, "mlog", 24);
   dmap_add_int(hreq->reply, "mstt", 200);          /* 12 */
-  dmap_add_int(hreq->reply, "mlid", session->id);  /* 12 */
+  dmap_add_int(hreq->reply, "mlid", session_id);   /* 12 */
 
   return DAAP_REPLY_OK;
 }
@@ -984,10 +1413,14 @@ daap_reply_login(struct httpd_request *hreq)
 static enum daap_reply_result
 daap_reply_logout(struct httpd_request *hreq)
 {
-  if (!hreq->extra_data)
+  struct daap_session *session = hreq->extra_data;
+
+  if (!session)
     return DAAP_REPLY_FORBIDDEN;
 
-  daap_session_remove(hreq->extra_data);
+  pthread_mutex_lock(&daap_sessions_lck);
+  daap_session_remove(daap_session_get(session->id));
+  pthread_mutex_unlock(&daap_sessions_lck);
 
   hreq->extra_data = NULL;
 
@@ -1052,7 +1485,7 @@ daap_reply_update(struct httpd_request *hreq)
 
   if (DAAP_UPDATE_REFRESH > 0)
     {
-      ur->timeout = evtimer_new(evbase_httpd, update_refresh_cb, ur);
+      ur->timeout = evtimer_new(httpd_request_evbase(hreq->req), update_refresh_cb, ur);
       if (ur->timeout)
 	ret = evtimer_add(ur->timeout, &daap_update_refresh_tv);
       else
@@ -1071,8 +1504,10 @@ daap_reply_update(struct httpd_request *hreq)
   /* NOTE: we may need to keep reqd_rev in there too */
   ur->req = hreq->req;
 
+  pthread_mutex_lock(&update_requests_lck);
   ur->next = update_requests;
   update_requests = ur;
+  pthread_mutex_unlock(&update_requests_lck);
 
   /* If the connection fails before we have an update to push out
    * to the client, we need to know.
@@ -1183,6 +1618,7 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
   struct db_media_file_info dbmfi;
   struct evbuffer *song;
   struct evbuffer *songlist;
+  struct evbuffer *trailer;
   struct evkeyvalq *headers;
   struct daap_session *s;
   const struct dmap_field **meta;
@@ -1192,10 +1628,15 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
   const char *tag;
   char *last_codectype;
   size_t len;
+  size_t streamlen;
+  size_t offset;
+  uint32_t crc;
+  bool streamable;
   int nmeta;
   int sort_headers;
   int nsongs;
   int transcode;
+  int streaming;
   int ret;
 
   DPRINTF(E_DBG, L_DAAP, "Fetching song list for playlist %d\n", playlist);
@@ -1223,6 +1664,7 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 
   CHECK_NULL(L_DAAP, songlist = evbuffer_new());
   CHECK_NULL(L_DAAP, song = evbuffer_new());
+  CHECK_NULL(L_DAAP, trailer = evbuffer_new());
   CHECK_NULL(L_DAAP, sctx = daap_sort_context_new());
   CHECK_ERR(L_DAAP, evbuffer_expand(hreq->reply, 61));
   CHECK_ERR(L_DAAP, evbuffer_expand(songlist, 4096));
@@ -1252,6 +1694,11 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
       nmeta = 0;
     }
 
+  // If the list may be streamed, it must already now have the order that the
+  // stream continues in
+  streamable = songlist_streamable(hreq, &qp);
+  qp.keyset = streamable;
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -1270,28 +1717,18 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
     }
 
   nsongs = 0;
+  streaming = 0;
+  streamlen = 0;
+  transcode = 0;
   last_codectype = NULL;
+  crc = crc32(0L, Z_NULL, 0);
   while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
     {
       nsongs++;
 
-      if (!dbmfi.codectype)
-	{
-	  DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", dbmfi.fname);
-
-	  transcode = 0;
-	}
-      else if (s->is_remote)
-	{
-	  transcode = 1;
-	}
-      else if (!last_codectype || (strcmp(last_codectype, dbmfi.codectype) != 0))
-	{
-	  transcode = transcode_needed(hreq->user_agent, client_codecs, dbmfi.codectype);
+      songlist_transcode_update(&transcode, &last_codectype, &dbmfi, s->is_remote, hreq->user_agent, client_codecs);
 
-	  free(last_codectype);
-	  last_codectype = strdup(dbmfi.codectype);
-	}
+      offset = evbuffer_get_length(songlist);
 
       ret = dmap_encode_file_metadata(songlist, song, &dbmfi, meta, nmeta, sort_headers, transcode);
       if (ret < 0)
@@ -1302,6 +1739,19 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 	  break;
 	}
 
+      if (streamable)
+	crc = songlist_crc(crc, songlist, offset);
+
+      // If the list gets large and we have a connection, we stop building it in
+      // memory and just count its length. It will then be streamed by running
+      // the query again. Replies for the cache (no connection) are always built.
+      if (streaming || (streamable && (evbuffer_get_length(songlist) > DAAP_SONGLIST_STREAM_THRESHOLD)))
+	{
+	  streaming = 1;
+	  streamlen += evbuffer_get_length(songlist);
+	  evbuffer_drain(songlist, evbuffer_get_length(songlist));
+	}
+
       if (sort_headers)
 	{
 	  ret = daap_sort_build(sctx, dbmfi.title_sort);
@@ -1320,23 +1770,24 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
   DPRINTF(E_DBG, L_DAAP, "Done with song list, %d songs\n", nsongs);
 
   free(last_codectype);
-  free(meta);
   db_query_end(&qp);
 
   if (ret == -100)
     {
+      free(meta);
       dmap_error_make(hreq->reply, tag, "Out of memory");
       goto error;
     }
   else if (ret < 0)
     {
       DPRINTF(E_LOG, L_DAAP, "Error fetching results\n");
+      free(meta);
       dmap_error_make(hreq->reply, tag, "Error fetching query results");
       goto error;
     }
 
   /* Add header to evbuf, add songlist to evbuf */
-  len = evbuffer_get_length(songlist);
+  len = streamlen + evbuffer_get_length(songlist);
   if (sort_headers)
     {
       daap_sort_finalize(sctx);
@@ -1351,25 +1802,42 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
   dmap_add_int(hreq->reply, "mrco", nsongs);     /* 12 */
   dmap_add_container(hreq->reply, "mlcl", len); /* 8 */
 
-  CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->reply, songlist));
-
   if (sort_headers)
     {
-      len = evbuffer_get_length(sctx->headerlist);
-      dmap_add_container(hreq->reply, "mshl", len); /* 8 */
+      dmap_add_container(trailer, "mshl", evbuffer_get_length(sctx->headerlist)); /* 8 */
 
-      CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->reply, sctx->headerlist));
+      CHECK_ERR(L_DAAP, evbuffer_add_buffer(trailer, sctx->headerlist));
+    }
+
+  if (streaming)
+    {
+      ret = daap_songlist_stream_start(hreq, &qp, meta, nmeta, sort_headers, client_codecs, hreq->reply, trailer, len, crc);
+      if (ret < 0)
+	{
+	  evbuffer_drain(hreq->reply, evbuffer_get_length(hreq->reply));
+	  dmap_error_make(hreq->reply, tag, "Could not stream song list");
+	  goto error;
+	}
+    }
+  else
+    {
+      free(meta);
+
+      CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->reply, songlist));
+      CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->reply, trailer));
     }
 
   daap_sort_context_free(sctx);
+  evbuffer_free(trailer);
   evbuffer_free(song);
   evbuffer_free(songlist);
   free_query_params(&qp, 1);
 
-  return DAAP_REPLY_OK;
+  return streaming ? DAAP_REPLY_STREAMING : DAAP_REPLY_OK;
 
  error:
   daap_sort_context_free(sctx);
+  evbuffer_free(trailer);
   evbuffer_free(song);
   evbuffer_free(songlist);
   free_query_params(&qp, 1);
@@ -2272,7 +2740,8 @@ daap_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
       return;
     }
 
-  // Check if we have a session and point hreq->extra_data to it
+  // Check if we have a session and point hreq->extra_data to a copy of it
+  memset(&session, 0, sizeof(struct daap_session));
   param = evhttp_find_header(hreq->query, "session-id");
   if (param)
     {
@@ -2280,16 +2749,14 @@ daap_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
       if (ret < 0)
 	DPRINTF(E_LOG, L_DAAP, "Ignoring non-numeric session id in DAAP request: '%s'\n", uri_parsed->uri);
       else
-	hreq->extra_data = daap_session_get(id);
+	daap_session_copy(&session, id);
     }
 
   // Create an ad-hoc session, which is a way of passing is_remote to the handler, even though no real session exists
-  if (!hreq->extra_data)
-    {
-      memset(&session, 0, sizeof(struct daap_session));
-      session.is_remote = (evhttp_find_header(hreq->query, "pairing-guid") != NULL);
-      hreq->extra_data = &session;
-    }
+  if (session.id == 0)
+    session.is_remote = (evhttp_find_header(hreq->query, "pairing-guid") != NULL);
+
+  hreq->extra_data = &session;
 
   ret = daap_request_authorize(hreq);
   if (ret < 0)
@@ -2311,7 +2778,7 @@ daap_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
   CHECK_NULL(L_DAAP, hreq->reply = evbuffer_new());
 
   // Try the cache
-  ret = cache_daap_get(hreq->reply, uri_parsed->uri);
+  ret = cache_daap_get(hreq->reply, uri_parsed->uri, hreq->user_agent, session.is_remote);
   if (ret == 0)
     {
       // The cache will return the data gzipped, so httpd_send_reply won't need to do it
@@ -2335,7 +2802,7 @@ daap_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
 
   DPRINTF(E_DBG, L_DAAP, "DAAP request handled in %d milliseconds\n", msec);
 
-  if (ret == DAAP_REPLY_OK && msec > cache_daap_threshold() && hreq->user_agent)
+  if ((ret == DAAP_REPLY_OK || ret == DAAP_REPLY_STREAMING) && msec > cache_daap_threshold() && hreq->user_agent)
     cache_daap_add(uri_parsed->uri, hreq->user_agent, ((struct daap_session *)hreq->extra_data)->is_remote, msec);
 
   evbuffer_free(hreq->reply);
@@ -2373,14 +2840,9 @@ daap_is_request(const char *path)
 int
 daap_session_is_valid(int id)
 {
-  struct daap_session *session;
-
-  session = daap_session_get(id);
-
-  if (session)
-    session->mtime = time(NULL);
+  struct daap_session session;
 
-  return session ? 1 : 0;
+  return (daap_session_copy(&session, id) == 0);
 }
 
 // Thread: Cache
@@ -2443,6 +2905,9 @@ daap_init(void)
   current_rev = 2;
   update_requests = NULL;
 
+  CHECK_ERR(L_DAAP, pthread_mutex_init(&daap_sessions_lck, NULL));
+  CHECK_ERR(L_DAAP, pthread_mutex_init(&update_requests_lck, NULL));
+
   for (i = 0; daap_handlers[i].handler; i++)
     {
       ret = regcomp(&daap_handlers[i].preg, daap_handlers[i].regexp, REG_EXTENDED | REG_NOSUB);
@@ -2488,4 +2953,7 @@ daap_deinit(void)
 
       update_free(ur);
     }
+
+  pthread_mutex_destroy(&update_requests_lck);
+  pthread_mutex_destroy(&daap_sessions_lck);
 }
@@ -30,6 +30,7 @@
 #include <sys/types.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #ifdef HAVE_EVENTFD
 # include <sys/eventfd.h>
@@ -58,6 +59,11 @@ extern struct event_base *evbase_httpd;
 struct dacp_update_request {
   struct evhttp_request *req;
 
+  // The request may belong to another httpd thread than the one that gets the
+  // status update, so the reply is sent by this event on the request's base
+  struct event *replyev;
+  struct evbuffer *reply;
+
   struct dacp_update_request *next;
 };
 
@@ -143,10 +149,12 @@ static struct event *updateev;
 static int current_rev;
 
 /* Play status update requests */
+static pthread_mutex_t update_requests_lck;
 static struct dacp_update_request *update_requests;
 
-/* Seek timer */
+/* Seek timer, the target is set by the request threads */
 static struct event *seek_timer;
+static pthread_mutex_t seek_lck;
 static int seek_target;
 
 /* If an item is removed from the library while in the queue, we replace it with this */
@@ -593,14 +601,19 @@ speaker_volume_step(struct player_speaker_info *speaker_info, int step)
 static void
 seek_timer_cb(int fd, short what, void *arg)
 {
+  int target;
   int ret;
 
-  DPRINTF(E_DBG, L_DACP, "Seek timer expired, target %d ms\n", seek_target);
+  pthread_mutex_lock(&seek_lck);
+  target = seek_target;
+  pthread_mutex_unlock(&seek_lck);
+
+  DPRINTF(E_DBG, L_DACP, "Seek timer expired, target %d ms\n", target);
 
-  ret = player_playback_seek(seek_target, PLAYER_SEEK_POSITION);
+  ret = player_playback_seek(target, PLAYER_SEEK_POSITION);
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_DACP, "Player failed to seek to %d ms\n", seek_target);
+      DPRINTF(E_LOG, L_DACP, "Player failed to seek to %d ms\n", target);
 
       return;
     }
@@ -718,13 +731,40 @@ make_playstatusupdate(struct evbuffer *evbuf)
   return 0;
 }
 
+static void
+update_request_free(struct dacp_update_request *ur)
+{
+  if (ur->replyev)
+    event_free(ur->replyev);
+  if (ur->reply)
+    evbuffer_free(ur->reply);
+
+  free(ur);
+}
+
+/* Thread: httpd (the one that owns the request) */
+static void
+update_reply_cb(int fd, short what, void *arg)
+{
+  struct dacp_update_request *ur;
+  struct evhttp_connection *evcon;
+
+  ur = (struct dacp_update_request *)arg;
+
+  evcon = evhttp_request_get_connection(ur->req);
+  if (evcon)
+    evhttp_connection_set_closecb(evcon, NULL, NULL);
+
+  httpd_send_reply(ur->req, HTTP_OK, "OK", ur->reply, 0);
+
+  update_request_free(ur);
+}
+
 static void
 playstatusupdate_cb(int fd, short what, void *arg)
 {
   struct dacp_update_request *ur;
-  struct evbuffer *evbuf;
   struct evbuffer *update;
-  struct evhttp_connection *evcon;
   uint8_t *buf;
   size_t len;
   int ret;
@@ -750,39 +790,33 @@ playstatusupdate_cb(int fd, short what, void *arg)
   if (!update_requests)
     goto readd;
 
-  CHECK_NULL(L_DACP, evbuf = evbuffer_new());
   CHECK_NULL(L_DACP, update = evbuffer_new());
 
   ret = make_playstatusupdate(update);
   if (ret < 0)
     goto out_free_update;
 
+  buf = evbuffer_pullup(update, -1);
   len = evbuffer_get_length(update);
 
+  // Each request gets a copy of the update and is replied to by its own thread.
+  // Activating the event must be done while holding the lock, since once the
+  // request is out of the list update_fail_cb() may free it.
+  pthread_mutex_lock(&update_requests_lck);
   for (ur = update_requests; update_requests; ur = update_requests)
     {
       update_requests = ur->next;
+      ur->next = NULL;
 
-      evcon = evhttp_request_get_connection(ur->req);
-      if (evcon)
-	evhttp_connection_set_closecb(evcon, NULL, NULL);
-
-      // Only copy buffer if we actually need to reuse it
-      if (ur->next)
-	{
-	  buf = evbuffer_pullup(update, -1);
-	  evbuffer_add(evbuf, buf, len);
-	  httpd_send_reply(ur->req, HTTP_OK, "OK", evbuf, 0);
-	}
-      else
-	httpd_send_reply(ur->req, HTTP_OK, "OK", update, 0);
+      CHECK_NULL(L_DACP, ur->reply = evbuffer_new());
+      evbuffer_add(ur->reply, buf, len);
 
-      free(ur);
+      event_active(ur->replyev, 0, 0);
     }
+  pthread_mutex_unlock(&update_requests_lck);
 
  out_free_update:
   evbuffer_free(update);
-  evbuffer_free(evbuf);
  readd:
   ret = event_add(updateev, NULL);
   if (ret < 0)
@@ -827,6 +861,9 @@ update_fail_cb(struct evhttp_connection *evcon, void *arg)
   if (evc)
     evhttp_connection_set_closecb(evc, NULL, NULL);
 
+  // If the request is not in the list then playstatusupdate_cb() has taken it
+  // out and activated its reply event, which is cancelled when we free it
+  pthread_mutex_lock(&update_requests_lck);
   if (ur == update_requests)
     update_requests = ur->next;
   else
@@ -834,17 +871,13 @@ update_fail_cb(struct evhttp_connection *evcon, void *arg)
       for (p = update_requests; p && (p->next != ur); p = p->next)
 	;
 
-      if (!p)
-	{
-	  DPRINTF(E_LOG, L_DACP, "WARNING: struct dacp_update_request not found in list; BUG!\n");
-	  return;
-	}
-
-      p->next = ur->next;
+      if (p)
+	p->next = ur->next;
     }
+  pthread_mutex_unlock(&update_requests_lck);
 
   evhttp_request_free(ur->req);
-  free(ur);
+  update_request_free(ur);
 }
 
 
@@ -1051,9 +1084,10 @@ static void
 dacp_propset_playingtime(const char *value, struct httpd_request *hreq)
 {
   struct timeval tv;
+  int target;
   int ret;
 
-  ret = safe_atoi32(value, &seek_target);
+  ret = safe_atoi32(value, &target);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_DACP, "dacp.playingtime argument doesn't convert to integer: %s\n", value);
@@ -1063,7 +1097,11 @@ dacp_propset_playingtime(const char *value, struct httpd_request *hreq)
 
   evutil_timerclear(&tv);
   tv.tv_usec = 200 * 1000;
+
+  pthread_mutex_lock(&seek_lck);
+  seek_target = target;
   evtimer_add(seek_timer, &tv);
+  pthread_mutex_unlock(&seek_lck);
 }
 
 static void
@@ -2298,8 +2336,20 @@ dacp_reply_playstatusupdate(struct httpd_request *hreq)
 
   ur->req = hreq->req;
 
+  ur->replyev = event_new(httpd_request_evbase(hreq->req), -1, 0, update_reply_cb, ur);
+  if (!ur->replyev)
+    {
+      DPRINTF(E_LOG, L_DACP, "Could not create event for update request\n");
+
+      dmap_send_error(hreq->req, "cmst", "Out of memory");
+      free(ur);
+      return -1;
+    }
+
+  pthread_mutex_lock(&update_requests_lck);
   ur->next = update_requests;
   update_requests = ur;
+  pthread_mutex_unlock(&update_requests_lck);
 
   /* If the connection fails before we have an update to push out
    * to the client, we need to know.
@@ -2909,6 +2959,9 @@ dacp_init(void)
   current_rev = 2;
   update_requests = NULL;
 
+  CHECK_ERR(L_DACP, pthread_mutex_init(&update_requests_lck, NULL));
+  CHECK_ERR(L_DACP, pthread_mutex_init(&seek_lck, NULL));
+
 #ifdef HAVE_EVENTFD
   update_efd = eventfd(0, EFD_CLOEXEC);
   if (update_efd < 0)
@@ -3003,9 +3056,12 @@ dacp_deinit(void)
 	  evhttp_connection_free(evcon);
 	}
 
-      free(ur);
+      update_request_free(ur);
     }
 
+  pthread_mutex_destroy(&update_requests_lck);
+  pthread_mutex_destroy(&seek_lck);
+
   event_free(updateev);
 
 #ifdef HAVE_EVENTFD
@@ -42,6 +42,8 @@
 #include <time.h>
 
 #include "httpd_jsonapi.h"
+#include "artwork.h"
+#include "cache.h"
 #include "conffile.h"
 #include "db.h"
 #ifdef LASTFM
@@ -658,6 +660,48 @@ query_params_limit_set(struct query_params *query_params, struct httpd_request *
   return 0;
 }
 
+// Listings sorted by name can be continued with the "next" token from the
+// previous page, which unlike offset doesn't get slower for deep pages. Must be
+// called after query_params_limit_set().
+static int
+query_params_after_set(struct query_params *query_params, struct httpd_request *hreq)
+{
+  const char *param;
+
+  // Only pages that get a "next" token are ordered by keyset
+  query_params->keyset = (query_params->limit > 0);
+
+  param = evhttp_find_header(hreq->query, "after");
+  if (!param)
+    return 0;
+
+  if (db_query_after_set(query_params, param) < 0)
+    return -1;
+
+  query_params->idx_type = I_SUB;
+  query_params->keyset = true;
+
+  return 0;
+}
+
+// The token is made from the last row of the query and not from the last item,
+// since rows without a name are not added as items
+static void
+query_params_next_add(json_object *reply, json_object *items, struct query_params *query_params)
+{
+  char *token;
+
+  if (query_params->limit <= 0 || json_object_array_length(items) == 0)
+    return;
+
+  token = db_query_after_make(query_params);
+  if (!token)
+    return;
+
+  json_object_object_add(reply, "next", json_object_new_string(token));
+  free(token);
+}
+
 /* --------------------------- REPLY HANDLERS ------------------------------- */
 
 /*
@@ -1077,6 +1121,77 @@ jsonapi_reply_meta_rescan(struct httpd_request *hreq)
   return HTTP_NOCONTENT;
 }
 
+/*
+ * Endpoint to retrieve statistics of the DAAP reply cache
+ *
+ * Example response:
+ *
+ * {
+ *  "enabled": true,
+ *  "entries": 12,
+ *  "bytes": 5242880,
+ *  "max_bytes": 67108864,
+ *  "hits": 340,
+ *  "misses": 52,
+ *  "hit_bytes": 148897792,
+ *  "evictions": 0,
+ *  "invalidations": 24,
+ *  "db_statements": { "hits": 5210, "misses": 310, "evictions": 120 },
+ *  "artwork": { "sizes": 3, "queued": 0, "prebuilt": 1500, "prebuilt_hits": 830, "rendered": 42 }
+ * }
+ */
+static int
+jsonapi_reply_cache(struct httpd_request *hreq)
+{
+  struct cache_daap_stats stats;
+  struct db_stmt_cache_stats stmt_stats;
+  struct artwork_stats art_stats;
+  json_object *jreply;
+  json_object *jstmt;
+  json_object *jart;
+  int ret;
+
+  CHECK_NULL(L_WEB, jreply = json_object_new_object());
+
+  ret = cache_daap_stats_get(&stats);
+
+  json_object_object_add(jreply, "enabled", json_object_new_boolean(ret == 0));
+  if (ret == 0)
+    {
+      json_object_object_add(jreply, "entries", json_object_new_int(stats.entries));
+      json_object_object_add(jreply, "bytes", json_object_new_int64(stats.bytes));
+      json_object_object_add(jreply, "max_bytes", json_object_new_int64(stats.max_bytes));
+      json_object_object_add(jreply, "hits", json_object_new_int64(stats.hits));
+      json_object_object_add(jreply, "misses", json_object_new_int64(stats.misses));
+      json_object_object_add(jreply, "hit_bytes", json_object_new_int64(stats.hit_bytes));
+      json_object_object_add(jreply, "evictions", json_object_new_int64(stats.evictions));
+      json_object_object_add(jreply, "invalidations", json_object_new_int64(stats.invalidations));
+    }
+
+  db_stmt_cache_stats_get(&stmt_stats);
+
+  CHECK_NULL(L_WEB, jstmt = json_object_new_object());
+  json_object_object_add(jstmt, "hits", json_object_new_int64(stmt_stats.hits));
+  json_object_object_add(jstmt, "misses", json_object_new_int64(stmt_stats.misses));
+  json_object_object_add(jstmt, "evictions", json_object_new_int64(stmt_stats.evictions));
+  json_object_object_add(jreply, "db_statements", jstmt);
+
+  artwork_stats_get(&art_stats);
+
+  CHECK_NULL(L_WEB, jart = json_object_new_object());
+  json_object_object_add(jart, "sizes", json_object_new_int(art_stats.sizes));
+  json_object_object_add(jart, "queued", json_object_new_int(art_stats.queued));
+  json_object_object_add(jart, "prebuilt", json_object_new_int64(art_stats.prebuilt));
+  json_object_object_add(jart, "prebuilt_hits", json_object_new_int64(art_stats.prebuilt_hits));
+  json_object_object_add(jart, "rendered", json_object_new_int64(art_stats.rendered));
+  json_object_object_add(jreply, "artwork", jart);
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(jreply)));
+  jparse_free(jreply);
+
+  return HTTP_OK;
+}
+
 
 /*
  * Endpoint to retrieve information about the spotify integration
@@ -2783,11 +2898,14 @@ jsonapi_reply_library_artists(struct httpd_request *hreq)
   if (ret < 0)
     goto error;
 
+  ret = query_params_after_set(&query_params, hreq);
+  if (ret < 0)
+    goto error;
+
   query_params.type = Q_GROUP_ARTISTS;
   query_params.sort = S_ARTIST;
 
-  if (media_kind)
-    query_params.filter = db_mprintf("(f.media_kind = %d)", media_kind);
+  query_params.media_kind = media_kind;
 
   ret = fetch_artists(&query_params, items, &total);
   if (ret < 0)
@@ -2796,6 +2914,7 @@ jsonapi_reply_library_artists(struct httpd_request *hreq)
   json_object_object_add(reply, "total", json_object_new_int(total));
   json_object_object_add(reply, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(reply, "limit", json_object_new_int(query_params.limit));
+  query_params_next_add(reply, items, &query_params);
 
   ret = evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(reply));
   if (ret < 0)
@@ -2931,11 +3050,14 @@ jsonapi_reply_library_albums(struct httpd_request *hreq)
   if (ret < 0)
     goto error;
 
+  ret = query_params_after_set(&query_params, hreq);
+  if (ret < 0)
+    goto error;
+
   query_params.type = Q_GROUP_ALBUMS;
   query_params.sort = S_ALBUM;
 
-  if (media_kind)
-    query_params.filter = db_mprintf("(f.media_kind = %d)", media_kind);
+  query_params.media_kind = media_kind;
 
   ret = fetch_albums(&query_params, items, &total);
   if (ret < 0)
@@ -2944,6 +3066,7 @@ jsonapi_reply_library_albums(struct httpd_request *hreq)
   json_object_object_add(reply, "total", json_object_new_int(total));
   json_object_object_add(reply, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(reply, "limit", json_object_new_int(query_params.limit));
+  query_params_next_add(reply, items, &query_params);
 
   ret = evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(reply));
   if (ret < 0)
@@ -3075,6 +3198,74 @@ jsonapi_reply_library_album_tracks_put_byid(struct httpd_request *hreq)
   return HTTP_OK;
 }
 
+static int
+jsonapi_reply_library_tracks(struct httpd_request *hreq)
+{
+  struct query_params query_params;
+  const char *param;
+  enum media_kind media_kind;
+  json_object *reply;
+  json_object *items;
+  int total;
+  int ret = 0;
+
+  if (!is_modified(hreq->req, DB_ADMIN_DB_MODIFIED))
+    return HTTP_NOTMODIFIED;
+
+  media_kind = 0;
+  param = evhttp_find_header(hreq->query, "media_kind");
+  if (param)
+    {
+      media_kind = db_media_kind_enum(param);
+      if (!media_kind)
+	{
+	  DPRINTF(E_LOG, L_WEB, "Invalid media kind '%s'\n", param);
+	  return HTTP_BADREQUEST;
+	}
+    }
+
+  reply = json_object_new_object();
+  items = json_object_new_array();
+  json_object_object_add(reply, "items", items);
+
+  memset(&query_params, 0, sizeof(struct query_params));
+
+  ret = query_params_limit_set(&query_params, hreq);
+  if (ret < 0)
+    goto error;
+
+  ret = query_params_after_set(&query_params, hreq);
+  if (ret < 0)
+    goto error;
+
+  query_params.type = Q_ITEMS;
+  query_params.sort = S_NAME;
+
+  query_params.media_kind = media_kind;
+
+  ret = fetch_tracks(&query_params, items, &total);
+  if (ret < 0)
+    goto error;
+
+  json_object_object_add(reply, "total", json_object_new_int(total));
+  json_object_object_add(reply, "offset", json_object_new_int(query_params.offset));
+  json_object_object_add(reply, "limit", json_object_new_int(query_params.limit));
+  query_params_next_add(reply, items, &query_params);
+
+  ret = evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(reply));
+  if (ret < 0)
+    DPRINTF(E_LOG, L_WEB, "browse: Couldn't add tracks to response buffer.\n");
+
+ error:
+  free_query_params(&query_params, 1);
+  jparse_free(reply);
+
+  if (ret < 0)
+    return HTTP_INTERNAL;
+
+  return HTTP_OK;
+}
+
 static int
 jsonapi_reply_library_tracks_get_byid(struct httpd_request *hreq)
 {
@@ -3843,6 +4034,36 @@ jsonapi_reply_library_add(struct httpd_request *hreq)
   return HTTP_OK;
 }
 
+// Sets the filter for a search for param_query in field, and if requested with
+// sort=relevance, sorts by how well the items match
+static void
+search_query_set(struct query_params *query_params, struct httpd_request *hreq, const char *field, const char *param_query, enum media_kind media_kind)
+{
+  const char *fields[] = { field, NULL };
+  const char *param_sort;
+  char *rank;
+
+  query_params->filter = db_search_filter(fields, param_query);
+  query_params->media_kind = media_kind;
+
+  param_sort = evhttp_find_header(hreq->query, "sort");
+  if (!param_sort || strcmp(param_sort, "relevance") != 0)
+    return;
+
+  // Not possible without the full-text index, then we keep the default sort
+  rank = db_search_rank(fields, param_query);
+  if (!rank)
+    return;
+
+  if (query_params->type == Q_ITEMS)
+    query_params->order = rank;
+  else
+    {
+      query_params->order = db_mprintf("MIN(%s)", rank);
+      free(rank);
+    }
+}
+
 static int
 search_tracks(json_object *reply, struct httpd_request *hreq, const char *param_query, struct smartpl *smartpl_expression, enum media_kind media_kind)
 {
@@ -3868,10 +4089,7 @@ search_tracks(json_object *reply, struct httpd_request *hreq, const char *param_
 
   if (param_query)
     {
-      if (media_kind)
-	query_params.filter = db_mprintf("(f.title LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.title LIKE '%%%q%%')", param_query);
+      search_query_set(&query_params, hreq, "f.title", param_query, media_kind);
     }
   else
     {
@@ -3929,10 +4147,7 @@ search_artists(json_object *reply, struct httpd_request *hreq, const char *param
 
   if (param_query)
     {
-      if (media_kind)
-	query_params.filter = db_mprintf("(f.album_artist LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.album_artist LIKE '%%%q%%')", param_query);
+      search_query_set(&query_params, hreq, "f.album_artist", param_query, media_kind);
     }
   else
     {
@@ -3991,10 +4206,7 @@ search_albums(json_object *reply, struct httpd_request *hreq, const char *param_
 
   if (param_query)
     {
-      if (media_kind)
-	query_params.filter = db_mprintf("(f.album LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.album LIKE '%%%q%%')", param_query);
+      search_query_set(&query_params, hreq, "f.album", param_query, media_kind);
     }
   else
     {
@@ -4171,6 +4383,7 @@ static struct httpd_uri_map adm_handlers[] =
     { EVHTTP_REQ_GET |
       EVHTTP_REQ_PUT,    "^/api/update$",                                jsonapi_reply_update },
     { EVHTTP_REQ_PUT,    "^/api/rescan$",                                jsonapi_reply_meta_rescan },
+    { EVHTTP_REQ_GET,    "^/api/cache$",                                 jsonapi_reply_cache },
     { EVHTTP_REQ_POST,   "^/api/spotify-login$",                         jsonapi_reply_spotify_login },
     { EVHTTP_REQ_GET,    "^/api/spotify$",                               jsonapi_reply_spotify },
     { EVHTTP_REQ_GET,    "^/api/pairing$",                               jsonapi_reply_pairing_get },
@@ -4222,6 +4435,7 @@ static struct httpd_uri_map adm_handlers[] =
     { EVHTTP_REQ_GET,    "^/api/library/albums/[[:digit:]]+$",           jsonapi_reply_library_album },
     { EVHTTP_REQ_GET,    "^/api/library/albums/[[:digit:]]+/tracks$",    jsonapi_reply_library_album_tracks },
     { EVHTTP_REQ_PUT,    "^/api/library/albums/[[:digit:]]+/tracks$",    jsonapi_reply_library_album_tracks_put_byid },
+    { EVHTTP_REQ_GET,    "^/api/library/tracks$",                        jsonapi_reply_library_tracks },
     { EVHTTP_REQ_GET,    "^/api/library/tracks/[[:digit:]]+$",           jsonapi_reply_library_tracks_get_byid },
     { EVHTTP_REQ_PUT,    "^/api/library/tracks/[[:digit:]]+$",           jsonapi_reply_library_tracks_put_byid },
     { EVHTTP_REQ_GET,    "^/api/library/tracks/[[:digit:]]+/playlists$", jsonapi_reply_library_track_playlists },
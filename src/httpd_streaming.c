@@ -30,7 +30,11 @@
 #include <unistd.h>
 #include <pthread.h>
 
+#include <stdatomic.h>
+
 #include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
 
 #include "httpd_streaming.h"
 #include "logger.h"
@@ -39,6 +43,7 @@
 #include "player.h"
 #include "listener.h"
 #include "db.h"
+#include "httpd.h"
 
 /* httpd event base, from httpd.c */
 extern struct event_base *evbase_httpd;
@@ -49,34 +54,112 @@ extern struct event_base *evbase_httpd;
 // How many bytes we try to read at a time from the httpd pipe
 #define STREAMING_READ_SIZE STOB(352, 16, 2)
 
-#define STREAMING_MP3_SAMPLE_RATE 44100
-#define STREAMING_MP3_BPS         16
-#define STREAMING_MP3_CHANNELS    2
-#define STREAMING_MP3_BIT_RATE    192000
+// Max number of streams (format/bit rate combinations) that can be encoded at
+// the same time
+#define STREAMING_STREAMS_MAX 8
+// Seconds of audio a client may have queued before it is dropped
+#define STREAMING_QUEUED_MAX_SECS 10
+
+#define STREAMING_SAMPLE_RATE 44100
+#define STREAMING_CHANNELS    2
 
+struct streaming_stream;
 
-// Linked list of mp3 streaming requests
+// Linked list of streaming requests, one list per stream
 struct streaming_session {
   struct evhttp_request *req;
+  struct streaming_stream *stream;
   struct streaming_session *next;
 
   bool     require_icy; // Client requested icy meta
   size_t   bytes_sent;  // Audio bytes sent since last metablock
+  bool     started;     // Has been sent the stream's header (if any) and data
+
+  // The request may be served by another httpd thread than the one encoding,
+  // so the encoded data is queued in pending (which has locking enabled) and
+  // sent by sendev, which is on the base of the request's thread
+  struct evbuffer *pending;
+  struct event *sendev;
+  bool ended;
+
+  // Max bytes queued for the client before we consider it too slow
+  size_t queued_max;
+};
+
+// Encoded audio or an ICY metadata block. The sessions' pending buffers get it
+// by reference (see streaming_chunk_add), so it is only copied once no matter
+// how many sessions there are. Freed when the last reference is dropped.
+struct streaming_chunk {
+  atomic_int refcount;
+  size_t len;
+  uint8_t data[];
+};
+
+// The formats that can be requested, e.g. /stream.mp3 or /stream.opus?br=64
+struct streaming_format {
+  const char *ext;
+  const char *content_type;
+  enum transcode_profile profile;
+  // Must match the sample format the profile gives to the encoder
+  int bits_per_sample;
+  // If zero the configured sample rate is used
+  int sample_rate;
+  // Allowed bit rates in kbps, zero terminated. NULL for lossless formats.
+  const int *bit_rates;
+  int bit_rate_default;
+  // Whether clients can get ICY metadata spliced into the stream
+  bool icy;
+  // Set if the encoder could not be opened, so we can refuse requests
+  bool not_supported;
 };
-static pthread_mutex_t streaming_sessions_lck;
-static struct streaming_session *streaming_sessions;
 
-// Means we're not able to encode to mp3
-static bool streaming_not_supported;
+static const int streaming_mp3_bit_rates[] = { 64, 96, 128, 192, 320, 0 };
+static const int streaming_aac_bit_rates[] = { 64, 96, 128, 192, 256, 0 };
+static const int streaming_opus_bit_rates[] = { 32, 64, 96, 128, 160, 0 };
+
+static struct streaming_format streaming_formats[] =
+  {
+    { "mp3",  "audio/mpeg", XCODE_MP3,      16, 0,     streaming_mp3_bit_rates,  192, true,  false },
+    { "aac",  "audio/aac",  XCODE_AAC_ADTS, 32, 0,     streaming_aac_bit_rates,  128, true,  false },
+    { "opus", "audio/ogg",  XCODE_OPUS_OGG, 16, 48000, streaming_opus_bit_rates, 96,  false, false },
+    { "flac", "audio/flac", XCODE_FLAC,     16, 0,     NULL,                     0,   false, false },
+  };
+
+// Gets its default bit rate from the config
+#define STREAMING_FORMAT_MP3 (&streaming_formats[0])
+
+// A stream is encoded once for all its sessions, and only while it has them.
+// Streams are added by the httpd thread that gets the request, but the encoder
+// is only touched by the main httpd thread, which is also the one that removes
+// streams that have no more sessions.
+struct streaming_stream {
+  struct streaming_format *format;
+  struct media_quality quality;
+
+  struct encode_ctx *encode_ctx;
+  struct evbuffer *encoded_data;
+  // The container header (Ogg/FLAC) that the encoder wrote when it was made.
+  // Each session gets it before its first data, but if the encoder is made
+  // again (new input quality), the sessions that already have started don't
+  // get the new one. NULL if the format has no header (MP3/AAC ADTS).
+  struct streaming_chunk *header;
+
+  struct streaming_session *sessions;
+  struct streaming_stream *next;
+};
+
+// Protects the streams list, the session lists and the counts below
+static pthread_mutex_t streaming_sessions_lck;
+static struct streaming_stream *streaming_streams;
+static int streaming_nstreams;
+static int streaming_nsessions;
 
 // Interval for sending silence when playback is paused
 static struct timeval streaming_silence_tv = { STREAMING_SILENCE_INTERVAL, 0 };
 
-// Input buffer, output buffer and encoding ctx for transcode
-static struct encode_ctx *streaming_encode_ctx;
-static struct evbuffer *streaming_encoded_data;
+// Quality of the data from the player, all streams are encoded from this
 static struct media_quality streaming_quality_in;
-static struct media_quality streaming_quality_out = { STREAMING_MP3_SAMPLE_RATE, STREAMING_MP3_BPS, STREAMING_MP3_CHANNELS, STREAMING_MP3_BIT_RATE };
+static int streaming_sample_rate = STREAMING_SAMPLE_RATE;
 
 // Used for pushing events and data from the player
 static struct event *streamingev;
@@ -100,161 +183,353 @@ static unsigned streaming_icy_clients;
 static char *streaming_icy_title;
 
 
+static struct streaming_chunk *
+streaming_chunk_new(size_t size)
+{
+  struct streaming_chunk *chunk;
+
+  CHECK_NULL(L_STREAMING, chunk = malloc(sizeof(struct streaming_chunk) + size));
+  atomic_init(&chunk->refcount, 1);
+  chunk->len = size;
+
+  return chunk;
+}
+
+/* Cleanup callback for evbuffer_add_reference(), called from the thread of the
+ * session that drains the data, and from streaming_stream_send() to drop its
+ * own reference
+ */
+static void
+streaming_chunk_unref_cb(const void *data, size_t datalen, void *extra)
+{
+  struct streaming_chunk *chunk = extra;
+
+  if (atomic_fetch_sub(&chunk->refcount, 1) == 1)
+    free(chunk);
+}
+
 static void
-streaming_close_cb(struct evhttp_connection *evcon, void *arg)
+streaming_session_free(struct streaming_session *session)
 {
-  struct streaming_session *this;
-  struct streaming_session *session;
-  struct streaming_session *prev;
+  if (session->sendev)
+    event_free(session->sendev);
+  if (session->pending)
+    evbuffer_free(session->pending);
+
+  free(session);
+}
+
+// Thread: httpd (the one that owns the request), or main during deinit
+static void
+streaming_session_end(struct streaming_session *session)
+{
+  struct evhttp_connection *evcon;
   char *address;
   ev_uint16_t port;
 
-  this = (struct streaming_session *)arg;
+  evcon = evhttp_request_get_connection(session->req);
+  if (evcon)
+    {
+      evhttp_connection_set_closecb(evcon, NULL, NULL);
+      evhttp_connection_get_peer(evcon, &address, &port);
+      DPRINTF(E_INFO, L_STREAMING, "Force close stream to %s:%d\n", address, (int)port);
+    }
+  evhttp_send_reply_end(session->req);
 
-  evhttp_connection_get_peer(evcon, &address, &port);
-  DPRINTF(E_INFO, L_STREAMING, "Stopping mp3 streaming to %s:%d\n", address, (int)port);
+  streaming_session_free(session);
+}
 
-  pthread_mutex_lock(&streaming_sessions_lck);
-  if (!streaming_sessions)
+// For the lossless formats this is the rate of the raw audio, which is more
+// than the encoded rate
+static size_t
+streaming_byte_rate(struct media_quality *quality)
+{
+  if (quality->bit_rate)
+    return quality->bit_rate / 8;
+
+  return STOB(quality->sample_rate, 16, quality->channels);
+}
+
+// Thread: httpd (the one that owns the request), or main during deinit
+static void
+streaming_stream_free(struct streaming_stream *stream)
+{
+  transcode_encode_cleanup(&stream->encode_ctx);
+  evbuffer_free(stream->encoded_data);
+  if (stream->header)
+    streaming_chunk_unref_cb(NULL, 0, stream->header);
+  free(stream);
+}
+
+// Returns the stream with the given format and bit rate, a new one if there is
+// no such stream yet. Returns NULL if we are already at the max number of
+// streams. Must be called with the lock held.
+static struct streaming_stream *
+streaming_stream_get(struct streaming_format *format, int bit_rate)
+{
+  struct streaming_stream *stream;
+
+  for (stream = streaming_streams; stream; stream = stream->next)
     {
-      // This close comes during deinit() - we don't free `this` since it is
-      // already a dangling ptr (free'd in deinit()) at this stage
-      pthread_mutex_unlock(&streaming_sessions_lck);
-      return;
+      if (stream->format == format && stream->quality.bit_rate == bit_rate * 1000)
+	return stream;
     }
 
+  if (streaming_nstreams >= STREAMING_STREAMS_MAX)
+    return NULL;
+
+  CHECK_NULL(L_STREAMING, stream = calloc(1, sizeof(struct streaming_stream)));
+  CHECK_NULL(L_STREAMING, stream->encoded_data = evbuffer_new());
+
+  stream->format = format;
+  stream->quality.sample_rate = format->sample_rate ? format->sample_rate : streaming_sample_rate;
+  stream->quality.bits_per_sample = format->bits_per_sample;
+  stream->quality.channels = STREAMING_CHANNELS;
+  stream->quality.bit_rate = bit_rate * 1000;
+
+  stream->next = streaming_streams;
+  streaming_streams = stream;
+  streaming_nstreams++;
+
+  return stream;
+}
+
+// Removes the session from its stream, must be called with the lock held
+static void
+streaming_session_remove(struct streaming_session *session)
+{
+  struct streaming_session *s;
+  struct streaming_session *prev;
+
   prev = NULL;
-  for (session = streaming_sessions; session; session = session->next)
+  for (s = session->stream->sessions; s; s = s->next)
     {
-      if (session->req == this->req)
+      if (s == session)
 	break;
 
-      prev = session;
+      prev = s;
     }
 
-  if (!session)
-    {
-      DPRINTF(E_LOG, L_STREAMING, "Bug! Got a failure callback for an unknown stream (%s:%d)\n", address, (int)port);
-      free(this);
-      pthread_mutex_unlock(&streaming_sessions_lck);
-      return;
-    }
+  if (!s)
+    return;
 
   if (!prev)
-    streaming_sessions = session->next;
+    session->stream->sessions = session->next;
   else
     prev->next = session->next;
 
+  session->stream = NULL;
+  streaming_nsessions--;
+
   if (session->require_icy)
     --streaming_icy_clients;
+}
 
-  // Valgrind says libevent doesn't free the request on disconnect (even though it owns it - libevent bug?),
-  // so we do it with a reply end
-  evhttp_send_reply_end(session->req);
-  free(session);
+// Removes the session from its stream, unless that was already done by
+// streaming_sessions_end(), which also means its sendev is pending, but that is
+// cancelled when the caller frees the session. The stream itself is freed by
+// streaming_send_cb() when it sees that there are no more sessions.
+//
+// Thread: httpd (the one that owns the request)
+static void
+streaming_session_detach(struct streaming_session *session)
+{
+  pthread_mutex_lock(&streaming_sessions_lck);
 
-  if (!streaming_sessions)
+  if (session->stream)
     {
-      DPRINTF(E_INFO, L_STREAMING, "No more clients, will stop streaming\n");
-      event_del(streamingev);
-      event_del(metaev);
+      streaming_session_remove(session);
+
+      if (streaming_nsessions == 0)
+	{
+	  DPRINTF(E_INFO, L_STREAMING, "No more clients, will stop streaming\n");
+	  event_del(streamingev);
+	  event_del(metaev);
+	}
     }
 
   pthread_mutex_unlock(&streaming_sessions_lck);
 }
 
+// Thread: httpd (the one that owns the request)
 static void
-streaming_end(void)
+streaming_session_send_cb(evutil_socket_t fd, short event, void *arg)
 {
-  struct streaming_session *session;
+  struct streaming_session *session = arg;
   struct evhttp_connection *evcon;
-  char *address;
-  ev_uint16_t port;
+  struct bufferevent *bufev;
+  size_t queued;
 
-  pthread_mutex_lock(&streaming_sessions_lck);
-  for (session = streaming_sessions; streaming_sessions; session = streaming_sessions)
+  if (session->ended)
     {
-      evcon = evhttp_request_get_connection(session->req);
-      if (evcon)
-	{
-	  evhttp_connection_set_closecb(evcon, NULL, NULL);
-	  evhttp_connection_get_peer(evcon, &address, &port);
-	  DPRINTF(E_INFO, L_STREAMING, "Force close stream to %s:%d\n", address, (int)port);
-	}
-      evhttp_send_reply_end(session->req);
+      streaming_session_end(session);
+      return;
+    }
+
+  // A listener that can't keep up would make the connection's output buffer
+  // grow without bounds, so we drop it instead
+  queued = evbuffer_get_length(session->pending);
+  evcon = evhttp_request_get_connection(session->req);
+  bufev = evcon ? evhttp_connection_get_bufferevent(evcon) : NULL;
+  if (bufev)
+    queued += evbuffer_get_length(bufferevent_get_output(bufev));
 
-      streaming_sessions = session->next;
-      free(session);
+  if (queued > session->queued_max)
+    {
+      DPRINTF(E_WARN, L_STREAMING, "Streaming client is too slow (%zu bytes queued), dropping it\n", queued);
+
+      streaming_session_detach(session);
+      streaming_session_end(session);
+      return;
     }
+
+  evhttp_send_reply_chunk(session->req, session->pending);
+}
+
+// The sessions are ended by their own threads. The event must be activated
+// while we hold the lock, since streaming_close_cb() may free the session once
+// it is out of the list. Must be called with the lock held.
+static void
+streaming_sessions_end(struct streaming_stream *stream)
+{
+  struct streaming_session *session;
+
+  for (session = stream->sessions; stream->sessions; session = stream->sessions)
+    {
+      stream->sessions = session->next;
+
+      session->stream = NULL;
+      streaming_nsessions--;
+      if (session->require_icy)
+	--streaming_icy_clients;
+
+      session->ended = true;
+      event_active(session->sendev, 0, 0);
+    }
+}
+
+// Thread: httpd (the one that owns the request)
+static void
+streaming_close_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct streaming_session *session;
+  char *address;
+  ev_uint16_t port;
+
+  session = (struct streaming_session *)arg;
+
+  evhttp_connection_get_peer(evcon, &address, &port);
+  DPRINTF(E_INFO, L_STREAMING, "Stopping streaming to %s:%d\n", address, (int)port);
+
+  streaming_session_detach(session);
+
+  // Valgrind says libevent doesn't free the request on disconnect (even though it owns it - libevent bug?),
+  // so we do it with a reply end
+  evhttp_send_reply_end(session->req);
+  streaming_session_free(session);
+}
+
+static void
+streaming_end(void)
+{
+  struct streaming_stream *stream;
+
+  pthread_mutex_lock(&streaming_sessions_lck);
+  for (stream = streaming_streams; stream; stream = stream->next)
+    streaming_sessions_end(stream);
   pthread_mutex_unlock(&streaming_sessions_lck);
 
   event_del(streamingev);
   event_del(metaev);
 }
 
+// Thread: httpd (main)
+static int
+streaming_stream_encode_setup(struct streaming_stream *stream)
+{
+  struct decode_ctx *decode_ctx;
+  struct evbuffer *header;
+  size_t len;
+
+  decode_ctx = NULL;
+  if (streaming_quality_in.bits_per_sample == 16)
+    decode_ctx = transcode_decode_setup_raw(XCODE_PCM16, &streaming_quality_in);
+  else if (streaming_quality_in.bits_per_sample == 24)
+    decode_ctx = transcode_decode_setup_raw(XCODE_PCM24, &streaming_quality_in);
+  else if (streaming_quality_in.bits_per_sample == 32)
+    decode_ctx = transcode_decode_setup_raw(XCODE_PCM32, &streaming_quality_in);
+
+  if (!decode_ctx)
+    return -1;
+
+  stream->encode_ctx = transcode_encode_setup(stream->format->profile, &stream->quality, decode_ctx, NULL, 0, 0);
+  transcode_decode_cleanup(&decode_ctx);
+  if (!stream->encode_ctx)
+    {
+      DPRINTF(E_LOG, L_STREAMING, "Will not be able to stream %s, libav does not support the encoding: %d/%d/%d @ %d\n", stream->format->ext,
+	stream->quality.sample_rate, stream->quality.bits_per_sample, stream->quality.channels, stream->quality.bit_rate);
+      stream->format->not_supported = true;
+      return -1;
+    }
+
+  // Kept aside, so that it doesn't go to the sessions as part of the data
+  CHECK_NULL(L_STREAMING, header = evbuffer_new());
+  transcode_encode_header(header, stream->encode_ctx);
+
+  if (stream->header)
+    streaming_chunk_unref_cb(NULL, 0, stream->header);
+  stream->header = NULL;
+
+  len = evbuffer_get_length(header);
+  if (len > 0)
+    {
+      stream->header = streaming_chunk_new(len);
+      evbuffer_remove(header, stream->header->data, len);
+    }
+
+  evbuffer_free(header);
+
+  return 0;
+}
+
+// Thread: httpd (main)
 static void
 streaming_meta_cb(evutil_socket_t fd, short event, void *arg)
 {
+  struct streaming_stream *stream;
   struct media_quality quality;
-  struct decode_ctx *decode_ctx;
   int ret;
 
-  transcode_encode_cleanup(&streaming_encode_ctx);
-
   ret = read(fd, &quality, sizeof(struct media_quality));
   if (ret != sizeof(struct media_quality))
     goto error;
 
-  decode_ctx = NULL;
-  if (quality.bits_per_sample == 16)
-    decode_ctx = transcode_decode_setup_raw(XCODE_PCM16, &quality);
-  else if (quality.bits_per_sample == 24)
-    decode_ctx = transcode_decode_setup_raw(XCODE_PCM24, &quality);
-  else if (quality.bits_per_sample == 32)
-    decode_ctx = transcode_decode_setup_raw(XCODE_PCM32, &quality);
-
-  if (!decode_ctx)
+  if (quality.bits_per_sample != 16 && quality.bits_per_sample != 24 && quality.bits_per_sample != 32)
     goto error;
 
-  streaming_encode_ctx = transcode_encode_setup(XCODE_MP3, &streaming_quality_out, decode_ctx, NULL, 0, 0);
-  transcode_decode_cleanup(&decode_ctx);
-  if (!streaming_encode_ctx)
-    {
-      DPRINTF(E_LOG, L_STREAMING, "Will not be able to stream MP3, libav does not support MP3 encoding: %d/%d/%d @ %d\n", streaming_quality_out.sample_rate, streaming_quality_out.bits_per_sample, streaming_quality_out.channels, streaming_quality_out.bit_rate);
-      streaming_not_supported = 1;
-      return;
-    }
+  // The encoders are made again with the new input quality by streaming_encode()
+  pthread_mutex_lock(&streaming_sessions_lck);
+  for (stream = streaming_streams; stream; stream = stream->next)
+    transcode_encode_cleanup(&stream->encode_ctx);
+  pthread_mutex_unlock(&streaming_sessions_lck);
 
   streaming_quality_in = quality;
-  streaming_not_supported = 0;
 
   return;
 
  error:
-  DPRINTF(E_LOG, L_STREAMING, "Unknown or unsupported quality of input data (%d/%d/%d), cannot MP3 encode\n", quality.sample_rate, quality.bits_per_sample, quality.channels);
-  streaming_not_supported = 1;
+  DPRINTF(E_LOG, L_STREAMING, "Unknown or unsupported quality of input data (%d/%d/%d), cannot encode\n", quality.sample_rate, quality.bits_per_sample, quality.channels);
+  memset(&streaming_quality_in, 0, sizeof(struct media_quality));
   streaming_end();
 }
 
 static int
-encode_buffer(uint8_t *buffer, size_t size)
+encode_buffer(struct streaming_stream *stream, uint8_t *buffer, size_t size)
 {
   transcode_frame *frame;
   int samples;
   int ret;
 
-  if (streaming_not_supported)
-    {
-      DPRINTF(E_LOG, L_STREAMING, "Streaming unsupported\n");
-      return -1;
-    }
-
-  if (streaming_quality_in.channels == 0)
-    {
-      DPRINTF(E_LOG, L_STREAMING, "Streaming quality is zero (%d/%d/%d)\n", streaming_quality_in.sample_rate, streaming_quality_in.bits_per_sample, streaming_quality_in.channels);
-      return -1;
-    }
-
   samples = BTOS(size, streaming_quality_in.bits_per_sample, streaming_quality_in.channels);
 
   frame = transcode_frame_new(buffer, size, samples, &streaming_quality_in);
@@ -264,12 +539,45 @@ encode_buffer(uint8_t *buffer, size_t size)
       return -1;
     }
 
-  ret = transcode_encode(streaming_encoded_data, streaming_encode_ctx, frame, 0);
+  ret = transcode_encode(stream->encoded_data, stream->encode_ctx, frame, 0);
   transcode_frame_free(frame);
 
   return ret;
 }
 
+/* Encodes the raw data for each of the streams. A stream that we can't make an
+ * encoder for has its sessions ended, and is removed from the array.
+ *
+ * Thread: httpd (main)
+ */
+static void
+streaming_encode(struct streaming_stream **streams, int *nstreams, uint8_t *buffer, size_t size)
+{
+  int i;
+
+  if (streaming_quality_in.channels == 0)
+    {
+      DPRINTF(E_LOG, L_STREAMING, "Streaming quality is zero (%d/%d/%d)\n", streaming_quality_in.sample_rate, streaming_quality_in.bits_per_sample, streaming_quality_in.channels);
+      return;
+    }
+
+  for (i = 0; i < *nstreams; )
+    {
+      if (!streams[i]->encode_ctx && streaming_stream_encode_setup(streams[i]) < 0)
+	{
+	  pthread_mutex_lock(&streaming_sessions_lck);
+	  streaming_sessions_end(streams[i]);
+	  pthread_mutex_unlock(&streaming_sessions_lck);
+
+	  streams[i] = streams[--(*nstreams)];
+	  continue;
+	}
+
+      encode_buffer(streams[i], buffer, size);
+      i++;
+    }
+}
+
 /* We know that the icymeta is limited to 1+255*16 (ie 4081) bytes so caller must
  * provide a buf of this size to avoid needless mallocs
  *
@@ -321,27 +629,34 @@ streaming_icy_meta_create(uint8_t buf[STREAMING_ICY_METALEN_MAX+1], const char *
   return buf;
 }
 
-static uint8_t *
-streaming_icy_meta_splice(const uint8_t *data, size_t datalen, off_t offset, size_t *len)
+static void
+streaming_chunk_add(struct evbuffer *evbuf, struct streaming_chunk *chunk, size_t offset, size_t len)
 {
-  uint8_t  meta[STREAMING_ICY_METALEN_MAX+1];  // Buffer, of max sz, for the created icymeta
-  unsigned metalen;     // How much of the buffer is in use
-  uint8_t *buf;         // Client returned buffer; contains the audio (from data) spliced w/meta (from meta)
+  int ret;
 
-  if (data == NULL || datalen == 0)
-    return NULL;
+  if (len == 0)
+    return;
 
-  memset(meta, 0, sizeof(meta));
-  streaming_icy_meta_create(meta, streaming_icy_title, &metalen);
+  atomic_fetch_add(&chunk->refcount, 1);
+  ret = evbuffer_add_reference(evbuf, chunk->data + offset, len, streaming_chunk_unref_cb, chunk);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_STREAMING, "Could not add encoded data to streaming buffer\n");
+      streaming_chunk_unref_cb(NULL, 0, chunk);
+    }
+}
 
-  *len = datalen + metalen;
-  // DPRINTF(E_DBG, L_STREAMING, "splicing meta, audio block=%d bytes, offset=%d, metalen=%d new buflen=%d\n", datalen, offset, metalen, *len);
-  buf = malloc(*len);
-  memcpy(buf,                data, offset);
-  memcpy(buf+offset,         &meta[0], metalen);
-  memcpy(buf+offset+metalen, data+offset, datalen-offset);
+static struct streaming_chunk *
+streaming_icy_meta_chunk_new(void)
+{
+  struct streaming_chunk *chunk;
+  unsigned metalen;
 
-  return buf;
+  chunk = streaming_chunk_new(STREAMING_ICY_METALEN_MAX + 1);
+  streaming_icy_meta_create(chunk->data, streaming_icy_title, &metalen);
+  chunk->len = metalen;
+
+  return chunk;
 }
 
 static void
@@ -379,19 +694,102 @@ streaming_player_status_update()
     }
 }
 
+// Queues the encoded data of the stream for each of its sessions and lets the
+// session's thread send it. Must be called with the lock held.
 static void
-streaming_send_cb(evutil_socket_t fd, short event, void *arg)
+streaming_stream_send(struct streaming_stream *stream)
 {
   struct streaming_session *session;
-  struct evbuffer *evbuf;
+  struct streaming_chunk *chunk;
+  struct streaming_chunk *meta;
+  size_t offset;
+  size_t len;
+  size_t n;
+
+  len = evbuffer_get_length(stream->encoded_data);
+  if (len == 0)
+    return;
+
+  chunk = streaming_chunk_new(len);
+  evbuffer_remove(stream->encoded_data, chunk->data, len);
+
+  // Made when the first session needs it, the title is the same for all
+  meta = NULL;
+
+  for (session = stream->sessions; session; session = session->next)
+    {
+      offset = 0;
+
+      // Sessions that joined a stream with a header must get it first. The
+      // header is not audio, so it doesn't count for the ICY interval.
+      if (!session->started && stream->header)
+	streaming_chunk_add(session->pending, stream->header, 0, stream->header->len);
+      session->started = true;
+
+      // ICY clients get a metadata block after every icy_metaint bytes of audio
+      while (session->require_icy && session->bytes_sent + (len - offset) >= streaming_icy_metaint)
+	{
+	  n = streaming_icy_metaint - session->bytes_sent;
+	  streaming_chunk_add(session->pending, chunk, offset, n);
+	  offset += n;
+
+	  if (!meta)
+	    meta = streaming_icy_meta_chunk_new();
+
+	  streaming_chunk_add(session->pending, meta, 0, meta->len);
+	  session->bytes_sent = 0;
+	}
+
+      streaming_chunk_add(session->pending, chunk, offset, len - offset);
+      session->bytes_sent += len - offset;
+
+      event_active(session->sendev, 0, 0);
+    }
+
+  streaming_chunk_unref_cb(NULL, 0, chunk);
+  if (meta)
+    streaming_chunk_unref_cb(NULL, 0, meta);
+}
+
+// Thread: httpd (main)
+static void
+streaming_send_cb(evutil_socket_t fd, short event, void *arg)
+{
+  struct streaming_stream *streams[STREAMING_STREAMS_MAX];
+  struct streaming_stream *stream;
+  struct streaming_stream *prev;
+  struct streaming_stream *next;
   uint8_t rawbuf[STREAMING_READ_SIZE];
-  uint8_t *buf;
-  uint8_t *splice_buf = NULL;
-  size_t splice_len;
-  size_t count;
-  int overflow;
-  int len;
+  int nstreams;
   int ret;
+  int i;
+
+  // Free the streams that no longer have sessions, and take out the ones to
+  // encode. Encoding is done without the lock, new sessions can still be added
+  // meanwhile, but only this thread removes streams.
+  pthread_mutex_lock(&streaming_sessions_lck);
+  nstreams = 0;
+  prev = NULL;
+  for (stream = streaming_streams; stream; stream = next)
+    {
+      next = stream->next;
+
+      if (stream->sessions)
+	{
+	  streams[nstreams++] = stream;
+	  prev = stream;
+	  continue;
+	}
+
+      if (!prev)
+	streaming_streams = next;
+      else
+	prev->next = next;
+
+      streaming_nstreams--;
+      streaming_stream_free(stream);
+    }
+  pthread_mutex_unlock(&streaming_sessions_lck);
 
   // Player wrote data to the pipe (EV_READ)
   if (event & EV_READ)
@@ -408,9 +806,7 @@ streaming_send_cb(evutil_socket_t fd, short event, void *arg)
 	      streaming_player_status_update();
 	    }
 
-	  ret = encode_buffer(rawbuf, ret);
-	  if (ret < 0)
-	    return;
+	  streaming_encode(streams, &nstreams, rawbuf, ret);
 	}
     }
   // Event timed out, let's see what the player is doing and send silence if it is paused
@@ -426,65 +822,13 @@ streaming_send_cb(evutil_socket_t fd, short event, void *arg)
 	return;
 
       memset(&rawbuf, 0, sizeof(rawbuf));
-      ret = encode_buffer(rawbuf, sizeof(rawbuf));
-      if (ret < 0)
-	return;
+      streaming_encode(streams, &nstreams, rawbuf, sizeof(rawbuf));
     }
 
-  len = evbuffer_get_length(streaming_encoded_data);
-  if (len == 0)
-    return;
-
-  // Send data
-  evbuf = evbuffer_new();
   pthread_mutex_lock(&streaming_sessions_lck);
-  for (session = streaming_sessions; session; session = session->next)
-    {
-      // Does this session want ICY meta data and is it time to send?
-      count = session->bytes_sent+len;
-      if (session->require_icy && count > streaming_icy_metaint)
-	{
-	  overflow = count%streaming_icy_metaint;
-	  buf = evbuffer_pullup(streaming_encoded_data, -1);
-
-	  // DPRINTF(E_DBG, L_STREAMING, "session=%x sent=%ld len=%ld overflow=%ld\n", session, session->bytes_sent, len, overflow);
-
-	  // Splice the 'icy title' in with the encoded audio data
-	  splice_len = 0;
-	  splice_buf = streaming_icy_meta_splice(buf, len, len-overflow, &splice_len);
-
-	  evbuffer_add(evbuf, splice_buf, splice_len);
-
-	  free(splice_buf);
-	  splice_buf = NULL;
-
-	  evhttp_send_reply_chunk(session->req, evbuf);
-
-	  if (session->next == NULL)
-	    {
-	      // We're the last session, drop the contents of the encoded buffer
-	      evbuffer_drain(streaming_encoded_data, len);
-	    }
-	  session->bytes_sent = overflow;
-	}
-      else
-	{
-	  if (session->next)
-	    {
-	      buf = evbuffer_pullup(streaming_encoded_data, -1);
-	      evbuffer_add(evbuf, buf, len);
-	      evhttp_send_reply_chunk(session->req, evbuf);
-	    }
-	  else
-	    {
-	      evhttp_send_reply_chunk(session->req, streaming_encoded_data);
-	    }
-	  session->bytes_sent += len;
-	}
-    }
+  for (i = 0; i < nstreams; i++)
+    streaming_stream_send(streams[i]);
   pthread_mutex_unlock(&streaming_sessions_lck);
-
-  evbuffer_free(evbuf);
 }
 
 // Thread: player (not fully thread safe, but hey...)
@@ -501,7 +845,7 @@ streaming_write(struct output_buffer *obuf)
   int ret;
 
   // Explicit no-lock - let the write to pipes fail if during deinit
-  if (!streaming_sessions)
+  if (!streaming_nsessions)
     return;
 
   if (!quality_is_equal(&obuf->data[0].quality, &streaming_quality_in))
@@ -532,10 +876,47 @@ streaming_write(struct output_buffer *obuf)
     }
 }
 
+static struct streaming_format *
+streaming_format_find(const char *path)
+{
+  char *ptr;
+  int i;
+
+  ptr = strrchr(path, '/');
+  if (!ptr || strncasecmp(ptr, "/stream.", strlen("/stream.")) != 0)
+    return NULL;
+
+  ptr += strlen("/stream.");
+
+  for (i = 0; i < ARRAY_SIZE(streaming_formats); i++)
+    {
+      if (strcasecmp(ptr, streaming_formats[i].ext) == 0)
+	return &streaming_formats[i];
+    }
+
+  return NULL;
+}
+
+static bool
+streaming_bit_rate_is_valid(struct streaming_format *format, int bit_rate)
+{
+  int i;
+
+  for (i = 0; format->bit_rates[i]; i++)
+    {
+      if (format->bit_rates[i] == bit_rate)
+	return true;
+    }
+
+  return false;
+}
+
 int
 streaming_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
 {
+  struct streaming_format *format;
   struct streaming_session *session;
+  struct streaming_stream *stream;
   struct evhttp_connection *evcon;
   struct evkeyvalq *output_headers;
   cfg_t *lib;
@@ -544,44 +925,39 @@ streaming_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parse
   ev_uint16_t port;
   const char *param;
   bool require_icy = false;
+  int32_t bit_rate;
   char buf[9];
 
-  if (streaming_not_supported)
+  format = streaming_format_find(uri_parsed->path);
+  if (!format)
     {
-      DPRINTF(E_LOG, L_STREAMING, "Got MP3 streaming request, but cannot encode to MP3\n");
-
       evhttp_send_error(req, HTTP_NOTFOUND, "Not Found");
       return -1;
     }
 
-  evcon = evhttp_request_get_connection(req);
-  evhttp_connection_get_peer(evcon, &address, &port);
-  param = evhttp_find_header( evhttp_request_get_input_headers(req), "Icy-MetaData");
-  if (param && strcmp(param, "1") == 0)
-    require_icy = true;
-
-  DPRINTF(E_INFO, L_STREAMING, "Beginning mp3 streaming (with icy=%d, icy_metaint=%d) to %s:%d\n", require_icy, streaming_icy_metaint, address, (int)port);
+  if (format->not_supported)
+    {
+      DPRINTF(E_LOG, L_STREAMING, "Got %s streaming request, but cannot encode to %s\n", format->ext, format->ext);
 
-  lib = cfg_getsec(cfg, "library");
-  name = cfg_getstr(lib, "name");
+      evhttp_send_error(req, HTTP_NOTFOUND, "Not Found");
+      return -1;
+    }
 
-  output_headers = evhttp_request_get_output_headers(req);
-  evhttp_add_header(output_headers, "Content-Type", "audio/mpeg");
-  evhttp_add_header(output_headers, "Server", "forked-daapd/" VERSION);
-  evhttp_add_header(output_headers, "Cache-Control", "no-cache");
-  evhttp_add_header(output_headers, "Pragma", "no-cache");
-  evhttp_add_header(output_headers, "Expires", "Mon, 31 Aug 2015 06:00:00 GMT");
-  if (require_icy)
+  bit_rate = format->bit_rate_default;
+  param = evhttp_find_header(&uri_parsed->ev_query, "br");
+  if (param && format->bit_rates && (safe_atoi32(param, &bit_rate) < 0 || !streaming_bit_rate_is_valid(format, bit_rate)))
     {
-      ++streaming_icy_clients;
-      evhttp_add_header(output_headers, "icy-name", name);
-      snprintf(buf, sizeof(buf)-1, "%d", streaming_icy_metaint);
-      evhttp_add_header(output_headers, "icy-metaint", buf);
+      DPRINTF(E_LOG, L_STREAMING, "Got %s streaming request with unsupported bit rate '%s'\n", format->ext, param);
+
+      evhttp_send_error(req, HTTP_BADREQUEST, "Bad Request");
+      return -1;
     }
-  evhttp_add_header(output_headers, "Access-Control-Allow-Origin", "*");
-  evhttp_add_header(output_headers, "Access-Control-Allow-Methods", "GET, POST, PUT, DELETE, OPTIONS");
 
-  evhttp_send_reply_start(req, HTTP_OK, "OK");
+  evcon = evhttp_request_get_connection(req);
+  evhttp_connection_get_peer(evcon, &address, &port);
+  param = evhttp_find_header( evhttp_request_get_input_headers(req), "Icy-MetaData");
+  if (format->icy && param && strcmp(param, "1") == 0)
+    require_icy = true;
 
   session = calloc(1, sizeof(struct streaming_session));
   if (!session)
@@ -592,22 +968,68 @@ streaming_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parse
       return -1;
     }
 
+  CHECK_NULL(L_STREAMING, session->pending = evbuffer_new());
+  CHECK_ERR(L_STREAMING, evbuffer_enable_locking(session->pending, NULL));
+  CHECK_NULL(L_STREAMING, session->sendev = event_new(httpd_request_evbase(req), -1, 0, streaming_session_send_cb, session));
+
   pthread_mutex_lock(&streaming_sessions_lck);
 
-  if (!streaming_sessions)
+  stream = streaming_stream_get(format, bit_rate);
+  if (!stream)
+    {
+      pthread_mutex_unlock(&streaming_sessions_lck);
+
+      DPRINTF(E_LOG, L_STREAMING, "Refusing %s streaming to %s:%d, already encoding %d streams\n", format->ext, address, (int)port, STREAMING_STREAMS_MAX);
+
+      streaming_session_free(session);
+      evhttp_send_error(req, HTTP_SERVUNAVAIL, "Service Unavailable");
+      return -1;
+    }
+
+  if (streaming_nsessions == 0)
     {
       event_add(streamingev, &streaming_silence_tv);
       event_add(metaev, NULL);
     }
 
+  // The session's sendev is on our own base, so it can't run before we have
+  // started the reply below
   session->req = req;
-  session->next = streaming_sessions;
+  session->stream = stream;
+  session->next = stream->sessions;
   session->require_icy = require_icy;
   session->bytes_sent = 0;
-  streaming_sessions = session;
+  session->queued_max = STREAMING_QUEUED_MAX_SECS * streaming_byte_rate(&stream->quality);
+  stream->sessions = session;
+  streaming_nsessions++;
+
+  if (require_icy)
+    ++streaming_icy_clients;
 
   pthread_mutex_unlock(&streaming_sessions_lck);
 
+  DPRINTF(E_INFO, L_STREAMING, "Beginning %s streaming @ %d kbps (with icy=%d, icy_metaint=%d) to %s:%d\n", format->ext, bit_rate, require_icy, streaming_icy_metaint, address, (int)port);
+
+  lib = cfg_getsec(cfg, "library");
+  name = cfg_getstr(lib, "name");
+
+  output_headers = evhttp_request_get_output_headers(req);
+  evhttp_add_header(output_headers, "Content-Type", format->content_type);
+  evhttp_add_header(output_headers, "Server", "forked-daapd/" VERSION);
+  evhttp_add_header(output_headers, "Cache-Control", "no-cache");
+  evhttp_add_header(output_headers, "Pragma", "no-cache");
+  evhttp_add_header(output_headers, "Expires", "Mon, 31 Aug 2015 06:00:00 GMT");
+  if (require_icy)
+    {
+      evhttp_add_header(output_headers, "icy-name", name);
+      snprintf(buf, sizeof(buf)-1, "%d", streaming_icy_metaint);
+      evhttp_add_header(output_headers, "icy-metaint", buf);
+    }
+  evhttp_add_header(output_headers, "Access-Control-Allow-Origin", "*");
+  evhttp_add_header(output_headers, "Access-Control-Allow-Methods", "GET, POST, PUT, DELETE, OPTIONS");
+
+  evhttp_send_reply_start(req, HTTP_OK, "OK");
+
   evhttp_connection_set_closecb(evcon, streaming_close_cb, session);
 
   return 0;
@@ -616,13 +1038,7 @@ streaming_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parse
 int
 streaming_is_request(const char *path)
 {
-  char *ptr;
-
-  ptr = strrchr(path, '/');
-  if (ptr && (strcasecmp(ptr, "/stream.mp3") == 0))
-    return 1;
-
-  return 0;
+  return streaming_format_find(path) ? 1 : 0;
 }
 
 int
@@ -639,7 +1055,7 @@ streaming_init(void)
   if (val % 11025 > 0 && val % 12000 > 0 && val % 8000 > 0)
     DPRINTF(E_LOG, L_STREAMING, "Non standard streaming sample_rate=%d, defaulting\n", val);
   else
-    streaming_quality_out.sample_rate = val;
+    streaming_sample_rate = val;
 
   val = cfg_getint(cfgsec, "bit_rate");
   switch (val)
@@ -649,13 +1065,13 @@ streaming_init(void)
     case 128:
     case 192:
     case 320:
-      streaming_quality_out.bit_rate = val*1000;
+      STREAMING_FORMAT_MP3->bit_rate_default = val;
       break;
 
     default:
       DPRINTF(E_LOG, L_STREAMING, "Unsuppported streaming bit_rate=%d, supports: 64/96/128/192/320, defaulting\n", val);
   }
-  DPRINTF(E_INFO, L_STREAMING, "Streaming quality: %d/%d/%d @ %dkbps\n", streaming_quality_out.sample_rate, streaming_quality_out.bits_per_sample, streaming_quality_out.channels, streaming_quality_out.bit_rate/1000);
+  DPRINTF(E_INFO, L_STREAMING, "Streaming quality: %d/%d @ %dkbps (mp3 default)\n", streaming_sample_rate, STREAMING_CHANNELS, STREAMING_FORMAT_MP3->bit_rate_default);
 
   val = cfg_getint(cfgsec, "icy_metaint");
   // Too low a value forces server to send more meta than data
@@ -707,9 +1123,7 @@ streaming_init(void)
       goto error;
     }
 
-  // Initialize buffer for encoded mp3 audio and event for pipe reading
-  CHECK_NULL(L_STREAMING, streaming_encoded_data = evbuffer_new());
-
+  // Initialize events for pipe reading
   CHECK_NULL(L_STREAMING, streamingev = event_new(evbase_httpd, streaming_pipe[0], EV_TIMEOUT | EV_READ | EV_PERSIST, streaming_send_cb, NULL));
   CHECK_NULL(L_STREAMING, metaev = event_new(evbase_httpd, streaming_meta[0], EV_READ | EV_PERSIST, streaming_meta_cb, NULL));
 
@@ -727,10 +1141,32 @@ streaming_init(void)
   return -1;
 }
 
+// Thread: main (httpd threads have been stopped)
 void
 streaming_deinit(void)
 {
-  streaming_end();
+  struct streaming_stream *stream;
+  struct streaming_session *session;
+
+  pthread_mutex_lock(&streaming_sessions_lck);
+  for (stream = streaming_streams; streaming_streams; stream = streaming_streams)
+    {
+      streaming_streams = stream->next;
+
+      for (session = stream->sessions; stream->sessions; session = stream->sessions)
+	{
+	  stream->sessions = session->next;
+	  streaming_session_end(session);
+	}
+
+      streaming_stream_free(stream);
+    }
+  streaming_nstreams = 0;
+  streaming_nsessions = 0;
+  pthread_mutex_unlock(&streaming_sessions_lck);
+
+  event_del(streamingev);
+  event_del(metaev);
 
   event_free(metaev);
   event_free(streamingev);
@@ -743,8 +1179,6 @@ streaming_deinit(void)
   close(streaming_meta[0]);
   close(streaming_meta[1]);
 
-  transcode_encode_cleanup(&streaming_encode_ctx);
-  evbuffer_free(streaming_encoded_data);
   free(streaming_icy_title);
 
   pthread_mutex_destroy(&streaming_sessions_lck);
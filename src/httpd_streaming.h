@@ -5,10 +5,12 @@
 #include "httpd.h"
 #include "outputs.h"
 
-/* httpd_streaming takes care of incoming requests to /stream.mp3
- * It will receive decoded audio from the player, and encode it, and
- * stream it to one or more clients. It will not be available
- * if a suitable ffmpeg/libav encoder is not present at runtime.
+/* httpd_streaming takes care of incoming requests to /stream.mp3, /stream.aac,
+ * /stream.opus and /stream.flac (the lossy ones take a bit rate in kbps, e.g.
+ * /stream.mp3?br=128). It will receive decoded audio from the player, encode
+ * it once per requested format and bit rate, and stream it to one or more
+ * clients. A format will not be available if a suitable ffmpeg/libav encoder
+ * is not present at runtime.
  */
 
 void
@@ -28,6 +28,7 @@
 #include <errno.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <stdatomic.h>
 
 #include <event2/event.h>
 #include <event2/buffer.h>
@@ -48,6 +49,19 @@
 #define INPUT_LOOP_TIMEOUT_NSEC 10000000
 // How long (in sec) to keep an input open without the player reading from it
 #define INPUT_OPEN_TIMEOUT 600
+// Size of the ring buffer for PCM data. Must be a power of two and leave room
+// for the writes that are made while the buffer is at INPUT_BUFFER_THRESHOLD.
+#define INPUT_RING_SIZE (1 << 20)
+// The start of the ring is mirrored after the end, so the player can always
+// get up to this many bytes as one contiguous span
+#define INPUT_RING_SPAN_MAX (64 * 1024)
+// Max number of INPUT_LOOP_TIMEOUT waits without progress when writing the
+// final data of a source, which the buffer is not allowed to refuse
+#define INPUT_END_WAIT_LOOPS 100
+// No marker pending
+#define INPUT_POS_NONE UINT64_MAX
+
+#define CACHELINE_ALIGNED __attribute__((aligned(64)))
 
 //#define DEBUG_INPUT 1
 // For testing http stream underruns
@@ -77,37 +91,65 @@ struct marker
   uint64_t pos;
 
   // Type of marker
-  enum input_flags flag;
+  short flag;
 
-  // Data associated with the marker, e.g. quality or metadata struct
+  // Data associated with the marker, e.g. metadata struct
   void *data;
 
+  // Quality for INPUT_FLAG_QUALITY, stored here so no allocation is needed
+  struct media_quality quality;
+
   // Reverse linked list, yay!
   struct marker *prev;
 };
 
+/* The input buffer is a single-producer/single-consumer ring, so the player can
+ * read without taking locks or copying. The producer is the input thread (or
+ * spotify), the consumer is the player thread. Positions are byte counts that
+ * never wrap, the offset in the ring is pos & (INPUT_RING_SIZE - 1).
+ *
+ * Markers are rare (a few per track), so they are kept in a list protected by
+ * marker_lck. The player only takes the lock when event_pos says that there is
+ * a marker (or a flush) within the data it is about to read.
+ */
 struct input_buffer
 {
-  // Raw pcm stream data
-  struct evbuffer *evbuf;
-
-  // If an input makes a write with a flag or a changed sample rate etc, we add
-  // a marker to head, and when we read we check from the tail to see if there
-  // are updates to the player.
-  struct marker *marker_tail;
-
+  // Raw pcm stream data, INPUT_RING_SIZE + INPUT_RING_SPAN_MAX bytes
+  uint8_t *data;
+
+  // Written by the producer, read by the player
+  CACHELINE_ALIGNED _Atomic uint64_t write_pos;
+  // Position of the first marker, 0 if a flush is pending
+  _Atomic uint64_t event_pos;
+
+  // Written by the player, read by the producer
+  CACHELINE_ALIGNED _Atomic uint64_t read_pos;
+  // Set when the player flushed, so the producer must resend quality
+  atomic_bool quality_reset;
   // Optional callback to player if buffer is full
-  input_cb full_cb;
+  _Atomic(input_cb) full_cb;
 
-  // Quality of write/read data
+  // Producer only. Serializes producers (input and spotify thread), never
+  // taken by the player.
+  CACHELINE_ALIGNED pthread_mutex_t write_lck;
+  // Position of the last flush by the producer
+  uint64_t flush_pos;
   struct media_quality cur_write_quality;
-  struct media_quality cur_read_quality;
 
-  size_t bytes_written;
-  size_t bytes_read;
+  // Player only
+  CACHELINE_ALIGNED struct media_quality cur_read_quality;
 
-  // Locks for sharing the buffer between input and player thread
-  pthread_mutex_t mutex;
+  // Protects the marker list and skip_pos
+  pthread_mutex_t marker_lck;
+  // Reverse linked list, the tail is the next marker to be read
+  struct marker *marker_tail;
+  // Set by a producer flush, the player must skip forward to this position
+  uint64_t skip_pos;
+
+  // For producers waiting for the player to read. The player signals without
+  // holding the lock, so a wakeup can be missed, which just means the producer
+  // waits for the (short) timeout.
+  pthread_mutex_t wait_lck;
   pthread_cond_t cond;
 };
 
@@ -253,14 +295,28 @@ marker_free(struct marker *marker)
   if (marker->flag == INPUT_FLAG_METADATA && marker->data)
     metadata_free(marker->data, 0);
 
-  if (marker->flag == INPUT_FLAG_QUALITY && marker->data)
-    free(marker->data);
-
   free(marker);
 }
 
+// Must be called with marker_lck held
 static void
-marker_add(size_t pos, short flag, void *flagdata)
+event_pos_update(void)
+{
+  uint64_t pos;
+
+  if (input_buffer.skip_pos > atomic_load(&input_buffer.read_pos))
+    pos = 0;
+  else if (input_buffer.marker_tail)
+    pos = input_buffer.marker_tail->pos;
+  else
+    pos = INPUT_POS_NONE;
+
+  atomic_store_explicit(&input_buffer.event_pos, pos, memory_order_release);
+}
+
+// Must be called with marker_lck held
+static struct marker *
+marker_add(uint64_t pos, short flag, void *flagdata)
 {
   struct marker *insert;
   struct marker *compare;
@@ -295,51 +351,148 @@ marker_add(size_t pos, short flag, void *flagdata)
       marker->prev = input_buffer.marker_tail;
       input_buffer.marker_tail = marker;
     }
+
+  return marker;
 }
 
+// Adds the markers for data that is in the ring from write_pos and write_size
+// bytes ahead, and publishes that data to the player. Both happen under
+// marker_lck, so a flush by the player sees either the markers and the data or
+// neither. Otherwise it could discard markers for data that it doesn't skip.
 static void
-markers_set(short flags, size_t write_size)
+markers_set(short flags, uint64_t write_pos, size_t write_size)
 {
-  struct media_quality *quality;
+  struct marker *marker;
   struct input_metadata *metadata;
+  uint64_t read_pos;
+  uint64_t end_pos;
+
+  // Get the metadata before locking, since it involves the db
+  metadata = NULL;
+  if (flags & INPUT_FLAG_METADATA)
+    metadata = metadata_get(&input_now_reading);
+
+  read_pos = atomic_load(&input_buffer.read_pos);
+  end_pos = write_pos + write_size;
+
+  pthread_mutex_lock(&input_buffer.marker_lck);
 
   if (flags & INPUT_FLAG_QUALITY)
     {
-      quality = malloc(sizeof(struct media_quality));
-      *quality = input_buffer.cur_write_quality;
-      marker_add(input_buffer.bytes_written - write_size, INPUT_FLAG_QUALITY, quality);
+      marker = marker_add(write_pos, INPUT_FLAG_QUALITY, NULL);
+      marker->quality = input_buffer.cur_write_quality;
     }
 
   if (flags & (INPUT_FLAG_EOF | INPUT_FLAG_ERROR))
     {
       // This controls when the player will open the next track in the queue
-      if (input_buffer.bytes_read + INPUT_BUFFER_THRESHOLD < input_buffer.bytes_written)
+      if (read_pos + INPUT_BUFFER_THRESHOLD < end_pos)
 	// The player's read is behind, tell it to open when it reaches where
 	// we are minus the buffer size
-	marker_add(input_buffer.bytes_written - INPUT_BUFFER_THRESHOLD, INPUT_FLAG_START_NEXT, NULL);
+	marker_add(end_pos - INPUT_BUFFER_THRESHOLD, INPUT_FLAG_START_NEXT, NULL);
       else
 	// The player's read is close to our write, so open right away
-	marker_add(input_buffer.bytes_read, INPUT_FLAG_START_NEXT, NULL);
+	marker_add(read_pos, INPUT_FLAG_START_NEXT, NULL);
 
-      marker_add(input_buffer.bytes_written, flags & (INPUT_FLAG_EOF | INPUT_FLAG_ERROR), NULL);
+      marker_add(end_pos, flags & (INPUT_FLAG_EOF | INPUT_FLAG_ERROR), NULL);
     }
 
-  if (flags & INPUT_FLAG_METADATA)
-    {
-      metadata = metadata_get(&input_now_reading);
-      if (metadata)
-	marker_add(input_buffer.bytes_written, INPUT_FLAG_METADATA, metadata);
-    }
+  if (metadata)
+    marker_add(end_pos, INPUT_FLAG_METADATA, metadata);
+
+  atomic_store_explicit(&input_buffer.write_pos, end_pos, memory_order_release);
+
+  event_pos_update();
+
+  pthread_mutex_unlock(&input_buffer.marker_lck);
 }
 
 static inline void
 buffer_full_cb(void)
 {
-  if (!input_buffer.full_cb)
-    return;
+  input_cb cb;
+
+  cb = atomic_exchange(&input_buffer.full_cb, NULL);
+  if (cb)
+    cb();
+}
+
+// Bytes of unread data since the last flush. Must be called with write_lck.
+static inline size_t
+buffer_fill(uint64_t *used)
+{
+  uint64_t write_pos;
+  uint64_t read_pos;
+
+  write_pos = atomic_load_explicit(&input_buffer.write_pos, memory_order_relaxed);
+  read_pos = atomic_load_explicit(&input_buffer.read_pos, memory_order_acquire);
+
+  // The player may not have skipped the data flushed by us yet, but the data
+  // still takes up space in the ring
+  if (used)
+    *used = write_pos - read_pos;
+
+  if (read_pos < input_buffer.flush_pos)
+    read_pos = input_buffer.flush_pos;
+
+  return write_pos - read_pos;
+}
+
+// Must be called with write_lck
+static inline bool
+buffer_is_full(void)
+{
+  uint64_t used;
+  size_t fill;
+
+  fill = buffer_fill(&used);
+
+  return (fill > INPUT_BUFFER_THRESHOLD) || (used > INPUT_RING_SIZE - INPUT_BUFFER_THRESHOLD);
+}
+
+// Copies up to len bytes from evbuf to the ring at write_pos, without publishing
+// them to the player. Returns number of bytes copied.
+static size_t
+ring_copy_in(uint64_t write_pos, struct evbuffer *evbuf, size_t len)
+{
+  size_t written;
+  size_t offset;
+  size_t n;
+  int ret;
+
+  written = 0;
+  while (written < len)
+    {
+      offset = (write_pos + written) & (INPUT_RING_SIZE - 1);
+      n = MIN(len - written, INPUT_RING_SIZE - offset);
+
+      ret = evbuffer_remove(evbuf, input_buffer.data + offset, n);
+      if (ret <= 0)
+	break;
+
+      n = ret;
+
+      // Mirror the start of the ring so that reads can go past the end
+      if (offset < INPUT_RING_SPAN_MAX)
+	memcpy(input_buffer.data + INPUT_RING_SIZE + offset, input_buffer.data + offset, MIN(n, INPUT_RING_SPAN_MAX - offset));
+
+      written += n;
+    }
+
+  return written;
+}
 
-  input_buffer.full_cb();
-  input_buffer.full_cb = NULL;
+static void
+producer_wait(void)
+{
+  struct timespec ts;
+
+  pthread_mutex_lock(&input_buffer.wait_lck);
+
+  ts = timespec_reltoabs(input_loop_timeout);
+  pthread_cond_timedwait(&input_buffer.cond, &input_buffer.wait_lck, &ts);
+
+  pthread_mutex_unlock(&input_buffer.wait_lck);
 }
 
 
@@ -352,44 +505,41 @@ clear(struct input_source *source)
   memset(source, 0, sizeof(struct input_source));
 }
 
+// Flush from the producer side. The player may be reading, so the data can't
+// be discarded here. Instead we tell the player to skip to where we are now.
 static void
-flush(short *flagptr)
+flush(void)
 {
   struct marker *marker;
-  short flags;
-  size_t len;
+  uint64_t write_pos;
 
-  pthread_mutex_lock(&input_buffer.mutex);
+  pthread_mutex_lock(&input_buffer.write_lck);
+
+  write_pos = atomic_load_explicit(&input_buffer.write_pos, memory_order_relaxed);
+
+  pthread_mutex_lock(&input_buffer.marker_lck);
 
-  // We will return an OR of all the unread marker flags
-  flags = 0;
   for (marker = input_buffer.marker_tail; marker; marker = input_buffer.marker_tail)
     {
-      flags |= marker->flag;
       input_buffer.marker_tail = marker->prev;
       marker_free(marker);
     }
 
-  len = evbuffer_get_length(input_buffer.evbuf);
+  input_buffer.skip_pos = write_pos;
 
-  evbuffer_drain(input_buffer.evbuf, len);
-
-  memset(&input_buffer.cur_read_quality, 0, sizeof(struct media_quality));
-  memset(&input_buffer.cur_write_quality, 0, sizeof(struct media_quality));
+  event_pos_update();
 
-  input_buffer.bytes_read = 0;
-  input_buffer.bytes_written = 0;
-
-  input_buffer.full_cb = NULL;
-
-  pthread_mutex_unlock(&input_buffer.mutex);
+  pthread_mutex_unlock(&input_buffer.marker_lck);
 
 #ifdef DEBUG_INPUT
-  DPRINTF(E_DBG, L_PLAYER, "Flushing %zu bytes with flags %d\n", len, flags);
+  DPRINTF(E_DBG, L_PLAYER, "Flushing %zu bytes\n", buffer_fill(NULL));
 #endif
 
-  if (flagptr)
-    *flagptr = flags;
+  input_buffer.flush_pos = write_pos;
+  memset(&input_buffer.cur_write_quality, 0, sizeof(struct media_quality));
+  atomic_store(&input_buffer.full_cb, NULL);
+
+  pthread_mutex_unlock(&input_buffer.write_lck);
 }
 
 static void
@@ -405,7 +555,7 @@ stop(void)
   if (inputs[type]->stop && input_now_reading.open)
     inputs[type]->stop(&input_now_reading);
 
-  flush(NULL);
+  flush();
 
   clear(&input_now_reading);
 }
@@ -478,7 +628,7 @@ start(void *arg, int *retval)
   // If we are asked to start the item that is currently open we can just seek
   if (input_now_reading.open && cmdarg->item_id == input_now_reading.item_id)
     {
-      flush(NULL);
+      flush();
 
       ret = seek(&input_now_reading, cmdarg->seek_ms);
       if (ret < 0)
@@ -551,7 +701,13 @@ stop_cmd(void *arg, int *retval)
 static void
 timeout_cb(int fd, short what, void *arg)
 {
-  if (input_buffer.bytes_read > 0)
+  bool has_read;
+
+  pthread_mutex_lock(&input_buffer.write_lck);
+  has_read = (atomic_load(&input_buffer.read_pos) > input_buffer.flush_pos);
+  pthread_mutex_unlock(&input_buffer.write_lck);
+
+  if (has_read)
     return;
 
   DPRINTF(E_WARN, L_PLAYER, "Timed out after %d sec without any reading from input source\n", INPUT_OPEN_TIMEOUT);
@@ -563,15 +719,21 @@ timeout_cb(int fd, short what, void *arg)
 /* ---------------------- Interface towards input backends ------------------ */
 /*                           Thread: input and spotify                        */
 
-// Called by input modules from within the playback loop
+// Called by input modules from within the playback loop. If the ring doesn't
+// have room for all of evbuf we take what we can, and the rest stays in evbuf.
 int
 input_write(struct evbuffer *evbuf, struct media_quality *quality, short flags)
 {
+  uint64_t write_pos;
+  uint64_t used;
   bool read_end;
+  size_t space;
   size_t len;
+  size_t n;
+  int wait_loops;
   int ret;
 
-  pthread_mutex_lock(&input_buffer.mutex);
+  pthread_mutex_lock(&input_buffer.write_lck);
 
   read_end = (flags & (INPUT_FLAG_EOF | INPUT_FLAG_ERROR));
   if (read_end)
@@ -580,7 +742,7 @@ input_write(struct evbuffer *evbuf, struct media_quality *quality, short flags)
       input_now_reading.open = false;
     }
 
-  if ((evbuffer_get_length(input_buffer.evbuf) > INPUT_BUFFER_THRESHOLD) && evbuf)
+  if (evbuf && buffer_is_full())
     {
       buffer_full_cb();
 
@@ -588,46 +750,82 @@ input_write(struct evbuffer *evbuf, struct media_quality *quality, short flags)
       // buffer is full. There is no point in holding back the input in that case.
       if (!read_end)
 	{
-	  pthread_mutex_unlock(&input_buffer.mutex);
+	  pthread_mutex_unlock(&input_buffer.write_lck);
 	  return EAGAIN;
 	}
     }
 
+  // The player flushed, so it no longer knows the quality
+  if (atomic_exchange(&input_buffer.quality_reset, false))
+    memset(&input_buffer.cur_write_quality, 0, sizeof(struct media_quality));
+
   if (quality && !quality_is_equal(quality, &input_buffer.cur_write_quality))
     {
       input_buffer.cur_write_quality = *quality;
       flags |= INPUT_FLAG_QUALITY;
     }
 
+  write_pos = atomic_load_explicit(&input_buffer.write_pos, memory_order_relaxed);
+
   ret = 0;
   len = 0;
   if (evbuf)
     {
-      len = evbuffer_get_length(evbuf);
 #ifdef DEBUG_UNDERRUN
       // Starves the player so it underruns after a few minutes
       debug_underrun_trigger++;
       if (debug_underrun_trigger % 10 == 0)
 	{
-	  DPRINTF(E_DBG, L_PLAYER, "Underrun debug mode: Dropping audio buffer length %zu\n", len);
-	  evbuffer_drain(evbuf, len);
-	  len = 0;
+	  DPRINTF(E_DBG, L_PLAYER, "Underrun debug mode: Dropping audio buffer length %zu\n", evbuffer_get_length(evbuf));
+	  evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
 	}
 #endif
-      input_buffer.bytes_written += len;
-      ret = evbuffer_add_buffer(input_buffer.evbuf, evbuf);
-      if (ret < 0)
+      wait_loops = 0;
+      while (evbuffer_get_length(evbuf) > 0)
 	{
-	  DPRINTF(E_LOG, L_PLAYER, "Error adding stream data to input buffer, stopping\n");
-	  input_stop();
-	  flags |= INPUT_FLAG_ERROR;
+	  buffer_fill(&used);
+	  space = INPUT_RING_SIZE - used;
+
+	  n = ring_copy_in(write_pos + len, evbuf, MIN(space, evbuffer_get_length(evbuf)));
+	  len += n;
+
+	  if (evbuffer_get_length(evbuf) == 0 || !read_end)
+	    break;
+
+	  // The final data of a source must get through, so we wait for the
+	  // player to make room (data written so far must be published first)
+	  if (n > 0)
+	    {
+	      markers_set(flags & INPUT_FLAG_QUALITY, write_pos, len);
+	      flags &= ~INPUT_FLAG_QUALITY;
+	      write_pos += len;
+	      len = 0;
+	      wait_loops = 0;
+	    }
+	  else if (++wait_loops > INPUT_END_WAIT_LOOPS)
+	    {
+	      DPRINTF(E_LOG, L_PLAYER, "Player is not reading, dropping last %zu bytes of input\n", evbuffer_get_length(evbuf));
+	      evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+	      break;
+	    }
+
+	  producer_wait();
+	}
+
+      if (evbuffer_get_length(evbuf) > 0)
+	{
+	  buffer_full_cb();
+	  ret = EAGAIN;
 	}
     }
 
+  // Markers must be in place when the player can see the data
   if (flags)
-    markers_set(flags, len);
+    markers_set(flags, write_pos, len);
+  else
+    atomic_store_explicit(&input_buffer.write_pos, write_pos + len, memory_order_release);
 
-  pthread_mutex_unlock(&input_buffer.mutex);
+  pthread_mutex_unlock(&input_buffer.write_lck);
 
   return ret;
 }
@@ -635,14 +833,8 @@ input_write(struct evbuffer *evbuf, struct media_quality *quality, short flags)
 int
 input_wait(void)
 {
-  struct timespec ts;
+  producer_wait();
 
-  pthread_mutex_lock(&input_buffer.mutex);
-
-  ts = timespec_reltoabs(input_loop_timeout);
-  pthread_cond_timedwait(&input_buffer.cond, &input_buffer.mutex, &ts);
-
-  pthread_mutex_unlock(&input_buffer.mutex);
   return 0;
 }
 
@@ -679,27 +871,25 @@ input(void *arg)
 static int
 wait_buffer_ready(void)
 {
-  struct timespec ts;
+  bool is_full;
 
-  pthread_mutex_lock(&input_buffer.mutex);
+  pthread_mutex_lock(&input_buffer.write_lck);
+  is_full = buffer_is_full();
+  if (is_full)
+    buffer_full_cb();
+  pthread_mutex_unlock(&input_buffer.write_lck);
 
-  // Is the buffer full? Then wait for a read or for loop_timeout to elapse
-  if (evbuffer_get_length(input_buffer.evbuf) > INPUT_BUFFER_THRESHOLD)
-    {
-      buffer_full_cb();
+  if (!is_full)
+    return 0;
 
-      ts = timespec_reltoabs(input_loop_timeout);
-      pthread_cond_timedwait(&input_buffer.cond, &input_buffer.mutex, &ts);
+  // The buffer is full, so wait for a read or for loop_timeout to elapse
+  producer_wait();
 
-      if (evbuffer_get_length(input_buffer.evbuf) > INPUT_BUFFER_THRESHOLD)
-	{
-	  pthread_mutex_unlock(&input_buffer.mutex);
-	  return -1;
-	}
-    }
+  pthread_mutex_lock(&input_buffer.write_lck);
+  is_full = buffer_is_full();
+  pthread_mutex_unlock(&input_buffer.write_lck);
 
-  pthread_mutex_unlock(&input_buffer.mutex);
-  return 0;
+  return is_full ? -1 : 0;
 }
 
 static void
@@ -740,70 +930,128 @@ play(evutil_socket_t fd, short flags, void *arg)
 /* ---------------------- Interface towards player thread ------------------- */
 /*                                Thread: player                              */
 
-int
-input_read(void *data, size_t size, short *flag, void **flagdata)
+// Handles a flush from the producer and the next marker, if it is within the
+// size bytes that will be read. Returns how much data can be read from
+// read_pos without passing the marker.
+static size_t
+read_marker(uint64_t *read_pos, uint64_t *write_pos, size_t size, short *flag, void **flagdata)
 {
   struct marker *marker;
-  int len;
 
-  *flag = 0;
+  pthread_mutex_lock(&input_buffer.marker_lck);
 
-  pthread_mutex_lock(&input_buffer.mutex);
+  *write_pos = atomic_load_explicit(&input_buffer.write_pos, memory_order_acquire);
+  *read_pos = atomic_load_explicit(&input_buffer.read_pos, memory_order_relaxed);
 
-  // First we check if there is a marker in the requested samples. If there is,
-  // we only return data up until that marker. That way we don't have to deal
+  // The producer flushed, so skip the data that was written before
+  if (input_buffer.skip_pos > *read_pos)
+    {
+      *read_pos = input_buffer.skip_pos;
+      atomic_store_explicit(&input_buffer.read_pos, *read_pos, memory_order_release);
+      memset(&input_buffer.cur_read_quality, 0, sizeof(struct media_quality));
+    }
+
+  // Only consider markers that are within what has been written
+  size = MIN(size, *write_pos - *read_pos);
+
+  // We only return data up until the marker. That way we don't have to deal
   // with multiple markers, and we don't return data that contains mixed sample
   // rates, bits per sample or an EOF in the middle.
   marker = input_buffer.marker_tail;
-  if (marker && marker->pos <= input_buffer.bytes_read + size)
+  if (marker && marker->pos <= *read_pos + size)
     {
       *flag = marker->flag;
       *flagdata = marker->data;
 
-      size = marker->pos - input_buffer.bytes_read;
+      if (marker->flag == INPUT_FLAG_QUALITY)
+	{
+	  input_buffer.cur_read_quality = marker->quality;
+	  *flagdata = &input_buffer.cur_read_quality;
+	}
+
+      size = (marker->pos > *read_pos) ? marker->pos - *read_pos : 0;
       input_buffer.marker_tail = marker->prev;
       free(marker);
     }
 
-  len = evbuffer_remove(input_buffer.evbuf, data, size);
-  if (len < 0)
-    {
-      DPRINTF(E_LOG, L_PLAYER, "Error reading stream data from input buffer\n");
-      *flag = INPUT_FLAG_ERROR;
-      goto out_unlock;
-    }
+  event_pos_update();
 
-  input_buffer.bytes_read += len;
+  pthread_mutex_unlock(&input_buffer.marker_lck);
 
-#ifdef DEBUG_INPUT
-  // Logs if flags present or each 10 seconds
+  return size;
+}
+
+int
+input_read_span(void **span, size_t size, short *flag, void **flagdata)
+{
+  uint64_t write_pos;
+  uint64_t read_pos;
+  uint64_t event_pos;
+  size_t offset;
+
+  *flag = 0;
+  *flagdata = NULL;
+
+  write_pos = atomic_load_explicit(&input_buffer.write_pos, memory_order_acquire);
+  event_pos = atomic_load_explicit(&input_buffer.event_pos, memory_order_acquire);
+  read_pos = atomic_load_explicit(&input_buffer.read_pos, memory_order_relaxed);
 
-  if (*flag & INPUT_FLAG_QUALITY)
-    input_buffer.cur_read_quality = *((struct media_quality *)(*flagdata));
+  // Only take the lock if there is a flush or a marker where we will read
+  if (event_pos <= read_pos + MIN(size, write_pos - read_pos))
+    size = read_marker(&read_pos, &write_pos, size, flag, flagdata);
+  else
+    size = MIN(size, write_pos - read_pos);
+
+  offset = read_pos & (INPUT_RING_SIZE - 1);
+  size = MIN(size, INPUT_RING_SIZE + INPUT_RING_SPAN_MAX - offset);
+
+  *span = input_buffer.data + offset;
 
+#ifdef DEBUG_INPUT
+  // Logs if flags present or each 10 seconds
   size_t one_sec_size = STOB(input_buffer.cur_read_quality.sample_rate, input_buffer.cur_read_quality.bits_per_sample, input_buffer.cur_read_quality.channels);
-  debug_elapsed += len;
+  debug_elapsed += size;
   if (*flag || (debug_elapsed > 10 * one_sec_size))
     {
       debug_elapsed = 0;
-      DPRINTF(E_DBG, L_PLAYER, "READ %zu bytes (%d/%d/%d), WROTE %zu bytes (%d/%d/%d), SIZE %zu (=%zu), FLAGS %04x\n",
-        input_buffer.bytes_read,
+      DPRINTF(E_DBG, L_PLAYER, "READ %" PRIu64 " bytes (%d/%d/%d), WROTE %" PRIu64 " bytes, SIZE %" PRIu64 ", FLAGS %04x\n",
+        read_pos,
         input_buffer.cur_read_quality.sample_rate,
         input_buffer.cur_read_quality.bits_per_sample,
         input_buffer.cur_read_quality.channels,
-        input_buffer.bytes_written,
-        input_buffer.cur_write_quality.sample_rate,
-        input_buffer.cur_write_quality.bits_per_sample,
-        input_buffer.cur_write_quality.channels,
-        evbuffer_get_length(input_buffer.evbuf),
-        input_buffer.bytes_written - input_buffer.bytes_read,
+        write_pos,
+        write_pos - read_pos,
         *flag);
     }
 #endif
 
- out_unlock:
+  return size;
+}
+
+void
+input_read_release(size_t len)
+{
+  if (len == 0)
+    return;
+
+  atomic_fetch_add_explicit(&input_buffer.read_pos, len, memory_order_release);
+
+  // Wake up a producer waiting for room, no need for the lock (see struct)
   pthread_cond_signal(&input_buffer.cond);
-  pthread_mutex_unlock(&input_buffer.mutex);
+}
+
+int
+input_read(void *data, size_t size, short *flag, void **flagdata)
+{
+  void *span;
+  int len;
+
+  len = input_read_span(&span, size, flag, flagdata);
+  if (len > 0)
+    {
+      memcpy(data, span, len);
+      input_read_release(len);
+    }
 
   return len;
 }
@@ -811,10 +1059,7 @@ input_read(void *data, size_t size, short *flag, void **flagdata)
 void
 input_buffer_full_cb(input_cb cb)
 {
-  pthread_mutex_lock(&input_buffer.mutex);
-  input_buffer.full_cb = cb;
-
-  pthread_mutex_unlock(&input_buffer.mutex);
+  atomic_store(&input_buffer.full_cb, cb);
 }
 
 int
@@ -861,10 +1106,50 @@ input_stop(void)
 }
 
 void
-input_flush(short *flags)
+input_flush(short *flagptr)
 {
-  // Flush should be thread safe
-  flush(flags);
+  struct marker *marker;
+  short flags;
+#ifdef DEBUG_INPUT
+  uint64_t len;
+#endif
+
+  pthread_mutex_lock(&input_buffer.marker_lck);
+
+  // We will return an OR of all the unread marker flags
+  flags = 0;
+  for (marker = input_buffer.marker_tail; marker; marker = input_buffer.marker_tail)
+    {
+      flags |= marker->flag;
+      input_buffer.marker_tail = marker->prev;
+      marker_free(marker);
+    }
+
+#ifdef DEBUG_INPUT
+  len = atomic_load(&input_buffer.write_pos) - atomic_load(&input_buffer.read_pos);
+#endif
+
+  // Skip everything that the producer has written
+  input_buffer.skip_pos = atomic_load_explicit(&input_buffer.write_pos, memory_order_acquire);
+  atomic_store_explicit(&input_buffer.read_pos, input_buffer.skip_pos, memory_order_release);
+
+  event_pos_update();
+
+  pthread_mutex_unlock(&input_buffer.marker_lck);
+
+  memset(&input_buffer.cur_read_quality, 0, sizeof(struct media_quality));
+
+  atomic_store(&input_buffer.quality_reset, true);
+  atomic_store(&input_buffer.full_cb, NULL);
+
+  pthread_cond_signal(&input_buffer.cond);
+
+#ifdef DEBUG_INPUT
+  DPRINTF(E_DBG, L_PLAYER, "Flushing %" PRIu64 " bytes with flags %d\n", len, flags);
+#endif
+
+  if (flagptr)
+    *flagptr = flags;
 }
 
 // Not currently used, perhaps remove?
@@ -882,11 +1167,19 @@ input_init(void)
   int i;
 
   // Prepare input buffer
-  pthread_mutex_init(&input_buffer.mutex, NULL);
+  pthread_mutex_init(&input_buffer.write_lck, NULL);
+  pthread_mutex_init(&input_buffer.marker_lck, NULL);
+  pthread_mutex_init(&input_buffer.wait_lck, NULL);
   pthread_cond_init(&input_buffer.cond, NULL);
 
+  CHECK_NULL(L_PLAYER, input_buffer.data = malloc(INPUT_RING_SIZE + INPUT_RING_SPAN_MAX));
+  atomic_init(&input_buffer.write_pos, 0);
+  atomic_init(&input_buffer.read_pos, 0);
+  atomic_init(&input_buffer.event_pos, INPUT_POS_NONE);
+  atomic_init(&input_buffer.quality_reset, false);
+  atomic_init(&input_buffer.full_cb, NULL);
+
   CHECK_NULL(L_PLAYER, evbase_input = event_base_new());
-  CHECK_NULL(L_PLAYER, input_buffer.evbuf = evbuffer_new());
   CHECK_NULL(L_PLAYER, input_ev = event_new(evbase_input, -1, EV_PERSIST, play, NULL));
   CHECK_NULL(L_PLAYER, input_open_timeout_ev = evtimer_new(evbase_input, timeout_cb, NULL));
 
@@ -937,8 +1230,8 @@ input_init(void)
  input_fail:
   event_free(input_open_timeout_ev);
   event_free(input_ev);
-  evbuffer_free(input_buffer.evbuf);
   event_base_free(evbase_input);
+  free(input_buffer.data);
   return -1;
 }
 
@@ -970,12 +1263,16 @@ input_deinit(void)
       return;
     }
 
+  input_flush(NULL);
+
   pthread_cond_destroy(&input_buffer.cond);
-  pthread_mutex_destroy(&input_buffer.mutex);
+  pthread_mutex_destroy(&input_buffer.wait_lck);
+  pthread_mutex_destroy(&input_buffer.marker_lck);
+  pthread_mutex_destroy(&input_buffer.write_lck);
 
   event_free(input_open_timeout_ev);
   event_free(input_ev);
-  evbuffer_free(input_buffer.evbuf);
   event_base_free(evbase_input);
+  free(input_buffer.data);
 }
 
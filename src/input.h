@@ -134,6 +134,10 @@ struct input_definition
  * samples. The input evbuf will be drained on succesful write. This is to avoid
  * copying memory.
  *
+ * If the buffer only has room for part of evbuf, the rest is left in evbuf and
+ * EAGAIN is returned. Writes with INPUT_FLAG_EOF or INPUT_FLAG_ERROR will wait
+ * for the player to make room.
+ *
  * @in  evbuf    Raw PCM_LE audio data to write
  * @in  evbuf    Quality of the PCM (sample rate etc.)
  * @in  flags    One or more INPUT_FLAG_*
@@ -165,6 +169,29 @@ input_wait(void);
 int
 input_read(void *data, size_t size, short *flag, void **flagdata);
 
+/*
+ * Same as input_read(), but instead of copying, span is set to point directly
+ * at the data in the input buffer. The data is valid until it is given back
+ * with input_read_release(), which must be done before the next read.
+ *
+ * @out span     Pointer to the stream data
+ * @in  size     Max number of bytes to get
+ * @out flag     Flag INPUT_FLAG_*
+ * @out flagdata Data associated with the flag, e.g. quality or metadata struct
+ * @return       Number of bytes available at span, -1 on error
+ */
+int
+input_read_span(void **span, size_t size, short *flag, void **flagdata);
+
+/*
+ * Releases data obtained with input_read_span(), so that the input can reuse
+ * the space in the buffer.
+ *
+ * @in  len      Number of bytes to release, i.e. the return of input_read_span
+ */
+void
+input_read_release(size_t len);
+
 /*
  * Player can set this to get a callback from the input when the input buffer
  * is full. The player may use this to resume playback after an underrun.
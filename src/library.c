@@ -122,14 +122,14 @@ static struct library_callback_register library_cb_register[LIBRARY_MAX_CALLBACK
 
 /* ------------------- CALLED BY LIBRARY SOURCE MODULES -------------------- */
 
-int
-library_media_save(struct media_file_info *mfi)
+static bool
+media_file_check(struct media_file_info *mfi)
 {
   if (!mfi->path || !mfi->fname)
     {
       DPRINTF(E_LOG, L_LIB, "Ignoring media file with missing values (path='%s', fname='%s', data_kind='%d')\n",
 	      mfi->path, mfi->fname, mfi->data_kind);
-      return -1;
+      return false;
     }
 
   if (!mfi->directory_id || !mfi->virtual_path)
@@ -139,12 +139,46 @@ library_media_save(struct media_file_info *mfi)
 	      mfi->path, mfi->directory_id, mfi->virtual_path);
     }
 
+  return true;
+}
+
+int
+library_media_save(struct media_file_info *mfi)
+{
+  if (!media_file_check(mfi))
+    return -1;
+
   if (mfi->id == 0)
     return db_file_add(mfi);
   else
     return db_file_update(mfi);
 }
 
+int
+library_media_save_batch(struct media_file_info **mfis, int n)
+{
+  struct media_file_info **valid;
+  int nvalid;
+  int i;
+  int ret;
+
+  if (n <= 0)
+    return 0;
+
+  CHECK_NULL(L_LIB, valid = calloc(n, sizeof(struct media_file_info *)));
+
+  for (i = 0, nvalid = 0; i < n; i++)
+    {
+      if (media_file_check(mfis[i]))
+	valid[nvalid++] = mfis[i];
+    }
+
+  ret = db_file_save_batch(valid, nvalid);
+
+  free(valid);
+  return ret;
+}
+
 int
 library_playlist_save(struct playlist_info *pli)
 {
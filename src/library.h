@@ -125,6 +125,17 @@ struct library_source
 int
 library_media_save(struct media_file_info *mfi);
 
+/*
+ * Adds or updates a batch of mfi's, e.g. from a bulk scan. Files are looked
+ * up by path, so mfi->id may be 0 also for files that are in the library.
+ *
+ * @param mfis Media to save
+ * @param n    Number of media in mfis
+ * @return     Number of media saved, -1 on failure
+ */
+int
+library_media_save_batch(struct media_file_info **mfis, int n);
+
 /*
  * Adds a playlist if pli->id == 0, otherwise updates.
  *
@@ -83,6 +83,13 @@
 #define F_SCAN_TYPE_AUDIOBOOK    (1 << 2)
 #define F_SCAN_TYPE_COMPILATION  (1 << 3)
 
+// Max number of threads that probe files with ffmpeg during a bulk scan
+#define SCAN_THREADS_MAX         16
+// Files that can be queued per probe thread. The queue is bounded so the
+// directory walk doesn't get too far ahead of the writing to the db. The files
+// are saved when the queue is full, so this is also about the batch size.
+#define SCAN_JOBS_PER_THREAD     32
+
 
 enum file_type {
   FILE_UNKNOWN = 0,
@@ -108,16 +115,83 @@ struct deferred_pl {
   int directory_id;
 };
 
+// Files that were written and wait to be scanned together, see
+// process_inotify_file_batch()
+struct pending_file {
+  struct watch_info wi;
+  char *path;
+  uint32_t path_hash;
+  // In the order the files were written
+  struct pending_file *prev;
+  struct pending_file *next;
+  // Next file in the same pending_files_hash bucket
+  struct pending_file *hash_next;
+};
+
 struct stacked_dir {
   char *path;
   int parent_id;
   struct stacked_dir *next;
 };
 
+// Regular files that were not modified since their directory was last scanned
+struct unchanged_file {
+  char *path;
+  struct stat sb;
+  struct unchanged_file *next;
+};
+
+// Directories that were completely scanned, their mtime is saved at the end of
+// the bulk scan
+struct scanned_dir {
+  int id;
+  time_t mtime;
+  struct scanned_dir *next;
+};
+
+struct scan_job {
+  struct media_file_info mfi;
+  time_t mtime;
+  int ret;
+  bool done;
+};
+
+// During bulk scans the scan thread walks the directories and checks the db,
+// the probing with ffmpeg is done by the pool's threads, and then the scan
+// thread saves the results to the db in the order the files were found.
+struct scan_pool {
+  pthread_t tid[SCAN_THREADS_MAX];
+  int nthreads;
+
+  pthread_mutex_t lck;
+  // Signals the probe threads that there are jobs (or that they must exit)
+  pthread_cond_t job_cond;
+  // Signals the scan thread that a job is done
+  pthread_cond_t done_cond;
+
+  // Ring of jobs in the order they were added. The count jobs from head are
+  // queued, probing or done, and the last npending of them are not yet picked
+  // up by a probe thread.
+  struct scan_job *jobs;
+  // For the mfi's of the jobs that are saved together
+  struct media_file_info **batch;
+  int size;
+  int head;
+  int count;
+  int next;
+  int npending;
+
+  bool exit;
+};
+
 static int inofd;
 static struct event *inoev;
+static struct event *pendingev;
+static struct pending_file *pending_files;
+static int pending_files_count;
 static struct deferred_pl *playlists;
 static struct stacked_dir *dirstack;
+static struct scanned_dir *scanned_dirs;
 
 /* From library.c */
 extern struct event_base *evbase_lib;
@@ -139,6 +213,9 @@ static struct event *deferred_inoev;
 
 /* Count of files scanned during a bulk scan */
 static int counter;
+static time_t counter_start;
+
+static struct scan_pool scan_pool;
 
 /* When copying into the lib (eg. if a file is moved to the lib by copying into
  * a Samba network share) inotify might give us IN_CREATE -> n x IN_ATTRIB ->
@@ -150,6 +227,17 @@ static int counter;
 static int incomingfiles_idx;
 static uint32_t incomingfiles_buffer[INCOMINGFILES_BUFFER_SIZE];
 
+/* Written files are scanned in batches of at most this many files, and at the
+ * latest this long after the first file of the batch was written.
+ */
+#define PENDING_FILES_MAX 200
+static struct timeval pending_files_wait = { 2, 0 };
+
+/* Pending files are also found by the hash of their path, must be a power of 2 */
+#define PENDING_FILES_HASH_SIZE 256
+static struct pending_file *pending_files_hash[PENDING_FILES_HASH_SIZE];
+static struct pending_file *pending_files_last;
+
 /* Forward */
 static void
 bulk_scan(int flags);
@@ -564,6 +652,228 @@ process_deferred_playlists(void)
     }
 }
 
+/* ------------------------------- SCAN POOL -------------------------------- */
+
+/* Thread: scan */
+// Saves the n jobs from the head in one batch
+static void
+scan_jobs_save(int n)
+{
+  struct scan_job *job;
+  int nbatch;
+  int i;
+
+  for (i = 0, nbatch = 0; i < n; i++)
+    {
+      job = &scan_pool.jobs[(scan_pool.head + i) % scan_pool.size];
+      if (job->ret < 0)
+	continue;
+
+      // The id of the file is looked up by the batch save
+      scan_pool.batch[nbatch++] = &job->mfi;
+    }
+
+  library_media_save_batch(scan_pool.batch, nbatch);
+
+  for (i = 0; i < n; i++)
+    {
+      job = &scan_pool.jobs[(scan_pool.head + i) % scan_pool.size];
+
+      // Only bulk scans use the pool
+      if (job->ret >= 0)
+	cache_artwork_ping(job->mfi.path, job->mtime, 0);
+
+      free_mfi(&job->mfi, 1);
+    }
+}
+
+/* Thread: scan */
+// Saves the done jobs in the order they were added, stopping at the first job
+// that is not done. If wait_all is set, it waits for all jobs to be done.
+static void
+scan_jobs_write(bool wait_all)
+{
+  int n;
+
+  pthread_mutex_lock(&scan_pool.lck);
+
+  while (scan_pool.count > 0)
+    {
+      for (n = 0; (n < scan_pool.count) && scan_pool.jobs[(scan_pool.head + n) % scan_pool.size].done; n++)
+	; /* EMPTY */
+
+      if (n == 0)
+	{
+	  if (!wait_all)
+	    break;
+
+	  pthread_cond_wait(&scan_pool.done_cond, &scan_pool.lck);
+	  continue;
+	}
+
+      // The probe threads don't touch jobs that are done, so we can save
+      // without holding the lock
+      pthread_mutex_unlock(&scan_pool.lck);
+      scan_jobs_save(n);
+      pthread_mutex_lock(&scan_pool.lck);
+
+      scan_pool.head = (scan_pool.head + n) % scan_pool.size;
+      scan_pool.count -= n;
+    }
+
+  pthread_mutex_unlock(&scan_pool.lck);
+}
+
+/* Thread: scan */
+// Ownership of the content of mfi is transferred to the job
+static void
+scan_job_add(struct media_file_info *mfi, time_t mtime)
+{
+  struct scan_job *job;
+  bool is_full;
+
+  pthread_mutex_lock(&scan_pool.lck);
+
+  // Queue is full, wait for the oldest job, so it and the jobs done after it
+  // can be written together
+  while (scan_pool.count == scan_pool.size && !scan_pool.jobs[scan_pool.head].done)
+    pthread_cond_wait(&scan_pool.done_cond, &scan_pool.lck);
+
+  is_full = (scan_pool.count == scan_pool.size);
+
+  pthread_mutex_unlock(&scan_pool.lck);
+
+  if (is_full)
+    scan_jobs_write(false);
+
+  pthread_mutex_lock(&scan_pool.lck);
+
+  job = &scan_pool.jobs[(scan_pool.head + scan_pool.count) % scan_pool.size];
+  job->mfi = *mfi;
+  job->mtime = mtime;
+  job->ret = 0;
+  job->done = false;
+
+  scan_pool.count++;
+  scan_pool.npending++;
+
+  pthread_cond_signal(&scan_pool.job_cond);
+  pthread_mutex_unlock(&scan_pool.lck);
+}
+
+/* Thread: scan probe */
+static void *
+scan_worker(void *arg)
+{
+  struct scan_job *job;
+  int ret;
+
+  pthread_mutex_lock(&scan_pool.lck);
+
+  while (!scan_pool.exit)
+    {
+      if (scan_pool.npending == 0)
+	{
+	  pthread_cond_wait(&scan_pool.job_cond, &scan_pool.lck);
+	  continue;
+	}
+
+      job = &scan_pool.jobs[scan_pool.next];
+      scan_pool.next = (scan_pool.next + 1) % scan_pool.size;
+      scan_pool.npending--;
+
+      pthread_mutex_unlock(&scan_pool.lck);
+      ret = scan_metadata_ffmpeg(&job->mfi, job->mfi.path);
+      pthread_mutex_lock(&scan_pool.lck);
+
+      job->ret = ret;
+      job->done = true;
+      pthread_cond_signal(&scan_pool.done_cond);
+    }
+
+  pthread_mutex_unlock(&scan_pool.lck);
+
+  pthread_exit(NULL);
+}
+
+/* Thread: scan */
+static void
+scan_pool_init(void)
+{
+  long nthreads;
+  int ret;
+  int i;
+
+  memset(&scan_pool, 0, sizeof(struct scan_pool));
+
+  nthreads = cfg_getint(cfg_getsec(cfg, "library"), "filescan_threads");
+  if (nthreads <= 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > SCAN_THREADS_MAX)
+    nthreads = SCAN_THREADS_MAX;
+  if (nthreads <= 0)
+    return;
+
+  scan_pool.size = nthreads * SCAN_JOBS_PER_THREAD;
+  CHECK_NULL(L_SCAN, scan_pool.jobs = calloc(scan_pool.size, sizeof(struct scan_job)));
+  CHECK_NULL(L_SCAN, scan_pool.batch = calloc(scan_pool.size, sizeof(struct media_file_info *)));
+
+  CHECK_ERR(L_SCAN, pthread_mutex_init(&scan_pool.lck, NULL));
+  CHECK_ERR(L_SCAN, pthread_cond_init(&scan_pool.job_cond, NULL));
+  CHECK_ERR(L_SCAN, pthread_cond_init(&scan_pool.done_cond, NULL));
+
+  for (i = 0; i < nthreads; i++)
+    {
+      ret = pthread_create(&scan_pool.tid[i], NULL, scan_worker, NULL);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_SCAN, "Could not spawn probe thread: %s\n", strerror(ret));
+	  break;
+	}
+
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+      pthread_setname_np(scan_pool.tid[i], "scan probe");
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+      pthread_set_name_np(scan_pool.tid[i], "scan probe");
+#endif
+    }
+
+  scan_pool.nthreads = i;
+
+  DPRINTF(E_DBG, L_SCAN, "Probing files with %d threads\n", scan_pool.nthreads);
+}
+
+/* Thread: scan */
+static void
+scan_pool_deinit(void)
+{
+  int i;
+
+  if (!scan_pool.jobs)
+    return;
+
+  // Saves what the probe threads have queued or are working on
+  if (scan_pool.nthreads > 0)
+    scan_jobs_write(true);
+
+  pthread_mutex_lock(&scan_pool.lck);
+  scan_pool.exit = true;
+  pthread_cond_broadcast(&scan_pool.job_cond);
+  pthread_mutex_unlock(&scan_pool.lck);
+
+  for (i = 0; i < scan_pool.nthreads; i++)
+    pthread_join(scan_pool.tid[i], NULL);
+
+  pthread_cond_destroy(&scan_pool.done_cond);
+  pthread_cond_destroy(&scan_pool.job_cond);
+  pthread_mutex_destroy(&scan_pool.lck);
+
+  free(scan_pool.batch);
+  free(scan_pool.jobs);
+  memset(&scan_pool, 0, sizeof(struct scan_pool));
+}
+
+
 static void
 process_regular_file(const char *file, struct stat *sb, int type, int flags, int dir_id)
 {
@@ -584,9 +894,6 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
   // File is new or modified - (re)scan metadata and update file in library
   memset(&mfi, 0, sizeof(struct media_file_info));
 
-  // Sets id=0 if file is not in the library already
-  mfi.id = db_file_id_bypath(file);
-
   mfi.fname = strdup(filename_from_path(file));
   mfi.path = strdup(file);
 
@@ -622,6 +929,14 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
 	  mfi.album_artist = safe_strdup(cfg_getstr(cfg_getsec(cfg, "library"), "compilation_artist"));
 	}
 
+      // Bulk scans probe and save the file via the scan pool, and the batch
+      // save looks up the id of the file
+      if (is_bulkscan && scan_pool.nthreads > 0)
+	{
+	  scan_job_add(&mfi, sb->st_mtime);
+	  return;
+	}
+
       ret = scan_metadata_ffmpeg(&mfi, file);
       if (ret < 0)
 	{
@@ -630,6 +945,9 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
 	}
     }
 
+  // Sets id=0 if file is not in the library already
+  mfi.id = db_file_id_bypath(file);
+
   library_media_save(&mfi);
 
   cache_artwork_ping(file, sb->st_mtime, !is_bulkscan);
@@ -652,7 +970,7 @@ process_file(char *file, struct stat *sb, int type, int flags, int dir_id)
 	/* When in bulk mode, split transaction in pieces of 200 */
 	if ((flags & F_SCAN_BULK) && (counter % 200 == 0))
 	  {
-	    DPRINTF(E_LOG, L_SCAN, "Scanned %d files...\n", counter);
+	    DPRINTF(E_LOG, L_SCAN, "Scanned %d files (%.0f files/sec)...\n", counter, counter / MAX(difftime(time(NULL), counter_start), 1));
 	    db_transaction_end();
 	    db_transaction_begin();
 	  }
@@ -815,6 +1133,153 @@ read_attributes(char *resolved_path, const char *path, struct stat *sb, int *is_
   return 0;
 }
 
+/* Thread: scan */
+/* If the mtime of a directory is the same as when it was last completely
+ * scanned, then the entries of the directory are also the same, and so are the
+ * files that were not modified after that scan started. Returns the start time
+ * of that scan, or 0 if the files must be checked one by one.
+ */
+static time_t
+directory_scan_time_get(const char *virtual_path, struct stat *dir_sb, int flags)
+{
+  time_t mtime;
+  time_t scan_time;
+  int ret;
+
+  if (!(flags & F_SCAN_BULK) || (flags & (F_SCAN_FAST | F_SCAN_METARESCAN)) || (dir_sb->st_mtime == 0))
+    return 0;
+
+  ret = db_directory_mtime_get(virtual_path, &mtime, &scan_time);
+  if ((ret < 0) || (mtime != dir_sb->st_mtime))
+    return 0;
+
+  return scan_time;
+}
+
+static int
+unchanged_file_add(struct unchanged_file **list, const char *path, struct stat *sb)
+{
+  struct unchanged_file *f;
+
+  f = malloc(sizeof(struct unchanged_file));
+  if (!f)
+    return -1;
+
+  f->path = strdup(path);
+  if (!f->path)
+    {
+      free(f);
+      return -1;
+    }
+
+  f->sb = *sb;
+
+  f->next = *list;
+  *list = f;
+
+  return 0;
+}
+
+/* Thread: scan */
+static void
+unchanged_files_process(struct unchanged_file **list, bool check, int type, int flags, int dir_id)
+{
+  struct unchanged_file *f;
+
+  while ((f = *list))
+    {
+      *list = f->next;
+
+      if (check)
+	process_file(f->path, &f->sb, type, flags, dir_id);
+
+      free(f->path);
+      free(f);
+    }
+}
+
+static int
+path_cmp(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Thread: scan */
+// Moves the unchanged files that are not in the library (e.g. a .txt or .cue
+// that didn't scan) from list to unstored. Those were not pinged by the
+// directory ping, so they must be checked one by one like in a full scan.
+// Returns the number of files left in list, or -1 if the library has other
+// files in the directory (or on error), then all must be checked.
+static int
+unchanged_files_split(struct unchanged_file **list, struct unchanged_file **unstored, int dir_id)
+{
+  struct unchanged_file **prev;
+  struct unchanged_file *f;
+  char **paths;
+  int npaths;
+  int nstored;
+  int i;
+
+  npaths = db_file_paths_bydirectory(dir_id, &paths);
+  if (npaths < 0)
+    return -1;
+
+  nstored = 0;
+  prev = list;
+  while ((f = *prev))
+    {
+      if (npaths > 0 && bsearch(&f->path, paths, npaths, sizeof(char *), path_cmp))
+	{
+	  nstored++;
+	  prev = &f->next;
+	  continue;
+	}
+
+      *prev = f->next;
+      f->next = *unstored;
+      *unstored = f;
+    }
+
+  for (i = 0; i < npaths; i++)
+    free(paths[i]);
+  free(paths);
+
+  return (nstored == npaths) ? nstored : -1;
+}
+
+static void
+scanned_dir_add(int id, time_t mtime)
+{
+  struct scanned_dir *d;
+
+  d = malloc(sizeof(struct scanned_dir));
+  if (!d)
+    return;
+
+  d->id = id;
+  d->mtime = mtime;
+
+  d->next = scanned_dirs;
+  scanned_dirs = d;
+}
+
+/* Thread: scan */
+static void
+scanned_dirs_save(bool save)
+{
+  struct scanned_dir *d;
+
+  while ((d = scanned_dirs))
+    {
+      scanned_dirs = d->next;
+
+      if (save)
+	db_directory_mtime_set(d->id, d->mtime);
+
+      free(d);
+    }
+}
+
 static void
 process_directory(char *path, int parent_id, int flags)
 {
@@ -828,6 +1293,14 @@ process_directory(char *path, int parent_id, int flags)
   struct watch_info wi;
   int type;
   char virtual_path[PATH_MAX];
+  struct stat dir_sb;
+  struct unchanged_file *unchanged;
+  struct unchanged_file *unstored;
+  int nunchanged;
+  int nstored;
+  time_t scan_start;
+  time_t scan_time;
+  bool is_complete;
   int dir_id;
   int ret;
 
@@ -847,6 +1320,13 @@ process_directory(char *path, int parent_id, int flags)
   if (ret < 0)
     return;
 
+  if (stat(path, &dir_sb) < 0)
+    memset(&dir_sb, 0, sizeof(struct stat));
+
+  // Must be read before the update below, which resets the saved mtime
+  scan_time = directory_scan_time_get(virtual_path, &dir_sb, flags);
+  scan_start = time(NULL);
+
   dir_id = db_directory_addorupdate(virtual_path, path, 0, parent_id);
   if (dir_id <= 0)
     {
@@ -864,6 +1344,10 @@ process_directory(char *path, int parent_id, int flags)
 
   follow_symlinks = cfg_getbool(cfg_getsec(cfg, "library"), "follow_symlinks");
 
+  unchanged = NULL;
+  nunchanged = 0;
+  is_complete = false;
+
   for (;;)
     {
       if (library_is_exiting())
@@ -879,7 +1363,10 @@ process_directory(char *path, int parent_id, int flags)
 	}
 
       if (!de)
-	break;
+	{
+	  is_complete = true;
+	  break;
+	}
 
       if (de->d_name[0] == '.')
 	continue;
@@ -912,15 +1399,59 @@ process_directory(char *path, int parent_id, int flags)
 	}
       else if (!(flags & F_SCAN_FAST))
 	{
-	  if (S_ISREG(sb.st_mode) || S_ISFIFO(sb.st_mode))
+	  if (!S_ISREG(sb.st_mode) && !S_ISFIFO(sb.st_mode))
+	    DPRINTF(E_LOG, L_SCAN, "Skipping %s, not a directory, symlink, pipe nor regular file\n", entry);
+	  else if ((scan_time == 0) || (file_type_get(resolved_path) != FILE_REGULAR))
 	    process_file(resolved_path, &sb, type, flags, dir_id);
+	  else if (S_ISREG(sb.st_mode) && (sb.st_mtime != 0) && (sb.st_mtime < scan_time) && (unchanged_file_add(&unchanged, resolved_path, &sb) == 0))
+	    nunchanged++;
 	  else
-	    DPRINTF(E_LOG, L_SCAN, "Skipping %s, not a directory, symlink, pipe nor regular file\n", entry);
+	    {
+	      // A modified file, so go back to checking the files one by one
+	      scan_time = 0;
+	      unchanged_files_process(&unchanged, true, type, flags, dir_id);
+	      nunchanged = 0;
+
+	      process_file(resolved_path, &sb, type, flags, dir_id);
+	    }
 	}
     }
 
   closedir(dirp);
 
+  // Ping the unchanged files with a single query, unless the library has other
+  // files in the directory than those (e.g. if some could not be scanned).
+  // Unchanged files that aren't in the library, e.g. because they aren't media,
+  // are checked one by one.
+  if (unchanged)
+    {
+      unstored = NULL;
+      nstored = unchanged_files_split(&unchanged, &unstored, dir_id);
+      if (nstored >= 0)
+	ret = db_file_ping_bydirectory(dir_id);
+
+      if (nstored >= 0 && ret == nstored)
+	{
+	  DPRINTF(E_DBG, L_SCAN, "Directory %s is unchanged, skipped checking %d files\n", path, nstored);
+
+	  counter += nstored;
+	  unchanged_files_process(&unchanged, false, type, flags, dir_id);
+	}
+      else
+	{
+	  DPRINTF(E_DBG, L_SCAN, "Directory %s is unchanged, but library doesn't match its %d files, checking each\n", path, nunchanged);
+
+	  unchanged_files_process(&unchanged, true, type, flags, dir_id);
+	}
+
+      unchanged_files_process(&unstored, true, type, flags, dir_id);
+    }
+
+  // The mtime can only be trusted next time if the directory wasn't modified
+  // in the second when this scan started
+  if (is_complete && (flags & F_SCAN_BULK) && !(flags & F_SCAN_FAST) && (dir_id > 0) && (dir_sb.st_mtime != 0) && (dir_sb.st_mtime < scan_start))
+    scanned_dir_add(dir_id, dir_sb.st_mtime);
+
   memset(&wi, 0, sizeof(struct watch_info));
 
   // Add inotify watch (for FreeBSD we limit the flags so only dirs will be
@@ -1021,16 +1552,21 @@ bulk_scan(int flags)
   char *deref;
   time_t start;
   time_t end;
+  int nfiles;
   int parent_id;
   int i;
   char virtual_path[PATH_MAX];
   int ret;
 
   start = time(NULL);
+  nfiles = 0;
 
   playlists = NULL;
   dirstack = NULL;
 
+  if (!(flags & F_SCAN_FAST))
+    scan_pool_init();
+
   lib = cfg_getsec(cfg, "library");
 
   ndirs = cfg_size(lib, "directories");
@@ -1062,17 +1598,33 @@ bulk_scan(int flags)
 	}
 
       counter = 0;
+      counter_start = time(NULL);
       db_transaction_begin();
 
       process_directories(deref, parent_id, flags);
+
+      // Saves the files still in the scan pool, so they are in the transaction
+      if (scan_pool.nthreads > 0)
+	scan_jobs_write(true);
+
+      // Only now are all the files of the scanned directories in the library
+      scanned_dirs_save(!library_is_exiting());
+
       db_transaction_end();
 
+      nfiles += counter;
+
       free(deref);
 
       if (library_is_exiting())
-	return;
+	{
+	  scan_pool_deinit();
+	  return;
+	}
     }
 
+  scan_pool_deinit();
+
   if (!(flags & F_SCAN_FAST) && playlists)
     process_deferred_playlists();
 
@@ -1090,7 +1642,8 @@ bulk_scan(int flags)
     }
   else
     {
-      DPRINTF(E_LOG, L_SCAN, "Bulk library scan completed in %.f sec\n", difftime(end, start));
+      DPRINTF(E_LOG, L_SCAN, "Bulk library scan completed in %.f sec (%d files, %.0f files/sec)\n",
+	difftime(end, start), nfiles, nfiles / MAX(difftime(end, start), 1));
     }
 }
 
@@ -1268,6 +1821,20 @@ process_inotify_dir(struct watch_info *wi, char *path, struct inotify_event *ie)
     }
 }
 
+static void
+incomingfiles_remove(const char *path, uint32_t path_hash)
+{
+  int i;
+
+  for (i = 0; i < INCOMINGFILES_BUFFER_SIZE; i++)
+    if (incomingfiles_buffer[i] == path_hash)
+      {
+	DPRINTF(E_SPAM, L_SCAN, "Incoming file closed '%s' (%d), index %d\n", path, (int)path_hash, i);
+
+	incomingfiles_buffer[i] = 0;
+      }
+}
+
 /* Thread: scan */
 static void
 process_inotify_file(struct watch_info *wi, char *path, struct inotify_event *ie)
@@ -1401,13 +1968,7 @@ process_inotify_file(struct watch_info *wi, char *path, struct inotify_event *ie
       DPRINTF(E_DBG, L_SCAN, "File closed: %s\n", path);
 
       // File has been closed so remove from the IN_ATTRIB ignore list
-      for (i = 0; i < INCOMINGFILES_BUFFER_SIZE; i++)
-	if (incomingfiles_buffer[i] == path_hash)
-	  {
-	    DPRINTF(E_SPAM, L_SCAN, "Incoming file closed '%s' (%d), index %d\n", path, (int)path_hash, i);
-
-	    incomingfiles_buffer[i] = 0;
-	  }
+      incomingfiles_remove(path, path_hash);
 
       ret = read_attributes(resolved_path, path, &sb, &is_link);
       if (ret < 0)
@@ -1448,6 +2009,200 @@ process_inotify_file(struct watch_info *wi, char *path, struct inotify_event *ie
     }
 }
 
+static void
+pending_file_free(struct pending_file *f)
+{
+  free(f->wi.path);
+  free(f->path);
+  free(f);
+}
+
+// Returns the pending file with the path, or NULL if not pending
+static struct pending_file *
+pending_file_find(const char *path, uint32_t path_hash)
+{
+  struct pending_file *f;
+
+  for (f = pending_files_hash[path_hash & (PENDING_FILES_HASH_SIZE - 1)]; f; f = f->hash_next)
+    {
+      if ((f->path_hash == path_hash) && (strcmp(f->path, path) == 0))
+	return f;
+    }
+
+  return NULL;
+}
+
+// Adds the file at the end of the pending files
+static void
+pending_file_append(struct pending_file *f)
+{
+  struct pending_file **bucket;
+
+  bucket = &pending_files_hash[f->path_hash & (PENDING_FILES_HASH_SIZE - 1)];
+  f->hash_next = *bucket;
+  *bucket = f;
+
+  f->prev = pending_files_last;
+  f->next = NULL;
+  if (pending_files_last)
+    pending_files_last->next = f;
+  else
+    pending_files = f;
+  pending_files_last = f;
+
+  pending_files_count++;
+}
+
+static void
+pending_file_remove(struct pending_file *f)
+{
+  struct pending_file **link;
+
+  for (link = &pending_files_hash[f->path_hash & (PENDING_FILES_HASH_SIZE - 1)]; *link != f; link = &(*link)->hash_next)
+    ; /* EMPTY */
+  *link = f->hash_next;
+
+  if (f->prev)
+    f->prev->next = f->next;
+  else
+    pending_files = f->next;
+  if (f->next)
+    f->next->prev = f->prev;
+  else
+    pending_files_last = f->prev;
+
+  pending_files_count--;
+}
+
+/* Thread: scan */
+static void
+pending_file_scan(struct pending_file *f)
+{
+  struct inotify_event ie;
+
+  memset(&ie, 0, sizeof(struct inotify_event));
+  ie.wd = f->wi.wd;
+  ie.mask = IN_CLOSE_WRITE;
+
+  process_inotify_file(&f->wi, f->path, &ie);
+}
+
+/* Thread: scan */
+static void
+pending_files_scan(void)
+{
+  struct pending_file *f;
+
+  if (!pending_files)
+    return;
+
+  evtimer_del(pendingev);
+
+  DPRINTF(E_DBG, L_SCAN, "Scanning %d written files\n", pending_files_count);
+
+  db_transaction_begin();
+
+  while ((f = pending_files))
+    {
+      pending_file_remove(f);
+
+      pending_file_scan(f);
+      pending_file_free(f);
+
+      if (library_is_exiting())
+	break;
+    }
+
+  db_transaction_end();
+
+  // Only if exiting
+  while ((f = pending_files))
+    {
+      pending_file_remove(f);
+      pending_file_free(f);
+    }
+}
+
+static void
+pending_files_cb(int fd, short what, void *arg)
+{
+  pending_files_scan();
+}
+
+/* Thread: scan */
+/* Copying an album into the library gives a stream of IN_CREATE, IN_CLOSE_WRITE
+ * and IN_ATTRIB events. Instead of scanning each file in its own transaction
+ * as soon as it is closed, the written media files (see below) are collected
+ * and then scanned in a single transaction, in the order they were written.
+ * Further writes or attribute changes of a pending file are dropped, since it
+ * will be scanned anyway. Any other event for a pending file makes it scan
+ * first, so the events of each file are handled in order.
+ */
+static void
+process_inotify_file_batch(struct watch_info *wi, char *path, struct inotify_event *ie)
+{
+  struct pending_file *f;
+  uint32_t path_hash;
+
+  path_hash = djb_hash(path, strlen(path));
+
+  f = pending_file_find(path, path_hash);
+  if (f && !(ie->mask & ~(IN_CLOSE_WRITE | IN_ATTRIB)))
+    {
+      DPRINTF(E_SPAM, L_SCAN, "File event 0x%x for pending file %s, ignoring\n", ie->mask, path);
+      return;
+    }
+  else if (f)
+    {
+      pending_file_remove(f);
+
+      pending_file_scan(f);
+      pending_file_free(f);
+    }
+
+  if (ie->mask != IN_CLOSE_WRITE)
+    {
+      process_inotify_file(wi, path, ie);
+      return;
+    }
+
+  // Only media files are batched. Playlists and iTunes XML are saved in their
+  // own transactions, which can't be nested in the batch's. The batch is saved
+  // first, since they may refer to its files.
+  if (file_type_get(path) != FILE_REGULAR)
+    {
+      pending_files_scan();
+      process_inotify_file(wi, path, ie);
+      return;
+    }
+
+  DPRINTF(E_DBG, L_SCAN, "File closed, scan pending: %s\n", path);
+
+  // As in process_inotify_file(), the file is no longer incoming
+  incomingfiles_remove(path, path_hash);
+
+  f = calloc(1, sizeof(struct pending_file));
+  if (!f)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Out of memory for pending file\n");
+
+      process_inotify_file(wi, path, ie);
+      return;
+    }
+
+  f->wi = *wi;
+  f->wi.path = strdup(wi->path);
+  f->path = strdup(path);
+  f->path_hash = path_hash;
+
+  pending_file_append(f);
+
+  if (pending_files_count >= PENDING_FILES_MAX)
+    pending_files_scan();
+  else if (pending_files_count == 1)
+    evtimer_add(pendingev, &pending_files_wait);
+}
+
 #ifndef __linux__
 /* Since kexec based inotify doesn't really have inotify we only get
  * a IN_CREATE. That is a bit too soon to start scanning the file,
@@ -1480,7 +2235,7 @@ process_inotify_file_defer(struct watch_info *wi, char *path, struct inotify_eve
 
   if (!(ie->mask & IN_CREATE))
     {
-      process_inotify_file(wi, path, ie);
+      process_inotify_file_batch(wi, path, ie);
       return;
     }
 
@@ -1600,10 +2355,14 @@ inotify_cb(int fd, short event, void *arg)
        * with the IN_ISDIR flag set.
        */
       if ((ie->mask & IN_ISDIR) || (ie->len == 0))
-	process_inotify_dir(&wi, path, ie);
+	{
+	  // Pending files might be moved or removed with the directory
+	  pending_files_scan();
+	  process_inotify_dir(&wi, path, ie);
+	}
       else
 #ifdef __linux__
-	process_inotify_file(&wi, path, ie);
+	process_inotify_file_batch(&wi, path, ie);
 #else
 	process_inotify_file_defer(&wi, path, ie);
 #endif
@@ -1629,6 +2388,14 @@ inofd_event_set(void)
 
   inoev = event_new(evbase_lib, inofd, EV_READ, inotify_cb, NULL);
 
+  pendingev = evtimer_new(evbase_lib, pending_files_cb, NULL);
+  if (!pendingev)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Could not create pending files event\n");
+
+      return -1;
+    }
+
 #ifndef __linux__
   deferred_inoev = evtimer_new(evbase_lib, inotify_deferred_cb, NULL);
   if (!deferred_inoev)
@@ -1646,9 +2413,19 @@ inofd_event_set(void)
 static void
 inofd_event_unset(void)
 {
+  struct pending_file *f;
+
 #ifndef __linux__
   event_free(deferred_inoev);
 #endif
+  // The files will be found by the scan that follows, if any
+  while ((f = pending_files))
+    {
+      pending_file_remove(f);
+      pending_file_free(f);
+    }
+
+  event_free(pendingev);
   event_free(inoev);
   close(inofd);
 }
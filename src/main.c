@@ -64,6 +64,7 @@ GCRY_THREAD_OPTION_PTHREAD_IMPL;
 #include "logger.h"
 #include "misc.h"
 #include "cache.h"
+#include "artwork.h"
 #include "httpd.h"
 #include "mpd.h"
 #include "mdns.h"
@@ -794,6 +795,16 @@ main(int argc, char **argv)
       goto cache_fail;
     }
 
+  /* Spawn artwork prebuild thread */
+  ret = artwork_init();
+  if (ret != 0)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Artwork thread failed to start\n");
+
+      ret = EXIT_FAILURE;
+      goto artwork_fail;
+    }
+
   /* Spawn library scan thread */
   ret = library_init();
   if (ret != 0)
@@ -953,6 +964,10 @@ main(int argc, char **argv)
   library_deinit();
 
  library_fail:
+  DPRINTF(E_LOG, L_MAIN, "Artwork deinit\n");
+  artwork_deinit();
+
+ artwork_fail:
   DPRINTF(E_LOG, L_MAIN, "Cache deinit\n");
   cache_deinit();
 
@@ -174,23 +174,23 @@ struct mpd_tagtype
 
 static struct mpd_tagtype tagtypes[] =
   {
-    /* tag               | db field             | db sort field                        | db group field  | type             | media_file offset                | group_in_listcommand */
+    /* tag               | db field             | db sort field                            | db group field  | type             | media_file offset                | group_in_listcommand */
 
     // We treat the artist tag as album artist, this allows grouping over the artist-persistent-id index and increases performance
     // { "Artist",           "f.artist",             "f.artist",             "f.artist",             MPD_TYPE_STRING,   dbmfi_offsetof(artist), },
-    { "Artist",           "f.album_artist",       "f.album_artist_sort, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   dbmfi_offsetof(album_artist),      false, },
-    { "ArtistSort",       "f.album_artist_sort",  "f.album_artist_sort, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   dbmfi_offsetof(album_artist_sort), false, },
-    { "AlbumArtist",      "f.album_artist",       "f.album_artist_sort, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   dbmfi_offsetof(album_artist),      false, },
-    { "AlbumArtistSort",  "f.album_artist_sort",  "f.album_artist_sort, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   dbmfi_offsetof(album_artist_sort), false, },
-    { "Album",            "f.album",              "f.album_sort, f.album",               "f.songalbumid",  MPD_TYPE_STRING,   dbmfi_offsetof(album),             false, },
-    { "Title",            "f.title",              "f.title",                             "f.title",        MPD_TYPE_STRING,   dbmfi_offsetof(title),             true, },
-    { "Track",            "f.track",              "f.track",                             "f.track",        MPD_TYPE_INT,      dbmfi_offsetof(track),             true, },
-    { "Genre",            "f.genre",              "f.genre",                             "f.genre",        MPD_TYPE_STRING,   dbmfi_offsetof(genre),             true, },
-    { "Disc",             "f.disc",               "f.disc",                              "f.disc",         MPD_TYPE_INT,      dbmfi_offsetof(disc),              true, },
-    { "Date",             "f.year",               "f.year",                              "f.year",         MPD_TYPE_INT,      dbmfi_offsetof(year),              true, },
-    { "file",             NULL,                   NULL,                                  NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
-    { "base",             NULL,                   NULL,                                  NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
-    { "any",              NULL,                   NULL,                                  NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
+    { "Artist",           "f.album_artist",       "f.album_artist_sort_key, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   dbmfi_offsetof(album_artist),      false, },
+    { "ArtistSort",       "f.album_artist_sort",  "f.album_artist_sort_key, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   dbmfi_offsetof(album_artist_sort), false, },
+    { "AlbumArtist",      "f.album_artist",       "f.album_artist_sort_key, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   dbmfi_offsetof(album_artist),      false, },
+    { "AlbumArtistSort",  "f.album_artist_sort",  "f.album_artist_sort_key, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   dbmfi_offsetof(album_artist_sort), false, },
+    { "Album",            "f.album",              "f.album_sort_key, f.album",               "f.songalbumid",  MPD_TYPE_STRING,   dbmfi_offsetof(album),             false, },
+    { "Title",            "f.title",              "f.title",                                 "f.title",        MPD_TYPE_STRING,   dbmfi_offsetof(title),             true, },
+    { "Track",            "f.track",              "f.track",                                 "f.track",        MPD_TYPE_INT,      dbmfi_offsetof(track),             true, },
+    { "Genre",            "f.genre",              "f.genre",                                 "f.genre",        MPD_TYPE_STRING,   dbmfi_offsetof(genre),             true, },
+    { "Disc",             "f.disc",               "f.disc",                                  "f.disc",         MPD_TYPE_INT,      dbmfi_offsetof(disc),              true, },
+    { "Date",             "f.year",               "f.year",                                  "f.year",         MPD_TYPE_INT,      dbmfi_offsetof(year),              true, },
+    { "file",             NULL,                   NULL,                                      NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
+    { "base",             NULL,                   NULL,                                      NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
+    { "any",              NULL,                   NULL,                                      NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
 
   };
 
@@ -678,6 +678,8 @@ append_string(char **a, const char *b, const char *separator)
 static int
 parse_filter_window_params(int argc, char **argv, bool exact_match, struct query_params *qp)
 {
+  const char *any_fields[] = { "f.artist", "f.album", "f.title", NULL };
+  const char *fields[2];
   struct mpd_tagtype *tagtype;
   char *c1;
   int start_pos;
@@ -710,7 +712,11 @@ parse_filter_window_params(int argc, char **argv, bool exact_match, struct query
 	      if (exact_match)
 		c1 = db_mprintf("(%s = '%q')", tagtype->field, argv[i + 1]);
 	      else
-		c1 = db_mprintf("(%s LIKE '%%%q%%')", tagtype->field, argv[i + 1]);
+		{
+		  fields[0] = tagtype->field;
+		  fields[1] = NULL;
+		  c1 = db_search_filter(fields, argv[i + 1]);
+		}
 	    }
 	  else if (tagtype->type == MPD_TYPE_INT)
 	    {
@@ -724,13 +730,15 @@ parse_filter_window_params(int argc, char **argv, bool exact_match, struct query
 	    {
 	      if (0 == strcasecmp(tagtype->tag, "any"))
 	        {
-		  c1 = db_mprintf("(f.artist LIKE '%%%q%%' OR f.album LIKE '%%%q%%' OR f.title LIKE '%%%q%%')", argv[i + 1], argv[i + 1], argv[i + 1]);
+		  c1 = db_search_filter(any_fields, argv[i + 1]);
 		}
 	      else if (0 == strcasecmp(tagtype->tag, "file"))
 	        {
 		  if (exact_match)
 		    c1 = db_mprintf("(f.virtual_path = '/%q')", argv[i + 1]);
 		  else
+		    // Not f.path from the full-text index, since the virtual path is
+		    // also what is matched for items that aren't files (e.g. streams)
 		    c1 = db_mprintf("(f.virtual_path LIKE '%%%q%%')", argv[i + 1]);
 		}
 	      else if (0 == strcasecmp(tagtype->tag, "base"))
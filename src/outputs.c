@@ -28,6 +28,7 @@
 #include <errno.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include <event2/event.h>
 
@@ -83,6 +84,10 @@ static struct output_definition *outputs[] = {
 
 #define OUTPUTS_MAX_CALLBACKS 64
 
+// Max number of threads that resample for the quality subscriptions (the player
+// thread runs the jobs that the workers haven't picked by the deadline)
+#define OUTPUTS_RESAMPLE_THREADS_MAX (OUTPUTS_MAX_QUALITY_SUBSCRIPTIONS - 1)
+
 struct outputs_callback_register
 {
   output_status_cb cb;
@@ -101,6 +106,31 @@ struct output_quality_subscription
   int count;
   struct media_quality quality;
   struct encode_ctx *encode_ctx;
+
+  // Resampled data, written by a resample worker while busy is set
+  struct evbuffer *evbuf;
+  // The raw data to resample
+  struct output_frame *frame;
+  // Set while the subscription is queued or being resampled, protected by
+  // resample_pool.lck
+  bool busy;
+};
+
+struct outputs_resample_pool
+{
+  pthread_t tid[OUTPUTS_RESAMPLE_THREADS_MAX];
+  int nthreads;
+
+  pthread_mutex_t lck;
+  // Signals workers that there are jobs in the queue (or that they must exit)
+  pthread_cond_t job_cond;
+  // Signals the player that a job is done
+  pthread_cond_t done_cond;
+
+  struct output_quality_subscription *queue[OUTPUTS_MAX_QUALITY_SUBSCRIPTIONS];
+  int queue_len;
+
+  bool exit;
 };
 
 static struct outputs_callback_register outputs_cb_register[OUTPUTS_MAX_CALLBACKS];
@@ -111,6 +141,10 @@ static struct timeval outputs_stop_timeout = { OUTPUTS_STOP_TIMEOUT, 0 };
 static struct output_quality_subscription output_quality_subscriptions[OUTPUTS_MAX_QUALITY_SUBSCRIPTIONS + 1];
 static bool outputs_got_new_subscription;
 
+static struct outputs_resample_pool resample_pool;
+
+static struct outputs_stats outputs_stats;
+
 
 /* ------------------------------- MISC HELPERS ----------------------------- */
 
@@ -260,6 +294,219 @@ quality_to_xcode(struct media_quality *quality)
   return XCODE_UNKNOWN;
 }
 
+/* ------------------------------- RESAMPLING ------------------------------- */
+/*                          Thread: player and resample                        */
+
+static void
+resample_run(struct output_quality_subscription *subscription)
+{
+  struct output_frame *raw = subscription->frame;
+  transcode_frame *frame;
+  int ret;
+
+  frame = transcode_frame_new(raw->data, raw->size, raw->samples, &raw->quality);
+  if (!frame)
+    return;
+
+  ret = transcode_encode(subscription->evbuf, subscription->encode_ctx, frame, 0);
+  if (ret < 0)
+    DPRINTF(E_WARN, L_PLAYER, "Error resampling to %d/%d/%d\n",
+      subscription->quality.sample_rate, subscription->quality.bits_per_sample, subscription->quality.channels);
+
+  transcode_frame_free(frame);
+}
+
+// Must be called with the pool lock held, which is released while resampling
+static void
+resample_queue_run(void)
+{
+  struct output_quality_subscription *subscription;
+
+  while (resample_pool.queue_len > 0)
+    {
+      subscription = resample_pool.queue[--resample_pool.queue_len];
+
+      pthread_mutex_unlock(&resample_pool.lck);
+      resample_run(subscription);
+      pthread_mutex_lock(&resample_pool.lck);
+
+      subscription->busy = false;
+      pthread_cond_broadcast(&resample_pool.done_cond);
+    }
+}
+
+static void *
+resample_worker(void *arg)
+{
+  pthread_mutex_lock(&resample_pool.lck);
+
+  while (!resample_pool.exit)
+    {
+      if (resample_pool.queue_len == 0)
+	{
+	  pthread_cond_wait(&resample_pool.job_cond, &resample_pool.lck);
+	  continue;
+	}
+
+      resample_queue_run();
+    }
+
+  pthread_mutex_unlock(&resample_pool.lck);
+
+  pthread_exit(NULL);
+}
+
+// Waits for all resampling to complete, so that the subscriptions can be
+// changed. The player will help out with jobs not yet picked by a worker.
+static void
+resample_wait_all(void)
+{
+  int i;
+
+  pthread_mutex_lock(&resample_pool.lck);
+
+  resample_queue_run();
+
+  for (i = 0; output_quality_subscriptions[i].count > 0; i++)
+    {
+      while (output_quality_subscriptions[i].busy)
+	pthread_cond_wait(&resample_pool.done_cond, &resample_pool.lck);
+    }
+
+  pthread_mutex_unlock(&resample_pool.lck);
+}
+
+static bool
+resample_deadline_passed(struct timespec *deadline)
+{
+  struct timespec now;
+
+#ifdef CLOCK_REALTIME
+  clock_gettime(CLOCK_REALTIME, &now);
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  TIMEVAL_TO_TIMESPEC(&tv, &now);
+#endif
+
+  return (timespec_cmp(now, *deadline) > 0);
+}
+
+// Resamples obuf->data[0] to all the subscribed qualities and returns when all
+// of it is done, so every write delivers all qualities and no frames are
+// skipped. The workers get until the deadline to pick the jobs. After that the
+// player runs the jobs still in the queue itself, and then waits for the ones
+// the workers are busy with.
+static void
+resample_start(struct output_buffer *obuf, struct timespec *deadline)
+{
+  struct output_quality_subscription *subscription;
+  bool late;
+  int ret;
+  int i;
+
+  pthread_mutex_lock(&resample_pool.lck);
+
+  for (i = 0; output_quality_subscriptions[i].count > 0; i++)
+    {
+      subscription = &output_quality_subscriptions[i]; // Just for short-hand
+
+      if (quality_is_equal(&subscription->quality, &obuf->data[0].quality))
+	continue; // Skip, no resampling required and we have the data in element 0
+
+      if (!subscription->encode_ctx)
+	continue;
+
+      // The previous frame is released here, since the reference count is only
+      // handled by the player thread
+      outputs_frame_put(subscription->frame);
+      subscription->frame = outputs_frame_get(&obuf->data[0]);
+      subscription->busy = true;
+
+      resample_pool.queue[resample_pool.queue_len++] = subscription;
+    }
+
+  if (resample_pool.nthreads > 0)
+    pthread_cond_broadcast(&resample_pool.job_cond);
+
+  // Without workers there is no point in waiting
+  ret = (resample_pool.nthreads > 0) ? 0 : ETIMEDOUT;
+  while (resample_pool.queue_len > 0 && ret != ETIMEDOUT)
+    ret = pthread_cond_timedwait(&resample_pool.done_cond, &resample_pool.lck, deadline);
+
+  late = (resample_pool.nthreads > 0 && resample_pool.queue_len > 0);
+
+  resample_queue_run();
+
+  for (i = 0; output_quality_subscriptions[i].count > 0; i++)
+    {
+      while (output_quality_subscriptions[i].busy)
+	pthread_cond_wait(&resample_pool.done_cond, &resample_pool.lck);
+    }
+
+  if (late || resample_deadline_passed(deadline))
+    {
+      DPRINTF(E_DBG, L_PLAYER, "Resampling missed the deadline\n");
+      outputs_stats.resample_late++;
+    }
+
+  pthread_mutex_unlock(&resample_pool.lck);
+}
+
+static void
+resample_pool_init(void)
+{
+  long ncpu;
+  int ret;
+  int i;
+
+  pthread_mutex_init(&resample_pool.lck, NULL);
+  pthread_cond_init(&resample_pool.job_cond, NULL);
+  pthread_cond_init(&resample_pool.done_cond, NULL);
+
+  // The player thread also resamples, so leave a cpu for that
+  ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  resample_pool.nthreads = (ncpu > 1) ? MIN(ncpu - 1, OUTPUTS_RESAMPLE_THREADS_MAX) : 0;
+
+  for (i = 0; i < resample_pool.nthreads; i++)
+    {
+      ret = pthread_create(&resample_pool.tid[i], NULL, resample_worker, NULL);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_PLAYER, "Could not spawn resample thread: %s\n", strerror(ret));
+	  break;
+	}
+
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+      pthread_setname_np(resample_pool.tid[i], "resample");
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+      pthread_set_name_np(resample_pool.tid[i], "resample");
+#endif
+    }
+
+  resample_pool.nthreads = i;
+
+  DPRINTF(E_DBG, L_PLAYER, "Resampling with %d worker threads\n", resample_pool.nthreads);
+}
+
+static void
+resample_pool_deinit(void)
+{
+  int i;
+
+  pthread_mutex_lock(&resample_pool.lck);
+  resample_pool.exit = true;
+  pthread_cond_broadcast(&resample_pool.job_cond);
+  pthread_mutex_unlock(&resample_pool.lck);
+
+  for (i = 0; i < resample_pool.nthreads; i++)
+    pthread_join(resample_pool.tid[i], NULL);
+
+  pthread_cond_destroy(&resample_pool.done_cond);
+  pthread_cond_destroy(&resample_pool.job_cond);
+  pthread_mutex_destroy(&resample_pool.lck);
+}
+
 static int
 encoding_reset(struct media_quality *quality)
 {
@@ -268,6 +515,9 @@ encoding_reset(struct media_quality *quality)
   enum transcode_profile profile;
   int i;
 
+  // Can't touch the encoding contexts while they are in use
+  resample_wait_all();
+
   profile = quality_to_xcode(quality);
   if  (profile == XCODE_UNKNOWN)
     {
@@ -308,8 +558,8 @@ encoding_reset(struct media_quality *quality)
 static void
 buffer_fill(struct output_buffer *obuf, void *buf, size_t bufsize, struct media_quality *quality, int nsamples, struct timespec *pts)
 {
-  transcode_frame *frame;
-  int ret;
+  struct output_quality_subscription *subscription;
+  struct timespec deadline;
   int i;
   int n;
 
@@ -324,38 +574,43 @@ buffer_fill(struct output_buffer *obuf, void *buf, size_t bufsize, struct media_
       outputs_got_new_subscription = false;
     }
 
-  // The first element of the output_buffer is always just the raw input data
-  // TODO can we avoid the copy below? we can't use evbuffer_add_buffer_reference,
-  // because then the outputs can't use it and we would need to copy there instead
-  evbuffer_add(obuf->data[0].evbuf, buf, bufsize);
+  // The first element of the output_buffer is always just the raw input data.
+  // It is not copied, the outputs get the player's buffer directly, and if an
+  // output needs to keep the data it uses outputs_frame_get().
   obuf->data[0].buffer = buf;
   obuf->data[0].bufsize = bufsize;
   obuf->data[0].quality = *quality;
   obuf->data[0].samples = nsamples;
 
+  // We give the resampling half the duration of the data, so there is time left
+  // for the outputs
+  deadline.tv_sec = 0;
+  deadline.tv_nsec = (quality->sample_rate > 0) ? 500000000UL * (uint64_t)nsamples / quality->sample_rate : 0;
+  deadline = timespec_reltoabs(deadline);
+
+  resample_start(obuf, &deadline);
+
+  pthread_mutex_lock(&resample_pool.lck);
+
   for (i = 0, n = 1; output_quality_subscriptions[i].count > 0; i++)
     {
-      if (quality_is_equal(&output_quality_subscriptions[i].quality, quality))
-	continue; // Skip, no resampling required and we have the data in element 0
+      subscription = &output_quality_subscriptions[i]; // Just for short-hand
 
-      if (!output_quality_subscriptions[i].encode_ctx)
-	continue;
+      if (evbuffer_get_length(subscription->evbuf) == 0)
+	continue; // Nothing to deliver (e.g. no resampling required)
 
-      frame = transcode_frame_new(buf, bufsize, nsamples, quality);
-      if (!frame)
-	continue;
-
-      ret = transcode_encode(obuf->data[n].evbuf, output_quality_subscriptions[i].encode_ctx, frame, 0);
-      transcode_frame_free(frame);
-      if (ret < 0)
-	continue;
+      // Moves the data without copying
+      evbuffer_add_buffer(obuf->data[n].evbuf, subscription->evbuf);
 
       obuf->data[n].buffer  = evbuffer_pullup(obuf->data[n].evbuf, -1);
       obuf->data[n].bufsize = evbuffer_get_length(obuf->data[n].evbuf);
-      obuf->data[n].quality = output_quality_subscriptions[i].quality;
+      obuf->data[n].quality = subscription->quality;
       obuf->data[n].samples = BTOS(obuf->data[n].bufsize, obuf->data[n].quality.bits_per_sample, obuf->data[n].quality.channels);
+      outputs_stats.bytes_resampled += obuf->data[n].bufsize;
       n++;
     }
+
+  pthread_mutex_unlock(&resample_pool.lck);
 }
 
 static void
@@ -365,7 +620,12 @@ buffer_drain(struct output_buffer *obuf)
 
   for (i = 0; obuf->data[i].buffer; i++)
     {
-      evbuffer_drain(obuf->data[i].evbuf, obuf->data[i].bufsize);
+      if (i > 0)
+	evbuffer_drain(obuf->data[i].evbuf, obuf->data[i].bufsize);
+
+      // Outputs that kept the frame still have their reference
+      outputs_frame_put(obuf->data[i].frame);
+      obuf->data[i].frame   = NULL;
       obuf->data[i].buffer  = NULL;
       obuf->data[i].bufsize = 0;
       // We don't reset quality and samples, would be a waste of time
@@ -535,6 +795,7 @@ outputs_quality_subscribe(struct media_quality *quality)
 
   output_quality_subscriptions[i].quality = *quality;
   output_quality_subscriptions[i].count++;
+  CHECK_NULL(L_PLAYER, output_quality_subscriptions[i].evbuf = evbuffer_new());
 
   DPRINTF(E_DBG, L_PLAYER, "Subscription request for quality %d/%d/%d (now %d subscribers)\n",
     quality->sample_rate, quality->bits_per_sample, quality->channels, output_quality_subscriptions[i].count);
@@ -571,7 +832,12 @@ outputs_quality_unsubscribe(struct media_quality *quality)
   if (output_quality_subscriptions[i].count > 0)
     return;
 
+  // Also makes sure that the shifting below doesn't move a queued subscription
+  resample_wait_all();
+
   transcode_encode_cleanup(&output_quality_subscriptions[i].encode_ctx);
+  outputs_frame_put(output_quality_subscriptions[i].frame);
+  evbuffer_free(output_quality_subscriptions[i].evbuf);
 
   // Shift elements
   for (; i < ARRAY_SIZE(output_quality_subscriptions) - 1; i++)
@@ -609,6 +875,50 @@ outputs_listener_notify(void)
   listener_notify(LISTENER_SPEAKER);
 }
 
+// The first call for a given write makes the copy, later calls (e.g. from
+// other outputs) just add a reference
+struct output_frame *
+outputs_frame_get(struct output_data *odata)
+{
+  struct output_frame *frame;
+
+  if (odata->frame)
+    {
+      odata->frame->refcount++;
+      return odata->frame;
+    }
+
+  // The data is allocated together with the struct
+  CHECK_NULL(L_PLAYER, frame = malloc(sizeof(struct output_frame) + odata->bufsize));
+
+  frame->data = (uint8_t *)frame + sizeof(struct output_frame);
+  frame->size = odata->bufsize;
+  frame->samples = odata->samples;
+  frame->quality = odata->quality;
+  memcpy(frame->data, odata->buffer, odata->bufsize);
+  outputs_stats.bytes_copied += odata->bufsize;
+
+  // One reference for the caller and one for odata, released by buffer_drain()
+  frame->refcount = 2;
+
+  odata->frame = frame;
+
+  return frame;
+}
+
+void
+outputs_frame_put(struct output_frame *frame)
+{
+  if (!frame)
+    return;
+
+  frame->refcount--;
+  if (frame->refcount > 0)
+    return;
+
+  free(frame);
+}
+
 
 /* ---------------------------- Called by player ---------------------------- */
 
@@ -933,6 +1243,9 @@ outputs_write(void *buf, size_t bufsize, int nsamples, struct media_quality *qua
 {
   int i;
 
+  outputs_stats.writes++;
+  outputs_stats.bytes_in += bufsize;
+
   buffer_fill(&output_buffer, buf, bufsize, quality, nsamples, pts);
 
   for (i = 0; outputs[i]; i++)
@@ -947,6 +1260,12 @@ outputs_write(void *buf, size_t bufsize, int nsamples, struct media_quality *qua
   buffer_drain(&output_buffer);
 }
 
+void
+outputs_stats_get(struct outputs_stats *stats)
+{
+  *stats = outputs_stats;
+}
+
 void
 outputs_metadata_send(uint32_t item_id, bool startup, output_metadata_finalize_cb cb)
 {
@@ -1006,12 +1325,15 @@ outputs_init(void)
 
   CHECK_NULL(L_PLAYER, outputs_deferredev = evtimer_new(evbase_player, deferred_cb, NULL));
 
+  resample_pool_init();
+
   no_output = 1;
   for (i = 0; outputs[i]; i++)
     {
       if (outputs[i]->type != i)
 	{
 	  DPRINTF(E_FATAL, L_PLAYER, "BUG! Output definitions are misaligned with output enum\n");
+	  resample_pool_deinit();
 	  return -1;
 	}
 
@@ -1029,7 +1351,10 @@ outputs_init(void)
     }
 
   if (no_output)
-    return -1;
+    {
+      resample_pool_deinit();
+      return -1;
+    }
 
   for (i = 0; i < ARRAY_SIZE(output_buffer.data); i++)
     output_buffer.data[i].evbuf = evbuffer_new();
@@ -1053,11 +1378,16 @@ outputs_deinit(void)
         outputs[i]->deinit();
     }
 
+  resample_wait_all();
+  resample_pool_deinit();
+
   // In case some outputs forgot to unsubscribe
   for (i = 0; i < ARRAY_SIZE(output_quality_subscriptions); i++)
     if (output_quality_subscriptions[i].count > 0)
       {
 	transcode_encode_cleanup(&output_quality_subscriptions[i].encode_ctx);
+	outputs_frame_put(output_quality_subscriptions[i].frame);
+	evbuffer_free(output_quality_subscriptions[i].evbuf);
 	memset(&output_quality_subscriptions[i], 0, sizeof(struct output_quality_subscription));
       }
 
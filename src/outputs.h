@@ -178,6 +178,22 @@ struct output_metadata
   output_metadata_finalize_cb finalize_cb;
 };
 
+// Immutable, reference counted copy of the audio in an output_data. Outputs
+// that need to keep the audio after write() returns should take one of these
+// with outputs_frame_get() instead of making their own copy. All outputs that
+// ask for a frame in the same write() share the same copy.
+struct output_frame
+{
+  uint8_t *data;
+  size_t size;
+  int samples;
+  struct media_quality quality;
+  int refcount;
+};
+
+// The data in buffer is only valid during the output's write(), and must not be
+// modified, since it is shared with the other outputs (and may be the player's
+// input buffer)
 struct output_data
 {
   struct media_quality quality;
@@ -185,6 +201,8 @@ struct output_data
   uint8_t *buffer;
   size_t bufsize;
   int samples;
+  // Made on request by outputs_frame_get()
+  struct output_frame *frame;
 };
 
 struct output_buffer
@@ -196,6 +214,16 @@ struct output_buffer
   struct output_data data[OUTPUTS_MAX_QUALITY_SUBSCRIPTIONS + 2];
 } output_buffer;
 
+// Counters for the data path, only updated by the player thread
+struct outputs_stats
+{
+  uint64_t writes;          // Calls to outputs_write()
+  uint64_t bytes_in;        // Bytes of raw audio written by the player
+  uint64_t bytes_copied;    // Bytes copied to frames by outputs_frame_get()
+  uint64_t bytes_resampled; // Bytes of resampled audio delivered to outputs
+  uint64_t resample_late;   // Writes where resampling missed the deadline
+};
+
 struct output_definition
 {
   // Name of the output
@@ -291,6 +319,12 @@ outputs_cb(int callback_id, uint64_t device_id, enum output_device_state);
 void
 outputs_listener_notify(void);
 
+struct output_frame *
+outputs_frame_get(struct output_data *odata);
+
+void
+outputs_frame_put(struct output_frame *frame);
+
 /* ---------------------------- Called by player ---------------------------- */
 
 // Ownership of *add is transferred, so don't address after calling. Instead you
@@ -344,6 +378,9 @@ outputs_stop_delayed_cancel(void);
 void
 outputs_write(void *buf, size_t bufsize, int nsamples, struct media_quality *quality, struct timespec *pts);
 
+void
+outputs_stats_get(struct outputs_stats *stats);
+
 void
 outputs_metadata_send(uint32_t item_id, bool startup, output_metadata_finalize_cb cb);
 
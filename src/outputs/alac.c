@@ -0,0 +1,482 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ * Copyright (C) 2012-2019 Espen Jürgensen <espenjurgensen@gmail.com>
+ * Copyright (C) 2010-2011 Julien BLACHE <jb@jblache.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef HAVE_ENDIAN_H
+# include <endian.h>
+#elif defined(HAVE_SYS_ENDIAN_H)
+# include <sys/endian.h>
+#elif defined(HAVE_LIBKERN_OSBYTEORDER_H)
+#include <libkern/OSByteOrder.h>
+#define htobe64(x) OSSwapHostToBigInt64(x)
+#define be64toh(x) OSSwapBigToHostInt64(x)
+#endif
+
+#include "alac.h"
+
+// Only stereo is supported
+#define ALAC_CHANNELS        2
+// The decoder reads residuals with one extra bit per channel above 1, since
+// the side channel of a stereo pair needs 17 bits
+#define ALAC_RESIDUAL_BITS   (16 + ALAC_CHANNELS - 1)
+
+// Predictor order and quantization (shift) of the predictor coefficients. The
+// quantization is Apple's default.
+#define ALAC_LPC_ORDER       8
+#define ALAC_LPC_QUANT       9
+
+// Max number of samples per channel that we will compress. The buffers for
+// them are on the stack.
+#define ALAC_MAX_SAMPLES     1024
+
+#define ALAC_ELEMENT_CPE     1
+#define ALAC_ELEMENT_END     7
+
+struct bitwriter
+{
+  uint8_t *buf;
+  size_t size;
+  size_t pos;
+  uint64_t acc;
+  int nbits;
+};
+
+struct alac_channel
+{
+  int32_t samples[ALAC_MAX_SAMPLES];
+  int32_t residuals[ALAC_MAX_SAMPLES];
+  int16_t coefs[ALAC_LPC_ORDER];
+  int order;
+};
+
+
+/* ---------------------------------- HELPERS ------------------------------- */
+
+static inline int32_t
+sign_extend(int32_t val, int bits)
+{
+  int shift = 32 - bits;
+
+  return (int32_t)((uint32_t)val << shift) >> shift;
+}
+
+static inline int
+sign_only(int32_t val)
+{
+  return (val > 0) - (val < 0);
+}
+
+static inline int
+log2_int(uint32_t val)
+{
+  return 31 - __builtin_clz(val | 1);
+}
+
+// Writes the lower n bits of val, n must be <= 32. Bits that don't fit in the
+// buffer are counted but not written, which the caller checks for at the end.
+static inline void
+bits_put(struct bitwriter *bw, int n, uint32_t val)
+{
+  bw->acc = (bw->acc << n) | (val & (uint32_t)((1ULL << n) - 1));
+  bw->nbits += n;
+
+  while (bw->nbits >= 8)
+    {
+      bw->nbits -= 8;
+      if (bw->pos < bw->size)
+	bw->buf[bw->pos] = (uint8_t)(bw->acc >> bw->nbits);
+      bw->pos++;
+    }
+}
+
+static inline void
+bits_align(struct bitwriter *bw)
+{
+  if (bw->nbits > 0)
+    bits_put(bw, 8 - bw->nbits, 0);
+}
+
+
+/* ------------------------------- UNCOMPRESSED ----------------------------- */
+
+/* The payload is written as 8 byte words, with a byte at a time for the
+ * remainder.
+ */
+void
+alac_encode_verbatim(uint8_t *dst, uint8_t *raw, int len)
+{
+  uint64_t w;
+  uint64_t next;
+  int i;
+
+  if (len <= 0)
+    return;
+
+  // Header: channel=1 (stereo), 4+8+4 unknown bits, hassize=0, 2 unused bits,
+  // is-not-compressed=1. That is 23 bits, so the samples are not byte aligned.
+  dst[0] = 0x20;
+  dst[1] = 0x00;
+  dst[2] = 0x02 | (raw[1] >> 7);
+
+  dst += 3;
+
+  // Each output byte is a big endian sample byte shifted one bit to the left,
+  // with the top bit of the next sample byte. We do 8 bytes at a time, which
+  // needs the byte that follows them.
+  for (i = 0; i + 8 < len; i += 8)
+    {
+      memcpy(&w, raw + i, sizeof(w));
+      w = be64toh(w);
+      // Byteswap the 16 bit samples to big endian
+      w = ((w & 0x00ff00ff00ff00ffULL) << 8) | ((w >> 8) & 0x00ff00ff00ff00ffULL);
+      next = raw[i + 9];
+      w = (w << 1) | (next >> 7);
+      w = htobe64(w);
+      memcpy(dst + i, &w, sizeof(w));
+    }
+
+  for (; i < len; i++)
+    {
+      // Sample bytes are little endian, so byte i of the output is raw[i ^ 1]
+      dst[i] = raw[i ^ 1] << 1;
+      if (i + 1 < len)
+	dst[i] |= raw[(i + 1) ^ 1] >> 7;
+    }
+}
+
+
+/* -------------------------------- COMPRESSED ------------------------------ */
+
+/* Finds the predictor coefficients with the autocorrelation method and the
+ * Levinson-Durbin recursion. The ALAC decoder predicts x[i] from the
+ * differences x[i-k] - x[i-order-1], k = 1..order, and adapts the coefficients
+ * as it goes, so the result is only the starting point. coefs[0] is for the
+ * oldest sample.
+ */
+static int
+lpc_coefs_find(int16_t *coefs, int32_t *x, int n)
+{
+  double r[ALAC_LPC_ORDER + 1];
+  double a[ALAC_LPC_ORDER + 1];
+  double tmp[ALAC_LPC_ORDER + 1];
+  double err;
+  double k;
+  double c;
+  int i;
+  int j;
+
+  for (j = 0; j <= ALAC_LPC_ORDER; j++)
+    {
+      r[j] = 0.0;
+      for (i = j; i < n; i++)
+	r[j] += (double)x[i] * x[i - j];
+    }
+
+  // Silence, order 0 means the residuals are the samples
+  if (r[0] == 0.0)
+    return 0;
+
+  // A little white noise keeps the recursion stable
+  err = r[0] * (1.0 + 1e-9);
+  memset(a, 0, sizeof(a));
+
+  for (i = 1; i <= ALAC_LPC_ORDER; i++)
+    {
+      k = r[i];
+      for (j = 1; j < i; j++)
+	k -= a[j] * r[i - j];
+      k /= err;
+
+      memcpy(tmp, a, sizeof(tmp));
+      a[i] = k;
+      for (j = 1; j < i; j++)
+	a[j] = tmp[j] - k * tmp[i - j];
+
+      err *= (1.0 - k * k);
+      if (err <= 0.0)
+	return 0;
+    }
+
+  for (j = 1; j <= ALAC_LPC_ORDER; j++)
+    {
+      c = a[j] * (1 << ALAC_LPC_QUANT);
+      if (c > INT16_MAX)
+	c = INT16_MAX;
+      else if (c < INT16_MIN)
+	c = INT16_MIN;
+
+      coefs[ALAC_LPC_ORDER - j] = (int16_t)(c < 0 ? c - 0.5 : c + 0.5);
+    }
+
+  return ALAC_LPC_ORDER;
+}
+
+/* Makes the residuals, mirroring the decoder's prediction and coefficient
+ * adaptation exactly. The coefficients are copied first, because the ones that
+ * go in the frame header are the starting point.
+ */
+static void
+lpc_residuals_make(struct alac_channel *ch, int n)
+{
+  int16_t c[ALAC_LPC_ORDER];
+  int32_t *x = ch->samples;
+  int32_t *e = ch->residuals;
+  int32_t *p;
+  int64_t sum;
+  int32_t d;
+  int32_t val;
+  int32_t err;
+  int sg;
+  int s;
+  int order = ch->order;
+  int i;
+  int j;
+
+  if (order == 0)
+    {
+      memcpy(e, x, n * sizeof(int32_t));
+      return;
+    }
+
+  memcpy(c, ch->coefs, sizeof(c));
+
+  e[0] = x[0];
+  for (i = 1; i <= order && i < n; i++)
+    e[i] = sign_extend(x[i] - x[i - 1], ALAC_RESIDUAL_BITS);
+
+  for (; i < n; i++)
+    {
+      d = x[i - order - 1];
+      p = &x[i - order];
+
+      sum = 0;
+      for (j = 0; j < order; j++)
+	sum += (int64_t)(p[j] - d) * c[j];
+
+      val = (int32_t)(sum + (1 << (ALAC_LPC_QUANT - 1))) >> ALAC_LPC_QUANT;
+      err = sign_extend(x[i] - (val + d), ALAC_RESIDUAL_BITS);
+      e[i] = err;
+
+      sg = sign_only(err);
+      for (j = 0; sg && j < order && err * sg > 0; j++)
+	{
+	  val = d - p[j];
+	  s = sign_only(val) * sg;
+	  c[j] -= s;
+	  val *= s;
+	  err -= (val >> ALAC_LPC_QUANT) * (j + 1);
+	}
+    }
+}
+
+static inline void
+rice_put(struct bitwriter *bw, uint32_t x, int k, int bits)
+{
+  uint32_t divisor;
+  uint32_t q;
+  uint32_t r;
+
+  if (k > ALAC_RICE_LIMIT)
+    k = ALAC_RICE_LIMIT;
+
+  divisor = (1 << k) - 1;
+  q = x / divisor;
+  r = x % divisor;
+
+  // More than 8 leading ones is an escape, followed by the value verbatim
+  if (q > 8)
+    {
+      bits_put(bw, 9, 0x1ff);
+      bits_put(bw, bits, x);
+      return;
+    }
+
+  if (q)
+    bits_put(bw, q, (1 << q) - 1);
+  bits_put(bw, 1, 0);
+
+  if (k == 1)
+    return;
+
+  if (r > 0)
+    bits_put(bw, k, r + 1);
+  else
+    bits_put(bw, k - 1, 0);
+}
+
+// Adaptive Rice coding of the residuals, with run length coding of zeros
+static void
+residuals_put(struct bitwriter *bw, int32_t *e, int n)
+{
+  uint32_t history = ALAC_RICE_INITIAL_HISTORY;
+  uint32_t x;
+  uint32_t block;
+  int sign_modifier = 0;
+  int k;
+  int i;
+
+  for (i = 0; i < n; )
+    {
+      k = log2_int((history >> 9) + 3);
+      x = (e[i] < 0) ? (uint32_t)(-2 * (int64_t)e[i] - 1) : (uint32_t)(2 * e[i]);
+      i++;
+
+      rice_put(bw, x - sign_modifier, k, ALAC_RESIDUAL_BITS);
+
+      sign_modifier = 0;
+      if (x > 0xffff)
+	history = 0xffff;
+      else
+	history += x * ALAC_RICE_HISTORY_MULT - ((history * ALAC_RICE_HISTORY_MULT) >> 9);
+
+      if (history < 128 && i < n)
+	{
+	  k = 7 - log2_int(history) + ((history + 16) >> 6);
+
+	  for (block = 0; i < n && e[i] == 0; i++)
+	    block++;
+
+	  rice_put(bw, block, k, 16);
+
+	  sign_modifier = (block <= 0xffff);
+	  history = 0;
+	}
+    }
+}
+
+// Rough estimate of the bits needed for a channel, used for choosing between
+// left/right and mid/side
+static uint64_t
+channel_cost(int32_t *x, int n)
+{
+  uint64_t cost = 0;
+  int i;
+
+  for (i = 2; i < n; i++)
+    cost += labs((long)x[i] - 2 * x[i - 1] + x[i - 2]);
+
+  return cost;
+}
+
+int
+alac_encode_compressed(uint8_t *dst, size_t dst_size, uint8_t *raw, int nsamples, int frame_length)
+{
+  struct alac_channel ch[ALAC_CHANNELS];
+  struct bitwriter bw;
+  uint64_t cost_lr;
+  uint64_t cost_ms;
+  int32_t l;
+  int32_t r;
+  int shift;
+  int weight;
+  int i;
+  int j;
+
+  if (nsamples <= ALAC_LPC_ORDER + 1 || nsamples > ALAC_MAX_SAMPLES)
+    return -1;
+
+  for (i = 0; i < nsamples; i++)
+    {
+      ch[0].samples[i] = (int16_t)(raw[4 * i] | (raw[4 * i + 1] << 8));
+      ch[1].samples[i] = (int16_t)(raw[4 * i + 2] | (raw[4 * i + 3] << 8));
+    }
+
+  // Mid/side (shift 1, weight 1) if that looks cheaper than left/right. The
+  // decoder reverses it with R = mid - (side >> 1) and L = side + R. The
+  // residual buffers are free at this point, so we use them for mid/side.
+  for (i = 0; i < nsamples; i++)
+    {
+      l = ch[0].samples[i];
+      r = ch[1].samples[i];
+      ch[1].residuals[i] = l - r;
+      ch[0].residuals[i] = r + ((l - r) >> 1);
+    }
+
+  cost_lr = channel_cost(ch[0].samples, nsamples) + channel_cost(ch[1].samples, nsamples);
+  cost_ms = channel_cost(ch[0].residuals, nsamples) + channel_cost(ch[1].residuals, nsamples);
+  if (cost_ms < cost_lr)
+    {
+      memcpy(ch[0].samples, ch[0].residuals, nsamples * sizeof(int32_t));
+      memcpy(ch[1].samples, ch[1].residuals, nsamples * sizeof(int32_t));
+      shift = 1;
+      weight = 1;
+    }
+  else
+    {
+      shift = 0;
+      weight = 0;
+    }
+
+  for (j = 0; j < ALAC_CHANNELS; j++)
+    {
+      ch[j].order = lpc_coefs_find(ch[j].coefs, ch[j].samples, nsamples);
+      lpc_residuals_make(&ch[j], nsamples);
+    }
+
+  memset(&bw, 0, sizeof(struct bitwriter));
+  bw.buf = dst;
+  bw.size = dst_size;
+
+  // Element header: type, instance tag, 12 unused bits, hassize, 2 bits of
+  // "wasted bytes" (none for 16 bit), is-not-compressed=0
+  bits_put(&bw, 3, ALAC_ELEMENT_CPE);
+  bits_put(&bw, 4, 0);
+  bits_put(&bw, 12, 0);
+  bits_put(&bw, 1, (nsamples != frame_length));
+  bits_put(&bw, 2, 0);
+  bits_put(&bw, 1, 0);
+  if (nsamples != frame_length)
+    bits_put(&bw, 32, nsamples);
+
+  bits_put(&bw, 8, shift);
+  bits_put(&bw, 8, weight);
+
+  for (j = 0; j < ALAC_CHANNELS; j++)
+    {
+      bits_put(&bw, 4, 0); // Prediction type
+      bits_put(&bw, 4, ALAC_LPC_QUANT);
+      bits_put(&bw, 3, 4); // Rice modifier, the decoder uses history_mult * 4 / 4
+      bits_put(&bw, 5, ch[j].order);
+
+      // Coefficients are written newest first
+      for (i = ch[j].order - 1; i >= 0; i--)
+	bits_put(&bw, 16, (uint16_t)ch[j].coefs[i]);
+    }
+
+  for (j = 0; j < ALAC_CHANNELS; j++)
+    residuals_put(&bw, ch[j].residuals, nsamples);
+
+  bits_put(&bw, 3, ALAC_ELEMENT_END);
+  bits_align(&bw);
+
+  // Overflowed or not worth it
+  if (bw.pos > bw.size || bw.pos >= (size_t)(ALAC_HEADER_LEN + 4 * nsamples))
+    return -1;
+
+  return bw.pos;
+}
@@ -0,0 +1,41 @@
+#ifndef __ALAC_H__
+#define __ALAC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Size of the header of an uncompressed frame
+#define ALAC_HEADER_LEN              3
+
+// Rice coder parameters. These must match the ones announced to the receiver,
+// e.g. the "40 10 14" in the RAOP SDP fmtp line.
+#define ALAC_RICE_HISTORY_MULT       40
+#define ALAC_RICE_INITIAL_HISTORY    10
+#define ALAC_RICE_LIMIT              14
+
+/* Makes an uncompressed ALAC frame from raw samples. The raw data must be 16
+ * bit little endian stereo, and dst must have room for ALAC_HEADER_LEN + len.
+ *
+ * @out dst          Buffer for the ALAC frame
+ * @in  raw          Raw samples
+ * @in  len          Length of raw in bytes
+ */
+void
+alac_encode_verbatim(uint8_t *dst, uint8_t *raw, int len);
+
+/* Makes a compressed ALAC frame from raw samples (16 bit little endian stereo).
+ * Uses a linear predictor with Rice coded residuals, like Apple's encoder.
+ * The frame is only made if it will be smaller than the uncompressed frame,
+ * so the caller should fall back to alac_encode_verbatim() if this fails.
+ *
+ * @out dst          Buffer for the ALAC frame
+ * @in  dst_size     Size of dst
+ * @in  raw          Raw samples
+ * @in  nsamples     Number of samples (per channel) in raw
+ * @in  frame_length Frame length announced to the receiver
+ * @return           Length of the frame, or -1 if not made
+ */
+int
+alac_encode_compressed(uint8_t *dst, size_t dst_size, uint8_t *raw, int nsamples, int frame_length);
+
+#endif /* !__ALAC_H__ */
@@ -166,15 +166,16 @@ enum cast_state
 
 struct cast_master_session
 {
-  struct evbuffer *evbuf;
-  int evbuf_samples;
-
   struct rtp_session *rtp_session;
 
   struct media_quality quality;
 
+  // Holds the start of a packet when the player's data doesn't end on a packet
+  // boundary. Full packets are made directly from the player's data.
   uint8_t *rawbuf;
   size_t rawbuf_size;
+  size_t rawbuf_len;
+  int rawbuf_samples;
   int samples_per_packet;
 };
 
@@ -230,6 +231,7 @@ struct cast_session
   int media_session_id;
 
   int udp_fd;
+  struct rtp_send_stats send_stats;
   unsigned short udp_port;
 
   struct cast_session *next;
@@ -544,7 +546,6 @@ master_session_free(struct cast_master_session *cms)
 
   outputs_quality_unsubscribe(&cms->rtp_session->quality);
   rtp_session_free(cms->rtp_session);
-  evbuffer_free(cms->evbuf);
   free(cms->rawbuf);
   free(cms);
 }
@@ -575,6 +576,10 @@ cast_session_free(struct cast_session *cs)
 
   master_session_cleanup(cs->master_session);
 
+  if (cs->send_stats.syscalls > 0)
+    DPRINTF(E_DBG, L_CAST, "Send statistics for '%s': %" PRIu64 " packets, %" PRIu64 " bytes, %" PRIu64 " syscalls, %" PRIu64 " full buffer, %" PRIu64 " errors\n",
+      cs->devname, cs->send_stats.packets, cs->send_stats.bytes, cs->send_stats.syscalls, cs->send_stats.eagain, cs->send_stats.errors);
+
   event_free(cs->reply_timeout);
   event_free(cs->ev);
 
@@ -1451,7 +1456,6 @@ master_session_make(struct media_quality *quality)
   cms->rawbuf_size = STOB(cms->samples_per_packet, quality->bits_per_sample, quality->channels);
 
   CHECK_NULL(L_CAST, cms->rawbuf = malloc(cms->rawbuf_size));
-  CHECK_NULL(L_CAST, cms->evbuf = evbuffer_new());
 
   cast_master_session = cms;
 
@@ -1764,66 +1768,52 @@ packet_prepare(struct rtp_packet *pkt, struct evbuffer *evbuf)
   return evbuffer_remove(evbuf, pkt->payload + CAST_HEADER_SIZE, pkt->payload_len - CAST_HEADER_SIZE);
 }
 
-static int
-packet_send(struct cast_session *cs, struct rtp_packet *pkt)
+// Sends all the packets that the session hasn't got yet in as few syscalls as
+// possible
+static inline int
+packets_send(struct cast_session *cs, struct rtp_session *rtp_session)
 {
+  int npkts;
   int ret;
 
-  ret = send(cs->udp_fd, pkt->data, pkt->data_len, 0);
+  npkts = (uint16_t)(rtp_session->seqnum - cs->seqnum_next);
+  if (npkts == 0)
+    return 0;
+
+  // If we have fallen so far behind that the oldest packets have left the
+  // retransmit buffer we must skip those
+  if ((size_t)npkts > rtp_session->pktbuf_len)
+    {
+      DPRINTF(E_WARN, L_CAST, "Skipping %d packets to '%s', no longer in buffer\n", npkts - (int)rtp_session->pktbuf_len, cs->devname);
+      npkts = rtp_session->pktbuf_len;
+      cs->seqnum_next = rtp_session->seqnum - npkts;
+    }
+
+  ret = rtp_packets_send(cs->udp_fd, rtp_session, cs->seqnum_next, npkts, -1, &cs->send_stats);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_CAST, "Send error for '%s': %s\n", cs->devname, strerror(errno));
       return -1;
     }
-  else if (ret != pkt->data_len)
-    {
-      DPRINTF(E_WARN, L_CAST, "Partial send (%d) for '%s'\n", ret, cs->devname);
-      return 0;
-    }
-
-/*  DPRINTF(E_DBG, L_CAST, "RTP PACKET seqnum %u, rtptime %u, payload 0x%x, pktbuf_s %zu\n",
-    cs->master_session->rtp_session->seqnum,
-    cs->master_session->rtp_session->pos,
-    pkt->header[1],
-    cs->master_session->rtp_session->pktbuf_len
-    );
-*/
-  return 0;
-}
-
-static inline int
-packets_send(struct cast_session *cs, struct rtp_session *rtp_session)
-{
-  struct rtp_packet *pkt;
-  int ret;
+  else if (ret != npkts)
+    DPRINTF(E_WARN, L_CAST, "Could only send %d of %d packets to '%s'\n", ret, npkts, cs->devname);
 
-  // Note that the loop must work even though seqnum wraps around, so we use !=, not <
-  for (; cs->seqnum_next != rtp_session->seqnum; cs->seqnum_next++)
-    {
-      pkt = rtp_packet_get(rtp_session, cs->seqnum_next);
-      if (!pkt)
-	{
-	  DPRINTF(E_WARN, L_CAST, "Packet to '%s' is missing in our buffer\n", cs->devname);
-	  return 0; // Don't fail session over a missing packet (or should we?)
-	}
-
-      ret = packet_send(cs, pkt);
-      if (ret < 0)
-	return -1;
-    }
+  // The packets that weren't sent (e.g. socket buffer full) are sent next time.
+  // Don't fail session over that (or should we?)
+  cs->seqnum_next += ret;
 
   return 0;
 }
 
 static int
-packet_make(struct cast_master_session *cms)
+packet_make(struct cast_master_session *cms, uint8_t *rawbuf)
 {
   struct rtp_packet *pkt;
   int len;
   int ret;
 
   // Encode payload into cast_encoded_data
-  len = payload_encode(cast_encoded_data, cms->rawbuf, cms->rawbuf_size, cms->samples_per_packet, &cms->quality);
+  len = payload_encode(cast_encoded_data, rawbuf, cms->rawbuf_size, cms->samples_per_packet, &cms->quality);
   if (len < 0)
     return -1;
 
@@ -1841,28 +1831,55 @@ packet_make(struct cast_master_session *cms)
   return 0;
 }
 
+// Slices the player's data into packets. Only the remainder that doesn't fill a
+// packet is copied (to rawbuf), and completed with the next write.
 static inline int
 packets_make(struct cast_master_session *cms, struct output_data *odata)
 {
+  uint8_t *data;
+  size_t len;
+  size_t n;
   int ret;
   int npkts;
 
-  // TODO avoid this copy
-  evbuffer_add(cms->evbuf, odata->buffer, odata->bufsize);
-  cms->evbuf_samples += odata->samples;
+  data = odata->buffer;
+  len = odata->bufsize;
 
-  // Make as many packets as we have data for (one packet requires rawbuf_size bytes)
   npkts = 0;
-  while (evbuffer_get_length(cms->evbuf) >= cms->rawbuf_size)
+  if (cms->rawbuf_len > 0)
     {
-      evbuffer_remove(cms->evbuf, cms->rawbuf, cms->rawbuf_size);
-      cms->evbuf_samples -= cms->samples_per_packet;
+      n = MIN(len, cms->rawbuf_size - cms->rawbuf_len);
+      memcpy(cms->rawbuf + cms->rawbuf_len, data, n);
+      cms->rawbuf_len += n;
+      data += n;
+      len -= n;
 
-      ret = packet_make(cms);
+      if (cms->rawbuf_len == cms->rawbuf_size)
+	{
+	  ret = packet_make(cms, cms->rawbuf);
+	  if (ret == 0)
+	    npkts++;
+
+	  cms->rawbuf_len = 0;
+	}
+    }
+
+  // Make as many packets as we have data for (one packet requires rawbuf_size bytes)
+  for (; len >= cms->rawbuf_size; data += cms->rawbuf_size, len -= cms->rawbuf_size)
+    {
+      ret = packet_make(cms, data);
       if (ret == 0)
 	npkts++;
     }
 
+  if (len > 0)
+    {
+      memcpy(cms->rawbuf + cms->rawbuf_len, data, len);
+      cms->rawbuf_len += len;
+    }
+
+  cms->rawbuf_samples = BTOS(cms->rawbuf_len, cms->quality.bits_per_sample, cms->quality.channels);
+
   return npkts;
 }
 
@@ -1886,7 +1903,7 @@ packets_sync_send(struct cast_master_session *cms, struct timespec pts)
 
   clock_gettime(CLOCK_MONOTONIC, &ts);
 
-  cur_stamp.pos = cms->rtp_session->pos + cms->evbuf_samples - cms->output_buffer_samples;
+  cur_stamp.pos = cms->rtp_session->pos + cms->rawbuf_samples - cms->output_buffer_samples;
 
   for (cs = cast_sessions; cs; cs = cs->next)
     {
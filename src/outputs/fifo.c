@@ -42,9 +42,8 @@
 
 struct fifo_packet
 {
-  /* pcm data */
-  uint8_t *samples;
-  size_t samples_size;
+  /* pcm data, shared with other outputs */
+  struct output_frame *frame;
 
   /* Presentation timestamp of the first sample */
   struct timespec pts;
@@ -75,6 +74,7 @@ free_buffer()
     {
       tmp = packet;
       packet = packet->next;
+      outputs_frame_put(tmp->frame);
       free(tmp);
     }
 
@@ -414,10 +414,8 @@ fifo_write(struct output_buffer *obuf)
   fifo_session->state = OUTPUT_STATE_STREAMING;
 
   CHECK_NULL(L_FIFO, packet = calloc(1, sizeof(struct fifo_packet)));
-  CHECK_NULL(L_FIFO, packet->samples = malloc(obuf->data[i].bufsize));
 
-  memcpy(packet->samples, obuf->data[i].buffer, obuf->data[i].bufsize);
-  packet->samples_size = obuf->data[i].bufsize;
+  packet->frame = outputs_frame_get(&obuf->data[i]);
   packet->pts = obuf->pts;
 
   if (buffer.head)
@@ -435,12 +433,12 @@ fifo_write(struct output_buffer *obuf)
 
   while (buffer.tail && (timespec_cmp(buffer.tail->pts, now) == -1))
     {
-      bytes = write(fifo_session->output_fd, buffer.tail->samples, buffer.tail->samples_size);
+      bytes = write(fifo_session->output_fd, buffer.tail->frame->data, buffer.tail->frame->size);
       if (bytes > 0)
 	{
 	  packet = buffer.tail;
 	  buffer.tail = buffer.tail->next;
-	  free(packet->samples);
+	  outputs_frame_put(packet->frame);
 	  free(packet);
 	  return;
 	}
@@ -74,14 +74,13 @@
 #include "artwork.h"
 #include "dmap_common.h"
 #include "rtp_common.h"
+#include "alac.h"
 #include "outputs.h"
 
 #ifdef RAOP_VERIFICATION
 #include "raop_verification.h"
 #endif
 
-#define ALAC_HEADER_LEN                      3
-
 #define RAOP_QUALITY_SAMPLE_RATE_DEFAULT     44100
 #define RAOP_QUALITY_BITS_PER_SAMPLE_DEFAULT 16
 #define RAOP_QUALITY_CHANNELS_DEFAULT        2
@@ -157,22 +156,29 @@ struct raop_extra
 
   uint16_t wanted_metadata;
   bool encrypt;
+  bool compress;
   bool supports_auth_setup;
 };
 
 struct raop_master_session
 {
-  struct evbuffer *evbuf;
-  int evbuf_samples;
-
   struct rtp_session *rtp_session;
 
   struct rtcp_timestamp cur_stamp;
 
+  // Holds the start of a packet when the player's data doesn't end on a packet
+  // boundary. Full packets are made directly from the player's data.
   uint8_t *rawbuf;
   size_t rawbuf_size;
+  size_t rawbuf_len;
+  int rawbuf_samples;
   int samples_per_packet;
   bool encrypt;
+  bool compress;
+
+  // For logging the compression ratio when compress is set
+  uint64_t raw_bytes;
+  uint64_t alac_bytes;
 
   // Number of samples that we tell the output to buffer (this will mean that
   // the position that we send in the sync packages are offset by this amount
@@ -196,6 +202,7 @@ struct raop_session
   uint16_t wanted_metadata;
   bool req_has_auth;
   bool encrypt;
+  bool compress;
   bool auth_quirk_itunes;
   bool supports_post;
   bool supports_auth_setup;
@@ -231,6 +238,7 @@ struct raop_session
 #endif
 
   int server_fd;
+  struct rtp_send_stats send_stats;
 
   union sockaddr_all sa;
 
@@ -350,84 +358,6 @@ raop_device_start(struct output_device *rd, int callback_id);
 
 /* ------------------------------- MISC HELPERS ----------------------------- */
 
-/* ALAC bits writer - big endian
- * p    outgoing buffer pointer
- * val  bitfield value
- * blen bitfield length, max 8 bits
- * bpos bit position in the current byte (pointed by *p)
- */
-static inline void
-alac_write_bits(uint8_t **p, uint8_t val, int blen, int *bpos)
-{
-  int lb;
-  int rb;
-  int bd;
-
-  /* Remaining bits in the current byte */
-  lb = 7 - *bpos + 1;
-
-  /* Number of bits overflowing */
-  rb = lb - blen;
-
-  if (rb >= 0)
-    {
-      bd = val << rb;
-      if (*bpos == 0)
-	**p = bd;
-      else
-	**p |= bd;
-
-      /* No over- nor underflow, we're done with this byte */
-      if (rb == 0)
-	{
-	  *p += 1;
-	  *bpos = 0;
-	}
-      else
-	*bpos += blen;
-    }
-  else
-    {
-      /* Fill current byte */
-      bd = val >> -rb;
-      **p |= bd;
-
-      /* Overflow goes to the next byte */
-      *p += 1;
-      **p = val << (8 + rb);
-      *bpos = -rb;
-    }
-}
-
-/* Raw data must be little endian */
-static void
-alac_encode(uint8_t *dst, uint8_t *raw, int len)
-{
-  uint8_t *maxraw;
-  int bpos;
-
-  bpos = 0;
-  maxraw = raw + len;
-
-  alac_write_bits(&dst, 1, 3, &bpos); /* channel=1, stereo */
-  alac_write_bits(&dst, 0, 4, &bpos); /* unknown */
-  alac_write_bits(&dst, 0, 8, &bpos); /* unknown */
-  alac_write_bits(&dst, 0, 4, &bpos); /* unknown */
-  alac_write_bits(&dst, 0, 1, &bpos); /* hassize */
-
-  alac_write_bits(&dst, 0, 2, &bpos); /* unused */
-  alac_write_bits(&dst, 1, 1, &bpos); /* is-not-compressed */
-
-  for (; raw < maxraw; raw += 4)
-    {
-      /* Byteswap to big endian */
-      alac_write_bits(&dst, *(raw + 1), 8, &bpos);
-      alac_write_bits(&dst, *raw, 8, &bpos);
-      alac_write_bits(&dst, *(raw + 3), 8, &bpos);
-      alac_write_bits(&dst, *(raw + 2), 8, &bpos);
-    }
-}
-
 /* AirTunes v2 time synchronization helpers */
 static inline void
 timespec_to_ntp(struct timespec *ts, struct ntp_stamp *ns)
@@ -1751,7 +1681,7 @@ raop_status(struct raop_session *rs)
 }
 
 static struct raop_master_session *
-master_session_make(struct media_quality *quality, bool encrypt)
+master_session_make(struct media_quality *quality, bool encrypt, bool compress)
 {
   struct raop_master_session *rms;
   int ret;
@@ -1759,7 +1689,7 @@ master_session_make(struct media_quality *quality, bool encrypt)
   // First check if we already have a suitable session
   for (rms = raop_master_sessions; rms; rms = rms->next)
     {
-      if (encrypt == rms->encrypt && quality_is_equal(quality, &rms->rtp_session->quality))
+      if (encrypt == rms->encrypt && compress == rms->compress && quality_is_equal(quality, &rms->rtp_session->quality))
 	return rms;
     }
 
@@ -1782,12 +1712,12 @@ master_session_make(struct media_quality *quality, bool encrypt)
     }
 
   rms->encrypt = encrypt;
+  rms->compress = compress;
   rms->samples_per_packet = RAOP_SAMPLES_PER_PACKET;
   rms->rawbuf_size = STOB(rms->samples_per_packet, quality->bits_per_sample, quality->channels);
   rms->output_buffer_samples = OUTPUTS_BUFFER_DURATION * quality->sample_rate;
 
   CHECK_NULL(L_RAOP, rms->rawbuf = malloc(rms->rawbuf_size));
-  CHECK_NULL(L_RAOP, rms->evbuf = evbuffer_new());
 
   rms->next = raop_master_sessions;
   raop_master_sessions = rms;
@@ -1801,9 +1731,12 @@ master_session_free(struct raop_master_session *rms)
   if (!rms)
     return;
 
+  if (rms->compress && rms->raw_bytes > 0)
+    DPRINTF(E_DBG, L_RAOP, "ALAC compressed %" PRIu64 " bytes of audio to %" PRIu64 " bytes (%.1f%%)\n",
+      rms->raw_bytes, rms->alac_bytes, 100.0 * rms->alac_bytes / rms->raw_bytes);
+
   outputs_quality_unsubscribe(&rms->rtp_session->quality);
   rtp_session_free(rms->rtp_session);
-  evbuffer_free(rms->evbuf);
   free(rms->rawbuf);
   free(rms);
 }
@@ -1845,6 +1778,10 @@ session_free(struct raop_session *rs)
 
   master_session_cleanup(rs->master_session);
 
+  if (rs->send_stats.syscalls > 0)
+    DPRINTF(E_DBG, L_RAOP, "Send statistics for '%s': %" PRIu64 " packets, %" PRIu64 " bytes, %" PRIu64 " syscalls, %" PRIu64 " full buffer, %" PRIu64 " errors\n",
+      rs->devname, rs->send_stats.packets, rs->send_stats.bytes, rs->send_stats.syscalls, rs->send_stats.eagain, rs->send_stats.errors);
+
   evrtsp_connection_set_closecb(rs->ctrl, NULL, NULL);
 
   evrtsp_connection_free(rs->ctrl);
@@ -2028,6 +1965,7 @@ session_make(struct output_device *rd, int family, int callback_id, bool only_pr
 
   rs->supports_auth_setup = re->supports_auth_setup;
   rs->wanted_metadata = re->wanted_metadata;
+  rs->compress = re->compress;
 
   switch (re->devtype)
     {
@@ -2128,7 +2066,7 @@ session_make(struct output_device *rd, int family, int callback_id, bool only_pr
 
   rs->volume = rd->volume;
 
-  rs->master_session = master_session_make(&rd->quality, rs->encrypt);
+  rs->master_session = master_session_make(&rd->quality, rs->encrypt, rs->compress);
   if (!rs->master_session)
     {
       DPRINTF(E_LOG, L_RAOP, "Could not attach a master session for device '%s'\n", rd->name);
@@ -2712,27 +2650,19 @@ raop_keep_alive_timer_cb(int fd, short what, void *arg)
 
 /* -------------------- Creation and sending of RTP packets  ---------------- */
 
+// Encrypts the packet in place. All packets use the same key and IV, so the key
+// schedule is only expanded once (in raop_init), and each packet just needs the
+// IV set. The receiver decrypts each packet as its own CBC chain, so a write's
+// packets can't be encrypted as one buffer, and since the rtp session only has
+// room for one uncommitted packet, this must be done per packet in
+// packet_make().
 static int
-packet_prepare(struct rtp_packet *pkt, uint8_t *rawbuf, size_t rawbuf_size, bool encrypt)
+packet_encrypt(struct rtp_packet *pkt)
 {
   char ebuf[64];
   gpg_error_t gc_err;
 
-  alac_encode(pkt->payload, rawbuf, rawbuf_size);
-
-  if (!encrypt)
-    return 0;
-
-  // Reset cipher
-  gc_err = gcry_cipher_reset(raop_aes_ctx);
-  if (gc_err != GPG_ERR_NO_ERROR)
-    {
-      gpg_strerror_r(gc_err, ebuf, sizeof(ebuf));
-      DPRINTF(E_LOG, L_RAOP, "Could not reset AES cipher: %s\n", ebuf);
-      return -1;
-    }
-
-  // Set IV
+  // Setting the IV starts a new CBC chain
   gc_err = gcry_cipher_setiv(raop_aes_ctx, raop_aes_iv, sizeof(raop_aes_iv));
   if (gc_err != GPG_ERR_NO_ERROR)
     {
@@ -2753,15 +2683,18 @@ packet_prepare(struct rtp_packet *pkt, uint8_t *rawbuf, size_t rawbuf_size, bool
   return 0;
 }
 
+// Sends npkts packets from the master session's buffer, starting with seqnum.
+// If type is not negative, it is used as RTP payload type instead of the one in
+// the packets.
 static int
-packet_send(struct raop_session *rs, struct rtp_packet *pkt)
+packets_send(struct raop_session *rs, uint16_t seqnum, int npkts, int type)
 {
   int ret;
 
   if (!rs)
     return -1;
 
-  ret = send(rs->server_fd, pkt->data, pkt->data_len, 0);
+  ret = rtp_packets_send(rs->server_fd, rs->master_session->rtp_session, seqnum, npkts, type, &rs->send_stats);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_RAOP, "Send error for '%s': %s\n", rs->devname, strerror(errno));
@@ -2771,19 +2704,12 @@ packet_send(struct raop_session *rs, struct rtp_packet *pkt)
       deferred_session_failure(rs);
       return -1;
     }
-  else if (ret != pkt->data_len)
+  else if (ret != npkts)
     {
-      DPRINTF(E_WARN, L_RAOP, "Partial send (%d) for '%s'\n", ret, rs->devname);
+      DPRINTF(E_WARN, L_RAOP, "Could only send %d of %d packets to '%s'\n", ret, npkts, rs->devname);
       return -1;
     }
 
-/*  DPRINTF(E_DBG, L_PLAYER, "RTP PACKET seqnum %u, rtptime %u, payload 0x%x, pktbuf_s %zu\n",
-    rs->master_session->rtp_session->seqnum,
-    rs->master_session->rtp_session->pos,
-    pkt->header[1],
-    rs->master_session->rtp_session->pktbuf_len
-    );
-*/
   return 0;
 }
 
@@ -2819,25 +2745,20 @@ static void
 packets_resend(struct raop_session *rs, uint16_t seqnum, int len)
 {
   struct rtp_session *rtp_session;
-  struct rtp_packet *pkt;
-  uint16_t s;
-  int i;
-  bool pkt_missing = false;
+  bool pkt_missing;
 
   rtp_session = rs->master_session->rtp_session;
 
   DPRINTF(E_DBG, L_RAOP, "Got retransmit request from '%s': seqnum %" PRIu16 " (len %d), last RTP session seqnum %" PRIu16 " (len %zu)\n",
     rs->devname, seqnum, len, rtp_session->seqnum - 1, rtp_session->pktbuf_len);
 
-  // Note that seqnum may wrap around, so we don't use it for counting
-  for (i = 0, s = seqnum; i < len; i++, s++)
-    {
-      pkt = rtp_packet_get(rtp_session, s);
-      if (pkt)
-	packet_send(rs, pkt);
-      else
-	pkt_missing = true;
-    }
+  if (len <= 0)
+    return;
+
+  // The buffer is contiguous, so if both ends are there the rest is too
+  pkt_missing = !rtp_packet_get(rtp_session, seqnum) || !rtp_packet_get(rtp_session, seqnum + len - 1);
+
+  packets_send(rs, seqnum, len, -1);
 
   if (pkt_missing)
     DPRINTF(E_WARN, L_RAOP, "Device '%s' retransmit request for seqnum %" PRIu16 " (len %d) is outside buffer range (last seqnum %" PRIu16 ", len %zu)\n",
@@ -2845,18 +2766,53 @@ packets_resend(struct raop_session *rs, uint16_t seqnum, int len)
 }
 
 static int
-packets_send(struct raop_master_session *rms)
+packet_make(struct raop_master_session *rms, uint8_t *rawbuf)
 {
   struct rtp_packet *pkt;
-  struct raop_session *rs;
-  int ret;
+  int len;
 
+  // Room for an uncompressed frame, a compressed frame will be smaller
   pkt = rtp_packet_next(rms->rtp_session, ALAC_HEADER_LEN + rms->rawbuf_size, rms->samples_per_packet, 0x60);
 
-  ret = packet_prepare(pkt, rms->rawbuf, rms->rawbuf_size, rms->encrypt);
-  if (ret < 0)
+  len = -1;
+  if (rms->compress)
+    len = alac_encode_compressed(pkt->payload, pkt->payload_size, rawbuf, rms->samples_per_packet, RAOP_SAMPLES_PER_PACKET);
+
+  if (len > 0)
+    {
+      pkt->data_len -= pkt->payload_len - len;
+      pkt->payload_len = len;
+    }
+  else
+    alac_encode_verbatim(pkt->payload, rawbuf, rms->rawbuf_size);
+
+  rms->raw_bytes += rms->rawbuf_size;
+  rms->alac_bytes += pkt->payload_len;
+
+  // Must be done before the packet goes in the retransmit buffer, so that a
+  // packet that failed encryption is never (re)sent. Not committing it means
+  // the next packet reuses its place and seqnum.
+  if (rms->encrypt && packet_encrypt(pkt) < 0)
     return -1;
 
+  // Commits packet to retransmit buffer, and prepares the session for the next packet
+  rtp_packet_commit(rms->rtp_session, pkt);
+
+  return 0;
+}
+
+// Sends the packets made since seqnum to all the master session's devices, one
+// batch per device
+static void
+packets_send_all(struct raop_master_session *rms, uint16_t seqnum)
+{
+  struct raop_session *rs;
+  int npkts;
+
+  npkts = (uint16_t)(rms->rtp_session->seqnum - seqnum);
+  if (npkts == 0)
+    return;
+
   for (rs = raop_sessions; rs; rs = rs->next)
     {
       if (rs->master_session != rms)
@@ -2864,21 +2820,49 @@ packets_send(struct raop_master_session *rms)
 
       // Device just joined
       if (rs->state == RAOP_STATE_CONNECTED)
-	{
-	  pkt->header[1] = 0xe0;
-	  packet_send(rs, pkt);
-	}
+	packets_send(rs, seqnum, npkts, 0xe0);
       else if (rs->state == RAOP_STATE_STREAMING)
+	packets_send(rs, seqnum, npkts, 0x60);
+    }
+}
+
+// Slices the player's data into packets. Only the remainder that doesn't fill a
+// packet is copied (to rawbuf), and completed with the next write.
+static void
+packets_make(struct raop_master_session *rms, struct output_data *odata)
+{
+  uint8_t *data;
+  size_t len;
+  size_t n;
+
+  data = odata->buffer;
+  len = odata->bufsize;
+
+  if (rms->rawbuf_len > 0)
+    {
+      n = MIN(len, rms->rawbuf_size - rms->rawbuf_len);
+      memcpy(rms->rawbuf + rms->rawbuf_len, data, n);
+      rms->rawbuf_len += n;
+      data += n;
+      len -= n;
+
+      if (rms->rawbuf_len == rms->rawbuf_size)
 	{
-	  pkt->header[1] = 0x60;
-	  packet_send(rs, pkt);
+	  packet_make(rms, rms->rawbuf);
+	  rms->rawbuf_len = 0;
 	}
     }
 
-  // Commits packet to retransmit buffer, and prepares the session for the next packet
-  rtp_packet_commit(rms->rtp_session, pkt);
+  for (; len >= rms->rawbuf_size; data += rms->rawbuf_size, len -= rms->rawbuf_size)
+    packet_make(rms, data);
 
-  return 0;
+  if (len > 0)
+    {
+      memcpy(rms->rawbuf + rms->rawbuf_len, data, len);
+      rms->rawbuf_len += len;
+    }
+
+  rms->rawbuf_samples = BTOS(rms->rawbuf_len, odata->quality.bits_per_sample, odata->quality.channels);
 }
 
 // Overview of rtptimes as they should be when starting a stream, and assuming
@@ -2908,15 +2892,15 @@ timestamp_set(struct raop_master_session *rms, struct timespec ts)
   //   -> we should be playing rtptime X + 600
   //
   // So how do we measure samples received from player? We know that from the
-  // pos, which says how much has been sent to the device, and from rms->evbuf,
+  // pos, which says how much has been sent to the device, and from rms->rawbuf,
   // which is the unsent stuff being buffered:
-  //   - received = (pos - X) + rms->evbuf_samples
+  //   - received = (pos - X) + rms->rawbuf_samples
   //
   // This means the rtptime is computed as:
   //   - rtptime = X + received - rms->output_buffer_samples
-  //   -> rtptime = X + (pos - X) + rms->evbuf_samples - rms->out_buffer_samples
-  //   -> rtptime = pos + rms->evbuf_samples - rms->output_buffer_samples
-  rms->cur_stamp.pos = rms->rtp_session->pos + rms->evbuf_samples - rms->output_buffer_samples;
+  //   -> rtptime = X + (pos - X) + rms->rawbuf_samples - rms->out_buffer_samples
+  //   -> rtptime = pos + rms->rawbuf_samples - rms->output_buffer_samples
+  rms->cur_stamp.pos = rms->rtp_session->pos + rms->rawbuf_samples - rms->output_buffer_samples;
 }
 
 static void
@@ -4600,6 +4584,10 @@ raop_device_cb(const char *name, const char *type, const char *domain, const cha
   if (p && (*p == '1'))
     re->encrypt = 1;
 
+  // Compress stream (ALAC), only if set in config
+  if (airplay && cfg_getbool(airplay, "alac_compression"))
+    re->compress = 1;
+
   // Metadata support
   p = keyval_get(txt, "md");
   if (p)
@@ -4783,6 +4771,7 @@ raop_write(struct output_buffer *obuf)
 {
   struct raop_master_session *rms;
   struct raop_session *rs;
+  uint16_t seqnum;
   int i;
 
   for (rms = raop_master_sessions; rms; rms = rms->next)
@@ -4799,18 +4788,11 @@ raop_write(struct output_buffer *obuf)
 	  // Sends sync packets to new sessions, and if it is sync time then also to old sessions
 	  packets_sync_send(rms);
 
-	  // TODO avoid this copy
-	  evbuffer_add(rms->evbuf, obuf->data[i].buffer, obuf->data[i].bufsize);
-	  rms->evbuf_samples += obuf->data[i].samples;
-
-	  // Send as many packets as we have data for (one packet requires rawbuf_size bytes)
-	  while (evbuffer_get_length(rms->evbuf) >= rms->rawbuf_size)
-	    {
-	      evbuffer_remove(rms->evbuf, rms->rawbuf, rms->rawbuf_size);
-	      rms->evbuf_samples -= rms->samples_per_packet;
-
-	      packets_send(rms);
-	    }
+	  // Make as many packets as we have data for (one packet requires
+	  // rawbuf_size bytes), and send them to each device in one go
+	  seqnum = rms->rtp_session->seqnum;
+	  packets_make(rms, &obuf->data[i]);
+	  packets_send_all(rms, seqnum);
 	}
     }
 
@@ -30,6 +30,9 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <sys/param.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #ifdef HAVE_ENDIAN_H
 # include <endian.h>
@@ -50,6 +53,8 @@
 
 #define RTP_HEADER_LEN        12
 #define RTCP_SYNC_PACKET_LEN  20 
+// Max number of packets given to one sendmmsg() call
+#define RTP_SEND_BATCH_MAX    32
 
 // NTP timestamp definitions
 #define FRAC             4294967296. // 2^32 as a double
@@ -231,6 +236,143 @@ rtp_packet_get(struct rtp_session *session, uint16_t seqnum)
   return &session->pktbuf[idx];
 }
 
+#ifdef HAVE_SENDMMSG
+// Returns number of packets sent or -1 on error
+static int
+packets_send_batch(int fd, struct rtp_packet **pkts, int npkts, int type, struct rtp_send_stats *stats)
+{
+  struct mmsghdr msgs[RTP_SEND_BATCH_MAX];
+  struct iovec iov[RTP_SEND_BATCH_MAX][2];
+  uint8_t header[RTP_SEND_BATCH_MAX][2];
+  int sent;
+  int ret;
+  int i;
+
+  memset(msgs, 0, npkts * sizeof(struct mmsghdr));
+
+  for (i = 0; i < npkts; i++)
+    {
+      msgs[i].msg_hdr.msg_iov = iov[i];
+
+      if (type < 0)
+	{
+	  iov[i][0].iov_base = pkts[i]->data;
+	  iov[i][0].iov_len = pkts[i]->data_len;
+	  msgs[i].msg_hdr.msg_iovlen = 1;
+	  continue;
+	}
+
+      // Replaces the payload type byte without modifying the packet
+      header[i][0] = pkts[i]->data[0];
+      header[i][1] = type;
+      iov[i][0].iov_base = header[i];
+      iov[i][0].iov_len = 2;
+      iov[i][1].iov_base = pkts[i]->data + 2;
+      iov[i][1].iov_len = pkts[i]->data_len - 2;
+      msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+
+  for (sent = 0; sent < npkts; sent += ret)
+    {
+      stats->syscalls++;
+
+      ret = sendmmsg(fd, msgs + sent, npkts - sent, 0);
+      if (ret < 0)
+	return (sent > 0) ? sent : -1;
+
+      for (i = sent; i < sent + ret; i++)
+	{
+	  stats->packets++;
+	  stats->bytes += msgs[i].msg_len;
+	}
+    }
+
+  return sent;
+}
+#else
+static int
+packets_send_batch(int fd, struct rtp_packet **pkts, int npkts, int type, struct rtp_send_stats *stats)
+{
+  uint8_t header[2];
+  struct iovec iov[2];
+  int sent;
+  int ret;
+
+  for (sent = 0; sent < npkts; sent++)
+    {
+      stats->syscalls++;
+
+      if (type < 0)
+	ret = send(fd, pkts[sent]->data, pkts[sent]->data_len, 0);
+      else
+	{
+	  header[0] = pkts[sent]->data[0];
+	  header[1] = type;
+	  iov[0].iov_base = header;
+	  iov[0].iov_len = 2;
+	  iov[1].iov_base = pkts[sent]->data + 2;
+	  iov[1].iov_len = pkts[sent]->data_len - 2;
+	  ret = writev(fd, iov, 2);
+	}
+
+      if (ret < 0)
+	return (sent > 0) ? sent : -1;
+
+      stats->packets++;
+      stats->bytes += ret;
+    }
+
+  return sent;
+}
+#endif
+
+int
+rtp_packets_send(int fd, struct rtp_session *session, uint16_t seqnum, int npkts, int type, struct rtp_send_stats *stats)
+{
+  struct rtp_packet *pkts[RTP_SEND_BATCH_MAX];
+  int total;
+  int ret;
+  int n;
+  int i;
+
+  total = 0;
+  n = 0;
+  for (i = 0; i < npkts || n > 0; )
+    {
+      // Note that seqnum may wrap around, so we don't use it for counting
+      for (; n < RTP_SEND_BATCH_MAX && i < npkts; i++, seqnum++)
+	{
+	  pkts[n] = rtp_packet_get(session, seqnum);
+	  if (pkts[n])
+	    n++;
+	}
+
+      if (n == 0)
+	break;
+
+      ret = packets_send_batch(fd, pkts, n, type, stats);
+      if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+	  stats->eagain++;
+	  return total;
+	}
+      else if (ret < 0)
+	{
+	  stats->errors++;
+	  return -1;
+	}
+
+      total += ret;
+
+      // If the batch was only partially sent we try the rest again, which will
+      // either progress or give us the error
+      n -= ret;
+      memmove(pkts, pkts + ret, n * sizeof(struct rtp_packet *));
+    }
+
+  return total;
+}
+
 bool
 rtp_sync_is_time(struct rtp_session *session)
 {
@@ -11,6 +11,15 @@ struct rtcp_timestamp
   struct timespec ts;
 };
 
+struct rtp_send_stats
+{
+  uint64_t syscalls;   // Number of send()/sendmmsg() calls
+  uint64_t packets;    // Packets sent
+  uint64_t bytes;      // Bytes sent
+  uint64_t eagain;     // Sends that failed because the socket buffer was full
+  uint64_t errors;     // Other send errors
+};
+
 struct rtp_packet
 {
   uint16_t seqnum;     // Sequence number
@@ -71,6 +80,24 @@ rtp_packet_commit(struct rtp_session *session, struct rtp_packet *pkt);
 struct rtp_packet *
 rtp_packet_get(struct rtp_session *session, uint16_t seqnum);
 
+/* Sends the npkts packets from the session's packet buffer that start with
+ * seqnum to the connected socket fd, batching them in as few syscalls as
+ * possible. Packets that are no longer in the buffer are skipped. If type is
+ * not negative it is sent instead of the packet's payload type byte (the
+ * packets in the buffer are not modified). If the socket buffer is full the
+ * rest of the packets are dropped.
+ *
+ * @in  fd       Connected socket to send to
+ * @in  session  RTP session with the packets
+ * @in  seqnum   Seqnum of first packet to send
+ * @in  npkts    Number of packets to send
+ * @in  type     Payload type byte to send, or -1 to send packets as they are
+ * @in  stats    Send statistics to update
+ * @return       Number of packets sent, -1 on error (errno is set)
+ */
+int
+rtp_packets_send(int fd, struct rtp_session *session, uint16_t seqnum, int npkts, int type, struct rtp_send_stats *stats);
+
 bool
 rtp_sync_is_time(struct rtp_session *session);
 
@@ -1034,9 +1034,11 @@ event_read(int nsamples)
 
 /* ---- Main playback stuff: Start, read, write and playback timer event ---- */
 
-// Returns -1 on error or bytes read (possibly 0)
+// Returns -1 on error or bytes read (possibly 0). On return buf points to the
+// data, which is either the session buffer (silence) or a span in the input
+// buffer. In the latter case input_read_release() must be called afterwards.
 static inline int
-source_read(int *nbytes, int *nsamples, uint8_t *buf, int len)
+source_read(int *nbytes, int *nsamples, uint8_t **buf, int len)
 {
   short flag;
   void *flagdata;
@@ -1063,15 +1065,18 @@ source_read(int *nbytes, int *nsamples, uint8_t *buf, int len)
 	}
 
       // Stream silence if playback didn't end yet
-      memset(buf, 0, len);
+      *buf = pb_session.buffer;
+      memset(*buf, 0, len);
       return 0;
     }
 
   *nsamples = 0;
-  *nbytes = input_read(buf, len, &flag, &flagdata);
+  *nbytes = input_read_span((void **)buf, len, &flag, &flagdata);
   if ((*nbytes < 0) || (flag == INPUT_FLAG_ERROR))
     {
       DPRINTF(E_LOG, L_PLAYER, "Error reading source '%s' (id=%d)\n", pb_session.reading_now->path, pb_session.reading_now->id);
+      if (*nbytes > 0)
+	input_read_release(*nbytes);
       event_read_error();
       return -1;
     }
@@ -1110,6 +1115,7 @@ playback_cb(int fd, short what, void *arg)
 {
   struct timespec ts;
   uint64_t overrun;
+  uint8_t *buf;
   int nbytes;
   int nsamples;
   int i;
@@ -1167,7 +1173,7 @@ playback_cb(int fd, short what, void *arg)
   // should not bring us further behind, even if there is no data.
   for (i = 1 + overrun; i > 0; i--)
     {
-      ret = source_read(&nbytes, &nsamples, pb_session.buffer, pb_session.bufsize);
+      ret = source_read(&nbytes, &nsamples, &buf, pb_session.bufsize);
       if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_PLAYER, "Error reading from source\n");
@@ -1181,7 +1187,11 @@ playback_cb(int fd, short what, void *arg)
 
       pb_session.read_deficit -= nbytes;
 
-      outputs_write(pb_session.buffer, nbytes, nsamples, &pb_session.quality, &pb_session.pts);
+      outputs_write(buf, nbytes, nsamples, &pb_session.quality, &pb_session.pts);
+
+      // The outputs have copied the data, so the input can reuse the space
+      if (buf != pb_session.buffer)
+	input_read_release(nbytes);
 
       if (nbytes < pb_session.bufsize)
 	{
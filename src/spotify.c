@@ -1029,6 +1029,16 @@ static int music_delivery(sp_session *sess, const sp_audioformat *format,
       return 0;
     }
 
+  // If the input buffer didn't take what we have from last time, we tell
+  // libspotify that we can't take more right now (it will deliver again later).
+  // That way spotify_audio_buffer doesn't grow while the input buffer is full.
+  if (evbuffer_get_length(spotify_audio_buffer) > 0)
+    {
+      input_write(spotify_audio_buffer, &quality, 0);
+      if (evbuffer_get_length(spotify_audio_buffer) > 0)
+	return 0;
+    }
+
   size = num_frames * sizeof(int16_t) * format->channels;
 
   ret = evbuffer_add(spotify_audio_buffer, frames, size);
@@ -1038,9 +1048,8 @@ static int music_delivery(sp_session *sess, const sp_audioformat *format,
       return num_frames;
     }
 
-  // The input buffer only accepts writing when it is approaching depletion, and
-  // because we use NONBLOCK it will just return if this is not the case. So in
-  // most cases no actual write is made and spotify_audio_buffer will just grow.
+  // The input buffer only takes what it has room for, the rest is kept in
+  // spotify_audio_buffer until the next delivery
   input_write(spotify_audio_buffer, &quality, 0);
 
   return num_frames;
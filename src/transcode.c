@@ -230,6 +230,27 @@ init_settings(struct settings_ctx *settings, enum transcode_profile profile, str
 	settings->sample_format = AV_SAMPLE_FMT_S16; // Only libopus support
 	break;
 
+      case XCODE_AAC_ADTS:
+	settings->encode_audio = 1;
+	settings->format = "adts";
+	settings->audio_codec = AV_CODEC_ID_AAC;
+	settings->sample_format = AV_SAMPLE_FMT_FLTP;
+	break;
+
+      case XCODE_OPUS_OGG:
+	settings->encode_audio = 1;
+	settings->format = "ogg";
+	settings->audio_codec = AV_CODEC_ID_OPUS;
+	settings->sample_format = AV_SAMPLE_FMT_S16;
+	break;
+
+      case XCODE_FLAC:
+	settings->encode_audio = 1;
+	settings->format = "flac";
+	settings->audio_codec = AV_CODEC_ID_FLAC;
+	settings->sample_format = AV_SAMPLE_FMT_S16;
+	break;
+
       case XCODE_JPEG:
 	settings->encode_video = 1;
 	settings->silent = 1;
@@ -946,6 +967,9 @@ open_output(struct encode_ctx *ctx, struct decode_ctx *src_ctx)
       goto out_free_streams;
     }
 
+  // Makes sure the header is in obuf, see transcode_encode_header()
+  avio_flush(ctx->ofmt_ctx->pb);
+
   if (ctx->settings.wavheader)
     {
       evbuffer_add(ctx->obuf, ctx->header, sizeof(ctx->header));
@@ -1126,6 +1150,14 @@ open_filter(struct stream_ctx *out_stream, struct stream_ctx *in_stream)
   if (ret < 0)
     goto out_fail;
 
+#ifdef HAVE_FFMPEG
+  // Encoders like AAC and Opus only take frames of exactly frame_size samples,
+  // so let the sink regroup the samples we are given (e.g. 352 from the player)
+  if (out_stream->codec->codec_type == AVMEDIA_TYPE_AUDIO && out_stream->codec->frame_size > 0 &&
+      !(out_stream->codec->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+    av_buffersink_set_frame_size(buffersink_ctx, out_stream->codec->frame_size);
+#endif
+
   /* Fill filtering context */
   out_stream->buffersrc_ctx = buffersrc_ctx;
   out_stream->buffersink_ctx = buffersink_ctx;
@@ -1552,6 +1584,10 @@ transcode_encode(struct evbuffer *evbuf, struct encode_ctx *ctx, transcode_frame
       av_write_trailer(ctx->ofmt_ctx);
     }
 
+  // Get everything the muxer has written, so that the output ends where a
+  // packet (or Ogg page) ends
+  avio_flush(ctx->ofmt_ctx->pb);
+
   ret = evbuffer_get_length(ctx->obuf) - start_length;
 
   evbuffer_add_buffer(evbuf, ctx->obuf);
@@ -1559,6 +1595,18 @@ transcode_encode(struct evbuffer *evbuf, struct encode_ctx *ctx, transcode_frame
   return ret;
 }
 
+int
+transcode_encode_header(struct evbuffer *evbuf, struct encode_ctx *ctx)
+{
+  int ret;
+
+  ret = evbuffer_get_length(ctx->obuf);
+
+  evbuffer_add_buffer(evbuf, ctx->obuf);
+
+  return ret;
+}
+
 int
 transcode(struct evbuffer *evbuf, int *icy_timer, struct transcode_ctx *ctx, int want_bytes)
 {
@@ -23,6 +23,11 @@ enum transcode_profile
   XCODE_MP3,
   // Transcodes the best audio stream into OPUS
   XCODE_OPUS,
+  // Transcodes the best audio stream into AAC with ADTS headers, Opus in Ogg
+  // or FLAC, all of which can be streamed (used by httpd_streaming)
+  XCODE_AAC_ADTS,
+  XCODE_OPUS_OGG,
+  XCODE_FLAC,
   // Transcodes the best video stream into JPEG/PNG
   XCODE_JPEG,
   XCODE_PNG,
@@ -88,6 +93,17 @@ transcode_decode(transcode_frame **frame, struct decode_ctx *ctx);
 int
 transcode_encode(struct evbuffer *evbuf, struct encode_ctx *ctx, transcode_frame *frame, int eof);
 
+/* Gets the container header (e.g. of Ogg or FLAC) that the muxer wrote when the
+ * encoder was set up. Must be called before transcode_encode(), otherwise the
+ * header is the start of the first encoded data.
+ *
+ * @out evbuf      An evbuffer filled with the header, may be empty
+ * @in  ctx        Encode context
+ * @return         Bytes added
+ */
+int
+transcode_encode_header(struct evbuffer *evbuf, struct encode_ctx *ctx);
+
 /* Demuxes, decodes, encodes and remuxes from the input.
  *
  * @out evbuf      An evbuffer filled with remuxed data